@@ -0,0 +1,638 @@
+/*
+ * batch.c - Check a batch of overlay stacks which share lower layers
+ *
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "common.h"
+#include "lib.h"
+#include "check.h"
+#include "mount.h"
+#include "list.h"
+#include "fsck.h"
+#include "layer.h"
+#include "throttle.h"
+#include "discover.h"
+#include "batch.h"
+
+extern int flags;
+extern int status;
+
+/* An underlying directory, shared between overlay stacks */
+struct ovl_batch_dir {
+	struct list_head list;
+	struct ovl_layer layer;		/* path, root fd and flag of this dir */
+	bool mounted;			/* used by a mounted overlay */
+};
+
+/*
+ * A lower layer together with all layers below it. Checking a lower layer
+ * only depends on the layers below, so each node is checked only once and
+ * the result is shared by all the overlay stacks built on it.
+ */
+struct ovl_batch_node {
+	struct list_head list;		/* all nodes, below nodes first */
+	struct list_head children;	/* nodes stacked directly on this one */
+	struct list_head sibling;	/* entry in below node's children */
+	struct ovl_batch_dir *dir;	/* layer dir of this node */
+	struct ovl_batch_node *below;	/* next lower layer, NULL if bottom */
+	int depth;			/* layer number from this to bottom */
+	struct ovl_layer_index index;	/* shared check result */
+	int status;			/* fsck status of this node */
+};
+
+/* An overlay stack specified in the manifest */
+struct ovl_batch_stack {
+	struct list_head list;
+	char *name;			/* manifest line or layer id */
+	struct ovl_batch_node *lower;	/* top lower layer */
+	struct ovl_batch_dir *upper;	/* upper dir, could be NULL */
+	struct ovl_batch_dir *work;	/* work dir, could be NULL */
+	pid_t pid;			/* check process, 0 if not running */
+	int status;			/* fsck status of this stack */
+};
+
+struct ovl_batch {
+	struct list_head dirs;		/* unique underlying dirs */
+	struct list_head nodes;		/* unique lower layer chains */
+	struct list_head roots;		/* bottom lower layer nodes */
+	struct list_head stacks;	/* overlay stacks */
+	int dir_num;
+	int node_num;
+	int stack_num;
+	int layer_num;			/* lower layers in all stacks */
+};
+
+/* Get the shared dir of @path, take over the @path buffer */
+static struct ovl_batch_dir *ovl_batch_get_dir(struct ovl_batch *batch,
+					       char *path)
+{
+	struct ovl_batch_dir *dir;
+	struct list_head *node;
+
+	list_for_each(node, &batch->dirs) {
+		dir = list_entry(node, struct ovl_batch_dir, list);
+		if (!strcmp(dir->layer.path, path)) {
+			free(path);
+			return dir;
+		}
+	}
+
+	dir = smalloc(sizeof(*dir));
+	dir->layer.path = path;
+	dir->layer.fd = -1;
+	list_add_tail(&dir->list, &batch->dirs);
+	batch->dir_num++;
+	return dir;
+}
+
+/* Get the shared node of lower layer @dir stacked on @below */
+static struct ovl_batch_node *ovl_batch_get_node(struct ovl_batch *batch,
+						 struct ovl_batch_dir *dir,
+						 struct ovl_batch_node *below)
+{
+	struct list_head *head = below ? &below->children : &batch->roots;
+	struct ovl_batch_node *bnode;
+	struct list_head *node;
+
+	list_for_each(node, head) {
+		bnode = list_entry(node, struct ovl_batch_node, sibling);
+		if (bnode->dir == dir)
+			return bnode;
+	}
+
+	bnode = smalloc(sizeof(*bnode));
+	INIT_LIST_HEAD(&bnode->children);
+	bnode->dir = dir;
+	bnode->below = below;
+	bnode->depth = below ? below->depth + 1 : 1;
+	list_add_tail(&bnode->sibling, head);
+	list_add_tail(&bnode->list, &batch->nodes);
+	batch->node_num++;
+	return bnode;
+}
+
+/*
+ * Add an overlay stack into batch, take over all the resolved dir
+ * buffers.
+ */
+static void ovl_batch_add_dirs(struct ovl_batch *batch, char *name,
+			       char **lowerdir, int lowernum,
+			       char *upperdir, char *workdir)
+{
+	struct ovl_batch_stack *stack;
+	struct ovl_batch_node *lower = NULL;
+	int i;
+
+	/* Build the lower chain from the bottom layer */
+	for (i = lowernum - 1; i >= 0; i--)
+		lower = ovl_batch_get_node(batch,
+				ovl_batch_get_dir(batch, lowerdir[i]), lower);
+
+	stack = smalloc(sizeof(*stack));
+	stack->name = name;
+	stack->lower = lower;
+	if (upperdir) {
+		stack->upper = ovl_batch_get_dir(batch, upperdir);
+		stack->work = ovl_batch_get_dir(batch, workdir);
+	}
+	list_add_tail(&stack->list, &batch->stacks);
+	batch->stack_num++;
+	batch->layer_num += lowernum;
+	free(lowerdir);
+}
+
+/*
+ * Parse one line of the manifest, which use the same format as the
+ * "-o" option, and add the overlay stack into batch.
+ */
+static int ovl_batch_add_stack(struct ovl_batch *batch, char *opt, int line)
+{
+	struct ovl_config config = {0};
+	char **lowerdir = NULL;
+	char *upperdir = NULL, *workdir = NULL;
+	char name[32];
+	int lowernum = 0;
+	int ret = -1;
+
+	ovl_parse_opt(opt, &config);
+
+	if (!config.lowerdir || (config.upperdir && !config.workdir) ||
+	    (!config.upperdir && config.workdir)) {
+		print_err(_("Manifest line %d: please specify correct "
+			    "lowerdir, upperdir and workdir\n"), line);
+		goto out;
+	}
+
+	if (ovl_get_dirs(&config, &lowerdir, &lowernum, &upperdir, &workdir)) {
+		print_err(_("Manifest line %d: cannot resolve dirs\n"), line);
+		goto out;
+	}
+
+	snprintf(name, sizeof(name), "line %d", line);
+	ovl_batch_add_dirs(batch, sstrdup(name), lowerdir, lowernum,
+			   upperdir, workdir);
+	ret = 0;
+out:
+	ovl_free_opt(&config);
+	return ret;
+}
+
+/* Read the manifest, one overlay stack per line */
+static int ovl_batch_load(struct ovl_batch *batch, const char *manifest)
+{
+	FILE *fp;
+	char *buf = NULL;
+	size_t size = 0;
+	ssize_t len;
+	int line = 0;
+	int ret = 0;
+
+	fp = fopen(manifest, "r");
+	if (!fp) {
+		print_err(_("Failed to open manifest %s:%s\n"),
+			    manifest, strerror(errno));
+		return -1;
+	}
+
+	while ((len = getline(&buf, &size, fp)) != -1) {
+		char *p = buf;
+
+		line++;
+		if (len > 0 && buf[len-1] == '\n')
+			buf[len-1] = '\0';
+
+		/* Skip leading blanks, empty lines and comments */
+		for (; *p == ' ' || *p == '\t'; p++);
+		if (*p == '\0' || *p == '#')
+			continue;
+
+		ret = ovl_batch_add_stack(batch, p, line);
+		if (ret)
+			break;
+	}
+
+	free(buf);
+	fclose(fp);
+
+	if (!ret && !batch->stack_num) {
+		print_err(_("No overlay found in manifest %s\n"), manifest);
+		ret = -1;
+	}
+	return ret;
+}
+
+/* Discover overlay stacks in the container runtime storage dir */
+static int ovl_batch_discover(struct ovl_batch *batch, const char *root,
+			      int jobs)
+{
+	struct ovl_discovered *found = NULL;
+	int i, num = 0;
+
+	if (ovl_discover(root, jobs, &found, &num))
+		return -1;
+
+	for (i = 0; i < num; i++)
+		ovl_batch_add_dirs(batch, found[i].name, found[i].lowerdir,
+				   found[i].lowernum, found[i].upperdir,
+				   found[i].workdir);
+	free(found);
+
+	if (!batch->stack_num) {
+		print_err(_("No overlay found in %s\n"), root);
+		return -1;
+	}
+	return 0;
+}
+
+/* Check all underlying dirs in one go through the mount table */
+static int ovl_batch_check_mount(struct ovl_batch *batch)
+{
+	struct ovl_batch_dir *dir;
+	struct list_head *node;
+	char **paths;
+	bool *mounted;
+	int i = 0;
+	int ret;
+
+	paths = smalloc(sizeof(char *) * batch->dir_num);
+	mounted = smalloc(sizeof(bool) * batch->dir_num);
+
+	list_for_each(node, &batch->dirs) {
+		dir = list_entry(node, struct ovl_batch_dir, list);
+		paths[i++] = dir->layer.path;
+	}
+
+	ret = ovl_check_mount_paths(paths, batch->dir_num, mounted);
+	if (ret)
+		goto out;
+
+	i = 0;
+	list_for_each(node, &batch->dirs) {
+		dir = list_entry(node, struct ovl_batch_dir, list);
+		dir->mounted = mounted[i++];
+		if (dir->mounted)
+			print_info(_("WARNING: Dir %s is mounted\n"),
+				     dir->layer.path);
+	}
+out:
+	free(paths);
+	free(mounted);
+	return ret;
+}
+
+/*
+ * Prepare each underlying dir to be opened lazily as a lower layer, it is
+ * opened and checked only once at the first use, and closed if too many
+ * dirs are open. Upper and work dirs are opened by the check process.
+ */
+static int ovl_batch_init_dirs(struct ovl_batch *batch)
+{
+	struct ovl_batch_dir *dir;
+	struct list_head *node;
+
+	if (ovl_layer_setup(batch->dir_num, false))
+		return -1;
+
+	list_for_each(node, &batch->dirs) {
+		dir = list_entry(node, struct ovl_batch_dir, list);
+		ovl_layer_init(&dir->layer);
+	}
+	return 0;
+}
+
+static inline bool ovl_batch_dir_usable(struct ovl_batch_dir *dir)
+{
+	return !dir->mounted || (flags & FL_OPT_NO);
+}
+
+/* Build lower layers of an overlay from the top lower node */
+static struct ovl_layer *ovl_batch_lower_layers(struct ovl_batch_node *top)
+{
+	struct ovl_layer *layers;
+	struct ovl_batch_node *bnode;
+	int i;
+
+	layers = smalloc(sizeof(struct ovl_layer) * top->depth);
+	for (bnode = top, i = 0; bnode; bnode = bnode->below, i++) {
+		layers[i] = bnode->dir->layer;
+		layers[i].type = OVL_LOWER;
+		layers[i].stack = i;
+		layers[i].index = &bnode->index;
+	}
+	return layers;
+}
+
+/*
+ * Check a lower layer node, all the nodes below have already been
+ * checked, so only the top layer of this chain is scanned.
+ */
+static void ovl_batch_check_node(struct ovl_batch_node *bnode)
+{
+	struct ovl_fs ofs = {};
+	int save_flags = flags;
+	int save_status = status;
+
+	if (!ovl_batch_dir_usable(bnode->dir) ||
+	    (bnode->below && (bnode->below->status & OVL_ST_ABORT))) {
+		bnode->status = OVL_ST_ABORT;
+		goto out;
+	}
+
+	if (flags & FL_VERBOSE)
+		print_info(_("Checking lower layer %s (%d layers below)\n"),
+			     bnode->dir->layer.path, bnode->depth - 1);
+
+	ofs.lower_num = bnode->depth;
+	ofs.lower_layer = ovl_batch_lower_layers(bnode);
+
+	flags &= ~FL_UPPER;
+	status = 0;
+	if (ovl_scan_fix(&ofs))
+		set_abort(&status);
+	bnode->status = status;
+	flags = save_flags;
+
+	free(ofs.lower_layer);
+out:
+	bnode->index.checked = true;
+	status = save_status | bnode->status;
+}
+
+/*
+ * Check the upper layer of an overlay stack against the shared lower
+ * layer results, running in a separate process.
+ */
+static int ovl_batch_check_stack(struct ovl_batch_stack *stack)
+{
+	struct ovl_fs ofs = {};
+
+	ofs.lower_num = stack->lower->depth;
+	ofs.lower_layer = ovl_batch_lower_layers(stack->lower);
+
+	status = 0;
+	flags &= ~FL_UPPER;
+	if (stack->upper) {
+		ofs.upper_layer = stack->upper->layer;
+		ofs.upper_layer.type = OVL_UPPER;
+		ofs.workdir = stack->work->layer;
+		ofs.workdir.type = OVL_WORK;
+		flags |= FL_UPPER;
+
+		if (ovl_open_layer(&ofs.upper_layer) ||
+		    ovl_open_layer(&ofs.workdir))
+			goto err;
+
+		if (ovl_basic_check_workdir(&ofs) ||
+		    ovl_basic_check_layer(&ofs.upper_layer))
+			goto err;
+
+		/* Upper layer should read-write */
+		if ((ofs.upper_layer.flag & FS_LAYER_RO) &&
+		    !(flags & FL_OPT_NO)) {
+			print_info(_("Upper base filesystem is read-only, "
+				     "should be read-write\n"));
+			goto err;
+		}
+	}
+
+	if (ovl_scan_fix(&ofs))
+		goto err;
+out:
+	free(ofs.lower_layer);
+	return status;
+err:
+	set_abort(&status);
+	goto out;
+}
+
+static const char *ovl_batch_status_desc(int st)
+{
+	if (st & OVL_ST_ABORT)
+		return _("check failed");
+	if (st & OVL_ST_INCONSISTNECY)
+		return _("inconsistency left");
+	if (st & OVL_ST_CHANGED)
+		return _("modified");
+	return _("clean");
+}
+
+/* Report the result of one overlay stack */
+static void ovl_batch_report_stack(struct ovl_batch_stack *stack)
+{
+	struct ovl_batch_node *bnode;
+	int st = stack->status;
+
+	for (bnode = stack->lower; bnode; bnode = bnode->below)
+		st |= bnode->status;
+
+	print_info(_("Overlay %s (%s): %s\n"), stack->name,
+		     stack->upper ? stack->upper->layer.path :
+				    stack->lower->dir->layer.path,
+		     ovl_batch_status_desc(st));
+	status |= st;
+}
+
+/* Wait for one running check process and report it */
+static void ovl_batch_reap(struct ovl_batch *batch, int *running)
+{
+	struct ovl_batch_stack *stack;
+	struct list_head *node;
+	int wstatus;
+	pid_t pid;
+
+	do {
+		pid = waitpid(-1, &wstatus, 0);
+	} while (pid < 0 && errno == EINTR);
+
+	if (pid < 0) {
+		print_err(_("Failed to wait check process:%s\n"),
+			    strerror(errno));
+		*running = 0;
+		return;
+	}
+
+	list_for_each(node, &batch->stacks) {
+		stack = list_entry(node, struct ovl_batch_stack, list);
+		if (stack->pid != pid)
+			continue;
+
+		if (WIFEXITED(wstatus))
+			stack->status = WEXITSTATUS(wstatus);
+		else
+			stack->status = OVL_ST_ABORT;
+		stack->pid = 0;
+		ovl_batch_report_stack(stack);
+		break;
+	}
+	(*running)--;
+}
+
+/* Check each overlay stack in its own process, at most @jobs at a time */
+static void ovl_batch_run_stacks(struct ovl_batch *batch, int jobs)
+{
+	struct ovl_batch_stack *stack;
+	struct ovl_batch_node *bnode;
+	struct list_head *node;
+	int running = 0;
+	pid_t pid;
+
+	list_for_each(node, &batch->stacks) {
+		stack = list_entry(node, struct ovl_batch_stack, list);
+
+		/* Skip the overlay if any layer cannot check */
+		for (bnode = stack->lower; bnode; bnode = bnode->below) {
+			if (bnode->status & OVL_ST_ABORT)
+				break;
+		}
+		if (bnode || (stack->upper &&
+		    (!ovl_batch_dir_usable(stack->upper) ||
+		     !ovl_batch_dir_usable(stack->work)))) {
+			stack->status = OVL_ST_ABORT;
+			ovl_batch_report_stack(stack);
+			continue;
+		}
+
+		/* Run less checks at the same time if io pressure is high */
+		while (running >= ovl_throttle_jobs(jobs))
+			ovl_batch_reap(batch, &running);
+
+		fflush(stdout);
+		fflush(stderr);
+		pid = fork();
+		if (pid < 0) {
+			print_err(_("Failed to fork:%s\n"), strerror(errno));
+			stack->status = OVL_ST_ABORT;
+			ovl_batch_report_stack(stack);
+			continue;
+		} else if (pid == 0) {
+			/* Keep lines of parallel checks from interleaving */
+			setvbuf(stdout, NULL, _IOLBF, 0);
+			ovl_throttle_share(jobs);
+			exit(ovl_batch_check_stack(stack));
+		}
+
+		stack->pid = pid;
+		running++;
+	}
+
+	while (running > 0)
+		ovl_batch_reap(batch, &running);
+}
+
+static void ovl_batch_free(struct ovl_batch *batch)
+{
+	struct list_head *node, *tmp;
+	int i;
+
+	list_for_each_safe(node, tmp, &batch->stacks) {
+		struct ovl_batch_stack *stack;
+
+		stack = list_entry(node, struct ovl_batch_stack, list);
+		list_del(node);
+		free(stack->name);
+		free(stack);
+	}
+
+	list_for_each_safe(node, tmp, &batch->nodes) {
+		struct ovl_batch_node *bnode;
+
+		bnode = list_entry(node, struct ovl_batch_node, list);
+		for (i = 0; i < bnode->index.redirect_num; i++) {
+			free(bnode->index.redirects[i].pathname);
+			free(bnode->index.redirects[i].origin);
+		}
+		free(bnode->index.redirects);
+		list_del(node);
+		free(bnode);
+	}
+
+	list_for_each_safe(node, tmp, &batch->dirs) {
+		struct ovl_batch_dir *dir;
+
+		dir = list_entry(node, struct ovl_batch_dir, list);
+		ovl_layer_release(&dir->layer);
+		free(dir->layer.path);
+		list_del(node);
+		free(dir);
+	}
+}
+
+/*
+ * Check every overlay stack listed in @manifest, or discovered in the
+ * container runtime storage dir @root. Each unique lower layer chain is
+ * checked only once in this process, and then the upper layer of each
+ * overlay is checked against the shared results in parallel.
+ */
+int ovl_batch_check(const char *manifest, const char *root, int jobs)
+{
+	struct ovl_batch batch;
+	struct ovl_batch_node *bnode;
+	struct list_head *node;
+	int ret;
+
+	INIT_LIST_HEAD(&batch.dirs);
+	INIT_LIST_HEAD(&batch.nodes);
+	INIT_LIST_HEAD(&batch.roots);
+	INIT_LIST_HEAD(&batch.stacks);
+	batch.dir_num = batch.node_num = 0;
+	batch.stack_num = batch.layer_num = 0;
+
+	if (manifest)
+		ret = ovl_batch_load(&batch, manifest);
+	else
+		ret = ovl_batch_discover(&batch, root, jobs);
+	if (ret)
+		goto out;
+
+	if (flags & FL_VERBOSE)
+		print_info(_("Batch: %d overlays, %d unique lower layers "
+			     "of %d stacked, %d dirs\n"), batch.stack_num,
+			     batch.node_num, batch.layer_num, batch.dir_num);
+
+	ret = ovl_batch_check_mount(&batch);
+	if (ret)
+		goto out;
+
+	ret = ovl_batch_init_dirs(&batch);
+	if (ret)
+		goto out;
+
+	/* Below nodes always come first */
+	list_for_each(node, &batch.nodes) {
+		bnode = list_entry(node, struct ovl_batch_node, list);
+		ovl_batch_check_node(bnode);
+	}
+
+	ovl_batch_run_stacks(&batch, jobs);
+out:
+	ovl_batch_free(&batch);
+	return ret;
+}
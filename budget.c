@@ -0,0 +1,534 @@
+/*
+ * budget.c - Check the most likely broken parts first within a time budget
+ *
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fts.h>
+
+#include "common.h"
+#include "lib.h"
+#include "list.h"
+#include "path.h"
+#include "budget.h"
+
+/*
+ * With a time budget, entries of each dir are scanned in the order of
+ * ctime, the most recently changed first, and the top entries of a layer
+ * left unchecked by the last run go before all others. Pass two checks
+ * the upper layer first, then lower layers from the top. When the budget
+ * runs out, the scan stops between two entries, and the coverage of each
+ * layer is reported as the fraction of its top entries checked. The top
+ * entries not checked are recorded in workdir for the next run, and a
+ * layer not reached is recorded as "<layer> .". Pass two of the next run
+ * scans the layers recorded before others. Pass one keeps its order, a
+ * layer needs the redirect dirs found in the layers below.
+ */
+#define OVL_BUDGET_TODO		"fsck.overlay.todo"
+#define OVL_BUDGET_LAYER	"."	/* the whole layer is left */
+
+extern int flags;
+extern int status;
+
+/* Coverage of one layer in one pass */
+struct ovl_budget_cover {
+	struct list_head list;
+	char *path;		/* layer root dir */
+	int pass;
+	int done;		/* top entries checked */
+	int total;		/* top entries of the layer */
+	char **todo;		/* top entries not checked, NULL if not stopped */
+	int todo_num;
+};
+
+static struct timespec budget_deadline;
+static bool budget_enabled;
+static bool budget_expired;
+static LIST_HEAD(budget_covers);
+
+/* Layer being scanned */
+static struct ovl_budget_cover *budget_cur;
+static char **budget_names;	/* sorted top entries of current layer */
+static bool *budget_checked;	/* checked flag of each top entry */
+static int budget_name_num;
+
+/* Top entries left by last run, each is "<layer> <name>" */
+static char **budget_last;
+static int budget_last_num;
+static char **budget_last_names;	/* sorted ones of current layer */
+static int budget_last_name_num;
+static char **budget_last_layers;	/* sorted layers left */
+static int budget_last_layer_num;
+
+static int ovl_budget_strcmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Set the time budget in seconds from now */
+int ovl_budget_setup(double seconds)
+{
+	if (seconds <= 0)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &budget_deadline);
+	budget_deadline.tv_sec += (time_t)seconds;
+	budget_deadline.tv_nsec += (seconds - (time_t)seconds) * 1e9;
+	if (budget_deadline.tv_nsec >= 1000000000) {
+		budget_deadline.tv_sec++;
+		budget_deadline.tv_nsec -= 1000000000;
+	}
+	budget_enabled = true;
+	return 0;
+}
+
+bool ovl_budget_enabled(void)
+{
+	return budget_enabled;
+}
+
+/* Check the time budget runs out, it never comes back once run out */
+bool ovl_budget_expired(void)
+{
+	struct timespec now;
+
+	if (!budget_enabled || budget_expired)
+		return budget_expired;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec > budget_deadline.tv_sec ||
+	    (now.tv_sec == budget_deadline.tv_sec &&
+	     now.tv_nsec >= budget_deadline.tv_nsec))
+		budget_expired = true;
+	return budget_expired;
+}
+
+/* Load the top entries left unchecked by last run from workdir */
+int ovl_budget_open(const struct ovl_layer *workdir)
+{
+	char *buf = NULL, *name;
+	size_t size = 0;
+	FILE *fp;
+	int fd;
+
+	if (!budget_enabled || !workdir->path)
+		return 0;
+
+	fd = openat(workdir->fd, OVL_BUDGET_TODO, O_RDONLY|O_CLOEXEC);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return 0;
+		print_err(_("Failed to open %s in %s:%s\n"), OVL_BUDGET_TODO,
+			    workdir->path, strerror(errno));
+		return -1;
+	}
+
+	fp = fdopen(fd, "r");
+	if (!fp) {
+		close(fd);
+		return -1;
+	}
+
+	while (getline(&buf, &size, fp) > 0) {
+		buf[strcspn(buf, "\n")] = '\0';
+		name = strrchr(buf, ' ');
+		if (!name)
+			continue;
+		budget_last = srealloc(budget_last, sizeof(char *) *
+				       (budget_last_num + 1));
+		budget_last[budget_last_num++] = sstrdup(buf);
+
+		/* Lines of one layer are in a row */
+		if (budget_last_layer_num &&
+		    !strncmp(budget_last_layers[budget_last_layer_num - 1],
+			     buf, name - buf) &&
+		    !budget_last_layers[budget_last_layer_num - 1][name - buf])
+			continue;
+		budget_last_layers = srealloc(budget_last_layers,
+				sizeof(char *) * (budget_last_layer_num + 1));
+		budget_last_layers[budget_last_layer_num++] =
+					sstrndup(buf, name - buf);
+	}
+	free(buf);
+	fclose(fp);
+
+	qsort(budget_last_layers, budget_last_layer_num, sizeof(char *),
+	      ovl_budget_strcmp);
+
+	if (budget_last_num && (flags & FL_VERBOSE))
+		print_info(_("Check %d entries left by last run first\n"),
+			     budget_last_num);
+	return 0;
+}
+
+/* Is the @layer left not checked by last run, scan it first in pass two */
+bool ovl_budget_left(const struct ovl_layer *layer)
+{
+	char *lpath;
+	bool found;
+
+	if (!budget_last_layer_num || !layer->path)
+		return false;
+
+	lpath = escapename(layer->path);
+	found = bsearch(&lpath, budget_last_layers, budget_last_layer_num,
+			sizeof(char *), ovl_budget_strcmp) != NULL;
+	free(lpath);
+	return found;
+}
+
+/* Is the top entry left unchecked by last run */
+static bool ovl_budget_is_last(const char *name)
+{
+	return bsearch(&name, budget_last_names, budget_last_name_num,
+		       sizeof(char *), ovl_budget_strcmp) != NULL;
+}
+
+/* Select the top entries of @path left by last run */
+static void ovl_budget_select_last(const char *path)
+{
+	char *lpath = escapename(path);
+	size_t len = strlen(lpath);
+	int i;
+
+	for (i = 0; i < budget_last_num; i++) {
+		if (strncmp(budget_last[i], lpath, len) ||
+		    budget_last[i][len] != ' ' ||
+		    !strcmp(budget_last[i] + len + 1, OVL_BUDGET_LAYER))
+			continue;
+		budget_last_names = srealloc(budget_last_names,
+				sizeof(char *) * (budget_last_name_num + 1));
+		budget_last_names[budget_last_name_num] =
+					sstrdup(budget_last[i] + len + 1);
+		unescapename(budget_last_names[budget_last_name_num++]);
+	}
+	free(lpath);
+
+	qsort(budget_last_names, budget_last_name_num, sizeof(char *),
+	      ovl_budget_strcmp);
+}
+
+/*
+ * Order entries of one dir for fts: top entries left by last run first,
+ * then the most recently changed first.
+ */
+int ovl_budget_compar(const FTSENT **a, const FTSENT **b)
+{
+	const struct stat *sa = (*a)->fts_statp, *sb = (*b)->fts_statp;
+
+	if ((*a)->fts_level == 1 && budget_last_name_num) {
+		bool la = ovl_budget_is_last((*a)->fts_name);
+		bool lb = ovl_budget_is_last((*b)->fts_name);
+
+		if (la != lb)
+			return la ? -1 : 1;
+	}
+
+	if (!sa || !sb)
+		return 0;
+	if (sa->st_ctim.tv_sec != sb->st_ctim.tv_sec)
+		return sa->st_ctim.tv_sec > sb->st_ctim.tv_sec ? -1 : 1;
+	if (sa->st_ctim.tv_nsec != sb->st_ctim.tv_nsec)
+		return sa->st_ctim.tv_nsec > sb->st_ctim.tv_nsec ? -1 : 1;
+	return strcmp((*a)->fts_name, (*b)->fts_name);
+}
+
+static struct ovl_budget_cover *ovl_budget_new_cover(
+					const struct ovl_layer *layer, int pass)
+{
+	struct ovl_budget_cover *cover;
+
+	cover = smalloc(sizeof(*cover));
+	cover->path = sstrdup(layer->path);
+	cover->pass = pass;
+	list_add_tail(&cover->list, &budget_covers);
+	return cover;
+}
+
+/* Read the top entries of a layer to count the coverage */
+static int ovl_budget_read_top(const struct ovl_layer *layer)
+{
+	struct dirent *de;
+	int size = 0;
+	DIR *dir;
+	int fd;
+
+	fd = openat(layer->fd, ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (fd < 0 || !(dir = fdopendir(fd))) {
+		print_err(_("Failed to open %s:%s\n"), layer->path,
+			    strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	while ((de = readdir(dir))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if (budget_name_num == size) {
+			size = size ? size * 2 : 64;
+			budget_names = srealloc(budget_names,
+						sizeof(char *) * size);
+		}
+		budget_names[budget_name_num++] = sstrdup(de->d_name);
+	}
+	closedir(dir);
+
+	qsort(budget_names, budget_name_num, sizeof(char *),
+	      ovl_budget_strcmp);
+	budget_checked = smalloc(sizeof(bool) * (budget_name_num ? : 1));
+	return 0;
+}
+
+/* Start scanning a layer in a pass */
+int ovl_budget_begin(const struct ovl_layer *layer, int pass)
+{
+	if (!budget_enabled)
+		return 0;
+
+	budget_cur = ovl_budget_new_cover(layer, pass);
+	ovl_budget_select_last(layer->path);
+	return ovl_budget_read_top(layer);
+}
+
+/* A top entry is checked, including all entries below it */
+void ovl_budget_checked(const char *name)
+{
+	char **found;
+
+	if (!budget_cur)
+		return;
+
+	found = bsearch(&name, budget_names, budget_name_num,
+			sizeof(char *), ovl_budget_strcmp);
+	if (found && !budget_checked[found - budget_names]) {
+		budget_checked[found - budget_names] = true;
+		budget_cur->done++;
+	}
+}
+
+/* Finish scanning a layer, remember the top entries not checked */
+void ovl_budget_end(void)
+{
+	int i;
+
+	if (!budget_cur)
+		return;
+
+	budget_cur->total = budget_name_num;
+	if (budget_expired) {
+		budget_cur->todo = smalloc(sizeof(char *) *
+					   (budget_name_num ? : 1));
+		for (i = 0; i < budget_name_num; i++) {
+			if (budget_checked[i])
+				continue;
+			budget_cur->todo[budget_cur->todo_num++] =
+							budget_names[i];
+			budget_names[i] = NULL;
+		}
+	} else {
+		/* Entries created while scanning may not be seen */
+		budget_cur->done = budget_name_num;
+	}
+
+	for (i = 0; i < budget_name_num; i++)
+		free(budget_names[i]);
+	free(budget_names);
+	free(budget_checked);
+	budget_names = NULL;
+	budget_checked = NULL;
+	budget_name_num = 0;
+	budget_cur = NULL;
+
+	for (i = 0; i < budget_last_name_num; i++)
+		free(budget_last_names[i]);
+	free(budget_last_names);
+	budget_last_names = NULL;
+	budget_last_name_num = 0;
+}
+
+/* A layer is not scanned in a pass because the budget runs out */
+void ovl_budget_skip(const struct ovl_layer *layer, int pass)
+{
+	struct ovl_budget_cover *cover;
+	struct list_head *node;
+	bool recorded = false;
+
+	if (!budget_enabled)
+		return;
+
+	/* Recorded once, though not reached in both passes */
+	list_for_each(node, &budget_covers) {
+		cover = list_entry(node, struct ovl_budget_cover, list);
+		if (cover->total < 0 && !strcmp(cover->path, layer->path))
+			recorded = true;
+	}
+
+	cover = ovl_budget_new_cover(layer, pass);
+	cover->total = -1;
+	if (recorded)
+		return;
+	cover->todo = smalloc(sizeof(char *));
+	cover->todo[0] = sstrdup(OVL_BUDGET_LAYER);
+	cover->todo_num = 1;
+}
+
+static int ovl_budget_save(const struct ovl_layer *workdir)
+{
+	struct ovl_budget_cover *cover;
+	struct list_head *node;
+	char *lpath, *name;
+	FILE *fp;
+	int fd;
+	int i;
+
+	fd = openat(workdir->fd, OVL_BUDGET_TODO,
+		    O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+	if (fd < 0 || !(fp = fdopen(fd, "w"))) {
+		print_err(_("Failed to save %s in %s:%s\n"), OVL_BUDGET_TODO,
+			    workdir->path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	list_for_each(node, &budget_covers) {
+		cover = list_entry(node, struct ovl_budget_cover, list);
+		lpath = escapename(cover->path);
+		for (i = 0; i < cover->todo_num; i++) {
+			name = escapename(cover->todo[i]);
+			fprintf(fp, "%s %s\n", lpath, name);
+			free(name);
+		}
+		free(lpath);
+	}
+
+	if (fclose(fp)) {
+		print_err(_("Failed to save %s in %s:%s\n"), OVL_BUDGET_TODO,
+			    workdir->path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static void ovl_budget_report(void)
+{
+	struct ovl_budget_cover *cover;
+	struct list_head *node;
+	bool unreached = false;
+
+	list_for_each(node, &budget_covers) {
+		cover = list_entry(node, struct ovl_budget_cover, list);
+		if (cover->total < 0) {
+			print_info(_("Coverage: pass %d %s: not checked\n"),
+				     cover->pass, cover->path);
+			if (cover->pass == OVL_SCAN_PASS_ONE)
+				unreached = true;
+		} else
+			print_info(_("Coverage: pass %d %s: %d/%d top "
+				     "entries (%.0f%%)\n"), cover->pass,
+				     cover->path, cover->done, cover->total,
+				     cover->total ? 100.0 * cover->done /
+						    cover->total : 100.0);
+	}
+
+	/* Next run starts pass one from the bottom again */
+	if (unreached)
+		print_info(_("Pass %d restarts from the bottom layer in each "
+			     "run, more time is needed\n"), OVL_SCAN_PASS_ONE);
+}
+
+static void ovl_budget_free(void)
+{
+	struct ovl_budget_cover *cover;
+	struct list_head *node, *tmp;
+	int i;
+
+	list_for_each_safe(node, tmp, &budget_covers) {
+		cover = list_entry(node, struct ovl_budget_cover, list);
+		list_del(node);
+		for (i = 0; i < cover->todo_num; i++)
+			free(cover->todo[i]);
+		free(cover->todo);
+		free(cover->path);
+		free(cover);
+	}
+
+	for (i = 0; i < budget_last_num; i++)
+		free(budget_last[i]);
+	free(budget_last);
+	budget_last = NULL;
+	budget_last_num = 0;
+
+	for (i = 0; i < budget_last_layer_num; i++)
+		free(budget_last_layers[i]);
+	free(budget_last_layers);
+	budget_last_layers = NULL;
+	budget_last_layer_num = 0;
+}
+
+/*
+ * Report the coverage after checking. If the budget runs out, the check
+ * is incomplete, and the entries not checked are saved in workdir for
+ * the next run, otherwise the entries saved by last run are dropped.
+ */
+int ovl_budget_close(const struct ovl_layer *workdir)
+{
+	int ret = 0;
+
+	if (!budget_enabled)
+		return 0;
+
+	if (budget_expired || (flags & FL_VERBOSE))
+		ovl_budget_report();
+
+	if (budget_expired) {
+		print_info(_("Time budget runs out, check is incomplete\n"));
+		set_inconsistency(&status);
+	}
+
+	/* Make no changes to the filesystem with -n */
+	if (!workdir->path || (flags & FL_OPT_NO))
+		goto out;
+
+	if (budget_expired)
+		ret = ovl_budget_save(workdir);
+	else if (budget_last_num &&
+		 unlinkat(workdir->fd, OVL_BUDGET_TODO, 0)) {
+		print_err(_("Failed to remove %s in %s:%s\n"),
+			    OVL_BUDGET_TODO, workdir->path, strerror(errno));
+		ret = -1;
+	}
+out:
+	ovl_budget_free();
+	return ret;
+}
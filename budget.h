@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef OVL_BUDGET_H
+#define OVL_BUDGET_H
+
+#include <stdbool.h>
+#include <fts.h>
+
+int ovl_budget_setup(double seconds);
+bool ovl_budget_enabled(void);
+bool ovl_budget_expired(void);
+int ovl_budget_open(const struct ovl_layer *workdir);
+bool ovl_budget_left(const struct ovl_layer *layer);
+int ovl_budget_compar(const FTSENT **a, const FTSENT **b);
+int ovl_budget_begin(const struct ovl_layer *layer, int pass);
+void ovl_budget_checked(const char *name);
+void ovl_budget_end(void);
+void ovl_budget_skip(const struct ovl_layer *layer, int pass);
+int ovl_budget_close(const struct ovl_layer *workdir);
+
+#endif /* OVL_BUDGET_H */
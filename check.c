@@ -30,6 +30,8 @@
 #include <fcntl.h>
 #include <stdbool.h>
 #include <libgen.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/xattr.h>
 #include <sys/stat.h>
@@ -42,6 +44,21 @@
 #include "path.h"
 #include "list.h"
 #include "overlayfs.h"
+#include "layer.h"
+#include "repair.h"
+#include "journal.h"
+#include "throttle.h"
+#include "budget.h"
+#include "sample.h"
+#include "shard.h"
+#include "watch.h"
+#include "device.h"
+#include "metrics.h"
+#include "probes.h"
+#include "trace.h"
+#include "findings.h"
+#include "progress.h"
+#include "profile.h"
 
 /* Lookup context */
 struct ovl_lookup_ctx {
@@ -63,6 +80,7 @@ struct ovl_lookup_data {
 	char pathname[PATH_MAX];	/* tatget's pathname found */
 	int stack;			/* which lower stack we found */
 	struct stat st;			/* target's stat(2) */
+	bool unknown;			/* a lower layer is quarantined */
 };
 
 /* Redirect information */
@@ -75,10 +93,6 @@ struct ovl_redirect_entry {
 	int stack;		/* redirect dir stack (valid in OVL_LOWER) */
 };
 
-/* Whiteout */
-#define WHITEOUT_DEV	0
-#define WHITEOUT_MOD	0
-
 extern int flags;
 extern int status;
 
@@ -118,14 +132,16 @@ static inline bool ovl_is_opaque(int dirfd, const char *pathname)
 	return is_dir_xattr(dirfd, pathname, OVL_OPAQUE_XATTR);
 }
 
-static inline int ovl_remove_opaque(int dirfd, const char *pathname)
+static inline int ovl_remove_opaque(const struct ovl_layer *layer,
+				    const char *pathname)
 {
-	return remove_xattr(dirfd, pathname, OVL_OPAQUE_XATTR);
+	return ovl_repair_remove_xattr(layer, pathname, OVL_OPAQUE_XATTR);
 }
 
-static inline int ovl_set_opaque(int dirfd, const char *pathname)
+static inline int ovl_set_opaque(const struct ovl_layer *layer,
+				 const char *pathname)
 {
-	return set_xattr(dirfd, pathname, OVL_OPAQUE_XATTR, "y", 1);
+	return ovl_repair_set_xattr(layer, pathname, OVL_OPAQUE_XATTR, "y", 1);
 }
 
 static inline int ovl_is_impure(int dirfd, const char *pathname)
@@ -133,9 +149,10 @@ static inline int ovl_is_impure(int dirfd, const char *pathname)
 	return is_dir_xattr(dirfd, pathname, OVL_IMPURE_XATTR);
 }
 
-static inline int ovl_set_impure(int dirfd, const char *pathname)
+static inline int ovl_set_impure(const struct ovl_layer *layer,
+				 const char *pathname)
 {
-	return set_xattr(dirfd, pathname, OVL_IMPURE_XATTR, "y", 1);
+	return ovl_repair_set_xattr(layer, pathname, OVL_IMPURE_XATTR, "y", 1);
 }
 
 static int ovl_get_redirect(int dirfd, const char *pathname,
@@ -164,19 +181,16 @@ static int ovl_get_redirect(int dirfd, const char *pathname,
 	return 0;
 }
 
-static inline int ovl_remove_redirect(int dirfd, const char *pathname)
+static inline int ovl_remove_redirect(const struct ovl_layer *layer,
+				      const char *pathname)
 {
-	return remove_xattr(dirfd, pathname, OVL_REDIRECT_XATTR);
+	return ovl_repair_remove_xattr(layer, pathname, OVL_REDIRECT_XATTR);
 }
 
-static inline int ovl_create_whiteout(int dirfd, const char *pathname)
+static inline int ovl_create_whiteout(const struct ovl_layer *layer,
+				      const char *pathname)
 {
-	if (mknodat(dirfd, pathname, S_IFCHR | WHITEOUT_MOD, makedev(0, 0))) {
-		print_err(_("Cannot mknod %s:%s\n"), pathname,
-			    strerror(errno));
-		return -1;
-	}
-	return 0;
+	return ovl_repair_whiteout(layer, pathname);
 }
 
 static inline bool ovl_is_redirect(int dirfd, const char *pathname)
@@ -193,10 +207,17 @@ static inline bool ovl_is_origin(int dirfd, const char *pathname)
 	return exist;
 }
 
-static inline int ovl_ask_action(const char *description, const char *pathname,
-				 int dirtype, int stack,
+/* Keep a question and its answer in one line if passes are pipelined */
+static pthread_mutex_t ask_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline int ovl_ask_action(int kind, const char *description,
+				 const char *pathname, int dirtype, int stack,
 				 const char *question, int action)
 {
+	int ret;
+
+	ovl_watch_pause();
+	pthread_mutex_lock(&ask_lock);
 	if (dirtype == OVL_UPPER || dirtype == OVL_WORK)
 		print_info(_("%s: \"%s\" in %s "),
 			     description, pathname, "upperdir");
@@ -204,13 +225,21 @@ static inline int ovl_ask_action(const char *description, const char *pathname,
 		print_info(_("%s: \"%s\" in %s-%d "),
 			     description, pathname, "lowerdir", stack);
 
-	return ask_question(question, action);
+	ret = ask_question(question, action);
+	ovl_finding(kind, pathname, dirtype, stack, ret);
+	pthread_mutex_unlock(&ask_lock);
+	ovl_watch_resume();
+	return ret;
 }
 
-static inline int ovl_ask_question(const char *question, const char *pathname,
-				   int dirtype, int stack,
+static inline int ovl_ask_question(int kind, const char *question,
+				   const char *pathname, int dirtype, int stack,
 				   int action)
 {
+	int ret;
+
+	ovl_watch_pause();
+	pthread_mutex_lock(&ask_lock);
 	if (dirtype == OVL_UPPER || dirtype == OVL_WORK)
 		print_info(_("%s: \"%s\" in %s "),
 			     question, pathname, "upperdir");
@@ -218,17 +247,23 @@ static inline int ovl_ask_question(const char *question, const char *pathname,
 		print_info(_("%s: \"%s\" in %s-%d "),
 			     question, pathname, "lowerdir", stack);
 
-	return ask_question("", action);
+	ret = ask_question("", action);
+	ovl_finding(kind, pathname, dirtype, stack, ret);
+	pthread_mutex_unlock(&ask_lock);
+	ovl_watch_resume();
+	return ret;
 }
 
 /*
- * Lookup a specified target exist or not, return the stat struct if exist
+ * Lookup a specified target exist or not, return the stat struct if exist.
+ * Never follow symlinks out of the layer.
  */
 static int ovl_lookup_single(int dirfd, const char *pathname,
 			     struct stat *st, bool *exist)
 {
-	if (fstatat(dirfd, pathname, st,
-		    AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW)) {
+	ovl_throttle(1);
+
+	if (fstatat_beneath(dirfd, pathname, st)) {
 		if (errno != ENOENT && errno != ENOTDIR) {
 			print_err(_("Cannot stat %s: %s\n"), pathname,
 				    strerror(errno));
@@ -305,6 +340,66 @@ out:
 	return ret;
 }
 
+static int ovl_lookup_layer_fn(int dirfd, void *arg)
+{
+	struct ovl_lookup_ctx *lctx = arg;
+
+	lctx->dirfd = dirfd;
+	return ovl_lookup_layer(lctx);
+}
+
+static void ovl_lookup_ctx_free(void *arg)
+{
+	struct ovl_lookup_ctx *lctx = arg;
+
+	free((char *)lctx->pathname);
+	free(lctx->redirect);
+	free(lctx);
+}
+
+/*
+ * Lookup in a lower layer, on a worker thread with timeout if watching.
+ *
+ * Return: 0 if looked up, OVL_WATCH_STUCK if the layer is quarantined
+ */
+static int ovl_lookup_lower_layer(struct ovl_layer *layer,
+				  struct ovl_lookup_ctx *lctx)
+{
+	struct ovl_lookup_ctx *wctx;
+	int ret;
+
+	if (!ovl_watch_enabled()) {
+		lctx->dirfd = ovl_layer_get(layer);
+		if (lctx->dirfd < 0)
+			return -1;
+		ret = ovl_lookup_layer(lctx);
+		ovl_layer_put(layer);
+		return ret;
+	}
+
+	/* The worker could outlive us, give it a copy */
+	wctx = smalloc(sizeof(*wctx));
+	*wctx = *lctx;
+	wctx->pathname = sstrdup(lctx->pathname);
+	wctx->redirect = NULL;
+
+	ret = ovl_watch_call(layer, lctx->pathname, ovl_lookup_layer_fn,
+			     wctx, ovl_lookup_ctx_free);
+	if (ret == OVL_WATCH_STUCK)
+		return ret;
+
+	lctx->exist = wctx->exist;
+	lctx->st = wctx->st;
+	lctx->stop = wctx->stop;
+	if (wctx->redirect) {
+		free(lctx->redirect);
+		lctx->redirect = wctx->redirect;
+		wctx->redirect = NULL;
+	}
+	ovl_lookup_ctx_free(wctx);
+	return ret;
+}
+
 /*
  * Lookup the lower layers have the same target with the specific one or not.
  *
@@ -319,11 +414,13 @@ static int ovl_lookup_lower(const struct ovl_fs * ofs,
 			    struct ovl_lookup_data *od)
 {
 	struct ovl_lookup_ctx lctx = {0};
+	unsigned long long begin = OVL_PROBE_CLOCK(lookup__end);
 	int i;
 	int ret = 0;
 
 	if (dirtype == OVL_UPPER)
 		start = 0;
+	OVL_PROBE2(lookup__begin, pathname, start);
 
 	if (dirtype == OVL_UPPER) {
 		lctx.dirfd = ofs->upper_layer.fd;
@@ -336,12 +433,17 @@ static int ovl_lookup_lower(const struct ovl_fs * ofs,
 	}
 
 	for (i = start; !lctx.stop && i < ofs->lower_num; i++) {
-		lctx.dirfd = ofs->lower_layer[i].fd;
 		lctx.pathname = (lctx.redirect) ? lctx.redirect : pathname;
 		lctx.skip = (dirtype == OVL_LOWER && i == start) ? true : false;
 		lctx.last = (i == ofs->lower_num - 1) ? true : false;
 
-		ret = ovl_lookup_layer(&lctx);
+		ret = ovl_lookup_lower_layer(&ofs->lower_layer[i], &lctx);
+		if (ret == OVL_WATCH_STUCK) {
+			/* Not known, checks depend on it are skipped */
+			od->unknown = true;
+			ret = 0;
+			goto out;
+		}
 		if (ret)
 			goto out;
 
@@ -356,6 +458,12 @@ static int ovl_lookup_lower(const struct ovl_fs * ofs,
 		od->st = lctx.st;
 	}
 out:
+	OVL_PROBE5(lookup__end, pathname, start, od->exist ? od->stack : -1,
+		   ret, ovl_probe_elapsed(begin));
+	ovl_trace(OVL_TRACE_LOOKUP, OVL_TRACE_DETAIL,
+		  _("Lookup \"%s\" from lower layer %d: %s %d\n"), pathname,
+		  start, od->unknown ? "unknown" : od->exist ? "found in" :
+		  "not found", od->exist ? od->stack : -1);
 	free(lctx.redirect);
 	return ret;
 }
@@ -368,15 +476,22 @@ static int ovl_lookup(const struct ovl_fs *ofs, const char *pathname,
 		      int start, struct ovl_lookup_data *od)
 {
 	struct ovl_lookup_ctx lctx = {0};
+	unsigned long long begin = OVL_PROBE_CLOCK(lookup__end);
 	int i;
 	int ret = 0;
 
+	OVL_PROBE2(lookup__begin, pathname, start);
 	for (i = start; !lctx.stop && i < ofs->lower_num; i++) {
-		lctx.dirfd = ofs->lower_layer[i].fd;
 		lctx.pathname = (lctx.redirect) ? lctx.redirect : pathname;
 		lctx.last = (i == ofs->lower_num - 1) ? true : false;
 
-		ret = ovl_lookup_layer(&lctx);
+		ret = ovl_lookup_lower_layer(&ofs->lower_layer[i], &lctx);
+		if (ret == OVL_WATCH_STUCK) {
+			/* Not known, checks depend on it are skipped */
+			od->unknown = true;
+			ret = 0;
+			goto out;
+		}
 		if (ret)
 			goto out;
 
@@ -391,6 +506,12 @@ static int ovl_lookup(const struct ovl_fs *ofs, const char *pathname,
 		od->st = lctx.st;
 	}
 out:
+	OVL_PROBE5(lookup__end, pathname, start, od->exist ? od->stack : -1,
+		   ret, ovl_probe_elapsed(begin));
+	ovl_trace(OVL_TRACE_LOOKUP, OVL_TRACE_DETAIL,
+		  _("Lookup \"%s\" from lower layer %d: %s %d\n"), pathname,
+		  start, od->unknown ? "unknown" : od->exist ? "found in" :
+		  "not found", od->exist ? od->stack : -1);
 	free(lctx.redirect);
 	return ret;
 }
@@ -425,7 +546,7 @@ static int ovl_check_whiteout(struct scan_ctx *sctx)
 	 */
 	ret = ovl_lookup_lower(ofs, pathname, layer->type,
 			       layer->stack, &od);
-	if (ret)
+	if (ret || od.unknown)
 		goto out;
 
 	if (od.exist && !is_whiteout(&od.st))
@@ -435,16 +556,13 @@ remove:
 	sctx->result.i_whiteouts++;
 
 	/* Remove orphan whiteout directly or ask user */
-	if (!ovl_ask_action("Orphan whiteout", pathname, layer->type,
-			    layer->stack, "Remove", 1))
+	if (!ovl_ask_action(OVL_FINDING_ORPHAN_WHITEOUT, "Orphan whiteout",
+			    pathname, layer->type, layer->stack, "Remove", 1))
 		return 0;
 
-	ret = unlinkat(layer->fd, pathname, 0);
-	if (ret) {
-		print_err(_("Cannot unlink %s: %s\n"), pathname,
-			    strerror(errno));
+	ret = ovl_repair_unlink(layer, pathname);
+	if (ret)
 		goto out;
-	}
 	set_changed(&status);
 	sctx->result.t_whiteouts--;
 	sctx->result.i_whiteouts--;
@@ -472,10 +590,10 @@ static void ovl_redirect_entry_add(const char *pathname, int dirtype, int stack,
 	new = smalloc(sizeof(*new));
 	INIT_LIST_HEAD(&new->list);
 
-	print_debug(_("Redirect entry add: [%s %s %d][%s %d]\n"),
-		      pathname, (dirtype == OVL_UPPER) ? "upper" : "lower",
-		      (dirtype == OVL_UPPER) ? 0 : stack,
-		      origin, ostack);
+	ovl_trace(OVL_TRACE_REDIRECT, OVL_TRACE_DETAIL,
+		  _("Redirect entry add: [%s %s %d][%s %d]\n"),
+		  pathname, (dirtype == OVL_UPPER) ? "upper" : "lower",
+		  (dirtype == OVL_UPPER) ? 0 : stack, origin, ostack);
 
 	new->pathname = sstrdup(pathname);
 	new->dirtype = dirtype;
@@ -533,11 +651,12 @@ static void ovl_redirect_entry_del(const char *origin, int ostack)
 		entry = list_entry(node, struct ovl_redirect_entry, list);
 
 		if (entry->ostack == ostack && !strcmp(entry->origin, origin)) {
-			print_debug(_("Redirect entry del: [%s %s %d][%s %d]\n"),
-				      entry->pathname,
-				      (entry->dirtype == OVL_UPPER) ? "upper" : "lower",
-				      (entry->dirtype == OVL_UPPER) ? 0 : entry->stack,
-				      entry->origin, entry->ostack);
+			ovl_trace(OVL_TRACE_REDIRECT, OVL_TRACE_DETAIL,
+				  _("Redirect entry del: [%s %s %d][%s %d]\n"),
+				  entry->pathname,
+				  (entry->dirtype == OVL_UPPER) ? "upper" : "lower",
+				  (entry->dirtype == OVL_UPPER) ? 0 : entry->stack,
+				  entry->origin, entry->ostack);
 
 			list_del_init(node);
 			free(entry->pathname);
@@ -554,10 +673,11 @@ static bool ovl_redirect_is_duplicate(const char *origin, int ostack)
 	char *dup;
 
 	if (ovl_redirect_entry_find(origin, ostack, &dirtype, &stack, &dup)) {
-		print_debug("Duplicate redirect dir found: Origin:%s in lower %d, "
-			    "Previous:%s in %s %d\n",
-			    origin, ostack, dup,
-			    (dirtype == OVL_UPPER) ? "upper" : "lower", stack);
+		ovl_trace(OVL_TRACE_REDIRECT, OVL_TRACE_EVENT,
+			  "Duplicate redirect dir found: Origin:%s in lower %d, "
+			  "Previous:%s in %s %d\n",
+			  origin, ostack, dup,
+			  (dirtype == OVL_UPPER) ? "upper" : "lower", stack);
 		return true;
 	}
 	return false;
@@ -577,6 +697,55 @@ static void ovl_redirect_free(void)
 	}
 }
 
+/*
+ * Save valid redirect entries found in a lower layer into the layer's
+ * shared index, keep the list order for replay.
+ */
+static void ovl_redirect_export(struct ovl_layer *layer)
+{
+	struct ovl_layer_index *index = layer->index;
+	struct ovl_redirect_entry *entry;
+	struct list_head *node;
+	int num = 0;
+
+	list_for_each(node, &redirect_list) {
+		entry = list_entry(node, struct ovl_redirect_entry, list);
+		if (entry->dirtype == OVL_LOWER && entry->stack == layer->stack)
+			num++;
+	}
+
+	index->redirects = smalloc(sizeof(struct ovl_redirect_rec) * (num ? : 1));
+	index->redirect_num = num;
+
+	/* The newest entry is at the head of list, store it last */
+	list_for_each(node, &redirect_list) {
+		entry = list_entry(node, struct ovl_redirect_entry, list);
+		if (entry->dirtype != OVL_LOWER || entry->stack != layer->stack)
+			continue;
+
+		num--;
+		index->redirects[num].pathname = sstrdup(entry->pathname);
+		index->redirects[num].origin = sstrdup(entry->origin);
+		index->redirects[num].odepth = entry->ostack - entry->stack;
+	}
+}
+
+/*
+ * Replay valid redirect entries of an already checked lower layer, as if
+ * we scan this layer again.
+ */
+static void ovl_redirect_import(const struct ovl_layer *layer)
+{
+	const struct ovl_layer_index *index = layer->index;
+	int i;
+
+	for (i = 0; i < index->redirect_num; i++)
+		ovl_redirect_entry_add(index->redirects[i].pathname,
+				       OVL_LOWER, layer->stack,
+				       index->redirects[i].origin,
+				       layer->stack + index->redirects[i].odepth);
+}
+
 /*
  * Remove an invalid redirect xattr.
  * If the lower dir with the same name exists, it may become a
@@ -586,15 +755,15 @@ static void ovl_redirect_free(void)
 static int ovl_do_remove_redirect(const struct ovl_fs *ofs,
 				  const struct ovl_layer *layer,
 				  const char *pathname,
-				  int *total,
-				  int *invalid)
+				  long long *total,
+				  long long *invalid)
 {
 	struct ovl_lookup_data od = {0};
 	int du_dirtype, du_stack;
 	char *duplicate;
 	int ret;
 
-	ret = ovl_remove_redirect(layer->fd, pathname);
+	ret = ovl_remove_redirect(layer, pathname);
 	if (ret)
 		goto out;
 
@@ -605,15 +774,15 @@ static int ovl_do_remove_redirect(const struct ovl_fs *ofs,
 	/* If lower corresponding dir exists, ask user to set opaque */
 	ret = ovl_lookup_lower(ofs, pathname, layer->type,
 			       layer->stack, &od);
-	if (ret)
+	if (ret || od.unknown)
 		goto out;
 
 	if (!od.exist || !is_dir(&od.st))
 		goto out;
 
-	if (ovl_ask_question("Should set opaque dir", pathname,
-			     layer->type, layer->stack, 0)) {
-		ret = ovl_set_opaque(layer->fd, pathname);
+	if (ovl_ask_question(OVL_FINDING_OPAQUE_DIR, "Should set opaque dir",
+			     pathname, layer->type, layer->stack, 0)) {
+		ret = ovl_set_opaque(layer, pathname);
 		if (!ret)
 			set_changed(&status);
 		goto out;
@@ -626,9 +795,10 @@ static int ovl_do_remove_redirect(const struct ovl_fs *ofs,
 		 * duplicate, should re-ask
 		 */
 		if ((du_dirtype == layer->type) && (du_stack == layer->stack) &&
-		    ovl_ask_action("Duplicate redirect directory",
-                                   duplicate, du_dirtype, du_stack,
-                                   "Remove redirect", 0)) {
+		    ovl_ask_action(OVL_FINDING_DUPLICATE_REDIRECT,
+				   "Duplicate redirect directory",
+				   duplicate, du_dirtype, du_stack,
+				   "Remove redirect", 0)) {
 			(*invalid)++;
 			ret = ovl_do_remove_redirect(ofs, layer, duplicate,
 						     total, invalid);
@@ -642,6 +812,68 @@ out:
 	return ret;
 }
 
+/* A dir resolved for its redirect xattr, could be done in parallel */
+struct ovl_redirect_info {
+	char *pathname;			/* dir pathname */
+	char *redirect;			/* NULL if not a redirect dir */
+	struct ovl_lookup_data *od;	/* redirect origin in lower layers */
+	struct stat cover_st;		/* target covers the origin */
+	bool cover_exist;
+	bool cover_merge;		/* cover is a merge dir */
+	int ret;
+};
+
+/*
+ * Read the redirect xattr of a dir, and lookup its origin and the target
+ * covers the origin in this layer. Lookups only, nothing is changed or
+ * reported here.
+ */
+static int ovl_redirect_resolve(const struct ovl_fs *ofs,
+				const struct ovl_layer *layer,
+				struct ovl_redirect_info *info)
+{
+	int start;
+	int ret;
+
+	/* Get redirect */
+	ret = ovl_get_redirect(layer->fd, info->pathname, &info->redirect);
+	if (ret || !info->redirect)
+		return ret;
+
+	info->od = smalloc(sizeof(*info->od));
+
+	/* Redirect dir in last lower dir ? */
+	if (layer->type == OVL_LOWER && layer->stack == ofs->lower_num-1)
+		return 0;
+
+	/* Scan lower directories to check redirect dir exist or not */
+	start = (layer->type == OVL_LOWER) ? layer->stack + 1 : 0;
+	ret = ovl_lookup(ofs, info->redirect, start, info->od);
+	if (ret || !info->od->exist || !is_dir(&info->od->st))
+		return ret;
+
+	/* Is there a target with the same name covers the origin */
+	ret = ovl_lookup_single(layer->fd, info->redirect, &info->cover_st,
+				&info->cover_exist);
+	if (ret)
+		return ret;
+
+	info->cover_merge = info->cover_exist && is_dir(&info->cover_st) &&
+			    !ovl_is_opaque(layer->fd, info->redirect) &&
+			    !ovl_is_redirect(layer->fd, info->redirect);
+	return 0;
+}
+
+static void ovl_redirect_info_free(struct ovl_redirect_info *info)
+{
+	free(info->redirect);
+	free(info->od);
+	info->redirect = NULL;
+	info->od = NULL;
+	info->cover_exist = false;
+	info->cover_merge = false;
+}
+
 /*
  * Get redirect origin directory stored in the xattr, check it's invlaid
  * or not, In auto-mode, invalid redirect xattr will be removed directly.
@@ -655,47 +887,42 @@ out:
  *    corresponding directory exists.
  * 5) If a duplicate redirect xattr is found, not sure which one is invalid
  *    and how to deal with it, so ask user by default.
+ *
+ * The redirect dir is already resolved in @info.
  */
-static int ovl_check_redirect(struct scan_ctx *sctx)
+static int ovl_check_redirect_info(struct scan_ctx *sctx,
+				   struct ovl_redirect_info *info)
 {
-	const char *pathname = sctx->pathname;
+	const char *pathname = info->pathname;
 	const struct ovl_fs *ofs = sctx->ofs;
 	const struct ovl_layer *layer = sctx->layer;
-	struct ovl_lookup_data od = {0};
-	struct stat cover_st;
-	bool cover_exist = false;
-	char *redirect = NULL;
-	int start;
-	int ret;
-
-	/* Get redirect */
-	ret = ovl_get_redirect(layer->fd, pathname, &redirect);
-	if (ret || !redirect)
-		return ret;
+	struct ovl_lookup_data *od = info->od;
+	const char *redirect = info->redirect;
+	int ret = 0;
 
-	print_debug(_("Dir \"%s\" has redirect \"%s\"\n"), pathname, redirect);
+	ovl_trace(OVL_TRACE_REDIRECT, OVL_TRACE_EVENT,
+		  _("Dir \"%s\" has redirect \"%s\"\n"), pathname, redirect);
 	sctx->result.t_redirects++;
 
 	/* Redirect dir in last lower dir ? */
 	if (layer->type == OVL_LOWER && layer->stack == ofs->lower_num-1)
 		goto remove;
 
-	/* Scan lower directories to check redirect dir exist or not */
-	start = (layer->type == OVL_LOWER) ? layer->stack + 1 : 0;
-	ret = ovl_lookup(ofs, redirect, start, &od);
-	if (ret)
+	/* Origin is not known, neither valid nor invalid */
+	if (od->unknown)
 		goto out;
 
-	if (od.exist && is_dir(&od.st)) {
+	if (od->exist && is_dir(&od->st)) {
 		/* Check duplicate with another redirect dir */
-		if (ovl_redirect_is_duplicate(od.pathname, od.stack)) {
+		if (ovl_redirect_is_duplicate(od->pathname, od->stack)) {
 			sctx->result.i_redirects++;
 
 			/*
 			 * Not sure which one is invalid, don't remove in
 			 * auto mode
 			 */
-			if (ovl_ask_action("Duplicate redirect directory",
+			if (ovl_ask_action(OVL_FINDING_DUPLICATE_REDIRECT,
+					   "Duplicate redirect directory",
 					   pathname, layer->type, layer->stack,
 					   "Remove redirect", 0))
 				goto remove_d;
@@ -704,39 +931,36 @@ static int ovl_check_redirect(struct scan_ctx *sctx)
 		}
 
 		/* Check duplicate with merge dir */
-		ret = ovl_lookup_single(layer->fd, redirect, &cover_st,
-					&cover_exist);
-		if (ret)
-			goto out;
-		if (!cover_exist) {
+		if (!info->cover_exist) {
 			/* Found nothing, create a whiteout */
-			if (ovl_ask_action("Missing whiteout", pathname,
+			if (ovl_ask_action(OVL_FINDING_MISSING_WHITEOUT,
+					   "Missing whiteout", pathname,
 					   layer->type, layer->stack,
 					   "Add", 1)) {
-				ret = ovl_create_whiteout(layer->fd, redirect);
+				ret = ovl_create_whiteout(layer, redirect);
 				if (ret)
 					goto out;
 
 				set_changed(&status);
 				sctx->result.t_whiteouts++;
 			}
-		} else if (is_dir(&cover_st) &&
-			   !ovl_is_opaque(layer->fd, redirect) &&
-			   !ovl_is_redirect(layer->fd, redirect)) {
+		} else if (info->cover_merge) {
 			/*
 			 * Found a directory merge with the same origin,
 			 * ask user to remove this duplicate redirect xattr
 			 * or set opaque to the cover directory
 			 */
 			sctx->result.i_redirects++;
-			if (ovl_ask_action("Duplicate redirect directory",
+			if (ovl_ask_action(OVL_FINDING_DUPLICATE_REDIRECT,
+					   "Duplicate redirect directory",
 					   pathname, layer->type, layer->stack,
 					   "Remove redirect", 0)) {
 				goto remove_d;
-			} else if (ovl_ask_question("Should set opaque dir",
+			} else if (ovl_ask_question(OVL_FINDING_OPAQUE_DIR,
+						    "Should set opaque dir",
 						    redirect, layer->type,
 						    layer->stack, 0)) {
-				ret = ovl_set_opaque(layer->fd, redirect);
+				ret = ovl_set_opaque(layer, redirect);
 				if (ret)
 					goto out;
 				set_changed(&status);
@@ -748,7 +972,7 @@ static int ovl_check_redirect(struct scan_ctx *sctx)
 
 		/* Now, this redirect xattr is valid */
 		ovl_redirect_entry_add(pathname, layer->type, layer->stack,
-				       od.pathname, od.stack);
+				       od->pathname, od->stack);
 
 		goto out;
 	}
@@ -757,15 +981,156 @@ remove:
 	sctx->result.i_redirects++;
 
 	/* Remove redirect xattr or ask user */
-	if (!ovl_ask_action("Invalid redirect directory", pathname, layer->type,
-			    layer->stack, "Remove redirect", 1))
+	if (!ovl_ask_action(OVL_FINDING_INVALID_REDIRECT,
+			    "Invalid redirect directory", pathname,
+			    layer->type, layer->stack, "Remove redirect", 1))
 		goto out;
 remove_d:
 	ret = ovl_do_remove_redirect(ofs, layer, pathname,
 				     &sctx->result.t_redirects,
 				     &sctx->result.i_redirects);
 out:
-	free(redirect);
+	/* Lookups of the following dirs depend on this one, apply at once */
+	if (!ret)
+		ret = ovl_repair_flush();
+	return ret;
+}
+
+static int ovl_check_redirect(struct scan_ctx *sctx)
+{
+	struct ovl_redirect_info info = {.pathname = (char *)sctx->pathname};
+	int ret;
+
+	ret = ovl_redirect_resolve(sctx->ofs, sctx->layer, &info);
+	if (!ret && info.redirect)
+		ret = ovl_check_redirect_info(sctx, &info);
+
+	ovl_redirect_info_free(&info);
+	return ret;
+}
+
+/*
+ * Check redirect dirs with several threads. Dirs found by the scan are
+ * resolved in batches in parallel, and then checked one by one in the
+ * scan order, so the duplicate redirect dirs found and the messages are
+ * the same as a sequential check. If a repair is made, the lookups of
+ * the following redirect dirs in the batch may be changed by it, they
+ * are resolved again.
+ */
+#define OVL_REDIRECT_BATCH	1024
+
+static int redirect_threads = 1;
+
+struct ovl_redirect_batch {
+	const struct ovl_fs *ofs;
+	const struct ovl_layer *layer;
+	struct ovl_redirect_info infos[OVL_REDIRECT_BATCH];
+	int num;
+};
+
+static struct ovl_redirect_batch *redirect_batch;
+
+/* Check redirect dirs with @threads threads in pass one */
+void ovl_scan_threads(int threads)
+{
+	redirect_threads = threads;
+}
+
+static void ovl_redirect_resolve_one(int i, void *arg)
+{
+	struct ovl_redirect_batch *batch = arg;
+
+	batch->infos[i].ret = ovl_redirect_resolve(batch->ofs, batch->layer,
+						   &batch->infos[i]);
+}
+
+/*
+ * Bound the lookups in flight by the storage of the layer and the lower
+ * layers below it, which are looked up for the origins, and scale them
+ * by io pressure as other workers.
+ */
+static int ovl_redirect_threads(const struct ovl_fs *ofs,
+				const struct ovl_layer *layer)
+{
+	int threads = ovl_device_threads(layer->device, redirect_threads);
+	int i;
+
+	i = (layer->type == OVL_LOWER) ? layer->stack + 1 : 0;
+	for (; i < ofs->lower_num; i++)
+		threads = ovl_device_threads(ofs->lower_layer[i].device,
+					     threads);
+	return ovl_throttle_jobs(threads);
+}
+
+/* Resolve the dirs in batch in parallel, and check them in order */
+static int ovl_redirect_batch_run(struct scan_ctx *sctx, int ret)
+{
+	struct ovl_redirect_batch *batch = redirect_batch;
+	unsigned int seq;
+	int i;
+
+	if (!batch)
+		return ret;
+
+	seq = ovl_repair_seq(batch->layer);
+
+	if (!ret) {
+		ovl_watch_pause();
+		run_parallel(batch->num,
+			     ovl_redirect_threads(batch->ofs, batch->layer),
+			     ovl_redirect_resolve_one, batch);
+		ovl_watch_resume();
+	}
+
+	for (i = 0; i < batch->num; i++) {
+		struct ovl_redirect_info *info = &batch->infos[i];
+
+		if (!ret && info->redirect &&
+		    seq != ovl_repair_seq(batch->layer)) {
+			ovl_redirect_info_free(info);
+			info->ret = ovl_redirect_resolve(sctx->ofs, sctx->layer,
+							 info);
+			seq = ovl_repair_seq(batch->layer);
+		}
+		if (!ret)
+			ret = info->ret;
+		if (!ret && info->redirect)
+			ret = ovl_check_redirect_info(sctx, info);
+
+		ovl_redirect_info_free(info);
+		free(info->pathname);
+	}
+	batch->num = 0;
+	return ret;
+}
+
+/* Queue a dir to check its redirect xattr in parallel */
+static int ovl_queue_redirect(struct scan_ctx *sctx)
+{
+	struct ovl_redirect_batch *batch = redirect_batch;
+	struct ovl_redirect_info *info;
+
+	if (!batch) {
+		batch = redirect_batch = smalloc(sizeof(*batch));
+		batch->ofs = sctx->ofs;
+		batch->layer = sctx->layer;
+	}
+
+	info = &batch->infos[batch->num++];
+	memset(info, 0, sizeof(*info));
+	info->pathname = sstrdup(sctx->pathname);
+
+	if (batch->num < OVL_REDIRECT_BATCH)
+		return 0;
+	return ovl_redirect_batch_run(sctx, 0);
+}
+
+/* Check the dirs left in batch at the end of scanning a layer */
+static int ovl_redirect_batch_end(struct scan_ctx *sctx, int ret)
+{
+	ret = ovl_redirect_batch_run(sctx, ret);
+	free(redirect_batch);
+	redirect_batch = NULL;
 	return ret;
 }
 
@@ -800,9 +1165,10 @@ static int ovl_check_impure(struct scan_ctx *sctx)
 		return 0;
 
 	/* Fix impure xattrs */
-	if (ovl_ask_action("Missing impure xattr", sctx->pathname,
-			   layer->type, layer->stack, "Fix", 1)) {
-		if (ovl_set_impure(layer->fd, sctx->pathname))
+	if (ovl_ask_action(OVL_FINDING_MISSING_IMPURE, "Missing impure xattr",
+			   sctx->pathname, layer->type, layer->stack,
+			   "Fix", 1)) {
+		if (ovl_set_impure(layer, sctx->pathname))
 			return -1;
 
 		set_changed(&status);
@@ -828,7 +1194,8 @@ static inline bool ovl_is_merge(const struct ovl_fs *ofs,
 
 	if (ovl_is_opaque(layer->fd, pathname))
 		return false;
-	if (ovl_lookup_lower(ofs, pathname, layer->type, layer->stack, &od))
+	if (ovl_lookup_lower(ofs, pathname, layer->type, layer->stack, &od) ||
+	    od.unknown)
 		return false;
 	if (od.exist && is_dir(&od.st))
 		return true;
@@ -886,9 +1253,9 @@ static void ovl_scan_clean(void)
 static void ovl_scan_report(struct scan_result *result)
 {
 	if (flags & FL_VERBOSE) {
-		print_info(_("Scan %d directories, %d files, "
-			     "%d/%d whiteouts, %d/%d redirect dirs "
-			     "%d missing impure\n"),
+		print_info(_("Scan %lld directories, %lld files, "
+			     "%lld/%lld whiteouts, %lld/%lld redirect dirs "
+			     "%lld missing impure\n"),
 			     result->directories, result->files,
 			     result->i_whiteouts, result->t_whiteouts,
 			     result->i_redirects, result->t_redirects,
@@ -902,17 +1269,17 @@ static void ovl_scan_check(struct scan_result *result)
 	bool inconsistency = false;
 
 	if (result->i_whiteouts) {
-		print_info(_("Invalid whiteouts %d left!\n"),
+		print_info(_("Invalid whiteouts %lld left!\n"),
 			     result->i_whiteouts);
 		inconsistency = true;
 	}
 	if (result->i_redirects) {
-		print_info(_("Invalid redirect directories %d left!\n"),
+		print_info(_("Invalid redirect directories %lld left!\n"),
 			     result->i_redirects);
 		inconsistency = true;
 	}
 	if (result->m_impure) {
-		print_info(_("Directories %d missing impure xattr!\n"),
+		print_info(_("Directories %lld missing impure xattr!\n"),
 			     result->m_impure);
 		inconsistency = true;
 	}
@@ -950,6 +1317,8 @@ static int ovl_scan_layer(struct ovl_fs *ofs, struct ovl_layer *layer,
 {
 	struct scan_ctx sctx = {.ofs = ofs};
 	struct scan_operations ops = {};
+	struct ovl_metrics_timer timer;
+	unsigned long long begin;
 	char skip[256] = {0};
 	bool scan = false;
 	int ret;
@@ -963,7 +1332,8 @@ static int ovl_scan_layer(struct ovl_fs *ofs, struct ovl_layer *layer,
 	case OVL_SCAN_PASS_ONE:
 		/* PASS 1: Checking redirect xattr and directory tree */
 		if (layer->flag & FS_LAYER_XATTR) {
-			ops.redirect = ovl_check_redirect;
+			ops.redirect = redirect_threads > 1 ?
+				       ovl_queue_redirect : ovl_check_redirect;
 			scan = true;
 		} else {
 			/* Skip redirect dir if not support xattr */
@@ -1005,71 +1375,478 @@ static int ovl_scan_layer(struct ovl_fs *ofs, struct ovl_layer *layer,
 		return 0;
 
 	sctx.layer = layer;
-	ret = scan_dir(&sctx, &ops);
+	begin = OVL_PROBE_CLOCK(layer__end);
+	OVL_PROBE3(layer__begin, layer->path,
+		   layer->type == OVL_UPPER ? -1 : layer->stack, pass);
+	ovl_metrics_layer_begin(&timer);
+	ovl_progress_scan_begin(layer, pass);
+	ovl_profile_scan_begin(layer, pass);
+	ret = ovl_budget_begin(layer, pass);
+	if (!ret)
+		ret = scan_dir(&sctx, &ops);
+	if (ops.redirect == ovl_queue_redirect)
+		ret = ovl_redirect_batch_end(&sctx, ret);
+	ovl_budget_end();
+	ovl_profile_scan_end();
+	ovl_progress_scan_end();
+
+	/* Apply the repairs left, even if scan failed */
+	if (ovl_repair_flush())
+		ret = -1;
 
 	/* Check scan result for this pass */
 	ovl_scan_check(&sctx.result);
 	ovl_scan_cumsum_result(&sctx.result, result);
+	ovl_metrics_layer_end(&timer, layer, pass, &sctx.result);
+	OVL_PROBE5(layer__end, layer->path,
+		   layer->type == OVL_UPPER ? -1 : layer->stack, pass,
+		   sctx.result.files + sctx.result.directories,
+		   ovl_probe_elapsed(begin));
+
+	return ret;
+}
+
+/* Held exclusively to switch the options for a read-only lower layer */
+static pthread_rwlock_t scan_flags_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Find the storage the layer is on to schedule the scan */
+static void ovl_scan_device(struct ovl_layer *layer)
+{
+	if (layer->device)
+		return;
+
+	layer->device = ovl_device_probe(layer->fd);
+	if (layer->type == OVL_LOWER)
+		ovl_trace(OVL_TRACE_SCAN, OVL_TRACE_EVENT,
+			  _("Lower layer %d is on %s storage\n"),
+			  layer->stack, ovl_device_desc(layer->device));
+	else
+		ovl_trace(OVL_TRACE_SCAN, OVL_TRACE_EVENT,
+			  _("Upper layer is on %s storage\n"),
+			  ovl_device_desc(layer->device));
+}
+
+/* Scan one lower layer in one pass */
+static int ovl_scan_lower(struct ovl_fs *ofs, int stack, int pass,
+			  struct scan_result *result)
+{
+	struct ovl_layer *layer = &ofs->lower_layer[stack];
+	struct ovl_layer_index *index = layer->index;
+	int ret;
+
+	/* Already checked, reuse the shared result */
+	if (index && index->checked) {
+		ovl_trace(OVL_TRACE_SCAN, OVL_TRACE_EVENT,
+			  _("Skip checked lower layer %d\n"), stack);
+		if (pass == OVL_SCAN_PASS_ONE)
+			ovl_redirect_import(layer);
+		return 0;
+	}
+
+	ovl_trace(OVL_TRACE_SCAN, OVL_TRACE_EVENT,
+		  _("Scan lower layer %d in pass %d\n"), stack, pass);
+
+	/* Skip the layer does not respond */
+	if (ovl_watch_probe(layer))
+		return 0;
+
+	/* Open the layer if not yet, keep it open while scanning */
+	layer->fd = ovl_layer_get(layer);
+	if (layer->fd < 0)
+		return -1;
+	ovl_scan_device(layer);
+
+	/* Layers on one rotational device are not scanned at once */
+	ovl_device_scan_begin(layer->device);
+
+	/*
+	 * If lower layer is read-only, switch to -n scan
+	 * option, because this layer cannot modifiy.
+	 */
+	if (layer->flag & FS_LAYER_RO) {
+		int save_flags = flags & (FL_OPT_MASK | FL_PLAN);
+
+		print_info(_("Lower layer %d is read-only, "
+			     "switch to -n option this layer\n"), stack);
+
+		/* No other pass is scanning while the options are switched */
+		pthread_rwlock_wrlock(&scan_flags_lock);
+		flags = (flags & ~(FL_OPT_MASK | FL_PLAN)) | FL_OPT_NO;
+		ovl_watch_scan_begin(layer);
+		ret = ovl_scan_layer(ofs, layer, pass, result);
+		ovl_watch_scan_end();
+		flags = (flags & ~FL_OPT_NO) | save_flags;
+		pthread_rwlock_unlock(&scan_flags_lock);
+	} else {
+		pthread_rwlock_rdlock(&scan_flags_lock);
+		ovl_watch_scan_begin(layer);
+		ret = ovl_scan_layer(ofs, layer, pass, result);
+		ovl_watch_scan_end();
+		pthread_rwlock_unlock(&scan_flags_lock);
+	}
+	ovl_device_scan_end(layer->device);
+
+	ovl_layer_put(layer);
+	layer->fd = -1;
+	if (ret)
+		return ret;
+
+	if (index && pass == OVL_SCAN_PASS_ONE)
+		ovl_redirect_export(layer);
+	return 0;
+}
+
+/* Keep the result and the valid redirect dirs of this shard to merge */
+static void ovl_scan_shard(const struct ovl_fs *ofs,
+			   const struct scan_result *result)
+{
+	struct ovl_redirect_entry *entry;
+	struct list_head *node;
+
+	list_for_each(node, &redirect_list) {
+		entry = list_entry(node, struct ovl_redirect_entry, list);
+		ovl_shard_redirect(entry->pathname, entry->dirtype,
+				   entry->stack, entry->origin, entry->ostack);
+	}
+	ovl_shard_result(ofs, result);
+}
+
+/*
+ * Get the stack of the @i-th layer to scan in a pass, -1 means the upper
+ * layer. Lower layers are scanned from the bottom and then the upper
+ * layer, the redirect dirs found below are needed when checking above.
+ * With a time budget, pass two checks the layers left not checked by last
+ * run first, and then the others, each the upper layer first and then lower
+ * layers from the top, they are more likely to be broken.
+ */
+static int ovl_scan_order(const struct ovl_fs *ofs, int pass, int i)
+{
+	const struct ovl_layer *layer;
+	int stack, n = 0;
+	int first;
+
+	if (pass != OVL_SCAN_PASS_TWO || !ovl_budget_enabled())
+		return i < ofs->lower_num ? ofs->lower_num - 1 - i : -1;
+
+	for (first = 1; first >= 0; first--) {
+		for (stack = -1; stack < ofs->lower_num; stack++) {
+			layer = stack < 0 ? &ofs->upper_layer :
+					    &ofs->lower_layer[stack];
+			if (ovl_budget_left(layer) != first)
+				continue;
+			if (n++ == i)
+				return stack;
+		}
+	}
+	return -1;
+}
+
+static int sample_probes;	/* probes per layer, 0 if not sampling */
+
+static const char *ovl_sample_desc[SAMPLE_KINDS] = {
+	[SAMPLE_FILES] = "files",
+	[SAMPLE_DIRECTORIES] = "directories",
+	[SAMPLE_T_WHITEOUTS] = "whiteouts",
+	[SAMPLE_I_WHITEOUTS] = "invalid whiteouts",
+	[SAMPLE_T_REDIRECTS] = "redirect dirs",
+	[SAMPLE_I_REDIRECTS] = "invalid redirect dirs",
+};
+
+/* Estimate the counts by @probes random walks in each layer, not scan */
+void ovl_scan_sample(int probes)
+{
+	sample_probes = probes;
+	srand48(time(NULL) ^ getpid());
+}
 
+static void ovl_sample_report(const struct ovl_layer *layer,
+			      const struct sample_result *sres)
+{
+	int k;
+
+	print_info(_("Sample %s layer %s: %d probes, %d directories read\n"),
+		     layer->type == OVL_UPPER ? "upper" : "lower",
+		     layer->path, sres->probes, sres->dirs);
+	for (k = 0; k < SAMPLE_KINDS; k++)
+		print_info(_("  estimated %-22s %10.0f +/- %.0f\n"),
+			     ovl_sample_desc[k], sres->mean[k], sres->ci[k]);
+}
+
+/*
+ * Check the entries of sampled dirs of a layer, whiteouts and redirect
+ * dirs are checked in one walk, and estimate the totals of the layer.
+ */
+static int ovl_sample_layer(struct ovl_fs *ofs, struct ovl_layer *layer,
+			    struct scan_result *result)
+{
+	struct scan_ctx sctx = {.ofs = ofs, .layer = layer};
+	struct scan_operations ops = {.whiteout = ovl_check_whiteout};
+	struct sample_result sres;
+	int ret;
+
+	if (layer->flag & FS_LAYER_XATTR)
+		ops.redirect = ovl_check_redirect;
+
+	ret = sample_dir(&sctx, &ops, sample_probes, &sres);
+	if (!ret)
+		ovl_sample_report(layer, &sres);
+
+	/* Invalid targets found in sampled dirs */
+	ovl_scan_check(&sctx.result);
+	ovl_scan_cumsum_result(&sctx.result, result);
 	return ret;
 }
 
+/*
+ * Sample each lower layer from the bottom and then the upper layer, the
+ * redirect dirs found below are needed when checking above.
+ */
+static int ovl_sample_fix(struct ovl_fs *ofs)
+{
+	struct scan_result result = {0};
+	struct ovl_layer *layer;
+	int ret = 0;
+	int i;
+
+	for (i = 0; i <= ofs->lower_num; i++) {
+		int stack = ovl_scan_order(ofs, OVL_SCAN_PASS_ONE, i);
+
+		if (stack < 0) {
+			if (!(flags & FL_UPPER))
+				continue;
+			ret = ovl_sample_layer(ofs, &ofs->upper_layer, &result);
+		} else {
+			layer = &ofs->lower_layer[stack];
+			if (ovl_watch_probe(layer))
+				continue;
+			layer->fd = ovl_layer_get(layer);
+			if (layer->fd < 0) {
+				ret = -1;
+				break;
+			}
+			ovl_watch_scan_begin(layer);
+			ret = ovl_sample_layer(ofs, layer, &result);
+			ovl_watch_scan_end();
+			ovl_layer_put(layer);
+			layer->fd = -1;
+		}
+		if (ret)
+			break;
+	}
+
+	ovl_scan_report(&result);
+	ovl_throttle_report();
+	ovl_watch_report();
+	ovl_scan_clean();
+	return ret;
+}
+
+/*
+ * Pipelined passes. Pass one of a layer only changes this layer, and
+ * pass two of a lower layer only looks up this layer and the layers
+ * below it, so pass two of the i-th layer could start once pass one has
+ * finished the first i layers (from the bottom), while pass one goes on
+ * with the layers above. Pass two of the upper layer waits for the whole
+ * pass one. Pass two may remove orphan whiteouts in a layer pass one is
+ * looking up, but a redirect origin is never found on an orphan whiteout
+ * with or without it.
+ */
+struct ovl_scan_pipe {
+	struct ovl_fs *ofs;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int done;			/* layers finished by pass one */
+	bool failed;			/* pass one failed */
+	struct scan_result result[OVL_SCAN_PASS_MAX];
+	int ret[OVL_SCAN_PASS_MAX];
+};
+
+/* Pipeline passes if checking with threads and without questions */
+static bool ovl_scan_pipelined(void)
+{
+	return redirect_threads > 1 && (flags & FL_OPT_MASK) &&
+	       !(flags & FL_DURABLE) && !ovl_budget_enabled();
+}
+
+/* Wait for pass one to finish the first @num layers */
+static bool ovl_scan_pipe_wait(struct ovl_scan_pipe *pipe, int num)
+{
+	bool failed;
+
+	pthread_mutex_lock(&pipe->lock);
+	while (pipe->done < num && !pipe->failed)
+		pthread_cond_wait(&pipe->cond, &pipe->lock);
+	failed = pipe->failed;
+	pthread_mutex_unlock(&pipe->lock);
+	return !failed;
+}
+
+static void ovl_scan_pipe_done(struct ovl_scan_pipe *pipe, int num, int ret)
+{
+	pthread_mutex_lock(&pipe->lock);
+	pipe->done = num;
+	if (ret)
+		pipe->failed = true;
+	pthread_cond_broadcast(&pipe->cond);
+	pthread_mutex_unlock(&pipe->lock);
+}
+
+/* Scan each layer in one pass */
+static int ovl_scan_pass(struct ovl_scan_pipe *pipe, int pass)
+{
+	struct ovl_fs *ofs = pipe->ofs;
+	struct scan_result *result = &pipe->result[pass];
+	int stack, i;
+	int ret = 0;
+
+	if (flags & FL_VERBOSE)
+		print_info(_("Pass %d: %s\n"), pass, ovl_scan_desc[pass]);
+
+	OVL_PROBE1(pass__begin, pass);
+	for (i = 0; i <= ofs->lower_num && !ret; i++) {
+		if (pass == OVL_SCAN_PASS_TWO && !ovl_scan_pipe_wait(pipe, i + 1))
+			break;
+
+		stack = ovl_scan_order(ofs, pass, i);
+		if (stack >= 0) {
+			ret = ovl_scan_lower(ofs, stack, pass, result);
+		} else if (flags & FL_UPPER) {
+			ovl_trace(OVL_TRACE_SCAN, OVL_TRACE_EVENT,
+				  _("Scan upper layer in pass %d\n"), pass);
+			ovl_device_scan_begin(ofs->upper_layer.device);
+			pthread_rwlock_rdlock(&scan_flags_lock);
+			ret = ovl_scan_layer(ofs, &ofs->upper_layer, pass,
+					     result);
+			pthread_rwlock_unlock(&scan_flags_lock);
+			ovl_device_scan_end(ofs->upper_layer.device);
+		}
+
+		if (pass == OVL_SCAN_PASS_ONE)
+			ovl_scan_pipe_done(pipe, i + 1, ret);
+	}
+	OVL_PROBE2(pass__end, pass, ret);
+	return ret;
+}
+
+static void *ovl_scan_pass_one(void *arg)
+{
+	struct ovl_scan_pipe *pipe = arg;
+
+	pipe->ret[OVL_SCAN_PASS_ONE] = ovl_scan_pass(pipe,
+						      OVL_SCAN_PASS_ONE);
+	return NULL;
+}
+
+/* Run pass one in a new thread, and pass two follows it in this thread */
+static int ovl_scan_pipeline(struct ovl_fs *ofs, struct scan_result *result)
+{
+	struct ovl_scan_pipe pipe = {
+		.ofs = ofs,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	pthread_t thread;
+	int pass;
+
+	if (pthread_create(&thread, NULL, ovl_scan_pass_one, &pipe)) {
+		print_err(_("Failed to create thread\n"));
+		return -1;
+	}
+
+	pipe.ret[OVL_SCAN_PASS_TWO] = ovl_scan_pass(&pipe, OVL_SCAN_PASS_TWO);
+	pthread_join(thread, NULL);
+
+	for (pass = 0; pass < OVL_SCAN_PASS_MAX; pass++)
+		ovl_scan_update_result(&pipe.result[pass], result);
+
+	if (pipe.ret[OVL_SCAN_PASS_ONE] || pipe.ret[OVL_SCAN_PASS_TWO])
+		return -1;
+	return 0;
+}
+
 /* Scan upperdir and each lowerdirs, check and fix inconsistency */
 int ovl_scan_fix(struct ovl_fs *ofs)
 {
 	struct scan_result result = {0};
-	int pass, stack;
+	int pass, stack, i;
 	int ret;
 
+	if (sample_probes)
+		return ovl_sample_fix(ofs);
+
+	/* Finish the repairs of an interrupted check first */
+	ret = ovl_journal_open(&ofs->workdir);
+	if (ret)
+		goto out;
+
+	ret = ovl_budget_open(&ofs->workdir);
+	if (ret)
+		goto out;
+
+	if (flags & FL_UPPER)
+		ovl_scan_device(&ofs->upper_layer);
+
+	if (ovl_scan_pipelined()) {
+		ret = ovl_scan_pipeline(ofs, &result);
+		goto out;
+	}
+
 	for (pass = 0; pass < OVL_SCAN_PASS_MAX; pass++) {
 		struct scan_result pass_result = {0};
 
 		if (flags & FL_VERBOSE)
 			print_info(_("Pass %d: %s\n"), pass,
 				     ovl_scan_desc[pass]);
+		OVL_PROBE1(pass__begin, pass);
+
+		/* Scan each lower layer and upper layer */
+		for (i = 0; i <= ofs->lower_num; i++) {
+			stack = ovl_scan_order(ofs, pass, i);
+			if (stack < 0 && !(flags & FL_UPPER))
+				continue;
+
+			/* Out of time, leave the rest unchecked */
+			if (ovl_budget_expired()) {
+				ovl_budget_skip(stack < 0 ? &ofs->upper_layer :
+						&ofs->lower_layer[stack], pass);
+				continue;
+			}
 
-		/* Scan each lower layer */
-		for (stack = ofs->lower_num - 1; stack >= 0; stack--) {
-			print_debug(_("Scan lower layer %d\n"), stack);
-
-			/*
-			 * If lower layer is read-only, switch to -n scan
-			 * option, because this layer cannot modifiy.
-			 */
-			if (ofs->lower_layer[stack].flag & FS_LAYER_RO) {
-				int save_flags = flags & FL_OPT_MASK;
-
-				print_info(_("Lower layer %d is read-only, "
-					     "switch to -n option this layer\n"),
-					     stack);
-
-				flags = (flags & !FL_OPT_MASK) | FL_OPT_NO;
-				ret = ovl_scan_layer(ofs, &ofs->lower_layer[stack],
-						     pass, &pass_result);
-				flags = (flags & !FL_OPT_NO) | save_flags;
+			if (stack >= 0) {
+				ret = ovl_scan_lower(ofs, stack, pass,
+						     &pass_result);
 			} else {
-				ret = ovl_scan_layer(ofs, &ofs->lower_layer[stack],
+				ovl_trace(OVL_TRACE_SCAN, OVL_TRACE_EVENT,
+					  _("Scan upper layer in pass %d\n"),
+					  pass);
+				ret = ovl_scan_layer(ofs, &ofs->upper_layer,
 						     pass, &pass_result);
 			}
-
-			if (ret)
-				goto out;
-		}
-
-		/* Scan upper layer */
-		if (flags & FL_UPPER) {
-			print_debug(_("Scan upper layer\n"));
-			ret = ovl_scan_layer(ofs, &ofs->upper_layer, pass,
-					     &pass_result);
 			if (ret)
-				goto out;
+				break;
 		}
+		OVL_PROBE2(pass__end, pass, ret);
+		if (ret)
+			goto out;
 
 		/* Update scan result */
 		ovl_scan_update_result(&pass_result, &result);
+
+		/* Make repairs of this pass durable */
+		ret = ovl_journal_commit();
+		if (ret)
+			goto out;
 	}
 out:
+	if (ovl_journal_close(!ret))
+		ret = -1;
+	if (ovl_budget_close(&ofs->workdir))
+		ret = -1;
 	ovl_scan_report(&result);
+	ovl_throttle_report();
+	ovl_watch_report();
+	if (ovl_shard_enabled())
+		ovl_scan_shard(ofs, &result);
 	ovl_scan_clean();
 	return ret;
 }
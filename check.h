@@ -22,4 +22,10 @@
 /* Scan upperdir and each lowerdirs, check and fix inconsistency */
 int ovl_scan_fix(struct ovl_fs *ofs);
 
+/* Estimate inconsistency by sampling instead of scanning */
+void ovl_scan_sample(int probes);
+
+/* Check redirect dirs with several threads */
+void ovl_scan_threads(int threads);
+
 #endif /* OVL_WHITECHECK_H */
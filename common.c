@@ -24,45 +24,41 @@
 #include <unistd.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <syslog.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include "common.h"
+#include "log.h"
 #include "config.h"
 
 extern char *program_name;
 
-/* #define DEBUG 1 */
-#ifdef DEBUG
-void print_debug(char *fmtstr, ...)
-{
-	va_list args;
-
-	va_start(args, fmtstr);
-	fprintf(stdout, "%s:[Debug]: ", program_name);
-	vfprintf(stdout, fmtstr, args);
-	va_end(args);
-}
-#else
-void print_debug (char *fmtstr, ...) {}
-#endif
-
 void print_info(char *fmtstr, ...)
 {
 	va_list args;
 
 	va_start(args, fmtstr);
-	vfprintf(stdout, fmtstr, args);
+	if (ovl_log_enabled)
+		ovl_log_vprintf(LOG_INFO, fmtstr, args);
+	else
+		vfprintf(stdout, fmtstr, args);
 	va_end(args);
 }
 
 void print_err(char *fmtstr, ...)
 {
 	va_list args;
+	int err = errno;	/* keep errno for the caller */
 
 	va_start(args, fmtstr);
-	fprintf(stderr, "%s:[Error]: ", program_name);
-	vfprintf(stderr, fmtstr, args);
+	if (ovl_log_enabled) {
+		ovl_log_vprintf(LOG_ERR, fmtstr, args);
+	} else {
+		fprintf(stderr, "%s:[Error]: ", program_name);
+		vfprintf(stderr, fmtstr, args);
+	}
 	va_end(args);
+	errno = err;
 }
 
 void *smalloc(size_t size)
@@ -54,9 +54,6 @@ void print_err(char *, ...) __attribute__ ((__format__ (__printf__, 1, 2)));
 /* Print an info message */
 void print_info(char *, ...) __attribute__ ((__format__ (__printf__, 1, 2)));
 
-/* Print an debug message */
-void print_debug(char *, ...) __attribute__ ((__format__ (__printf__, 1, 2)));
-
 /* Safety wrapper */
 void *smalloc(size_t size);
 void *srealloc(void *addr, size_t size);
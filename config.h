@@ -22,7 +22,7 @@
 /* program version */
 #define PACKAGE_VERSION	"v0.1.0"
 
-/* File with mounted filesystems */
-#define MOUNT_TAB "/proc/mounts"
+/* File with mount information of the current mount namespace */
+#define MOUNT_INFO "/proc/self/mountinfo"
 
 #endif
@@ -0,0 +1,231 @@
+/*
+ * device.c - Find the kind of storage each layer is on
+ *
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/sysmacros.h>
+#include <linux/magic.h>
+#include <linux/limits.h>
+
+#include "common.h"
+#include "lib.h"
+#include "device.h"
+
+/*
+ * Layers on the same physical device share one device, found by st_dev
+ * of the layer root, a partition is mapped to its whole disk by sysfs.
+ * A device is rotational or solid-state by queue/rotational of the disk,
+ * and a network filesystem by f_type of fstatfs(2). Others, e.g. tmpfs
+ * or btrfs with an anonymous st_dev, are unknown.
+ *
+ * Rotational devices are scanned one layer at a time, each dir in inode
+ * order, with few lookups in flight. Network filesystems are scanned as
+ * usual with a bounded number of lookups in flight, and solid-state and
+ * unknown devices take as many as the threads.
+ */
+#define OVL_SYS_DEV_BLOCK	"/sys/dev/block"
+#define OVL_DEVICE_ROTATIONAL_DEPTH	2
+#define OVL_DEVICE_NETWORK_DEPTH	8
+
+extern int flags;
+
+struct ovl_device {
+	struct ovl_device *next;
+	dev_t dev;			/* whole disk, or st_dev if not a disk */
+	int kind;			/* OVL_DEVICE_* */
+	pthread_mutex_t lock;		/* one scan at a time if rotational */
+};
+
+static struct ovl_device *devices;
+static pthread_mutex_t devices_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *ovl_device_kinds[] = {
+	[OVL_DEVICE_UNKNOWN] = "unknown",
+	[OVL_DEVICE_ROTATIONAL] = "rotational",
+	[OVL_DEVICE_SOLID] = "solid-state",
+	[OVL_DEVICE_NETWORK] = "network",
+};
+
+static bool ovl_device_is_network(long type)
+{
+	switch (type) {
+	case NFS_SUPER_MAGIC:
+	case SMB_SUPER_MAGIC:
+	case CIFS_SUPER_MAGIC:
+	case SMB2_SUPER_MAGIC:
+	case CEPH_SUPER_MAGIC:
+	case AFS_SUPER_MAGIC:
+	case CODA_SUPER_MAGIC:
+	case V9FS_MAGIC:
+	case FUSE_SUPER_MAGIC:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Read an int in sysfs file "@dir/@name", -1 if not available */
+static int ovl_device_read_sys(const char *dir, const char *name)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+	int val = -1;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+	if (fscanf(fp, "%d", &val) != 1)
+		val = -1;
+	fclose(fp);
+	return val;
+}
+
+/* Read "major:minor" in sysfs file "@dir/dev" */
+static int ovl_device_read_dev(const char *dir, dev_t *dev)
+{
+	char path[PATH_MAX];
+	unsigned int major, minor;
+	FILE *fp;
+	int ret = -1;
+
+	snprintf(path, sizeof(path), "%s/dev", dir);
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+	if (fscanf(fp, "%u:%u", &major, &minor) == 2) {
+		*dev = makedev(major, minor);
+		ret = 0;
+	}
+	fclose(fp);
+	return ret;
+}
+
+/* Map a partition to its whole disk, and find out rotational or not */
+static int ovl_device_probe_disk(dev_t *dev)
+{
+	char dir[PATH_MAX];
+	int rotational;
+
+	snprintf(dir, sizeof(dir), OVL_SYS_DEV_BLOCK "/%u:%u",
+		 major(*dev), minor(*dev));
+
+	/* Partition has no queue, its parent dir is the disk */
+	if (ovl_device_read_sys(dir, "partition") > 0) {
+		strncat(dir, "/..", sizeof(dir) - strlen(dir) - 1);
+		if (ovl_device_read_dev(dir, dev))
+			return OVL_DEVICE_UNKNOWN;
+	}
+
+	rotational = ovl_device_read_sys(dir, "queue/rotational");
+	if (rotational < 0)
+		return OVL_DEVICE_UNKNOWN;
+	return rotational ? OVL_DEVICE_ROTATIONAL : OVL_DEVICE_SOLID;
+}
+
+/*
+ * Find the device the root dir @fd of a layer is on, layers on the same
+ * device share it.
+ *
+ * Return: the device, NULL if failed
+ */
+struct ovl_device *ovl_device_probe(int fd)
+{
+	struct ovl_device *device;
+	struct statfs sfs;
+	struct stat st;
+	dev_t dev;
+	int kind;
+
+	if (fstat(fd, &st) || fstatfs(fd, &sfs)) {
+		print_err(_("Failed to stat layer root:%s\n"), strerror(errno));
+		return NULL;
+	}
+
+	dev = st.st_dev;
+	if (ovl_device_is_network(sfs.f_type))
+		kind = OVL_DEVICE_NETWORK;
+	else
+		kind = ovl_device_probe_disk(&dev);
+
+	pthread_mutex_lock(&devices_lock);
+	for (device = devices; device; device = device->next) {
+		if (device->dev == dev && device->kind == kind)
+			goto out;
+	}
+
+	device = smalloc(sizeof(*device));
+	device->dev = dev;
+	device->kind = kind;
+	pthread_mutex_init(&device->lock, NULL);
+	device->next = devices;
+	devices = device;
+out:
+	pthread_mutex_unlock(&devices_lock);
+	return device;
+}
+
+const char *ovl_device_desc(const struct ovl_device *device)
+{
+	return ovl_device_kinds[device ? device->kind : OVL_DEVICE_UNKNOWN];
+}
+
+/* Scan entries of each dir in inode order on the device */
+bool ovl_device_sorted(const struct ovl_device *device)
+{
+	return device && device->kind == OVL_DEVICE_ROTATIONAL;
+}
+
+/* Bound @threads looking up on the device at the same time */
+int ovl_device_threads(const struct ovl_device *device, int threads)
+{
+	if (!device)
+		return threads;
+
+	switch (device->kind) {
+	case OVL_DEVICE_ROTATIONAL:
+		return min(threads, OVL_DEVICE_ROTATIONAL_DEPTH);
+	case OVL_DEVICE_NETWORK:
+		return min(threads, OVL_DEVICE_NETWORK_DEPTH);
+	default:
+		return threads;
+	}
+}
+
+/* Scan one layer at a time on a rotational device */
+void ovl_device_scan_begin(struct ovl_device *device)
+{
+	if (device && device->kind == OVL_DEVICE_ROTATIONAL)
+		pthread_mutex_lock(&device->lock);
+}
+
+void ovl_device_scan_end(struct ovl_device *device)
+{
+	if (device && device->kind == OVL_DEVICE_ROTATIONAL)
+		pthread_mutex_unlock(&device->lock);
+}
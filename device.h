@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef OVL_DEVICE_H
+#define OVL_DEVICE_H
+
+/* Kind of storage a layer is on */
+enum {
+	OVL_DEVICE_UNKNOWN,
+	OVL_DEVICE_ROTATIONAL,
+	OVL_DEVICE_SOLID,
+	OVL_DEVICE_NETWORK,
+};
+
+struct ovl_device;
+
+struct ovl_device *ovl_device_probe(int fd);
+const char *ovl_device_desc(const struct ovl_device *device);
+bool ovl_device_sorted(const struct ovl_device *device);
+int ovl_device_threads(const struct ovl_device *device, int threads);
+void ovl_device_scan_begin(struct ovl_device *device);
+void ovl_device_scan_end(struct ovl_device *device);
+
+#endif /* OVL_DEVICE_H */
@@ -0,0 +1,447 @@
+/*
+ * discover.c - Discover overlay stacks laid out by container runtimes
+ *
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+#include "common.h"
+#include "lib.h"
+#include "path.h"
+#include "overlayfs.h"
+#include "discover.h"
+
+/*
+ * Docker overlay2 storage driver layout:
+ *
+ *   <root>/l/<short>		-> ../<id>/diff
+ *   <root>/<id>/diff		layer contents, upperdir of the overlay
+ *   <root>/<id>/link		short name of this layer
+ *   <root>/<id>/lower		lower chain, "l/<short>:l/<short>...",
+ *				not exist in the bottom layer
+ *   <root>/<id>/work		workdir of the overlay
+ *   <root>/<id>-init		init layer of a container, the first
+ *				lower layer of the container layer <id>
+ *
+ * Image layers other than the bottom one have a lower chain and a work
+ * dir as well, but are never mounted as an upper layer, only container
+ * layers are, and they have an init layer beside.
+ */
+#define OVERLAY2_DIR		"overlay2"
+#define OVERLAY2_LINK_DIR	"l"
+#define OVERLAY2_LOWER		"lower"
+#define OVERLAY2_WORK		"work"
+#define OVERLAY2_DIFF		"diff"
+#define OVERLAY2_INIT_SUFFIX	"-init"
+
+/* Parsing layer files is read-only, always use some threads */
+#define OVL_DISCOVER_JOBS	8
+
+/* One layer of the overlay2 layout */
+struct ovl_o2_layer {
+	char *id;		/* layer dir name */
+	char **lowers;		/* short names of lower chain */
+	int lowernum;
+	bool work;		/* have work dir */
+	bool referenced;	/* used as a lower layer by others */
+	bool bad;		/* cannot parse */
+};
+
+/* Short name to layer map, from the "l/" dir */
+struct ovl_o2_link {
+	char *name;		/* short name */
+	char *id;		/* layer dir name */
+};
+
+struct ovl_o2_ctx {
+	int rootfd;
+	struct ovl_o2_layer *layers;
+	int layer_num;
+	struct ovl_o2_link *links;
+	int link_num;
+};
+
+/*
+ * Read a file into a null-terminated buffer, grown as needed since the
+ * "lower" file of a deep stack could be long. Return NULL with errno set
+ * if failed.
+ */
+static char *ovl_o2_read_file(int dirfd, const char *pathname)
+{
+	size_t size = PATH_MAX;
+	size_t total = 0;
+	char *buf;
+	ssize_t len;
+	int fd;
+
+	fd = openat(dirfd, pathname, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	buf = smalloc(size);
+	for (;;) {
+		if (total == size - 1) {
+			size *= 2;
+			buf = srealloc(buf, size);
+		}
+		len = read(fd, buf + total, size - 1 - total);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0) {
+			int err = errno;
+
+			close(fd);
+			free(buf);
+			errno = err;
+			return NULL;
+		}
+		if (!len)
+			break;
+		total += len;
+	}
+	close(fd);
+
+	for (; total > 0 && buf[total-1] == '\n'; total--);
+	buf[total] = '\0';
+	return buf;
+}
+
+/* Parse one layer dir, run in parallel */
+static void ovl_o2_parse_layer(int i, void *arg)
+{
+	struct ovl_o2_ctx *ctx = arg;
+	struct ovl_o2_layer *layer = &ctx->layers[i];
+	char *path, *lower, *p;
+	struct stat st;
+	int num;
+
+	path = joinname(layer->id, OVERLAY2_WORK);
+	layer->work = path && !fstatat(ctx->rootfd, path, &st, 0) &&
+		      S_ISDIR(st.st_mode);
+	free(path);
+
+	path = joinname(layer->id, OVERLAY2_LOWER);
+	if (!path) {
+		layer->bad = true;
+		return;
+	}
+	lower = ovl_o2_read_file(ctx->rootfd, path);
+	if (!lower && errno != ENOENT) {
+		print_err(_("Failed to read %s:%s\n"), path, strerror(errno));
+		layer->bad = true;
+	}
+	free(path);
+
+	/* The bottom layer */
+	if (!lower)
+		return;
+
+	/* Split into "l/<short>" entries */
+	num = ovl_split_lowerdirs(lower);
+	if (num > OVL_MAX_STACK) {
+		print_err(_("Too many lower layers in %s\n"), layer->id);
+		layer->bad = true;
+		goto out;
+	}
+
+	layer->lowers = smalloc(sizeof(char *) * num);
+	for (p = lower; layer->lowernum < num; p = strchr(p, '\0') + 1) {
+		const char *name = basename2(p, OVERLAY2_LINK_DIR);
+
+		layer->lowers[layer->lowernum++] = sstrdup(name);
+	}
+out:
+	free(lower);
+}
+
+/* Resolve one short link in "l/", run in parallel */
+static void ovl_o2_parse_link(int i, void *arg)
+{
+	struct ovl_o2_ctx *ctx = arg;
+	struct ovl_o2_link *link = &ctx->links[i];
+	char target[PATH_MAX];
+	char *path, *p;
+	ssize_t len;
+
+	path = joinname(OVERLAY2_LINK_DIR, link->name);
+	len = path ? readlinkat(ctx->rootfd, path, target,
+				sizeof(target) - 1) : -1;
+	free(path);
+	if (len <= 0)
+		return;
+	target[len] = '\0';
+
+	/* Link target is "../<id>/diff" */
+	p = strrchr(target, '/');
+	if (!p || strcmp(p + 1, OVERLAY2_DIFF))
+		return;
+	*p = '\0';
+	p = strrchr(target, '/');
+	link->id = sstrdup(p ? p + 1 : target);
+}
+
+static int ovl_o2_cmp_layer(const void *a, const void *b)
+{
+	return strcmp(((const struct ovl_o2_layer *)a)->id,
+		      ((const struct ovl_o2_layer *)b)->id);
+}
+
+static int ovl_o2_cmp_link(const void *a, const void *b)
+{
+	return strcmp(((const struct ovl_o2_link *)a)->name,
+		      ((const struct ovl_o2_link *)b)->name);
+}
+
+/* Read names in a dir, skip dot entries and @skip */
+static int ovl_o2_read_names(int dirfd, const char *pathname,
+			     const char *skip, char ***names, int *num)
+{
+	struct dirent *de;
+	DIR *dir;
+	int fd, n = 0, allocated = 0;
+	char **list = NULL;
+
+	fd = openat(dirfd, pathname, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (fd < 0 || !(dir = fdopendir(fd))) {
+		print_err(_("Failed to open %s:%s\n"), pathname,
+			    strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] == '.' || (skip && !strcmp(de->d_name, skip)))
+			continue;
+		if (de->d_type != DT_DIR && de->d_type != DT_LNK &&
+		    de->d_type != DT_UNKNOWN)
+			continue;
+
+		if (n == allocated) {
+			allocated = allocated ? allocated * 2 : 64;
+			list = srealloc(list, sizeof(char *) * allocated);
+		}
+		list[n++] = sstrdup(de->d_name);
+	}
+	closedir(dir);
+
+	*names = list;
+	*num = n;
+	return 0;
+}
+
+static struct ovl_o2_layer *ovl_o2_find_short(struct ovl_o2_ctx *ctx,
+					      const char *name)
+{
+	struct ovl_o2_link key = {.name = (char *)name};
+	struct ovl_o2_layer lkey;
+	struct ovl_o2_link *link;
+
+	link = bsearch(&key, ctx->links, ctx->link_num,
+		       sizeof(struct ovl_o2_link), ovl_o2_cmp_link);
+	if (!link || !link->id)
+		return NULL;
+
+	lkey.id = link->id;
+	return bsearch(&lkey, ctx->layers, ctx->layer_num,
+		       sizeof(struct ovl_o2_layer), ovl_o2_cmp_layer);
+}
+
+static void ovl_o2_free(struct ovl_o2_ctx *ctx)
+{
+	int i, j;
+
+	for (i = 0; i < ctx->layer_num; i++) {
+		for (j = 0; j < ctx->layers[i].lowernum; j++)
+			free(ctx->layers[i].lowers[j]);
+		free(ctx->layers[i].lowers);
+		free(ctx->layers[i].id);
+	}
+	free(ctx->layers);
+
+	for (i = 0; i < ctx->link_num; i++) {
+		free(ctx->links[i].name);
+		free(ctx->links[i].id);
+	}
+	free(ctx->links);
+
+	if (ctx->rootfd >= 0)
+		close(ctx->rootfd);
+}
+
+/* Container layers have an init layer "<id>-init" */
+static bool ovl_o2_is_container(struct ovl_o2_ctx *ctx,
+				const struct ovl_o2_layer *layer)
+{
+	struct ovl_o2_layer key;
+	bool found;
+
+	key.id = smalloc(strlen(layer->id) + sizeof(OVERLAY2_INIT_SUFFIX));
+	strcpy(key.id, layer->id);
+	strcat(key.id, OVERLAY2_INIT_SUFFIX);
+	found = bsearch(&key, ctx->layers, ctx->layer_num,
+			sizeof(struct ovl_o2_layer), ovl_o2_cmp_layer);
+	free(key.id);
+	return found;
+}
+
+/*
+ * Build overlay stacks from parsed layers. Only the container layers
+ * are reported, the layers below are checked as their lower layers.
+ * Image layers are read-only, not checked as an upper layer even if
+ * no other layer references them.
+ */
+static int ovl_o2_build(struct ovl_o2_ctx *ctx, const char *root,
+			struct ovl_discovered **stacks, int *num)
+{
+	struct ovl_discovered *found;
+	struct ovl_o2_layer *layer, *lower;
+	int i, j, n = 0;
+
+	for (i = 0; i < ctx->layer_num; i++) {
+		layer = &ctx->layers[i];
+		for (j = 0; j < layer->lowernum; j++) {
+			lower = ovl_o2_find_short(ctx, layer->lowers[j]);
+			if (lower) {
+				lower->referenced = true;
+			} else {
+				print_err(_("Cannot find lower layer %s of %s\n"),
+					    layer->lowers[j], layer->id);
+				layer->bad = true;
+			}
+		}
+	}
+
+	found = smalloc(sizeof(struct ovl_discovered) * (ctx->layer_num ? : 1));
+	for (i = 0; i < ctx->layer_num; i++) {
+		char *dir;
+
+		layer = &ctx->layers[i];
+		if (layer->referenced || layer->bad || !layer->lowernum ||
+		    !layer->work || !ovl_o2_is_container(ctx, layer))
+			continue;
+
+		found[n].name = sstrdup(layer->id);
+		found[n].lowernum = layer->lowernum;
+		found[n].lowerdir = smalloc(sizeof(char *) * layer->lowernum);
+		for (j = 0; j < layer->lowernum; j++) {
+			lower = ovl_o2_find_short(ctx, layer->lowers[j]);
+			dir = joinname(root, lower->id);
+			found[n].lowerdir[j] = joinname(dir, OVERLAY2_DIFF);
+			free(dir);
+		}
+
+		dir = joinname(root, layer->id);
+		found[n].upperdir = joinname(dir, OVERLAY2_DIFF);
+		found[n].workdir = joinname(dir, OVERLAY2_WORK);
+		free(dir);
+		n++;
+	}
+
+	*stacks = found;
+	*num = n;
+	return 0;
+}
+
+/*
+ * Discover every overlay stack under the runtime storage root @root,
+ * which could be the docker root dir or its "overlay2" dir. Layer files
+ * are parsed on @jobs threads, and the short links are resolved only
+ * once for all stacks.
+ */
+int ovl_discover(const char *root, int jobs, struct ovl_discovered **stacks,
+		 int *num)
+{
+	struct ovl_o2_ctx ctx = {.rootfd = -1};
+	char temp[PATH_MAX];
+	char *o2root = NULL;
+	char **names = NULL;
+	struct stat st;
+	int i, n;
+	int ret = -1;
+
+	if (!realpath(root, temp)) {
+		print_err(_("Failed to resolve %s:%s\n"), root, strerror(errno));
+		return -1;
+	}
+
+	/* Accept docker root dir as well */
+	o2root = joinname(temp, OVERLAY2_DIR);
+	if (stat(o2root, &st) || !S_ISDIR(st.st_mode)) {
+		free(o2root);
+		o2root = sstrdup(temp);
+	}
+
+	ctx.rootfd = open(o2root, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (ctx.rootfd < 0) {
+		print_err(_("Failed to open %s:%s\n"), o2root, strerror(errno));
+		goto out;
+	}
+
+	if (fstatat(ctx.rootfd, OVERLAY2_LINK_DIR, &st, 0) ||
+	    !S_ISDIR(st.st_mode)) {
+		print_err(_("%s is not an overlay2 layout\n"), o2root);
+		goto out;
+	}
+
+	/* Layer dirs */
+	if (ovl_o2_read_names(ctx.rootfd, ".", OVERLAY2_LINK_DIR, &names, &n))
+		goto out;
+	ctx.layers = smalloc(sizeof(struct ovl_o2_layer) * (n ? : 1));
+	for (i = 0; i < n; i++)
+		ctx.layers[i].id = names[i];
+	ctx.layer_num = n;
+	free(names);
+	qsort(ctx.layers, ctx.layer_num, sizeof(struct ovl_o2_layer),
+	      ovl_o2_cmp_layer);
+
+	/* Short links */
+	if (ovl_o2_read_names(ctx.rootfd, OVERLAY2_LINK_DIR, NULL, &names, &n))
+		goto out;
+	ctx.links = smalloc(sizeof(struct ovl_o2_link) * (n ? : 1));
+	for (i = 0; i < n; i++)
+		ctx.links[i].name = names[i];
+	ctx.link_num = n;
+	free(names);
+	qsort(ctx.links, ctx.link_num, sizeof(struct ovl_o2_link),
+	      ovl_o2_cmp_link);
+
+	jobs = max(jobs, OVL_DISCOVER_JOBS);
+	run_parallel(ctx.layer_num, jobs, ovl_o2_parse_layer, &ctx);
+	run_parallel(ctx.link_num, jobs, ovl_o2_parse_link, &ctx);
+
+	ret = ovl_o2_build(&ctx, o2root, stacks, num);
+out:
+	ovl_o2_free(&ctx);
+	free(o2root);
+	return ret;
+}
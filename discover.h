@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef OVL_DISCOVER_H
+#define OVL_DISCOVER_H
+
+/* Overlay stack found in the runtime storage dir, absolute paths */
+struct ovl_discovered {
+	char *name;		/* layer id of the top layer */
+	char **lowerdir;
+	int lowernum;
+	char *upperdir;
+	char *workdir;
+};
+
+int ovl_discover(const char *root, int jobs, struct ovl_discovered **stacks,
+		 int *num);
+
+#endif /* OVL_DISCOVER_H */
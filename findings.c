@@ -0,0 +1,333 @@
+/*
+ * findings.c - Stream the inconsistencies found as NDJSON records
+ *
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "lib.h"
+#include "findings.h"
+
+/*
+ * With --findings-format=ndjson, each inconsistency found is written to
+ * stdout as one line of JSON, and the other messages go to stderr. A
+ * finding not repaired is written at once, while a finding to repair is
+ * kept by the checking thread until the repair is queued, and written
+ * when the repair is applied, with the action done and its errno.
+ *
+ * Records are appended into a bounded queue of buffers, a writer thread
+ * writes the full ones, and the partial one every second, so the checks
+ * never wait for the output unless the queue is full.
+ */
+#define OVL_FINDINGS_BUF	(64 * 1024)
+#define OVL_FINDINGS_BUFS	8
+#define OVL_FINDINGS_INTERVAL	1	/* seconds */
+
+/* A finding to repair, written when the repair is done */
+struct ovl_finding {
+	int kind;		/* OVL_FINDING_* */
+	int dirtype;		/* OVL_UPPER or OVL_LOWER */
+	int stack;
+	char *pathname;
+};
+
+struct ovl_findings_buf {
+	char data[OVL_FINDINGS_BUF];
+	size_t len;
+};
+
+static const char *ovl_finding_names[] = {
+	[OVL_FINDING_ORPHAN_WHITEOUT]	= "orphan_whiteout",
+	[OVL_FINDING_INVALID_REDIRECT]	= "invalid_redirect",
+	[OVL_FINDING_DUPLICATE_REDIRECT] = "duplicate_redirect",
+	[OVL_FINDING_MISSING_WHITEOUT]	= "missing_whiteout",
+	[OVL_FINDING_OPAQUE_DIR]	= "opaque_dir",
+	[OVL_FINDING_MISSING_IMPURE]	= "missing_impure",
+};
+
+static bool findings_on;
+static int findings_fd = -1;		/* the original stdout */
+static int findings_err;		/* errno of the first failed write */
+static struct ovl_findings_buf *findings_bufs;
+static int findings_head;		/* next buffer to write */
+static int findings_full;		/* buffers ready to write */
+static bool findings_closing;
+static pthread_t findings_thread;
+static pthread_mutex_t findings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t findings_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t findings_space = PTHREAD_COND_INITIALIZER;
+static __thread struct ovl_finding *findings_pending;
+
+/* The buffer being filled */
+static inline struct ovl_findings_buf *ovl_findings_tail(void)
+{
+	return &findings_bufs[(findings_head + findings_full) %
+			      OVL_FINDINGS_BUFS];
+}
+
+static int ovl_findings_write(const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write(findings_fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* Write the full buffers, and the partial one if idle for a while */
+static void *ovl_findings_writer(void *arg)
+{
+	struct ovl_findings_buf *buf;
+	struct timespec ts;
+
+	pthread_mutex_lock(&findings_lock);
+	for (;;) {
+		if (!findings_full && ovl_findings_tail()->len &&
+		    findings_closing)
+			findings_full++;
+
+		if (!findings_full) {
+			if (findings_closing)
+				break;
+
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += OVL_FINDINGS_INTERVAL;
+			if (pthread_cond_timedwait(&findings_ready,
+						   &findings_lock, &ts) &&
+			    !findings_full && ovl_findings_tail()->len)
+				findings_full++;
+			continue;
+		}
+
+		buf = &findings_bufs[findings_head];
+		pthread_mutex_unlock(&findings_lock);
+
+		if (!findings_err && ovl_findings_write(buf->data, buf->len))
+			findings_err = errno;
+		buf->len = 0;
+
+		pthread_mutex_lock(&findings_lock);
+		findings_head = (findings_head + 1) % OVL_FINDINGS_BUFS;
+		findings_full--;
+		pthread_cond_broadcast(&findings_space);
+	}
+	pthread_mutex_unlock(&findings_lock);
+	return NULL;
+}
+
+/* Append a record into the queue, wait if all buffers are full */
+static void ovl_findings_append(const char *rec, size_t len)
+{
+	struct ovl_findings_buf *buf;
+
+	pthread_mutex_lock(&findings_lock);
+	for (;;) {
+		buf = ovl_findings_tail();
+		if (findings_full < OVL_FINDINGS_BUFS &&
+		    buf->len + len <= OVL_FINDINGS_BUF)
+			break;
+
+		/* Hand the tail to the writer, keep one to fill */
+		if (findings_full < OVL_FINDINGS_BUFS - 1 && buf->len) {
+			findings_full++;
+			pthread_cond_signal(&findings_ready);
+			continue;
+		}
+		pthread_cond_signal(&findings_ready);
+		pthread_cond_wait(&findings_space, &findings_lock);
+	}
+	memcpy(buf->data + buf->len, rec, len);
+	buf->len += len;
+	pthread_mutex_unlock(&findings_lock);
+}
+
+/* Append @str into @p quoted, escape '"', '\' and control chars */
+static char *ovl_findings_quote(char *p, const char *str)
+{
+	const unsigned char *s;
+
+	*p++ = '"';
+	for (s = (const unsigned char *)str; *s; s++) {
+		if (*s == '"' || *s == '\\') {
+			*p++ = '\\';
+			*p++ = *s;
+		} else if (*s < ' ') {
+			p += sprintf(p, "\\u%04x", *s);
+		} else {
+			*p++ = *s;
+		}
+	}
+	*p++ = '"';
+	return p;
+}
+
+static void ovl_findings_record(int kind, const char *pathname, int dirtype,
+				int stack, const char *action, int err)
+{
+	char *rec = smalloc(strlen(pathname) * 6 + 256);
+	char *p = rec;
+
+	p += sprintf(p, "{\"kind\":\"%s\",\"layer\":\"%s\",",
+		     ovl_finding_names[kind],
+		     dirtype == OVL_LOWER ? "lowerdir" : "upperdir");
+	if (dirtype == OVL_LOWER)
+		p += sprintf(p, "\"stack\":%d,", stack);
+	else
+		p += sprintf(p, "\"stack\":null,");
+	p += sprintf(p, "\"path\":");
+	p = ovl_findings_quote(p, pathname);
+	p += sprintf(p, ",\"action\":\"%s\",\"errno\":%d}\n", action, err);
+
+	/* Records longer than a buffer are too long to be a path, drop */
+	if (p - rec <= OVL_FINDINGS_BUF)
+		ovl_findings_append(rec, p - rec);
+	free(rec);
+}
+
+/*
+ * Stream findings as NDJSON if @ndjson, they take the stdout, which is
+ * redirected to stderr for all the other messages.
+ */
+int ovl_findings_setup(bool ndjson)
+{
+	if (!ndjson)
+		return 0;
+
+	fflush(stdout);
+	findings_fd = dup(STDOUT_FILENO);
+	if (findings_fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+		print_err(_("Failed to redirect stdout:%s\n"),
+			    strerror(errno));
+		return -1;
+	}
+
+	findings_bufs = smalloc(sizeof(*findings_bufs) * OVL_FINDINGS_BUFS);
+	if (pthread_create(&findings_thread, NULL, ovl_findings_writer,
+			   NULL)) {
+		print_err(_("Failed to create findings writer\n"));
+		return -1;
+	}
+	findings_on = true;
+	return 0;
+}
+
+/*
+ * Write all the records queued and stop the writer.
+ *
+ * Return: 0 on success, -1 if any record failed to write
+ */
+int ovl_findings_close(void)
+{
+	if (!findings_on)
+		return 0;
+
+	if (findings_pending) {
+		ovl_finding_done(findings_pending, "none", 0);
+		findings_pending = NULL;
+	}
+
+	pthread_mutex_lock(&findings_lock);
+	findings_closing = true;
+	pthread_cond_signal(&findings_ready);
+	pthread_mutex_unlock(&findings_lock);
+	pthread_join(findings_thread, NULL);
+	findings_on = false;
+
+	free(findings_bufs);
+	close(findings_fd);
+	if (findings_err) {
+		print_err(_("Failed to write findings:%s\n"),
+			    strerror(findings_err));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * An inconsistency of @kind is found on @pathname in the layer of
+ * @dirtype and @stack. If the answer is to @repair, it is kept until
+ * the repair is queued by this thread, it is written now otherwise.
+ */
+void ovl_finding(int kind, const char *pathname, int dirtype, int stack,
+		 bool repair)
+{
+	struct ovl_finding *finding;
+
+	if (!findings_on)
+		return;
+
+	/* The last one is not repaired at all */
+	if (findings_pending) {
+		ovl_finding_done(findings_pending, "none", 0);
+		findings_pending = NULL;
+	}
+
+	if (!repair) {
+		ovl_findings_record(kind, pathname, dirtype, stack, "none", 0);
+		return;
+	}
+
+	finding = smalloc(sizeof(*finding));
+	finding->kind = kind;
+	finding->dirtype = dirtype;
+	finding->stack = stack;
+	finding->pathname = sstrdup(pathname);
+	findings_pending = finding;
+}
+
+/* Take the finding to repair by the repair being queued, NULL if none */
+struct ovl_finding *ovl_finding_take(void)
+{
+	struct ovl_finding *finding = findings_pending;
+
+	findings_pending = NULL;
+	return finding;
+}
+
+/* The repair of @finding is done by @action, failed with @err if not 0 */
+void ovl_finding_done(struct ovl_finding *finding, const char *action,
+		      int err)
+{
+	if (!finding)
+		return;
+
+	ovl_findings_record(finding->kind, finding->pathname,
+			    finding->dirtype, finding->stack, action, err);
+	free(finding->pathname);
+	free(finding);
+}
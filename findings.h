@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef OVL_FINDINGS_H
+#define OVL_FINDINGS_H
+
+/* Kinds of inconsistency found */
+#define OVL_FINDING_ORPHAN_WHITEOUT	0
+#define OVL_FINDING_INVALID_REDIRECT	1
+#define OVL_FINDING_DUPLICATE_REDIRECT	2
+#define OVL_FINDING_MISSING_WHITEOUT	3
+#define OVL_FINDING_OPAQUE_DIR		4
+#define OVL_FINDING_MISSING_IMPURE	5
+
+struct ovl_finding;
+
+int ovl_findings_setup(bool ndjson);
+int ovl_findings_close(void);
+void ovl_finding(int kind, const char *pathname, int dirtype, int stack,
+		 bool repair);
+struct ovl_finding *ovl_finding_take(void);
+void ovl_finding_done(struct ovl_finding *finding, const char *action,
+		      int err);
+
+#endif /* OVL_FINDINGS_H */
@@ -45,6 +45,21 @@
 #include "check.h"
 #include "mount.h"
 #include "overlayfs.h"
+#include "fsck.h"
+#include "layer.h"
+#include "batch.h"
+#include "plan.h"
+#include "throttle.h"
+#include "budget.h"
+#include "shard.h"
+#include "watch.h"
+#include "metrics.h"
+#include "progress.h"
+#include "latency.h"
+#include "trace.h"
+#include "findings.h"
+#include "log.h"
+#include "profile.h"
 
 char *program_name;
 
@@ -52,71 +67,63 @@ struct ovl_fs ofs = {};
 int flags = 0;		/* user input option flags */
 int status = 0;		/* fsck scan status */
 
+static char *batch_file;	/* manifest of overlays to check in batch */
+static char *runtime_root;	/* container runtime dir to discover overlays */
+static int batch_jobs = 1;	/* parallel check processes in batch mode */
+static bool eager;		/* open all lower layers up front */
+static char *plan_out;		/* save repairs into this plan file */
+static char *plan_in;		/* apply repairs saved in this plan file */
+static bool review;		/* ask for all found repairs after checking */
+static double rate;		/* max scan ops/sec, 0 if unlimited */
+static double pressure;		/* io stall percent to back off, 0 if not */
+static double time_budget;	/* seconds to check, 0 if unlimited */
+static int sample;		/* probes per layer to estimate, 0 if not */
+static int threads = 1;		/* threads to check redirect dirs */
+static char *shard;		/* "I/N[:DEPTH]" part of the overlay to check */
+static char *shard_out;		/* save the result of this shard to merge */
+static bool shard_merge;	/* merge shard results given as arguments */
+static char **shard_files;
+static int shard_file_num;
+static double op_timeout;	/* seconds a lower layer could hang, 0 if not */
+static char *metrics_file;	/* save the cost of this check into this file */
+static int progress_fd = -1;	/* report progress into this fd, -1 if not */
+static bool latency;		/* time the operations on layers */
+static char *trace_spec;	/* categories traced, NULL if not */
+static bool findings_ndjson;	/* stream findings as NDJSON to stdout */
+static char *log_target;	/* write messages by a thread into this */
+static bool profile;		/* report the shape of each layer */
+
 /*
- * Open underlying dirs (include upper dir and lower dirs), check system
- * file descriptor limits and try to expend it if necessary.
+ * Open underlying dirs. Upper dir and work dir are opened at once, while
+ * lower dirs are opened lazily at the first use and closed if too many
+ * are open, unless in eager mode, which open and check them all up front
+ * and expand the file descriptor limit if necessary.
  */
 static int ovl_open_dirs(struct ovl_fs *ofs)
 {
-	unsigned int i;
-	struct rlimit rlim;
-	rlim_t rlim_need = ofs->lower_num + 20;
+	int i;
 
-	/* If RLIMIT_NOFILE limit is small than we need, try to expand limit */
-	if ((getrlimit(RLIMIT_NOFILE, &rlim))) {
-		print_err(_("Failed to getrlimit:%s\n"), strerror(errno));
+	if (ovl_layer_setup(ofs->lower_num, eager))
 		return -1;
-	}
-	if (rlim.rlim_cur < rlim_need) {
-		print_info(_("Process fd number limit=%lu "
-			     "too small, need %lu\n"),
-			     rlim.rlim_cur, rlim_need);
-
-		rlim.rlim_cur = rlim_need;
-		if (rlim.rlim_max < rlim.rlim_cur)
-			rlim.rlim_max = rlim.rlim_cur;
-
-		if ((setrlimit(RLIMIT_NOFILE, &rlim))) {
-			print_err(_("Failed to setrlimit:%s\n"),
-				    strerror(errno));
-			return -1;
-		}
-	}
 
 	if (ofs->upper_layer.path) {
-		ofs->upper_layer.fd = open(ofs->upper_layer.path,
-			       O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC);
-		if (ofs->upper_layer.fd < 0) {
-			print_err(_("Failed to open %s:%s\n"),
-				    ofs->upper_layer.path, strerror(errno));
+		if (ovl_open_layer(&ofs->upper_layer))
 			return -1;
-		}
 
-		ofs->workdir.fd = open(ofs->workdir.path, O_RDONLY|O_NONBLOCK|
-				       O_DIRECTORY|O_CLOEXEC);
-		if (ofs->workdir.fd < 0) {
-			print_err(_("Failed to open %s:%s\n"),
-				    ofs->workdir.path, strerror(errno));
+		if (ovl_open_layer(&ofs->workdir))
 			goto err;
-		}
 	}
 
-	for (i = 0; i < ofs->lower_num; i++) {
-		ofs->lower_layer[i].fd = open(ofs->lower_layer[i].path,
-				  O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC);
-		if (ofs->lower_layer[i].fd < 0) {
-			print_err(_("Failed to open %s:%s\n"),
-				    ofs->lower_layer[i].path, strerror(errno));
-			goto err2;
-		}
-	}
+	for (i = 0; i < ofs->lower_num; i++)
+		ovl_layer_init(&ofs->lower_layer[i]);
+
+	if (eager && ovl_layer_activate_all(ofs->lower_layer, ofs->lower_num))
+		goto err2;
 
 	return 0;
 err2:
-	for (i--; i >= 0; i--) {
-		close(ofs->lower_layer[i].fd);
-		ofs->lower_layer[i].fd = 0;
-	}
+	for (i = 0; i < ofs->lower_num; i++)
+		ovl_layer_release(&ofs->lower_layer[i]);
 	close(ofs->workdir.fd);
 	ofs->workdir.fd = 0;
 err:
@@ -131,10 +138,7 @@ static void ovl_clean_dirs(struct ovl_fs *ofs)
 	int i;
 
 	for (i = 0; i < ofs->lower_num; i++) {
-		if (ofs->lower_layer && ofs->lower_layer[i].fd) {
-			close(ofs->lower_layer[i].fd);
-			ofs->lower_layer[i].fd = 0;
-		}
+		ovl_layer_release(&ofs->lower_layer[i]);
 		free(ofs->lower_layer[i].path);
 		ofs->lower_layer[i].path = NULL;
 	}
@@ -154,44 +158,8 @@ static void ovl_clean_dirs(struct ovl_fs *ofs)
 	}
 }
 
-/* Do basic check for one layer */
-static int ovl_basic_check_layer(struct ovl_layer *layer)
-{
-	struct statfs statfs;
-	ssize_t ret;
-	int err;
-
-	/* Check the underlying layer is read-only or not */
-	err = fstatfs(layer->fd, &statfs);
-	if (err) {
-		print_err(_("fstatfs failed:%s\n"), strerror(errno));
-		return -1;
-	}
-
-	if (statfs.f_flags & ST_RDONLY)
-		layer->flag |= FS_LAYER_RO;
-
-	/*
-	 * Check the underlying layer support xattr or not. One special
-	 * case, a nested overlayfs does not support OVL_XATTR_PREFIX
-	 * xattr.
-	 */
-	if (statfs.f_type == OVERLAYFS_SUPER_MAGIC)
-		return 0;
-
-	ret = fgetxattr(layer->fd, OVL_XATTR_PREFIX, NULL, 0);
-	if (ret < 0 && errno != ENOTSUP && errno != ENODATA) {
-		print_err(_("fgetxattr failed:%s\n"), strerror(errno));
-		return -1;
-	} else if (ret >= 0 || errno == ENODATA) {
-		layer->flag |= FS_LAYER_XATTR;
-	}
-
-	return 0;
-}
-
 /* Do some basic check for the workdir, not iterate the dir */
-static int ovl_basic_check_workdir(struct ovl_fs *ofs)
+int ovl_basic_check_workdir(struct ovl_fs *ofs)
 {
 	struct statfs upperfs, workfs;
 	int ret;
@@ -239,7 +207,6 @@ static int ovl_basic_check_workdir(struct ovl_fs *ofs)
 static int ovl_basic_check(struct ovl_fs *ofs)
 {
 	int ret;
-	int i;
 
 	if (flags & FL_UPPER) {
 		/* Check work root dir */
@@ -260,25 +227,86 @@ static int ovl_basic_check(struct ovl_fs *ofs)
 		}
 	}
 
-	for (i = 0; i < ofs->lower_num; i++) {
-		ret = ovl_basic_check_layer(&ofs->lower_layer[i]);
-		if (ret)
-			return ret;
-	}
-
+	/* Lower layers are checked when they are opened */
 	return 0;
 }
 
 static void usage(void)
 {
 	print_info(_("Usage:\n\t%s [-o lowerdir=<lowers>,upperdir=<upper>,workdir=<work>] "
-		    "[-pnyvhV]\n\n"), program_name);
+		    "[-pnyvhV] [-C fd] [--eager] [--durable] [--review]\n"
+		    "\t\t[--rate=<ops>] [--io-pressure=<pct>] "
+		    "[--time-budget=<seconds>]\n"
+		    "\t\t[--threads=<n>] [--sample=<probes>] [--shard=<i/n[:depth]> "
+		    "[--shard-out=<result>]]\n"
+		    "\t\t[--op-timeout=<seconds>] [--metrics=<file>] [--latency]\n"
+		    "\t\t[--trace=<category[:level]>,...] "
+		    "[--findings-format=<text|ndjson>]\n"
+		    "\t\t[--log=<stdout|syslog|journal|file>] [--profile]\n"
+		    "\t%s -b <manifest> [-j <jobs>] [-pnyv] [-C fd]\n"
+		    "\t%s -d <runtime root> [-j <jobs>] [-pnyv] [-C fd]\n"
+		    "\t%s --plan-apply=<plan> [-v]\n"
+		    "\t%s --shard-merge <result>...\n\n"),
+		    program_name, program_name, program_name, program_name,
+		    program_name);
 	print_info(_("Options:\n"
 		    "-o,                       specify underlying directories of overlayfs\n"
 		    "                          multiple lower directories use ':' as separator\n"
 		    "-p,                       automatic repair (no questions)\n"
 		    "-n,                       make no changes to the filesystem\n"
 		    "-y,                       assume \"yes\" to all questions\n"
+		    "-b, --batch=FILE          check each overlay listed in FILE, one\n"
+		    "                          -o style option string per line\n"
+		    "-d, --discover=DIR        check each container overlay found in\n"
+		    "                          the docker overlay2 storage dir DIR in\n"
+		    "                          batch mode, image layers are skipped\n"
+		    "-j, --jobs=N              check N overlays in parallel in batch mode\n"
+		    "-C, FD                    report progress of each layer into FD\n"
+		    "                          every second, 0 for stdout\n"
+		    "    --eager               open and check all lower dirs up front,\n"
+		    "                          lower dirs are opened at the first use\n"
+		    "                          by default\n"
+		    "    --plan-out=FILE       with -n, save repairs auto mode would do\n"
+		    "                          into FILE instead of asking\n"
+		    "    --plan-apply=FILE     apply repairs saved in FILE without\n"
+		    "                          scanning, skip the stale ones\n"
+		    "    --durable             log repairs in workdir and sync them\n"
+		    "                          at the end of each pass\n"
+		    "    --review              check without asking, then accept or\n"
+		    "                          reject found repairs by group at once\n"
+		    "    --rate=OPS            scan at most OPS entries per second\n"
+		    "    --io-pressure=PCT     slow down if io stall exceeds PCT\n"
+		    "                          percent (/proc/pressure/io)\n"
+		    "    --time-budget=SECONDS stop checking after SECONDS, check\n"
+		    "                          recently changed entries first\n"
+		    "    --threads=N           check redirect dirs with N threads, the\n"
+		    "                          result is the same as one thread\n"
+		    "    --sample=N            with -n, estimate counts of each layer\n"
+		    "                          by N random walks instead of scanning\n"
+		    "    --shard=I/N[:DEPTH]   check the I-th of N parts of the overlay,\n"
+		    "                          split by entries down to DEPTH (1)\n"
+		    "    --shard-out=FILE      save the result of this shard into FILE\n"
+		    "    --shard-merge         merge the shard results given as\n"
+		    "                          arguments, find cross-shard problems\n"
+		    "    --op-timeout=SECONDS  quarantine a lower dir does not respond\n"
+		    "                          in SECONDS, and check the others\n"
+		    "    --metrics=FILE        save counts and cost of the check into\n"
+		    "                          FILE in JSON, or Prometheus text if\n"
+		    "                          FILE ends with .prom\n"
+		    "    --latency             time operations on each layer, print\n"
+		    "                          percentiles and the slowest paths\n"
+		    "    --trace=CAT[:LEVEL],...\n"
+		    "                          trace CAT (scan, lookup, redirect,\n"
+		    "                          repair, mount or all) at LEVEL (1 or\n"
+		    "                          2), dumped at exit or on SIGUSR1\n"
+		    "    --findings-format=FMT print findings as text (default), or\n"
+		    "                          one JSON record per line to stdout\n"
+		    "                          if FMT is ndjson\n"
+		    "    --log=TARGET          write messages by a separate thread\n"
+		    "                          to stdout, syslog, journal or the\n"
+		    "                          file TARGET, need -p, -n or -y\n"
+		    "    --profile             report the shape of each layer and\n"
+		    "                          predict the check time\n"
 		    "-v, --verbose             print more messages of overlayfs\n"
 		    "-h, --help                display this usage of overlayfs\n"
 		    "-V, --version             display version information\n"));
@@ -298,10 +326,33 @@ static void parse_options(int argc, char *argv[])
 		{"verbose", no_argument, NULL, 'v'},
 		{"version", no_argument, NULL, 'V'},
 		{"help", no_argument, NULL, 'h'},
+		{"batch", required_argument, NULL, 'b'},
+		{"discover", required_argument, NULL, 'd'},
+		{"jobs", required_argument, NULL, 'j'},
+		{"eager", no_argument, NULL, 'E'},
+		{"plan-out", required_argument, NULL, 'O'},
+		{"plan-apply", required_argument, NULL, 'A'},
+		{"durable", no_argument, NULL, 'D'},
+		{"review", no_argument, NULL, 'R'},
+		{"rate", required_argument, NULL, 'T'},
+		{"io-pressure", required_argument, NULL, 'P'},
+		{"time-budget", required_argument, NULL, 'B'},
+		{"sample", required_argument, NULL, 'S'},
+		{"threads", required_argument, NULL, 'N'},
+		{"shard", required_argument, NULL, 'H'},
+		{"shard-out", required_argument, NULL, 'U'},
+		{"shard-merge", no_argument, NULL, 'M'},
+		{"op-timeout", required_argument, NULL, 'W'},
+		{"metrics", required_argument, NULL, 'X'},
+		{"latency", no_argument, NULL, 'L'},
+		{"trace", required_argument, NULL, 'G'},
+		{"findings-format", required_argument, NULL, 'F'},
+		{"log", required_argument, NULL, 'K'},
+		{"profile", no_argument, NULL, 'Q'},
 		{NULL, 0, NULL, 0}
 	};
 
-	while ((c = getopt_long(argc, argv, "o:apnyvVh",
+	while ((c = getopt_long(argc, argv, "o:apnyb:d:j:C:vVh",
 		long_options, NULL)) != -1) {
 
 		switch (c) {
@@ -328,6 +379,123 @@ static void parse_options(int argc, char *argv[])
 			else
 				flags |= FL_OPT_YES;
 			break;
+		case 'b':
+			batch_file = optarg;
+			break;
+		case 'd':
+			runtime_root = optarg;
+			break;
+		case 'j':
+			batch_jobs = atoi(optarg);
+			if (batch_jobs <= 0) {
+				print_info(_("Invalid jobs number %s\n\n"),
+					     optarg);
+				usage();
+			}
+			break;
+		case 'C':
+			progress_fd = atoi(optarg);
+			if (progress_fd < 0) {
+				print_info(_("Invalid progress fd %s\n\n"),
+					     optarg);
+				usage();
+			}
+			break;
+		case 'E':
+			eager = true;
+			break;
+		case 'O':
+			plan_out = optarg;
+			break;
+		case 'A':
+			plan_in = optarg;
+			break;
+		case 'D':
+			flags |= FL_DURABLE;
+			break;
+		case 'R':
+			review = true;
+			break;
+		case 'T':
+			rate = atof(optarg);
+			if (rate <= 0) {
+				print_info(_("Invalid rate %s\n\n"), optarg);
+				usage();
+			}
+			break;
+		case 'B':
+			time_budget = atof(optarg);
+			if (time_budget <= 0) {
+				print_info(_("Invalid time budget %s\n\n"),
+					     optarg);
+				usage();
+			}
+			break;
+		case 'S':
+			sample = atoi(optarg);
+			if (sample <= 0) {
+				print_info(_("Invalid sample probes %s\n\n"),
+					     optarg);
+				usage();
+			}
+			break;
+		case 'N':
+			threads = atoi(optarg);
+			if (threads <= 0) {
+				print_info(_("Invalid threads number %s\n\n"),
+					     optarg);
+				usage();
+			}
+			break;
+		case 'H':
+			shard = optarg;
+			break;
+		case 'U':
+			shard_out = optarg;
+			break;
+		case 'M':
+			shard_merge = true;
+			break;
+		case 'X':
+			metrics_file = optarg;
+			break;
+		case 'L':
+			latency = true;
+			break;
+		case 'G':
+			trace_spec = optarg;
+			break;
+		case 'Q':
+			profile = true;
+			break;
+		case 'K':
+			log_target = optarg;
+			break;
+		case 'F':
+			if (!strcmp(optarg, "ndjson")) {
+				findings_ndjson = true;
+			} else if (strcmp(optarg, "text")) {
+				print_info(_("Invalid findings format %s\n\n"),
+					     optarg);
+				usage();
+			}
+			break;
+		case 'W':
+			op_timeout = atof(optarg);
+			if (op_timeout <= 0) {
+				print_info(_("Invalid operation timeout %s\n\n"),
+					     optarg);
+				usage();
+			}
+			break;
+		case 'P':
+			pressure = atof(optarg);
+			if (pressure <= 0 || pressure > 100) {
+				print_info(_("Invalid io pressure %s\n\n"),
+					     optarg);
+				usage();
+			}
+			break;
 		case 'v':
 			flags |= FL_VERBOSE;
 			break;
@@ -341,6 +509,104 @@ static void parse_options(int argc, char *argv[])
 		}
 	}
 
+	if (ovl_trace_setup(trace_spec))
+		goto usage_out;
+
+	if (shard_merge) {
+		if (config.lowerdir || config.upperdir || config.workdir ||
+		    batch_file || runtime_root || plan_in || shard ||
+		    optind >= argc) {
+			print_info(_("Option --shard-merge need shard results "
+				     "and cannot be specified with -o, -b, -d, "
+				     "--plan-apply or --shard!\n\n"));
+			goto usage_out;
+		}
+		shard_files = argv + optind;
+		shard_file_num = argc - optind;
+		return;
+	}
+
+	if (plan_in) {
+		if (config.lowerdir || config.upperdir || config.workdir ||
+		    batch_file || runtime_root || plan_out) {
+			print_info(_("Option --plan-apply cannot be specified "
+				     "with -o, -b, -d or --plan-out!\n\n"));
+			goto usage_out;
+		}
+		return;
+	}
+
+	/* Questions cannot be asked in the log */
+	if (log_target && !(flags & FL_OPT_MASK)) {
+		print_info(_("Option --log need one of the options -p, -n "
+			     "or -y\n\n"));
+		goto usage_out;
+	}
+
+	if (plan_out && !(flags & FL_OPT_NO)) {
+		print_info(_("Option --plan-out need the option -n\n\n"));
+		goto usage_out;
+	}
+
+	/* Sampling only estimates, nothing could be repaired */
+	if (sample && (!(flags & FL_OPT_NO) || plan_out || profile)) {
+		print_info(_("Option --sample need the option -n and cannot be "
+			     "specified with --plan-out or --profile\n\n"));
+		goto usage_out;
+	}
+
+	/* Overlays in batch mode are checked in several processes */
+	if ((metrics_file || latency || findings_ndjson || profile) &&
+	    (batch_file || runtime_root)) {
+		print_info(_("Option --metrics, --latency, --profile or "
+			     "--findings-format=ndjson cannot be specified "
+			     "with -b or -d\n\n"));
+		goto usage_out;
+	}
+
+	/* Each shard checks a part of one overlay */
+	if (shard) {
+		if (batch_file || runtime_root || sample || time_budget ||
+		    (flags & FL_DURABLE)) {
+			print_info(_("Option --shard cannot be specified with "
+				     "-b, -d, --sample, --time-budget or "
+				     "--durable!\n\n"));
+			goto usage_out;
+		}
+		if (ovl_shard_setup(shard, shard_out))
+			goto usage_out;
+	} else if (shard_out) {
+		print_info(_("Option --shard-out need the option --shard\n\n"));
+		goto usage_out;
+	}
+
+	/* Collect repairs as auto mode, and ask for them after checking */
+	if (review) {
+		if ((flags & FL_OPT_MASK) || plan_out) {
+			print_info(_("Option --review cannot be specified "
+				     "with -p, -n, -y or --plan-out!\n\n"));
+			goto usage_out;
+		}
+		flags |= FL_OPT_AUTO | FL_REVIEW;
+	}
+
+	if (batch_file || runtime_root) {
+		if (config.lowerdir || config.upperdir || config.workdir ||
+		    (batch_file && runtime_root)) {
+			print_info(_("Only one of the options -o, -b or -d "
+				     "can be specified!\n\n"));
+			goto usage_out;
+		}
+		if (batch_jobs > 1 && !(flags & FL_OPT_MASK)) {
+			print_info(_("Parallel batch check need one of "
+				     "the options -p, -n or -y\n\n"));
+			goto usage_out;
+		}
+		if (conflict)
+			goto conflict_out;
+		return;
+	}
+
 	/* Resolve and get each underlying directory of overlay filesystem */
 	if (ovl_get_dirs(&config, &lowerdir, &ofs.lower_num,
 			 &ofs.upper_layer.path, &ofs.workdir.path))
@@ -370,16 +636,16 @@ static void parse_options(int argc, char *argv[])
 		goto usage_out;
 	}
 
-	if (conflict) {
-		print_info(_("Only one of the options -p/-a, -n or -y "
-			     "can be specified!\n\n"));
-		goto usage_out;
-	}
+	if (conflict)
+		goto conflict_out;
 
 	ovl_free_opt(&config);
 	free(lowerdir);
 	return;
 
+conflict_out:
+	print_info(_("Only one of the options -p/-a, -n or -y "
+		     "can be specified!\n\n"));
 usage_out:
 	ovl_free_opt(&config);
 	ovl_clean_dirs(&ofs);
@@ -394,6 +660,27 @@ static void fsck_exit(void)
 {
 	int exit_value = FSCK_OK;
 
+	if (flags & FL_REVIEW) {
+		/* Repairs are made from now on */
+		flags &= ~(FL_PLAN | FL_REVIEW);
+		if (!(status & OVL_ST_ABORT) && ovl_plan_review())
+			set_abort(&status);
+	} else if (flags & FL_PLAN) {
+		if (ovl_plan_close())
+			set_abort(&status);
+		else
+			print_info(_("Repair plan saved in %s\n"), plan_out);
+	}
+
+	if (ovl_shard_close(status))
+		set_abort(&status);
+
+	if (ovl_findings_close())
+		set_abort(&status);
+
+	ovl_latency_report();
+	ovl_profile_report();
+
 	if (status & OVL_ST_CHANGED) {
 		exit_value |= FSCK_NONDESTRUCT;
 		print_info(_("File system was modified!\n"));
@@ -415,6 +702,9 @@ static void fsck_exit(void)
 	    (!(exit_value & FSCK_ERROR) && !(exit_value & FSCK_UNCORRECTED)))
 		print_info(_("Filesystem clean\n"));
 
+	if (ovl_metrics_close(exit_value))
+		exit_value |= FSCK_ERROR;
+
 	exit(exit_value);
 }
 
@@ -426,6 +716,52 @@ int main(int argc, char *argv[])
 
 	parse_options(argc, argv);
 
+	/* Limit the scan rate if run with online workloads */
+	ovl_metrics_setup(metrics_file);
+	ovl_latency_setup(latency);
+	ovl_profile_setup(profile);
+	ovl_throttle_setup(rate, pressure);
+	ovl_budget_setup(time_budget);
+	if (ovl_log_setup(log_target) ||
+	    ovl_findings_setup(findings_ndjson) ||
+	    ovl_watch_setup(op_timeout) || ovl_progress_setup(progress_fd)) {
+		set_abort(&status);
+		fsck_exit();
+	}
+	if (sample)
+		ovl_scan_sample(sample);
+	ovl_scan_threads(threads);
+
+	/* Merge the results of all shards without scanning */
+	if (shard_merge) {
+		if (ovl_shard_merge(shard_files, shard_file_num))
+			set_abort(&status);
+		fsck_exit();
+	}
+
+	/* Apply a saved plan without scanning */
+	if (plan_in) {
+		if (ovl_plan_apply(plan_in))
+			set_abort(&status);
+		fsck_exit();
+	}
+
+	/* Save repairs into the plan file instead of doing */
+	if (plan_out || review) {
+		if (ovl_plan_create(plan_out)) {
+			set_abort(&status);
+			fsck_exit();
+		}
+		flags |= FL_PLAN;
+	}
+
+	/* Check overlays listed in manifest or found in runtime dir */
+	if (batch_file || runtime_root) {
+		if (ovl_batch_check(batch_file, runtime_root, batch_jobs))
+			set_abort(&status);
+		fsck_exit();
+	}
+
 	/* Open all specified base dirs */
 	if (ovl_open_dirs(&ofs))
 		goto err;
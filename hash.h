@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * This is a simple version of hash functions from the Linux kernel
+ * (see include/linux/hash.h)
+ */
+
+#ifndef OVL_HASH_H
+#define OVL_HASH_H
+
+#include <stdint.h>
+
+#define GOLDEN_RATIO_64 0x61C8864680B583EBull
+
+/* Hash a 64-bit value into @bits bits */
+static inline unsigned int hash_64(uint64_t val, unsigned int bits)
+{
+	return (val * GOLDEN_RATIO_64) >> (64 - bits);
+}
+
+/* Hash a null-terminated string into @bits bits (FNV-1a) */
+static inline unsigned int hash_str(const char *str, unsigned int bits)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+
+	for (; *str; str++) {
+		hash ^= (unsigned char)*str;
+		hash *= 0x100000001b3ull;
+	}
+	return hash_64(hash, bits);
+}
+
+/* Order of the smallest power of two table which can hold @num */
+static inline unsigned int hash_bits(unsigned long num)
+{
+	unsigned int bits = 4;
+
+	while ((1UL << bits) < num && bits < 24)
+		bits++;
+	return bits;
+}
+
+#endif /* OVL_HASH_H */
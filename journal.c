@@ -0,0 +1,287 @@
+/*
+ * journal.c - Log repairs in workdir and make them durable in groups
+ *
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "lib.h"
+#include "path.h"
+#include "plan.h"
+#include "journal.h"
+#include "trace.h"
+
+/*
+ * In durable mode, each repair is written into the intent log in the
+ * workdir before it is queued, in the same format as the plan file. The
+ * log is synced once before a batch of queued repairs is applied, and
+ * each modified layer filesystem is synced once at the end of each scan
+ * pass, then the log is emptied. If the check is interrupted, the log
+ * is replayed at the next check, the repairs already done are skipped.
+ */
+#define OVL_JOURNAL_NAME	"fsck.overlay.log"
+#define OVL_JOURNAL_HEADER	"# fsck.overlay intent log v1\n"
+
+extern int flags;
+extern int status;
+
+/* A filesystem modified since last commit */
+struct ovl_journal_fs {
+	dev_t dev;
+	int fd;			/* a dir on it to syncfs */
+};
+
+static int journal_dirfd = -1;	/* workdir */
+static int journal_fd = -1;	/* intent log, -1 if not durable */
+static bool journal_dirty;	/* logged but not synced */
+static struct ovl_journal_fs *journal_fs;
+static int journal_fs_num;
+
+static char *ovl_journal_path(const struct ovl_layer *workdir)
+{
+	return joinname(workdir->path, OVL_JOURNAL_NAME);
+}
+
+/* Sync the workdir to make the creation or removal of the log durable */
+static int ovl_journal_sync_dir(void)
+{
+	if (fsync(journal_dirfd)) {
+		print_err(_("Failed to fsync workdir:%s\n"), strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* Replay the intent log left by an interrupted check, and remove it */
+static int ovl_journal_replay(const struct ovl_layer *workdir)
+{
+	struct stat st;
+	char *path;
+	int ret = 0;
+
+	if (fstatat(workdir->fd, OVL_JOURNAL_NAME, &st, AT_SYMLINK_NOFOLLOW)) {
+		if (errno == ENOENT)
+			return 0;
+		print_err(_("Failed to stat intent log in %s:%s\n"),
+			    workdir->path, strerror(errno));
+		return -1;
+	}
+
+	path = ovl_journal_path(workdir);
+	if (flags & FL_OPT_NO) {
+		print_info(_("Found intent log %s of an interrupted check, "
+			     "not replayed\n"), path);
+		set_inconsistency(&status);
+		goto out;
+	}
+
+	print_info(_("Replay intent log %s of an interrupted check\n"), path);
+	ret = ovl_plan_replay(path);
+	if (ret)
+		goto out;
+
+	ret = unlinkat(workdir->fd, OVL_JOURNAL_NAME, 0);
+	if (ret) {
+		print_err(_("Failed to remove %s:%s\n"), path, strerror(errno));
+		goto out;
+	}
+	ret = ovl_journal_sync_dir();
+out:
+	free(path);
+	return ret;
+}
+
+/*
+ * Replay the intent log left in workdir if any, and create a new one if
+ * in durable mode. Nothing to do if no upper layer.
+ */
+int ovl_journal_open(const struct ovl_layer *workdir)
+{
+	char *path;
+	int ret;
+
+	if (!workdir->path)
+		return 0;
+
+	journal_dirfd = workdir->fd;
+	ret = ovl_journal_replay(workdir);
+	if (ret || !(flags & FL_DURABLE) || (flags & FL_OPT_NO))
+		return ret;
+
+	path = ovl_journal_path(workdir);
+	journal_fd = openat(workdir->fd, OVL_JOURNAL_NAME,
+			    O_WRONLY|O_CREAT|O_EXCL|O_APPEND|O_CLOEXEC, 0600);
+	if (journal_fd < 0) {
+		print_err(_("Failed to create intent log %s:%s\n"),
+			    path, strerror(errno));
+		ret = -1;
+		goto out;
+	}
+	if (write(journal_fd, OVL_JOURNAL_HEADER,
+		  strlen(OVL_JOURNAL_HEADER)) < 0) {
+		print_err(_("Failed to write intent log %s:%s\n"),
+			    path, strerror(errno));
+		ret = -1;
+		goto out;
+	}
+	ret = ovl_journal_sync_dir();
+out:
+	free(path);
+	return ret;
+}
+
+/* Remember the filesystem of a layer to sync it at commit */
+static int ovl_journal_add_fs(const struct ovl_layer *layer)
+{
+	struct stat st;
+	int i;
+
+	if (fstat(layer->fd, &st)) {
+		print_err(_("Failed to fstat %s:%s\n"),
+			    layer->path, strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < journal_fs_num; i++)
+		if (journal_fs[i].dev == st.st_dev)
+			return 0;
+
+	/* Lower layer fd could be closed by LRU, keep a copy */
+	journal_fs = srealloc(journal_fs,
+			      sizeof(*journal_fs) * (journal_fs_num + 1));
+	journal_fs[journal_fs_num].dev = st.st_dev;
+	journal_fs[journal_fs_num].fd = fcntl(layer->fd, F_DUPFD_CLOEXEC, 0);
+	if (journal_fs[journal_fs_num].fd < 0) {
+		print_err(_("Failed to dup fd:%s\n"), strerror(errno));
+		return -1;
+	}
+	journal_fs_num++;
+	return 0;
+}
+
+static void ovl_journal_free_fs(void)
+{
+	int i;
+
+	for (i = 0; i < journal_fs_num; i++)
+		close(journal_fs[i].fd);
+	free(journal_fs);
+	journal_fs = NULL;
+	journal_fs_num = 0;
+}
+
+/* Write a repair into the intent log before queueing it */
+int ovl_journal_log(int type, const struct ovl_layer *layer,
+		    const char *pathname, const char *xattr,
+		    const void *value, size_t size)
+{
+	if (journal_fd < 0)
+		return 0;
+
+	if (ovl_journal_add_fs(layer))
+		return -1;
+
+	journal_dirty = true;
+	return ovl_plan_write(journal_fd, type, layer, pathname, xattr,
+			      value, size);
+}
+
+/* Make the logged repairs durable before applying them, all at once */
+int ovl_journal_sync(void)
+{
+	if (journal_fd < 0 || !journal_dirty)
+		return 0;
+
+	if (fdatasync(journal_fd)) {
+		print_err(_("Failed to sync intent log:%s\n"), strerror(errno));
+		return -1;
+	}
+	journal_dirty = false;
+	return 0;
+}
+
+/*
+ * Sync each modified filesystem once, and then the logged repairs are
+ * not needed any more. Called at the end of each scan pass.
+ */
+int ovl_journal_commit(void)
+{
+	int i;
+
+	if (journal_fd < 0 || !journal_fs_num)
+		return 0;
+
+	for (i = 0; i < journal_fs_num; i++) {
+		if (syncfs(journal_fs[i].fd)) {
+			print_err(_("Failed to syncfs:%s\n"), strerror(errno));
+			return -1;
+		}
+	}
+	ovl_journal_free_fs();
+
+	ovl_trace(OVL_TRACE_REPAIR, OVL_TRACE_EVENT, _("Commit intent log\n"));
+
+	if (ftruncate(journal_fd, strlen(OVL_JOURNAL_HEADER)) ||
+	    fdatasync(journal_fd)) {
+		print_err(_("Failed to truncate intent log:%s\n"),
+			    strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Commit and remove the intent log. The log is left for the next check
+ * if @commit is false, e.g. the check is failed.
+ */
+int ovl_journal_close(bool commit)
+{
+	int ret = 0;
+
+	if (journal_fd < 0)
+		return 0;
+
+	if (commit) {
+		ret = ovl_journal_commit();
+		if (!ret && unlinkat(journal_dirfd, OVL_JOURNAL_NAME, 0)) {
+			print_err(_("Failed to remove intent log:%s\n"),
+				    strerror(errno));
+			ret = -1;
+		}
+		if (!ret)
+			ret = ovl_journal_sync_dir();
+	}
+
+	ovl_journal_free_fs();
+	close(journal_fd);
+	journal_fd = -1;
+	return ret;
+}
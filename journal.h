@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef OVL_JOURNAL_H
+#define OVL_JOURNAL_H
+
+#include <stdbool.h>
+
+int ovl_journal_open(const struct ovl_layer *workdir);
+int ovl_journal_log(int type, const struct ovl_layer *layer,
+		    const char *pathname, const char *xattr,
+		    const void *value, size_t size);
+int ovl_journal_sync(void);
+int ovl_journal_commit(void);
+int ovl_journal_close(bool commit);
+
+#endif /* OVL_JOURNAL_H */
@@ -0,0 +1,473 @@
+/*
+ * latency.c - Histograms of latency of operations on each layer
+ *
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "lib.h"
+#include "list.h"
+#include "latency.h"
+
+/*
+ * Each timed operation is recorded in a log-linear histogram of its layer
+ * and type: every power of two of nanoseconds is split into 8 linear
+ * buckets, so a latency is known within 12.5% from 1ns up to 18 minutes
+ * in a fixed 2.5KB. Percentiles are taken from the buckets.
+ *
+ * Operations are timed by the vDSO clock_gettime(), and each thread
+ * buffers the samples and merges them into the histograms by batches,
+ * so the lock is not taken for each operation. The slowest operations
+ * of each layer are kept with their paths, the lock is only taken if an
+ * operation is slower than all of them.
+ *
+ * Operations are accounted to the layer whose root dir fd they are based
+ * on, the others to "other".
+ */
+#define OVL_LATENCY_SUB_BITS	3
+#define OVL_LATENCY_SUB		(1 << OVL_LATENCY_SUB_BITS)
+#define OVL_LATENCY_MAX_SHIFT	40	/* about 18 minutes in ns */
+#define OVL_LATENCY_BUCKETS	((OVL_LATENCY_MAX_SHIFT - OVL_LATENCY_SUB_BITS \
+				  + 2) * OVL_LATENCY_SUB)
+#define OVL_LATENCY_BATCH	256	/* samples buffered by a thread */
+#define OVL_LATENCY_SLOWEST	8	/* slowest paths kept of a layer */
+#define OVL_LATENCY_FDS		4096	/* layer root dir fds looked up */
+
+static const char *ovl_latency_names[OVL_LATENCY_OPS] = {
+	[OVL_LATENCY_FSTATAT] = "fstatat",
+	[OVL_LATENCY_OPENAT] = "openat",
+	[OVL_LATENCY_GETXATTR] = "getxattr",
+	[OVL_LATENCY_SETXATTR] = "setxattr",
+	[OVL_LATENCY_REMOVEXATTR] = "removexattr",
+	[OVL_LATENCY_UNLINKAT] = "unlinkat",
+	[OVL_LATENCY_MKNODAT] = "mknodat",
+	[OVL_LATENCY_READDIR] = "readdir",
+};
+
+struct ovl_latency_hist {
+	unsigned long long buckets[OVL_LATENCY_BUCKETS];
+	unsigned long long count;
+	unsigned long long sum;		/* ns */
+	unsigned long long max;		/* ns */
+};
+
+/* A slow operation with its path */
+struct ovl_latency_path {
+	unsigned long long ns;
+	int op;
+	char *path;
+};
+
+/* Histograms of one layer, never freed, samples point to it */
+struct ovl_latency_layer {
+	struct list_head list;
+	char *path;
+	struct ovl_latency_hist hist[OVL_LATENCY_OPS];
+	struct ovl_latency_path slowest[OVL_LATENCY_SLOWEST]; /* slowest first */
+	unsigned long long slow_min;	/* ns of the last slowest */
+};
+
+struct ovl_latency_sample {
+	struct ovl_latency_layer *layer;
+	int op;
+	unsigned long long ns;
+};
+
+/* Samples buffered by one thread */
+struct ovl_latency_batch {
+	struct list_head list;
+	int num;			/* written by the owner only */
+	int merged;			/* merged by a report, under lock */
+	struct ovl_latency_sample samples[OVL_LATENCY_BATCH];
+};
+
+static bool latency_enabled;
+static pthread_mutex_t latency_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(latency_layers);
+static LIST_HEAD(latency_batches);
+static struct ovl_latency_layer *latency_fds[OVL_LATENCY_FDS];
+static struct ovl_latency_layer *latency_other;
+static pthread_key_t latency_key;
+static __thread struct ovl_latency_batch *latency_batch;
+
+static int ovl_latency_bucket(unsigned long long ns)
+{
+	int shift;
+
+	if (ns < OVL_LATENCY_SUB)
+		return ns;
+
+	shift = 63 - __builtin_clzll(ns);
+	if (shift > OVL_LATENCY_MAX_SHIFT)
+		return OVL_LATENCY_BUCKETS - 1;
+
+	return (shift - OVL_LATENCY_SUB_BITS + 1) * OVL_LATENCY_SUB +
+	       ((ns >> (shift - OVL_LATENCY_SUB_BITS)) & (OVL_LATENCY_SUB - 1));
+}
+
+/* The middle of a bucket in ns */
+static unsigned long long ovl_latency_value(int bucket)
+{
+	int shift, sub;
+
+	if (bucket < OVL_LATENCY_SUB)
+		return bucket;
+
+	shift = bucket / OVL_LATENCY_SUB + OVL_LATENCY_SUB_BITS - 1;
+	sub = bucket % OVL_LATENCY_SUB;
+	return ((unsigned long long)(OVL_LATENCY_SUB + sub) <<
+		(shift - OVL_LATENCY_SUB_BITS)) +
+	       (1ULL << (shift - OVL_LATENCY_SUB_BITS)) / 2;
+}
+
+/* Caller holds latency_lock */
+static void ovl_latency_merge(struct ovl_latency_batch *batch, int num)
+{
+	struct ovl_latency_sample *sample;
+	struct ovl_latency_hist *hist;
+	int i;
+
+	for (i = batch->merged; i < num; i++) {
+		sample = &batch->samples[i];
+		hist = &sample->layer->hist[sample->op];
+		hist->buckets[ovl_latency_bucket(sample->ns)]++;
+		hist->count++;
+		hist->sum += sample->ns;
+		hist->max = max(hist->max, sample->ns);
+	}
+	batch->merged = num;
+}
+
+/* Merge the samples left by a thread when it exits */
+static void ovl_latency_release(void *arg)
+{
+	struct ovl_latency_batch *batch = arg;
+
+	pthread_mutex_lock(&latency_lock);
+	ovl_latency_merge(batch, batch->num);
+	list_del(&batch->list);
+	pthread_mutex_unlock(&latency_lock);
+	free(batch);
+}
+
+/* Caller holds latency_lock */
+static struct ovl_latency_layer *ovl_latency_find(const char *path)
+{
+	struct ovl_latency_layer *layer;
+	struct list_head *node;
+
+	list_for_each(node, &latency_layers) {
+		layer = list_entry(node, struct ovl_latency_layer, list);
+		if (!strcmp(layer->path, path))
+			return layer;
+	}
+
+	layer = smalloc(sizeof(*layer));
+	layer->path = sstrdup(path);
+	list_add_tail(&layer->list, &latency_layers);
+	return layer;
+}
+
+/* Time the operations on layers if @enable */
+void ovl_latency_setup(bool enable)
+{
+	if (!enable)
+		return;
+
+	if (pthread_key_create(&latency_key, ovl_latency_release)) {
+		print_err(_("Failed to create thread key\n"));
+		return;
+	}
+	latency_other = ovl_latency_find("other");
+	latency_enabled = true;
+}
+
+bool ovl_latency_enabled(void)
+{
+	return latency_enabled;
+}
+
+/* The root dir of the layer at @path is open as @fd, NULL if closed */
+void ovl_latency_layer(int fd, const char *path)
+{
+	struct ovl_latency_layer *layer = NULL;
+
+	if (!latency_enabled || fd < 0 || fd >= OVL_LATENCY_FDS)
+		return;
+
+	pthread_mutex_lock(&latency_lock);
+	if (path)
+		layer = ovl_latency_find(path);
+	__atomic_store_n(&latency_fds[fd], layer, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&latency_lock);
+}
+
+/* Start timing an operation, 0 if not timing */
+unsigned long long ovl_latency_start(void)
+{
+	struct timespec ts;
+
+	if (!latency_enabled)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec + 1;
+}
+
+/* Keep @pathname if it is one of the slowest of @layer */
+static void ovl_latency_slow(struct ovl_latency_layer *layer, int op,
+			     unsigned long long ns, const char *pathname)
+{
+	struct ovl_latency_path *slow = layer->slowest;
+	int i;
+
+	pthread_mutex_lock(&latency_lock);
+	if (ns <= slow[OVL_LATENCY_SLOWEST - 1].ns)
+		goto out;
+
+	free(slow[OVL_LATENCY_SLOWEST - 1].path);
+	for (i = OVL_LATENCY_SLOWEST - 1; i > 0 && slow[i - 1].ns < ns; i--)
+		slow[i] = slow[i - 1];
+	slow[i].ns = ns;
+	slow[i].op = op;
+	slow[i].path = sstrdup(pathname ? pathname : "");
+	__atomic_store_n(&layer->slow_min, slow[OVL_LATENCY_SLOWEST - 1].ns,
+			 __ATOMIC_RELAXED);
+out:
+	pthread_mutex_unlock(&latency_lock);
+}
+
+/*
+ * Record an operation @op on @pathname based on @dirfd, started at
+ * @start got from ovl_latency_start(), errno is kept.
+ */
+void ovl_latency_record(int dirfd, int op, unsigned long long start,
+			const char *pathname)
+{
+	struct ovl_latency_layer *layer = NULL;
+	struct ovl_latency_batch *batch = latency_batch;
+	unsigned long long ns;
+	int err = errno;
+
+	if (!start)
+		return;
+
+	ns = ovl_latency_start() - start;
+	if (dirfd >= 0 && dirfd < OVL_LATENCY_FDS)
+		layer = __atomic_load_n(&latency_fds[dirfd], __ATOMIC_RELAXED);
+	if (!layer)
+		layer = latency_other;
+
+	if (ns > __atomic_load_n(&layer->slow_min, __ATOMIC_RELAXED))
+		ovl_latency_slow(layer, op, ns, pathname);
+
+	if (!batch) {
+		batch = smalloc(sizeof(*batch));
+		pthread_mutex_lock(&latency_lock);
+		list_add_tail(&batch->list, &latency_batches);
+		pthread_mutex_unlock(&latency_lock);
+		pthread_setspecific(latency_key, batch);
+		latency_batch = batch;
+	}
+
+	if (batch->num == OVL_LATENCY_BATCH) {
+		pthread_mutex_lock(&latency_lock);
+		ovl_latency_merge(batch, batch->num);
+		batch->merged = 0;
+		__atomic_store_n(&batch->num, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&latency_lock);
+	}
+
+	batch->samples[batch->num].layer = layer;
+	batch->samples[batch->num].op = op;
+	batch->samples[batch->num].ns = ns;
+	__atomic_store_n(&batch->num, batch->num + 1, __ATOMIC_RELEASE);
+	errno = err;
+}
+
+/* Merge the samples buffered by all threads, caller holds latency_lock */
+static void ovl_latency_merge_all(void)
+{
+	struct ovl_latency_batch *batch;
+	struct list_head *node;
+
+	list_for_each(node, &latency_batches) {
+		batch = list_entry(node, struct ovl_latency_batch, list);
+		ovl_latency_merge(batch, __atomic_load_n(&batch->num,
+							  __ATOMIC_ACQUIRE));
+	}
+}
+
+static double ovl_latency_quantile(const struct ovl_latency_hist *hist,
+				   double q)
+{
+	unsigned long long target = q * (hist->count - 1) + 1;
+	unsigned long long seen = 0;
+	int i;
+
+	for (i = 0; i < OVL_LATENCY_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= target)
+			return min(ovl_latency_value(i), hist->max) / 1e9;
+	}
+	return hist->max / 1e9;
+}
+
+/*
+ * Get the latency of each operation on each layer done so far, free
+ * *@stats when done.
+ *
+ * Return: number of stats
+ */
+int ovl_latency_stats(struct ovl_latency_stat **stats)
+{
+	struct ovl_latency_layer *layer;
+	struct ovl_latency_hist *hist;
+	struct ovl_latency_stat *stat;
+	struct list_head *node;
+	int num = 0;
+	int op;
+
+	*stats = NULL;
+	if (!latency_enabled)
+		return 0;
+
+	pthread_mutex_lock(&latency_lock);
+	ovl_latency_merge_all();
+	list_for_each(node, &latency_layers) {
+		layer = list_entry(node, struct ovl_latency_layer, list);
+		for (op = 0; op < OVL_LATENCY_OPS; op++) {
+			hist = &layer->hist[op];
+			if (!hist->count)
+				continue;
+
+			*stats = srealloc(*stats, sizeof(**stats) * (num + 1));
+			stat = &(*stats)[num++];
+			stat->layer = layer->path;
+			stat->op = ovl_latency_names[op];
+			stat->count = hist->count;
+			stat->sum = hist->sum / 1e9;
+			stat->p50 = ovl_latency_quantile(hist, 0.5);
+			stat->p99 = ovl_latency_quantile(hist, 0.99);
+			stat->p999 = ovl_latency_quantile(hist, 0.999);
+			stat->max = hist->max / 1e9;
+		}
+	}
+	pthread_mutex_unlock(&latency_lock);
+	return num;
+}
+
+/*
+ * Get the slowest operations of each layer, slowest first in a layer,
+ * free *@slow when done.
+ *
+ * Return: number of operations
+ */
+int ovl_latency_slowest(struct ovl_latency_slow **slow)
+{
+	struct ovl_latency_layer *layer;
+	struct ovl_latency_path *path;
+	struct list_head *node;
+	int num = 0;
+	int i;
+
+	*slow = NULL;
+	if (!latency_enabled)
+		return 0;
+
+	pthread_mutex_lock(&latency_lock);
+	list_for_each(node, &latency_layers) {
+		layer = list_entry(node, struct ovl_latency_layer, list);
+		for (i = 0; i < OVL_LATENCY_SLOWEST; i++) {
+			path = &layer->slowest[i];
+			if (!path->path)
+				break;
+
+			*slow = srealloc(*slow, sizeof(**slow) * (num + 1));
+			(*slow)[num].layer = layer->path;
+			(*slow)[num].op = ovl_latency_names[path->op];
+			(*slow)[num].path = path->path;
+			(*slow)[num].seconds = path->ns / 1e9;
+			num++;
+		}
+	}
+	pthread_mutex_unlock(&latency_lock);
+	return num;
+}
+
+static const char *ovl_latency_format(char *buf, size_t size,
+				      double seconds)
+{
+	if (seconds < 1e-3)
+		snprintf(buf, size, "%.1fus", seconds * 1e6);
+	else if (seconds < 1)
+		snprintf(buf, size, "%.1fms", seconds * 1e3);
+	else
+		snprintf(buf, size, "%.2fs", seconds);
+	return buf;
+}
+
+/* Print the latency of operations on each layer */
+void ovl_latency_report(void)
+{
+	struct ovl_latency_stat *stats;
+	struct ovl_latency_slow *slow;
+	const char *layer = NULL;
+	char b[4][16];
+	int num;
+	int i;
+
+	num = ovl_latency_stats(&stats);
+	for (i = 0; i < num; i++) {
+		if (!layer || strcmp(layer, stats[i].layer)) {
+			layer = stats[i].layer;
+			print_info(_("Latency of operations on %s:\n"), layer);
+		}
+		print_info(_("  %-12s %10llu  p50 %-9s p99 %-9s "
+			     "p999 %-9s max %s\n"), stats[i].op,
+			     stats[i].count,
+			     ovl_latency_format(b[0], sizeof(b[0]), stats[i].p50),
+			     ovl_latency_format(b[1], sizeof(b[1]), stats[i].p99),
+			     ovl_latency_format(b[2], sizeof(b[2]),
+						stats[i].p999),
+			     ovl_latency_format(b[3], sizeof(b[3]),
+						stats[i].max));
+	}
+	free(stats);
+
+	layer = NULL;
+	num = ovl_latency_slowest(&slow);
+	for (i = 0; i < num; i++) {
+		if (!layer || strcmp(layer, slow[i].layer)) {
+			layer = slow[i].layer;
+			print_info(_("Slowest operations on %s:\n"), layer);
+		}
+		print_info(_("  %-12s %-9s \"%s\"\n"), slow[i].op,
+			     ovl_latency_format(b[0], sizeof(b[0]),
+						slow[i].seconds),
+			     slow[i].path);
+	}
+	free(slow);
+}
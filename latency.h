@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef OVL_LATENCY_H
+#define OVL_LATENCY_H
+
+/* Operations timed */
+enum {
+	OVL_LATENCY_FSTATAT,
+	OVL_LATENCY_OPENAT,
+	OVL_LATENCY_GETXATTR,
+	OVL_LATENCY_SETXATTR,
+	OVL_LATENCY_REMOVEXATTR,
+	OVL_LATENCY_UNLINKAT,
+	OVL_LATENCY_MKNODAT,
+	OVL_LATENCY_READDIR,		/* fts_read(3) of one entry */
+	OVL_LATENCY_OPS,
+};
+
+/* Latency of one operation on one layer, in seconds */
+struct ovl_latency_stat {
+	const char *layer;
+	const char *op;
+	unsigned long long count;
+	double sum;
+	double p50;
+	double p99;
+	double p999;
+	double max;
+};
+
+/* One of the slowest operations on a layer */
+struct ovl_latency_slow {
+	const char *layer;
+	const char *op;
+	const char *path;
+	double seconds;
+};
+
+void ovl_latency_setup(bool enable);
+bool ovl_latency_enabled(void);
+void ovl_latency_layer(int fd, const char *path);
+unsigned long long ovl_latency_start(void);
+void ovl_latency_record(int dirfd, int op, unsigned long long start,
+			const char *pathname);
+
+/*
+ * Record an operation started at @start, which is 0 without --latency,
+ * the other arguments are not evaluated then.
+ */
+#define ovl_latency(dirfd, op, start, pathname)			\
+do {									\
+	if (__builtin_expect((start) != 0, 0))				\
+		ovl_latency_record(dirfd, op, start, pathname);	\
+} while (0)
+int ovl_latency_stats(struct ovl_latency_stat **stats);
+int ovl_latency_slowest(struct ovl_latency_slow **slow);
+void ovl_latency_report(void);
+
+#endif /* OVL_LATENCY_H */
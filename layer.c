@@ -0,0 +1,320 @@
+/*
+ * layer.c - Open and probe root dirs of underlying layers
+ *
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <sys/resource.h>
+#include <sys/vfs.h>
+#include <sys/statvfs.h>
+
+#include "common.h"
+#include "lib.h"
+#include "list.h"
+#include "overlayfs.h"
+#include "layer.h"
+#include "throttle.h"
+#include "metrics.h"
+#include "latency.h"
+#include "probes.h"
+
+/* File descriptors reserved for scanning, not used by layer root dirs */
+#define OVL_LAYER_FD_RESERVE	32
+#define OVL_LAYER_FD_MIN	8
+
+/* Threads used to open and probe layers in eager mode */
+#define OVL_LAYER_JOBS		16
+
+/*
+ * Lazily opened root dir of a lower layer. It is shared by all the
+ * copies of the layer, and is closed by LRU if too many layers are open.
+ */
+struct ovl_layer_slot {
+	struct list_head lru;	/* in LRU list if open and not in use */
+	int fd;			/* root dir fd, -1 if not open */
+	int flag;		/* FS_LAYER_* found when probing */
+	int users;		/* users of fd, cannot close if in use */
+	bool probed;		/* basic checked */
+};
+
+static LIST_HEAD(layer_lru);
+static pthread_mutex_t layer_lock = PTHREAD_MUTEX_INITIALIZER;
+static int layer_open_num;	/* lower layer root dirs opened */
+static int layer_open_max = OVL_MAX_STACK;
+
+/* Open the root dir of one underlying layer */
+int ovl_open_layer(struct ovl_layer *layer)
+{
+	layer->fd = open(layer->path, O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC);
+	if (layer->fd < 0) {
+		print_err(_("Failed to open %s:%s\n"),
+			    layer->path, strerror(errno));
+		return -1;
+	}
+	ovl_latency_layer(layer->fd, layer->path);
+	return 0;
+}
+
+/* Check an opened layer is read-only or not and support xattr or not */
+static int ovl_probe_layer(int fd, int *flag)
+{
+	struct statfs statfs;
+	ssize_t ret;
+	int err;
+
+	/* Check the underlying layer is read-only or not */
+	err = fstatfs(fd, &statfs);
+	if (err) {
+		print_err(_("fstatfs failed:%s\n"), strerror(errno));
+		return -1;
+	}
+
+	if (statfs.f_flags & ST_RDONLY)
+		*flag |= FS_LAYER_RO;
+
+	/*
+	 * Check the underlying layer support xattr or not. One special
+	 * case, a nested overlayfs does not support OVL_XATTR_PREFIX
+	 * xattr.
+	 */
+	if (statfs.f_type == OVERLAYFS_SUPER_MAGIC)
+		return 0;
+
+	ovl_metric(OVL_METRIC_GETXATTR, 1);
+	ret = fgetxattr(fd, OVL_XATTR_PREFIX, NULL, 0);
+	if (ret < 0 && errno != ENOTSUP && errno != ENODATA) {
+		print_err(_("fgetxattr failed:%s\n"), strerror(errno));
+		return -1;
+	} else if (ret >= 0 || errno == ENODATA) {
+		*flag |= FS_LAYER_XATTR;
+	}
+
+	return 0;
+}
+
+/* Do basic check for one opened layer */
+int ovl_basic_check_layer(struct ovl_layer *layer)
+{
+	return ovl_probe_layer(layer->fd, &layer->flag);
+}
+
+/*
+ * Set the budget of lower layer root dirs opened at the same time. In
+ * eager mode all layers are opened up front, so expand the file
+ * descriptor limit if necessary, otherwise keep within current limit.
+ */
+int ovl_layer_setup(int lower_num, bool eager)
+{
+	struct rlimit rlim;
+	rlim_t rlim_need = lower_num + OVL_LAYER_FD_RESERVE;
+
+	if ((getrlimit(RLIMIT_NOFILE, &rlim))) {
+		print_err(_("Failed to getrlimit:%s\n"), strerror(errno));
+		return -1;
+	}
+
+	if (!eager) {
+		rlim_t avail = OVL_LAYER_FD_MIN;
+
+		if (rlim.rlim_cur > OVL_LAYER_FD_RESERVE + OVL_LAYER_FD_MIN)
+			avail = rlim.rlim_cur - OVL_LAYER_FD_RESERVE;
+		layer_open_max = min(avail, (rlim_t)max(lower_num, 1));
+		return 0;
+	}
+
+	/* If RLIMIT_NOFILE limit is small than we need, try to expand limit */
+	if (rlim.rlim_cur < rlim_need) {
+		print_info(_("Process fd number limit=%lu "
+			     "too small, need %lu\n"),
+			     rlim.rlim_cur, rlim_need);
+
+		rlim.rlim_cur = rlim_need;
+		if (rlim.rlim_max < rlim.rlim_cur)
+			rlim.rlim_max = rlim.rlim_cur;
+
+		if ((setrlimit(RLIMIT_NOFILE, &rlim))) {
+			print_err(_("Failed to setrlimit:%s\n"),
+				    strerror(errno));
+			return -1;
+		}
+	}
+	layer_open_max = lower_num;
+	return 0;
+}
+
+/* Make a lower layer open lazily at the first use */
+void ovl_layer_init(struct ovl_layer *layer)
+{
+	struct ovl_layer_slot *slot;
+
+	slot = smalloc(sizeof(*slot));
+	INIT_LIST_HEAD(&slot->lru);
+	slot->fd = -1;
+
+	layer->slot = slot;
+	layer->fd = -1;
+}
+
+/* Close the least recently used layers to keep within budget */
+static void ovl_layer_shrink(void)
+{
+	struct ovl_layer_slot *slot;
+
+	while (layer_open_num >= layer_open_max && !list_empty(&layer_lru)) {
+		slot = list_entry(layer_lru.next, struct ovl_layer_slot, lru);
+		list_del_init(&slot->lru);
+		ovl_latency_layer(slot->fd, NULL);
+		close(slot->fd);
+		slot->fd = -1;
+		layer_open_num--;
+	}
+}
+
+/*
+ * Get the root dir fd of a lower layer, open and probe it if this is the
+ * first use or it was closed by LRU. The fd cannot be closed until
+ * ovl_layer_put().
+ *
+ * Return: fd on success, -1 otherwise
+ */
+int ovl_layer_get(struct ovl_layer *layer)
+{
+	struct ovl_layer_slot *slot = layer->slot;
+	int flag = 0;
+	int fd;
+
+	pthread_mutex_lock(&layer_lock);
+	if (slot->fd >= 0) {
+		ovl_metric(OVL_METRIC_LAYER_HIT, 1);
+		OVL_PROBE2(cache__hit, "layer_fd", layer->path);
+		goto found;
+	}
+	pthread_mutex_unlock(&layer_lock);
+
+	/* Open and probe without lock, could be in parallel */
+	ovl_metric(OVL_METRIC_LAYER_MISS, 1);
+	OVL_PROBE2(cache__miss, "layer_fd", layer->path);
+	ovl_metric(OVL_METRIC_OPENAT, 1);
+	fd = open(layer->path, O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC);
+	if (fd < 0) {
+		print_err(_("Failed to open %s:%s\n"),
+			    layer->path, strerror(errno));
+		return -1;
+	}
+	if (!slot->probed && ovl_probe_layer(fd, &flag)) {
+		close(fd);
+		return -1;
+	}
+
+	pthread_mutex_lock(&layer_lock);
+	if (slot->fd >= 0) {
+		/* Someone else open it first */
+		close(fd);
+		goto found;
+	}
+	ovl_layer_shrink();
+	slot->fd = fd;
+	ovl_latency_layer(fd, layer->path);
+	if (!slot->probed) {
+		slot->flag = flag;
+		slot->probed = true;
+	}
+	layer_open_num++;
+found:
+	if (!slot->users++)
+		list_del_init(&slot->lru);
+	layer->flag |= slot->flag;
+	fd = slot->fd;
+	pthread_mutex_unlock(&layer_lock);
+	return fd;
+}
+
+/* Done with the fd got from ovl_layer_get() */
+void ovl_layer_put(struct ovl_layer *layer)
+{
+	struct ovl_layer_slot *slot = layer->slot;
+
+	pthread_mutex_lock(&layer_lock);
+	if (!--slot->users) {
+		/* The most recently used at the tail */
+		list_add_tail(&slot->lru, &layer_lru);
+		ovl_layer_shrink();
+	}
+	pthread_mutex_unlock(&layer_lock);
+}
+
+/* Close and free a lower layer, all copies of it cannot be used */
+void ovl_layer_release(struct ovl_layer *layer)
+{
+	struct ovl_layer_slot *slot = layer->slot;
+
+	if (!slot)
+		return;
+
+	pthread_mutex_lock(&layer_lock);
+	list_del_init(&slot->lru);
+	if (slot->fd >= 0) {
+		ovl_latency_layer(slot->fd, NULL);
+		close(slot->fd);
+		layer_open_num--;
+	}
+	pthread_mutex_unlock(&layer_lock);
+
+	free(slot);
+	layer->slot = NULL;
+}
+
+static void ovl_layer_activate(int i, void *arg)
+{
+	struct ovl_layer *layers = arg;
+
+	if (ovl_layer_get(&layers[i]) >= 0)
+		ovl_layer_put(&layers[i]);
+}
+
+/*
+ * Open and probe all the lower layers up front in parallel (eager mode).
+ */
+int ovl_layer_activate_all(struct ovl_layer *layers, int num)
+{
+	int i;
+
+	run_parallel(num, ovl_throttle_jobs(OVL_LAYER_JOBS),
+		     ovl_layer_activate, layers);
+
+	for (i = 0; i < num; i++) {
+		if (!layers[i].slot->probed)
+			return -1;
+		layers[i].flag |= layers[i].slot->flag;
+	}
+	return 0;
+}
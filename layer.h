@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef OVL_LAYER_H
+#define OVL_LAYER_H
+
+int ovl_open_layer(struct ovl_layer *layer);
+int ovl_basic_check_layer(struct ovl_layer *layer);
+
+/* Lazily opened lower layers */
+int ovl_layer_setup(int lower_num, bool eager);
+void ovl_layer_init(struct ovl_layer *layer);
+int ovl_layer_get(struct ovl_layer *layer);
+void ovl_layer_put(struct ovl_layer *layer);
+void ovl_layer_release(struct ovl_layer *layer);
+int ovl_layer_activate_all(struct ovl_layer *layers, int num);
+
+#endif /* OVL_LAYER_H */
@@ -18,6 +18,9 @@
  * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -30,10 +33,26 @@
 #include <sys/stat.h>
 #include <sys/xattr.h>
 #include <fts.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#ifdef __NR_openat2
+#include <linux/openat2.h>
+#endif
 
 #include "common.h"
 #include "lib.h"
 #include "path.h"
+#include "throttle.h"
+#include "budget.h"
+#include "shard.h"
+#include "watch.h"
+#include "device.h"
+#include "metrics.h"
+#include "progress.h"
+#include "latency.h"
+#include "probes.h"
+#include "trace.h"
+#include "profile.h"
 
 extern int flags;
 extern int status;
@@ -60,6 +79,14 @@ static int ask_yn(const char *question, int def)
 
 int ask_question(const char *question, int def)
 {
+	/* Answer as auto mode if planning, repairs go to the plan */
+	if (flags & FL_PLAN) {
+		print_info(_("%s? %s\n"), question,
+			     def ? ((flags & FL_REVIEW) ? _("review") :
+				    _("planned")) : _("n"));
+		return def;
+	}
+
 	if (flags & FL_OPT_MASK) {
 		def = (flags & FL_OPT_YES) ? 1 : (flags & FL_OPT_NO) ? 0 : def;
 		print_info(_("%s? %s\n"), question, def ? _("y") : _("n"));
@@ -81,18 +108,25 @@ int ask_question(const char *question, int def)
 ssize_t get_xattr(int dirfd, const char *pathname, const char *xattrname,
 		  char **value, bool *exist)
 {
+	unsigned long long start;
 	char *buf = NULL;
 	int fd;
 	ssize_t ret;
 
+	ovl_metric(OVL_METRIC_OPENAT, 1);
+	start = ovl_latency_start();
 	fd = openat(dirfd, pathname, O_CLOEXEC|O_NONBLOCK|O_NOFOLLOW|O_RDONLY);
+	ovl_latency(dirfd, OVL_LATENCY_OPENAT, start, pathname);
 	if (fd < 0) {
 		print_err(_("Failed to openat %s: %s\n"),
 			    pathname, strerror(errno));
 		return -1;
 	}
 
+	ovl_metric(OVL_METRIC_GETXATTR, 1);
+	start = ovl_latency_start();
 	ret = fgetxattr(fd, xattrname, NULL, 0);
+	ovl_latency(dirfd, OVL_LATENCY_GETXATTR, start, pathname);
 	if (ret < 0) {
 		if (errno != ENODATA && errno != ENOTSUP)
 			goto fail;
@@ -109,7 +143,10 @@ ssize_t get_xattr(int dirfd, const char *pathname, const char *xattrname,
 		goto out;
 
 	buf = smalloc(ret+1);
+	ovl_metric(OVL_METRIC_GETXATTR, 1);
+	start = ovl_latency_start();
 	ret = fgetxattr(fd, xattrname, buf, ret);
+	ovl_latency(dirfd, OVL_LATENCY_GETXATTR, start, pathname);
 	if (ret <= 0)
 		goto fail2;
 
@@ -137,22 +174,32 @@ fail:
 int set_xattr(int dirfd, const char *pathname, const char *xattrname,
 	      void *value, size_t size)
 {
+	unsigned long long start;
 	int fd;
 	int ret;
 
+	ovl_metric(OVL_METRIC_OPENAT, 1);
+	start = ovl_latency_start();
 	fd = openat(dirfd, pathname, O_CLOEXEC|O_NONBLOCK|O_NOFOLLOW|O_RDONLY);
+	ovl_latency(dirfd, OVL_LATENCY_OPENAT, start, pathname);
 	if (fd < 0) {
 		print_err(_("Failed to openat %s: %s\n"),
 			    pathname, strerror(errno));
 		return -1;
 	}
 
+	ovl_metric(OVL_METRIC_SETXATTR, 1);
+	start = ovl_latency_start();
 	ret = fsetxattr(fd, xattrname, value, size, XATTR_CREATE);
+	ovl_latency(dirfd, OVL_LATENCY_SETXATTR, start, pathname);
 	if (ret && errno != EEXIST)
 		goto fail;
 
 	if (errno == EEXIST) {
+		ovl_metric(OVL_METRIC_SETXATTR, 1);
+		start = ovl_latency_start();
 		ret = fsetxattr(fd, xattrname, value, size, XATTR_REPLACE);
+		ovl_latency(dirfd, OVL_LATENCY_SETXATTR, start, pathname);
 		if (ret)
 			goto fail;
 	}
@@ -169,17 +216,24 @@ fail:
 /* Remove the specified xattr */
 int remove_xattr(int dirfd, const char *pathname, const char *xattrname)
 {
+	unsigned long long start;
 	int fd;
 	int ret;
 
+	ovl_metric(OVL_METRIC_OPENAT, 1);
+	start = ovl_latency_start();
 	fd = openat(dirfd, pathname, O_CLOEXEC|O_NONBLOCK|O_NOFOLLOW|O_RDONLY);
+	ovl_latency(dirfd, OVL_LATENCY_OPENAT, start, pathname);
 	if (fd < 0) {
 		print_err(_("Failed to openat %s: %s\n"),
 			    pathname, strerror(errno));
 		return -1;
 	}
 
+	ovl_metric(OVL_METRIC_REMOVEXATTR, 1);
+	start = ovl_latency_start();
 	ret = fremovexattr(fd, xattrname);
+	ovl_latency(dirfd, OVL_LATENCY_REMOVEXATTR, start, pathname);
 	if (ret)
 		print_err(_("Cannot fremovexattr %s %s: %s\n"), pathname,
 			    xattrname, strerror(errno));
@@ -188,6 +242,146 @@ int remove_xattr(int dirfd, const char *pathname, const char *xattrname)
 	return ret;
 }
 
+#ifdef __NR_openat2
+static bool no_openat2;		/* kernel not support openat2(2) */
+static bool no_resolve_cached;	/* kernel not support RESOLVE_CACHED */
+
+static inline int ovl_openat2(int dirfd, const char *pathname,
+			      struct open_how *how)
+{
+	return syscall(__NR_openat2, dirfd, pathname, how, sizeof(*how));
+}
+#endif
+
+/*
+ * Stat the target beneath the layer root dir without following the last
+ * symlink, the same as fstatat(AT_SYMLINK_NOFOLLOW) but never escape the
+ * layer through absolute symlinks or "..". Use openat2(2) and try the
+ * lockless dcache lookup (RESOLVE_CACHED) first, only fall back to the
+ * full lookup if it cannot be done in cache. Use fstatat(2) on old
+ * kernels which not support openat2(2).
+ *
+ * A target out of the layer is treated as not exist (ENOENT).
+ */
+static int ovl_fstatat_beneath(int dirfd, const char *pathname,
+			       struct stat *st)
+{
+#ifdef __NR_openat2
+	struct open_how how = {
+		.flags = O_PATH | O_NOFOLLOW | O_CLOEXEC,
+		.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS,
+	};
+	int fd, ret, err;
+
+	ovl_metric(OVL_METRIC_FSTATAT, 1);
+	if (!*pathname || no_openat2)
+		goto fallback;
+
+	if (!no_resolve_cached) {
+		struct open_how cached = how;
+
+		cached.resolve |= RESOLVE_CACHED;
+		fd = ovl_openat2(dirfd, pathname, &cached);
+		if (fd >= 0) {
+			ovl_metric(OVL_METRIC_CACHED_HIT, 1);
+			OVL_PROBE2(cache__hit, "resolve_cached", pathname);
+			goto found;
+		}
+		if (errno == ENOSYS)
+			goto nosys;
+		if (errno == EINVAL) {
+			no_resolve_cached = true;
+		} else if (errno != EAGAIN) {
+			goto err;
+		} else {
+			ovl_metric(OVL_METRIC_CACHED_MISS, 1);
+			OVL_PROBE2(cache__miss, "resolve_cached", pathname);
+		}
+	}
+
+	fd = ovl_openat2(dirfd, pathname, &how);
+	if (fd < 0) {
+		if (errno == ENOSYS)
+			goto nosys;
+		goto err;
+	}
+found:
+	ret = fstat(fd, st);
+	err = errno;
+	close(fd);
+	errno = err;
+	return ret;
+err:
+	if (errno == EXDEV || errno == ELOOP)
+		errno = ENOENT;
+	return -1;
+nosys:
+	no_openat2 = true;
+fallback:
+#else
+	ovl_metric(OVL_METRIC_FSTATAT, 1);
+#endif
+	return fstatat(dirfd, pathname, st,
+		       AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+}
+
+int fstatat_beneath(int dirfd, const char *pathname, struct stat *st)
+{
+	unsigned long long start = ovl_latency_start();
+	int ret;
+
+	ret = ovl_fstatat_beneath(dirfd, pathname, st);
+	ovl_latency(dirfd, OVL_LATENCY_FSTATAT, start, pathname);
+	return ret;
+}
+
+/* Work shared by parallel threads */
+struct parallel_work {
+	void (*fn)(int, void *);
+	void *arg;
+	int num;
+	int next;		/* next index to handle */
+};
+
+static void *parallel_worker(void *data)
+{
+	struct parallel_work *work = data;
+	int i;
+
+	while ((i = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED)) <
+	       work->num)
+		work->fn(i, work->arg);
+
+	return NULL;
+}
+
+/*
+ * Call @fn for each index in [0, @num) on at most @jobs threads, the
+ * calling thread also join the work. Return after all done.
+ */
+void run_parallel(int num, int jobs, void (*fn)(int, void *), void *arg)
+{
+	struct parallel_work work = {fn, arg, num, 0};
+	pthread_t *threads;
+	int started = 0;
+	int i;
+
+	jobs = min(jobs, num);
+	threads = smalloc(sizeof(pthread_t) * max(jobs, 1));
+
+	for (i = 1; i < jobs; i++) {
+		if (pthread_create(&threads[started], NULL,
+				   parallel_worker, &work))
+			break;
+		started++;
+	}
+
+	parallel_worker(&work);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+}
 
 static void scan_entry_init(struct scan_ctx *sctx, FTSENT *ftsent)
 {
@@ -202,6 +396,83 @@ static inline int scan_check_entry(int (*do_check)(struct scan_ctx *),
 	return do_check ? do_check(sctx) : 0;
 }
 
+/*
+ * Pass an entry of another shard. Dirs above the shard depth are entered
+ * by all shards, and the owner of a dir counts the impurities of all its
+ * entries for its impure xattr.
+ */
+static int scan_shard_skip(FTS *ftsp, FTSENT *ftsent, struct scan_ctx *sctx,
+			   struct scan_operations *sop)
+{
+	FTSENT *parent = ftsent->fts_parent;
+	bool shared = ovl_shard_shared(ftsent->fts_level);
+	int ret = 0;
+
+	if (ftsent->fts_info == FTS_DP) {
+		if (shared) {
+			free(sctx->dirdata);
+			sctx->dirdata = ftsent->fts_pointer;
+		}
+		return 0;
+	}
+
+	if (ftsent->fts_info != FTS_D && ftsent->fts_info != FTS_F)
+		return 0;
+
+	if (ftsent->fts_level > FTS_ROOTLEVEL &&
+	    ovl_shard_mine(parent->fts_level,
+			   basename2(parent->fts_path, sctx->layer->path)))
+		ret = scan_check_entry(sop->impurity, sctx);
+
+	if (ftsent->fts_info == FTS_D) {
+		if (shared) {
+			ftsent->fts_pointer = sctx->dirdata;
+			sctx->dirdata = smalloc(sizeof(struct scan_dir_data));
+		} else {
+			fts_set(ftsp, ftsent, FTS_SKIP);
+		}
+	}
+	return ret;
+}
+
+/*
+ * Stop scanning before @ftsent, free the data of dirs entered but not
+ * finished.
+ */
+static void scan_dir_stop(struct scan_ctx *sctx, FTSENT *ftsent)
+{
+	FTSENT *p = ftsent;
+
+	if (ftsent->fts_info != FTS_DP)
+		p = ftsent->fts_parent;
+
+	for (; p && p->fts_level >= FTS_ROOTLEVEL; p = p->fts_parent) {
+		free(sctx->dirdata);
+		sctx->dirdata = p->fts_pointer;
+	}
+}
+
+/* Account the syscalls made by fts(3) to read an entry */
+static void scan_metrics(const FTSENT *ftsent)
+{
+	if (ftsent->fts_info == FTS_DP)
+		return;
+
+	ovl_metric(OVL_METRIC_FSTATAT, 1);
+	if (ftsent->fts_info == FTS_D) {
+		ovl_metric(OVL_METRIC_OPENAT, 1);
+		ovl_metric(OVL_METRIC_DIR_BYTES, ftsent->fts_statp->st_size);
+	}
+}
+
+/* Entries of a dir in inode order, cut seeks on rotational devices */
+static int scan_inode_compar(const FTSENT **a, const FTSENT **b)
+{
+	if ((*a)->fts_ino != (*b)->fts_ino)
+		return (*a)->fts_ino < (*b)->fts_ino ? -1 : 1;
+	return 0;
+}
+
 /*
  * Scan specified directories and invoke callback to check/fix underlying
  * dirs of overlay filesystem
@@ -209,33 +480,79 @@ static inline int scan_check_entry(int (*do_check)(struct scan_ctx *),
 int scan_dir(struct scan_ctx *sctx, struct scan_operations *sop)
 {
 	char *paths[2] = {sctx->layer->path, NULL};
+	int (*compar)(const FTSENT **, const FTSENT **) = NULL;
 	FTS *ftsp;
 	FTSENT *ftsent;
+	unsigned long long start;
 	int ret = 0;
 
-	ftsp = fts_open(paths, FTS_NOCHDIR | FTS_PHYSICAL, NULL);
+	/* The most likely broken entries go first if time is limited */
+	if (ovl_budget_enabled())
+		compar = ovl_budget_compar;
+	else if (ovl_device_sorted(sctx->layer->device))
+		compar = scan_inode_compar;
+
+	ftsp = fts_open(paths, FTS_NOCHDIR | FTS_PHYSICAL, compar);
 	if (ftsp == NULL) {
 		print_err(_("Failed to fts open %s:%s\n"),
 			    sctx->layer->path, strerror(errno));
 		return -1;
 	}
 
-	while ((ftsent = fts_read(ftsp)) != NULL) {
+	for (;;) {
+		start = ovl_latency_start();
+		ftsent = fts_read(ftsp);
+		if (!ftsent)
+			break;
+		ovl_latency(sctx->layer->fd, OVL_LATENCY_READDIR, start,
+			    basename2(ftsent->fts_path, sctx->layer->path));
+
+		/* Stop between two entries if run out of time */
+		if (ovl_budget_expired()) {
+			scan_dir_stop(sctx, ftsent);
+			break;
+		}
+
+		/* Stop if the layer is quarantined for not responding */
+		if (!ovl_watch_progress(ftsent->fts_path)) {
+			scan_dir_stop(sctx, ftsent);
+			break;
+		}
+
+		ovl_throttle(1);
+
 		/* Fillup base context */
 		scan_entry_init(sctx, ftsent);
-
-		print_debug(_("Scan:%-3s %2d %7lld   %-40s %-20s\n"),
-			      (ftsent->fts_info == FTS_D) ? "d" :
-			      (ftsent->fts_info == FTS_DNR) ? "dnr" :
-			      (ftsent->fts_info == FTS_DP) ? "dp" :
-			      (ftsent->fts_info == FTS_F) ? "f" :
-			      (ftsent->fts_info == FTS_NS) ? "ns" :
-			      (ftsent->fts_info == FTS_SL) ? "sl" :
-			      (ftsent->fts_info == FTS_SLNONE) ? "sln" :
-			      (ftsent->fts_info == FTS_DEFAULT) ? "df" : "???",
-			      ftsent->fts_level,
-			      (long long)ftsent->fts_statp->st_size,
-			      ftsent->fts_path, sctx->layer->path);
+		scan_metrics(ftsent);
+		OVL_PROBE4(scan__entry, sctx->layer->path, sctx->pathname,
+			   ftsent->fts_info, ftsent->fts_level);
+		if (ftsent->fts_info == FTS_DP)
+			ovl_progress_dir();
+		else
+			ovl_progress_entry();
+
+		ovl_trace(OVL_TRACE_SCAN, OVL_TRACE_DETAIL,
+			  _("Scan:%-3s %2d %7lld   %-40s %-20s\n"),
+			  (ftsent->fts_info == FTS_D) ? "d" :
+			  (ftsent->fts_info == FTS_DNR) ? "dnr" :
+			  (ftsent->fts_info == FTS_DP) ? "dp" :
+			  (ftsent->fts_info == FTS_F) ? "f" :
+			  (ftsent->fts_info == FTS_NS) ? "ns" :
+			  (ftsent->fts_info == FTS_SL) ? "sl" :
+			  (ftsent->fts_info == FTS_SLNONE) ? "sln" :
+			  (ftsent->fts_info == FTS_DEFAULT) ? "df" : "???",
+			  ftsent->fts_level,
+			  (long long)ftsent->fts_statp->st_size,
+			  ftsent->fts_path, sctx->layer->path);
+
+		/* Entries of other shards are left to them */
+		if (!ovl_shard_mine(ftsent->fts_level, sctx->pathname)) {
+			ret = scan_shard_skip(ftsp, ftsent, sctx, sop);
+			if (ret)
+				goto out;
+			continue;
+		}
+		ovl_profile_entry(ftsent);
 
 		switch (ftsent->fts_info) {
 		case FTS_F:
@@ -287,6 +604,10 @@ int scan_dir(struct scan_ctx *sctx, struct scan_operations *sop)
 			ret = -1;
 			goto out;
 		}
+
+		/* A top entry is checked with all entries below it */
+		if (ftsent->fts_level == 1 && ftsent->fts_info != FTS_D)
+			ovl_budget_checked(ftsent->fts_name);
 	}
 out:
 	fts_close(ftsp);
@@ -41,6 +41,11 @@
 #define FL_OPT_NO	(1 << 4)	/* no changes to the filesystem */
 #define FL_OPT_YES	(1 << 5)	/* yes to all questions */
 #define FL_OPT_MASK	(FL_OPT_AUTO|FL_OPT_NO|FL_OPT_YES)
+#define FL_PLAN		(1 << 6)	/* save repairs into plan, no changes */
+#define FL_DURABLE	(1 << 7)	/* log repairs and sync them in groups */
+#define FL_REVIEW	(1 << 8)	/* ask for found repairs after checking */
+
+extern int flags;
 
 /* Scan pass */
 #define OVL_SCAN_PASS_ONE	0
@@ -57,6 +62,23 @@
 #define FS_LAYER_RO	(1 << 0)	/* layer is read-only */
 #define FS_LAYER_XATTR	(1 << 1)	/* layer support xattr */
 
+/* Valid redirect dir recorded in a checked lower layer */
+struct ovl_redirect_rec {
+	char *pathname;		/* redirect dir path */
+	char *origin;		/* redirected origin dir path */
+	int odepth;		/* origin stack relative to the redirect dir */
+};
+
+/* Check result of a lower layer, shared between overlays (batch mode) */
+struct ovl_layer_index {
+	bool checked;			/* layer already checked, skip scan */
+	struct ovl_redirect_rec *redirects;	/* valid redirect dirs */
+	int redirect_num;
+};
+
+struct ovl_layer_slot;
+struct ovl_device;
+
 /* Information for each underlying layer */
 struct ovl_layer {
 	char *path;		/* root dir path for this layer */
@@ -64,6 +86,10 @@ struct ovl_layer {
 	int type;		/* OVL_UPPER or OVL_LOWER */
 	int stack;		/* lower layer stack number, OVL_LOWER use only */
 	int flag;		/* special flag for this layer */
+	struct ovl_layer_index *index;	/* shared check result, could be NULL */
+	struct ovl_layer_slot *slot;	/* lazily opened root dir, lower only */
+	struct ovl_device *device;	/* storage it is on, NULL if unknown */
+	long long entries;	/* entries found by pass one, 0 if not yet */
 };
 
 /* Information for the whole overlay filesystem */
@@ -82,13 +108,13 @@ struct scan_dir_data {
 };
 
 struct scan_result {
-	int files;		/* total files */
-	int directories;	/* total directories */
-	int t_whiteouts;	/* total whiteouts */
-	int i_whiteouts;	/* invalid whiteouts */
-	int t_redirects;	/* total redirect dirs */
-	int i_redirects;	/* invalid redirect dirs */
-	int m_impure;		/* missing inpure dirs */
+	long long files;	/* total files */
+	long long directories;	/* total directories */
+	long long t_whiteouts;	/* total whiteouts */
+	long long i_whiteouts;	/* invalid whiteouts */
+	long long t_redirects;	/* total redirect dirs */
+	long long i_redirects;	/* invalid redirect dirs */
+	long long m_impure;	/* missing inpure dirs */
 };
 
 struct scan_ctx {
@@ -111,19 +137,26 @@ struct scan_operations {
 	int (*impure)(struct scan_ctx *);
 };
 
+/* Status could be set by pipelined passes at the same time */
 static inline void set_inconsistency(int *status)
 {
-	*status |= OVL_ST_INCONSISTNECY;
+	__atomic_or_fetch(status, OVL_ST_INCONSISTNECY, __ATOMIC_RELAXED);
 }
 
 static inline void set_abort(int *status)
 {
-	*status |= OVL_ST_ABORT;
+	__atomic_or_fetch(status, OVL_ST_ABORT, __ATOMIC_RELAXED);
 }
 
 static inline void set_changed(int *status)
 {
-	*status |= OVL_ST_CHANGED;
+	/* Repairs to review are decided later */
+	if (flags & FL_REVIEW)
+		return;
+
+	/* Planned repairs are not done yet */
+	__atomic_or_fetch(status, (flags & FL_PLAN) ? OVL_ST_INCONSISTNECY :
+			  OVL_ST_CHANGED, __ATOMIC_RELAXED);
 }
 
 int scan_dir(struct scan_ctx *sctx, struct scan_operations *sop);
@@ -133,5 +166,7 @@ ssize_t get_xattr(int dirfd, const char *pathname, const char *xattrname,
 int set_xattr(int dirfd, const char *pathname, const char *xattrname,
 	      void *value, size_t size);
 int remove_xattr(int dirfd, const char *pathname, const char *xattrname);
+int fstatat_beneath(int dirfd, const char *pathname, struct stat *st);
+void run_parallel(int num, int jobs, void (*fn)(int, void *), void *arg);
 
 #endif /* OVL_LIB_H */
@@ -0,0 +1,678 @@
+/*
+ * log.c - Write messages by a background thread, to syslog or journal
+ *
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/limits.h>
+
+#include "common.h"
+#include "log.h"
+
+/*
+ * With --log, print_info() and print_err() format each message into a
+ * line buffer of the thread, and complete lines are queued as records
+ * into a bounded ring, written by a background thread to stdout and
+ * stderr, a file, or syslog (/dev/log) or journald socket datagrams, so
+ * a slow consumer never stalls the check until the ring is full.
+ *
+ * Syslog and journal are shared by the system, more than OVL_LOG_BURST
+ * lines of the same format in OVL_LOG_INTERVAL are suppressed there,
+ * and the number suppressed is logged with the next one or at exit.
+ * The text of a leading "%s" up to ':' is a part of the format, so the
+ * findings, e.g. "Orphan whiteout: ...", are told apart by kind.
+ *
+ * Records queued are written at exit, before fork, and on a fatal signal
+ * or SIGINT/SIGTERM, with write(2) only in that case. Records are taken
+ * to write by moving log_claimed, by the writer or the signal handler,
+ * and log_written tells the ones done, so none is written twice.
+ */
+#define OVL_LOG_LINE		(PATH_MAX + 256)	/* longer are cut */
+#define OVL_LOG_REC		(OVL_LOG_LINE + 128)	/* with the header */
+#define OVL_LOG_SLOTS		256
+#define OVL_LOG_BATCH		64	/* records written at once */
+#define OVL_LOG_BURST		10
+#define OVL_LOG_INTERVAL	5	/* seconds */
+#define OVL_LOG_RATES		64	/* formats rate limited */
+#define OVL_LOG_NOTE		80	/* text kept of a suppressed line */
+#define OVL_LOG_SIGNAL_WAIT	100	/* ms the handler waits the writer */
+
+#define OVL_LOG_STDOUT		0
+#define OVL_LOG_FILE		1
+#define OVL_LOG_SYSLOG		2
+#define OVL_LOG_JOURNAL		3
+
+#define OVL_LOG_SYSLOG_PATH	"/dev/log"
+#define OVL_LOG_JOURNAL_PATH	"/run/systemd/journal/socket"
+
+extern char *program_name;
+
+/* A line ready to write, with the header of the target */
+struct ovl_log_rec {
+	int fd;
+	int len;
+	char data[OVL_LOG_REC];
+};
+
+/*
+ * Lines being formatted by a thread. The ones before @start are queued,
+ * up to @pending if the record of the line being queued is in the ring,
+ * so the signal handler writes the rest only.
+ */
+struct ovl_log_line {
+	const char *fmt;	/* format of the first part, to rate limit */
+	size_t len;
+	size_t start;
+	volatile size_t pending;
+	volatile bool moving;	/* being moved to the front */
+	char buf[OVL_LOG_LINE];
+};
+
+/* Lines of one format in the current interval */
+struct ovl_log_rate {
+	unsigned long key;		/* 0 if not used */
+	time_t start;
+	int count;
+	int missed;
+	char last[OVL_LOG_NOTE];	/* the last line suppressed */
+};
+
+bool ovl_log_enabled;
+
+static int log_target;
+static int log_fd = -1;			/* file or socket */
+static int log_err;			/* errno of the first failed write */
+static pid_t log_pid;
+static struct ovl_log_rec *log_recs;
+static unsigned long log_queued;	/* sequence of the next record */
+static unsigned long log_claimed;	/* records taken to write, atomic */
+static unsigned long log_written;	/* records written, atomic */
+static bool log_writer;			/* writer thread is running */
+static __thread bool log_in_writer;	/* this is the writer thread */
+static __thread volatile unsigned long log_line_seq;	/* line queued */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t log_space = PTHREAD_COND_INITIALIZER;
+static struct ovl_log_rate log_rates[OVL_LOG_RATES];
+static __thread struct ovl_log_line log_lines[2];	/* info and err */
+
+static const int log_signals[] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT,
+				  SIGINT, SIGTERM};
+static struct sigaction log_old_actions[sizeof(log_signals) /
+					sizeof(log_signals[0])];
+
+static inline bool ovl_log_is_err(int prio)
+{
+	return prio <= LOG_ERR;
+}
+
+static inline bool ovl_log_is_socket(void)
+{
+	return log_target == OVL_LOG_SYSLOG || log_target == OVL_LOG_JOURNAL;
+}
+
+/* Write one record, signal safe */
+static int ovl_log_write_rec(const struct ovl_log_rec *rec)
+{
+	const char *p = rec->data;
+	size_t len = rec->len;
+	ssize_t ret;
+
+	if (ovl_log_is_socket()) {
+		while (send(rec->fd, p, len, MSG_NOSIGNAL) < 0) {
+			if (errno != EINTR)
+				return -1;
+		}
+		return 0;
+	}
+
+	while (len) {
+		ret = write(rec->fd, p, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int ovl_log_writev(int fd, struct iovec *iov, int cnt)
+{
+	ssize_t ret;
+
+	while (cnt) {
+		ret = writev(fd, iov, cnt);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		while (cnt && ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return 0;
+}
+
+static inline struct ovl_log_rec *ovl_log_rec(unsigned long seq)
+{
+	return &log_recs[seq % OVL_LOG_SLOTS];
+}
+
+/* Records before @seq are written, by the writer or a signal handler */
+static void ovl_log_written_to(unsigned long seq)
+{
+	unsigned long old = __atomic_load_n(&log_written, __ATOMIC_ACQUIRE);
+
+	while (old < seq &&
+	       !__atomic_compare_exchange_n(&log_written, &old, seq, false,
+					    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		;
+}
+
+/* Write @n records from @first, records to one fd by one writev(2) */
+static int ovl_log_write_recs(unsigned long first, int n)
+{
+	struct iovec iov[OVL_LOG_BATCH];
+	struct ovl_log_rec *rec;
+	int cnt = 0;
+	int fd = -1;
+	int ret = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		rec = ovl_log_rec(first + i);
+		if (ovl_log_is_socket()) {
+			ret |= ovl_log_write_rec(rec);
+			continue;
+		}
+
+		if (cnt && rec->fd != fd) {
+			ret |= ovl_log_writev(fd, iov, cnt);
+			cnt = 0;
+		}
+		fd = rec->fd;
+		iov[cnt].iov_base = rec->data;
+		iov[cnt++].iov_len = rec->len;
+	}
+	if (cnt)
+		ret |= ovl_log_writev(fd, iov, cnt);
+	return ret;
+}
+
+static void *ovl_log_thread(void *arg)
+{
+	unsigned long first;
+	int n;
+
+	log_in_writer = true;
+	pthread_mutex_lock(&log_lock);
+	for (;;) {
+		first = __atomic_load_n(&log_claimed, __ATOMIC_ACQUIRE);
+		if (first == log_queued) {
+			pthread_cond_wait(&log_ready, &log_lock);
+			continue;
+		}
+
+		/* Records in a row, not wrapped, unless taken by a signal */
+		n = min(log_queued - first, (unsigned long)OVL_LOG_BATCH);
+		n = min(n, OVL_LOG_SLOTS - (int)(first % OVL_LOG_SLOTS));
+		if (!__atomic_compare_exchange_n(&log_claimed, &first,
+						 first + n, false,
+						 __ATOMIC_ACQ_REL,
+						 __ATOMIC_ACQUIRE))
+			continue;
+		pthread_mutex_unlock(&log_lock);
+
+		if (ovl_log_write_recs(first, n) && !log_err)
+			log_err = errno;
+
+		pthread_mutex_lock(&log_lock);
+		ovl_log_written_to(first + n);
+		pthread_cond_broadcast(&log_space);
+	}
+	pthread_mutex_unlock(&log_lock);
+	return NULL;
+}
+
+/*
+ * Format a line with the header of the target into @rec. No time stamp
+ * in a signal handler, syslog adds the time it receives then.
+ */
+static void ovl_log_format(struct ovl_log_rec *rec, int prio,
+			   const char *msg, int len, bool newline, bool stamp)
+{
+	char date[32] = "";
+	time_t now;
+	struct tm tm;
+	int ret;
+
+	rec->fd = log_fd;
+	switch (log_target) {
+	case OVL_LOG_SYSLOG:
+		if (stamp) {
+			now = time(NULL);
+			localtime_r(&now, &tm);
+			strftime(date, sizeof(date), "%b %e %H:%M:%S ", &tm);
+		}
+		ret = snprintf(rec->data, OVL_LOG_REC, "<%d>%s%.32s[%d]: %.*s",
+			       LOG_USER | prio, date, program_name, log_pid,
+			       len, msg);
+		break;
+	case OVL_LOG_JOURNAL:
+		ret = snprintf(rec->data, OVL_LOG_REC, "PRIORITY=%d\n"
+			       "SYSLOG_IDENTIFIER=%.32s\nSYSLOG_PID=%d\n"
+			       "MESSAGE=%.*s\n", prio, program_name, log_pid,
+			       len, msg);
+		break;
+	default:
+		if (log_target == OVL_LOG_STDOUT)
+			rec->fd = ovl_log_is_err(prio) ? STDERR_FILENO :
+							 STDOUT_FILENO;
+		ret = snprintf(rec->data, OVL_LOG_REC, "%.32s%s%.*s%s",
+			       ovl_log_is_err(prio) ? program_name : "",
+			       ovl_log_is_err(prio) ? ":[Error]: " : "",
+			       len, msg, newline ? "\n" : "");
+		break;
+	}
+	rec->len = min(ret, OVL_LOG_REC - 1);
+}
+
+/* Queue a line with the header of the target, log_lock is held */
+static void ovl_log_push(int prio, const char *msg, int len, bool newline,
+			 bool line)
+{
+	struct ovl_log_rec *rec;
+	pthread_t thread;
+
+	while (log_queued - __atomic_load_n(&log_written, __ATOMIC_ACQUIRE) ==
+	       OVL_LOG_SLOTS)
+		pthread_cond_wait(&log_space, &log_lock);
+
+	if (!log_writer &&
+	    !pthread_create(&thread, NULL, ovl_log_thread, NULL)) {
+		pthread_detach(thread);
+		log_writer = true;
+	}
+
+	rec = ovl_log_rec(log_queued);
+	ovl_log_format(rec, prio, msg, len, newline, true);
+
+	/* No writer, write it at once */
+	if (!log_writer) {
+		if (ovl_log_write_rec(rec) && !log_err)
+			log_err = errno;
+		if (line)
+			log_line_seq = 0;
+		return;
+	}
+	if (line)
+		log_line_seq = log_queued;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	__atomic_store_n(&log_queued, log_queued + 1, __ATOMIC_RELEASE);
+	pthread_cond_signal(&log_ready);
+}
+
+static void ovl_log_push_missed(int prio, struct ovl_log_rate *rate)
+{
+	char note[OVL_LOG_NOTE + 64];
+	int len;
+
+	len = snprintf(note, sizeof(note), _("%d similar messages suppressed, "
+		       "the last: %s"), rate->missed, rate->last);
+	ovl_log_push(prio, note, min(len, (int)sizeof(note) - 1), true, false);
+	rate->missed = 0;
+}
+
+static unsigned long ovl_log_rate_key(const char *fmt, const char *msg,
+				      int len)
+{
+	unsigned long key = (unsigned long)fmt;
+	int i;
+
+	if (!strncmp(fmt, "%s", 2)) {
+		for (i = 0; i < len && msg[i] != ':'; i++)
+			key = key * 31 + (unsigned char)msg[i];
+	}
+	return key ? key : 1;
+}
+
+/*
+ * Count a line of @fmt into its rate, push the note of the lines
+ * suppressed in the last interval if any, log_lock is held.
+ *
+ * Return: true if the line is kept, false if suppressed
+ */
+static bool ovl_log_ratelimit(int prio, const char *fmt, const char *msg,
+			      int len)
+{
+	unsigned long key = ovl_log_rate_key(fmt, msg, len);
+	struct ovl_log_rate *rate = NULL;
+	time_t now = time(NULL);
+	int i;
+
+	for (i = 0; i < OVL_LOG_RATES; i++) {
+		rate = &log_rates[((key >> 3) + i) % OVL_LOG_RATES];
+		if (!rate->key) {
+			rate->key = key;
+			rate->start = now;
+			break;
+		}
+		if (rate->key == key)
+			break;
+	}
+	/* Too many formats, not limited */
+	if (i == OVL_LOG_RATES)
+		return true;
+
+	if (now - rate->start >= OVL_LOG_INTERVAL) {
+		if (rate->missed)
+			ovl_log_push_missed(prio, rate);
+		rate->start = now;
+		rate->count = 0;
+	}
+
+	if (rate->count++ < OVL_LOG_BURST)
+		return true;
+
+	rate->missed++;
+	snprintf(rate->last, sizeof(rate->last), "%.*s", len, msg);
+	return false;
+}
+
+static void ovl_log_emit(int prio, const char *fmt, const char *msg, int len,
+			 bool newline)
+{
+	pthread_mutex_lock(&log_lock);
+	if (!ovl_log_is_socket() || ovl_log_ratelimit(prio, fmt, msg, len))
+		ovl_log_push(prio, msg, len, newline, true);
+	else
+		log_line_seq = 0;	/* suppressed, as if written */
+	pthread_mutex_unlock(&log_lock);
+}
+
+/* Queue @len bytes of the @line from its start, @used are consumed */
+static void ovl_log_emit_line(struct ovl_log_line *line, int prio,
+			      size_t len, size_t used, bool newline)
+{
+	log_line_seq = ULONG_MAX;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	line->pending = line->start + used;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	ovl_log_emit(prio, line->fmt, line->buf + line->start, len, newline);
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	line->start = line->pending;
+}
+
+/*
+ * Format a message into the line buffer of this thread, and queue the
+ * complete lines. Messages and errors are in their own lines, as they
+ * are on stdout and stderr.
+ */
+void ovl_log_vprintf(int prio, const char *fmt, va_list args)
+{
+	struct ovl_log_line *line = &log_lines[ovl_log_is_err(prio)];
+	size_t used;
+	char *nl;
+	int ret;
+
+	if (!line->len)
+		line->fmt = fmt;
+
+	ret = vsnprintf(line->buf + line->len, OVL_LOG_LINE - line->len,
+			fmt, args);
+	if (ret > 0)
+		line->len = min(line->len + ret, (size_t)OVL_LOG_LINE - 1);
+
+	while ((nl = memchr(line->buf + line->start, '\n',
+			    line->len - line->start))) {
+		used = nl - (line->buf + line->start) + 1;
+		ovl_log_emit_line(line, prio, used - 1, used, true);
+		line->fmt = fmt;
+	}
+
+	/* Too long, cut here */
+	if (line->len == OVL_LOG_LINE - 1 && line->start < line->len)
+		ovl_log_emit_line(line, prio, line->len - line->start,
+				  line->len - line->start, true);
+
+	/* The line not ended to the front */
+	if (line->start == line->len) {
+		line->len = 0;
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+		line->start = line->pending = 0;
+	} else if (line->start) {
+		line->moving = true;
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+		memmove(line->buf, line->buf + line->start,
+			line->len - line->start);
+		line->len -= line->start;
+		line->start = line->pending = 0;
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+		line->moving = false;
+	}
+}
+
+/* Wait for all queued records written, log_lock is held */
+static void ovl_log_drain(void)
+{
+	while (__atomic_load_n(&log_written, __ATOMIC_ACQUIRE) != log_queued)
+		pthread_cond_wait(&log_space, &log_lock);
+}
+
+static void ovl_log_exit(void)
+{
+	struct ovl_log_line *line;
+	int i;
+
+	/* Lines not ended of this thread */
+	for (i = 0; i < 2; i++) {
+		line = &log_lines[i];
+		if (line->len)
+			ovl_log_emit_line(line, i ? LOG_ERR : LOG_INFO,
+					  line->len, line->len, false);
+		line->len = 0;
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+		line->start = line->pending = 0;
+	}
+
+	pthread_mutex_lock(&log_lock);
+	for (i = 0; i < OVL_LOG_RATES; i++) {
+		if (log_rates[i].missed)
+			ovl_log_push_missed(LOG_INFO, &log_rates[i]);
+	}
+	ovl_log_drain();
+	ovl_log_enabled = false;
+	pthread_mutex_unlock(&log_lock);
+
+	if (log_err)
+		print_err(_("Failed to write log:%s\n"), strerror(log_err));
+}
+
+/*
+ * Write the queued records before dying, then do the former action. The
+ * writer is given a moment to finish the records it is writing, they are
+ * skipped if it does not, or if it is this thread, never written twice.
+ * The lines not ended of this thread are written last.
+ */
+static void ovl_log_signal(int sig)
+{
+	struct timespec ts = { .tv_nsec = 1000000 };
+	struct ovl_log_line *line;
+	struct ovl_log_rec rec;
+	unsigned long seq, end;
+	size_t start;
+	int i;
+
+	end = __atomic_load_n(&log_queued, __ATOMIC_ACQUIRE);
+	for (i = 0; !log_in_writer && i < OVL_LOG_SIGNAL_WAIT; i++) {
+		if (__atomic_load_n(&log_written, __ATOMIC_ACQUIRE) ==
+		    __atomic_load_n(&log_claimed, __ATOMIC_ACQUIRE))
+			break;
+		nanosleep(&ts, NULL);
+	}
+
+	seq = __atomic_load_n(&log_claimed, __ATOMIC_ACQUIRE);
+	while (seq < end) {
+		if (!__atomic_compare_exchange_n(&log_claimed, &seq, seq + 1,
+						 false, __ATOMIC_ACQ_REL,
+						 __ATOMIC_ACQUIRE))
+			continue;
+		ovl_log_write_rec(ovl_log_rec(seq));
+		seq++;
+	}
+	ovl_log_written_to(end);
+
+	for (i = 0; i < 2; i++) {
+		line = &log_lines[i];
+		start = line->start;
+		if (line->pending > start && log_line_seq < end)
+			start = line->pending;
+		if (line->moving || start >= line->len)
+			continue;
+		ovl_log_format(&rec, i ? LOG_ERR : LOG_INFO, line->buf + start,
+			       line->len - start, true, false);
+		ovl_log_write_rec(&rec);
+	}
+
+	for (i = 0; i < sizeof(log_signals) / sizeof(log_signals[0]); i++) {
+		if (log_signals[i] == sig)
+			sigaction(sig, &log_old_actions[i], NULL);
+	}
+	raise(sig);
+}
+
+/* Records queued by the parent are written before fork */
+static void ovl_log_fork_prepare(void)
+{
+	pthread_mutex_lock(&log_lock);
+	ovl_log_drain();
+}
+
+static void ovl_log_fork_parent(void)
+{
+	pthread_mutex_unlock(&log_lock);
+}
+
+/*
+ * The writer is not copied, started again at the first record. The
+ * conds waited by the writer of the parent are not usable, init again.
+ */
+static void ovl_log_fork_child(void)
+{
+	log_writer = false;
+	log_pid = getpid();
+	memset(log_lines, 0, sizeof(log_lines));
+	pthread_cond_init(&log_ready, NULL);
+	pthread_cond_init(&log_space, NULL);
+	pthread_mutex_init(&log_lock, NULL);
+}
+
+static int ovl_log_connect(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		print_err(_("Failed to connect %s:%s\n"), path,
+			    strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Write messages by a background thread to @target: "stdout" (stdout
+ * and stderr), "syslog", "journal", or a file appended. NULL to write
+ * them at once as usual.
+ */
+int ovl_log_setup(const char *target)
+{
+	struct sigaction sa = {};
+	int i;
+
+	if (!target)
+		return 0;
+
+	if (!strcmp(target, "stdout")) {
+		log_target = OVL_LOG_STDOUT;
+	} else if (!strcmp(target, "syslog")) {
+		log_target = OVL_LOG_SYSLOG;
+		log_fd = ovl_log_connect(OVL_LOG_SYSLOG_PATH);
+	} else if (!strcmp(target, "journal")) {
+		log_target = OVL_LOG_JOURNAL;
+		log_fd = ovl_log_connect(OVL_LOG_JOURNAL_PATH);
+	} else {
+		log_target = OVL_LOG_FILE;
+		log_fd = open(target, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC,
+			      0644);
+		if (log_fd < 0)
+			print_err(_("Failed to open %s:%s\n"), target,
+				    strerror(errno));
+	}
+	if (log_target != OVL_LOG_STDOUT && log_fd < 0)
+		return -1;
+
+	if (pthread_atfork(ovl_log_fork_prepare, ovl_log_fork_parent,
+			   ovl_log_fork_child) || atexit(ovl_log_exit)) {
+		print_err(_("Failed to set up log\n"));
+		return -1;
+	}
+
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = ovl_log_signal;
+	sa.sa_flags = SA_RESETHAND | SA_NODEFER;
+	for (i = 0; i < sizeof(log_signals) / sizeof(log_signals[0]); i++)
+		sigaction(log_signals[i], &sa, &log_old_actions[i]);
+
+	fflush(stdout);
+	log_pid = getpid();
+	log_recs = smalloc(sizeof(*log_recs) * OVL_LOG_SLOTS);
+	ovl_log_enabled = true;
+	return 0;
+}
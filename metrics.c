@@ -0,0 +1,499 @@
+/*
+ * metrics.c - Save the cost of a check for monitoring
+ *
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "common.h"
+#include "lib.h"
+#include "list.h"
+#include "metrics.h"
+#include "latency.h"
+
+/*
+ * Counters of operations are 64-bit and updated atomically, as the
+ * layers and the redirect dirs could be checked by several threads.
+ * Each layer scanned in each pass records its counts, wall time and
+ * the CPU time of the scanning thread. At exit, all of them are saved
+ * into the metrics file in JSON, or in Prometheus text format if the
+ * file name ends with ".prom" (for the textfile collector), by writing
+ * a temporary file and renaming it.
+ */
+#define OVL_METRICS_PROM_SUFFIX	".prom"
+
+#define ARRAY_SIZE(a)	(sizeof(a) / sizeof((a)[0]))
+
+static const char *ovl_metric_names[OVL_METRICS] = {
+	[OVL_METRIC_FSTATAT] = "fstatat",
+	[OVL_METRIC_OPENAT] = "openat",
+	[OVL_METRIC_GETXATTR] = "getxattr",
+	[OVL_METRIC_SETXATTR] = "setxattr",
+	[OVL_METRIC_REMOVEXATTR] = "removexattr",
+	[OVL_METRIC_UNLINKAT] = "unlinkat",
+	[OVL_METRIC_MKNODAT] = "mknodat",
+	[OVL_METRIC_DIR_BYTES] = "dir_bytes",
+	[OVL_METRIC_CACHED_HIT] = "cached_hit",
+	[OVL_METRIC_CACHED_MISS] = "cached_miss",
+	[OVL_METRIC_LAYER_HIT] = "layer_hit",
+	[OVL_METRIC_LAYER_MISS] = "layer_miss",
+};
+
+/* Syscalls reported by type, the rest are not syscalls */
+#define OVL_METRIC_SYSCALLS	(OVL_METRIC_MKNODAT + 1)
+
+/* Lookup caches, each has a hit and a miss counter */
+static const struct {
+	const char *name;
+	int hit;
+	int miss;
+} ovl_metric_caches[] = {
+	{"resolve_cached", OVL_METRIC_CACHED_HIT, OVL_METRIC_CACHED_MISS},
+	{"layer_fd", OVL_METRIC_LAYER_HIT, OVL_METRIC_LAYER_MISS},
+};
+
+/* Counts of one layer in one pass */
+struct ovl_metrics_layer {
+	struct list_head list;
+	char *path;
+	int type;
+	int stack;
+	int pass;
+	struct scan_result result;
+	double wall;
+	double cpu;
+};
+
+static char *metrics_file;
+static unsigned long long metrics[OVL_METRICS];
+static double metrics_start;
+static LIST_HEAD(metrics_layers);
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double ovl_metrics_clock(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Save the metrics of this run into @file at exit */
+int ovl_metrics_setup(char *file)
+{
+	if (!file)
+		return 0;
+
+	metrics_file = file;
+	metrics_start = ovl_metrics_clock(CLOCK_MONOTONIC);
+	return 0;
+}
+
+/* Account @n of @metric */
+void ovl_metric(int metric, long long n)
+{
+	if (metrics_file)
+		__atomic_add_fetch(&metrics[metric], n, __ATOMIC_RELAXED);
+}
+
+/* Start timing the scan of a layer in this thread */
+void ovl_metrics_layer_begin(struct ovl_metrics_timer *timer)
+{
+	if (!metrics_file)
+		return;
+
+	timer->wall = ovl_metrics_clock(CLOCK_MONOTONIC);
+	timer->cpu = ovl_metrics_clock(CLOCK_THREAD_CPUTIME_ID);
+}
+
+/* Record the counts of @layer in @pass, timed from @timer */
+void ovl_metrics_layer_end(struct ovl_metrics_timer *timer,
+			   const struct ovl_layer *layer, int pass,
+			   const struct scan_result *result)
+{
+	struct ovl_metrics_layer *ml;
+
+	if (!metrics_file)
+		return;
+
+	ml = smalloc(sizeof(*ml));
+	ml->path = sstrdup(layer->path);
+	ml->type = layer->type;
+	ml->stack = layer->stack;
+	ml->pass = pass;
+	ml->result = *result;
+	ml->wall = ovl_metrics_clock(CLOCK_MONOTONIC) - timer->wall;
+	ml->cpu = ovl_metrics_clock(CLOCK_THREAD_CPUTIME_ID) - timer->cpu;
+
+	pthread_mutex_lock(&metrics_lock);
+	list_add_tail(&ml->list, &metrics_layers);
+	pthread_mutex_unlock(&metrics_lock);
+}
+
+static const char *ovl_metrics_layer_type(const struct ovl_metrics_layer *ml)
+{
+	return ml->type == OVL_UPPER ? "upper" : "lower";
+}
+
+static double ovl_metrics_rate(unsigned long long hit, unsigned long long miss)
+{
+	return hit + miss ? (double)hit / (hit + miss) : 0.0;
+}
+
+/* Print a string quoted, escape '"', '\' and control chars for @json */
+static void ovl_metrics_quote(FILE *fp, const char *str, bool json)
+{
+	const unsigned char *s;
+
+	fputc('"', fp);
+	for (s = (const unsigned char *)str; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(fp, "\\%c", *s);
+		else if (*s == '\n')
+			fputs("\\n", fp);
+		else if (*s < ' ' && json)
+			fprintf(fp, "\\u%04x", *s);
+		else
+			fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+static void ovl_metrics_json_result(FILE *fp, const struct scan_result *r)
+{
+	fprintf(fp, "\"files\": %lld, \"directories\": %lld, "
+		"\"whiteouts\": %lld, \"invalid_whiteouts\": %lld, "
+		"\"redirect_dirs\": %lld, \"invalid_redirect_dirs\": %lld, "
+		"\"missing_impure\": %lld", r->files, r->directories,
+		r->t_whiteouts, r->i_whiteouts, r->t_redirects,
+		r->i_redirects, r->m_impure);
+}
+
+static void ovl_metrics_write_json_latency(FILE *fp)
+{
+	struct ovl_latency_stat *stats;
+	struct ovl_latency_slow *slow;
+	int num;
+	int i;
+
+	num = ovl_latency_stats(&stats);
+	fprintf(fp, ",\n  \"latency\": [");
+	for (i = 0; i < num; i++) {
+		fprintf(fp, "%s\n    {\"path\": ", i ? "," : "");
+		ovl_metrics_quote(fp, stats[i].layer, true);
+		fprintf(fp, ", \"op\": \"%s\", \"count\": %llu, "
+			"\"sum_seconds\": %.9f, \"p50_seconds\": %.9f, "
+			"\"p99_seconds\": %.9f, \"p999_seconds\": %.9f, "
+			"\"max_seconds\": %.9f}", stats[i].op, stats[i].count,
+			stats[i].sum, stats[i].p50, stats[i].p99,
+			stats[i].p999, stats[i].max);
+	}
+	fprintf(fp, "%s]", num ? "\n  " : "");
+	free(stats);
+
+	num = ovl_latency_slowest(&slow);
+	fprintf(fp, ",\n  \"slowest\": [");
+	for (i = 0; i < num; i++) {
+		fprintf(fp, "%s\n    {\"path\": ", i ? "," : "");
+		ovl_metrics_quote(fp, slow[i].layer, true);
+		fprintf(fp, ", \"op\": \"%s\", \"target\": ", slow[i].op);
+		ovl_metrics_quote(fp, slow[i].path, true);
+		fprintf(fp, ", \"seconds\": %.9f}", slow[i].seconds);
+	}
+	fprintf(fp, "%s]", num ? "\n  " : "");
+	free(slow);
+}
+
+static void ovl_metrics_write_json(FILE *fp, int exit_value, double wall,
+				   const struct rusage *ru)
+{
+	struct ovl_metrics_layer *ml;
+	struct list_head *node;
+	bool first = true;
+	int i;
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "  \"exit_value\": %d,\n", exit_value);
+	fprintf(fp, "  \"wall_seconds\": %.6f,\n", wall);
+	fprintf(fp, "  \"user_seconds\": %ld.%06ld,\n",
+		(long)ru->ru_utime.tv_sec, (long)ru->ru_utime.tv_usec);
+	fprintf(fp, "  \"system_seconds\": %ld.%06ld,\n",
+		(long)ru->ru_stime.tv_sec, (long)ru->ru_stime.tv_usec);
+	fprintf(fp, "  \"max_rss_bytes\": %lld,\n",
+		(long long)ru->ru_maxrss * 1024);
+
+	fprintf(fp, "  \"syscalls\": {");
+	for (i = 0; i < OVL_METRIC_SYSCALLS; i++)
+		fprintf(fp, "%s\"%s\": %llu", i ? ", " : "",
+			ovl_metric_names[i], metrics[i]);
+	fprintf(fp, "},\n");
+	fprintf(fp, "  \"dir_bytes_read\": %llu,\n",
+		metrics[OVL_METRIC_DIR_BYTES]);
+
+	fprintf(fp, "  \"caches\": {");
+	for (i = 0; i < ARRAY_SIZE(ovl_metric_caches); i++) {
+		unsigned long long hit = metrics[ovl_metric_caches[i].hit];
+		unsigned long long miss = metrics[ovl_metric_caches[i].miss];
+
+		fprintf(fp, "%s\"%s\": {\"hits\": %llu, \"misses\": %llu, "
+			"\"hit_rate\": %.4f}", i ? ", " : "",
+			ovl_metric_caches[i].name, hit, miss,
+			ovl_metrics_rate(hit, miss));
+	}
+	fprintf(fp, "},\n");
+
+	fprintf(fp, "  \"layers\": [");
+	list_for_each(node, &metrics_layers) {
+		ml = list_entry(node, struct ovl_metrics_layer, list);
+		fprintf(fp, "%s\n    {\"layer\": \"%s\", \"stack\": %d, "
+			"\"path\": ", first ? "" : ",",
+			ovl_metrics_layer_type(ml),
+			ml->type == OVL_UPPER ? -1 : ml->stack);
+		ovl_metrics_quote(fp, ml->path, true);
+		fprintf(fp, ", \"pass\": %d, \"wall_seconds\": %.6f, "
+			"\"cpu_seconds\": %.6f, ", ml->pass, ml->wall, ml->cpu);
+		ovl_metrics_json_result(fp, &ml->result);
+		fprintf(fp, "}");
+		first = false;
+	}
+	fprintf(fp, "%s]", first ? "" : "\n  ");
+
+	if (ovl_latency_enabled())
+		ovl_metrics_write_json_latency(fp);
+	fprintf(fp, "\n}\n");
+}
+
+static void ovl_metrics_prom_head(FILE *fp, const char *name,
+				  const char *type, const char *help)
+{
+	fprintf(fp, "# HELP fsck_overlay_%s %s\n", name, help);
+	fprintf(fp, "# TYPE fsck_overlay_%s %s\n", name, type);
+}
+
+static void ovl_metrics_prom_layer(FILE *fp, const char *name,
+				   const struct ovl_metrics_layer *ml,
+				   const char *label, const char *value)
+{
+	fprintf(fp, "fsck_overlay_%s{layer=\"%s\",stack=\"%d\",path=",
+		name, ovl_metrics_layer_type(ml),
+		ml->type == OVL_UPPER ? -1 : ml->stack);
+	ovl_metrics_quote(fp, ml->path, false);
+	fprintf(fp, ",pass=\"%d\",%s=\"%s\"} ", ml->pass, label, value);
+}
+
+static void ovl_metrics_prom_op(FILE *fp, const char *name,
+				const struct ovl_latency_stat *stat)
+{
+	fprintf(fp, "fsck_overlay_%s{path=", name);
+	ovl_metrics_quote(fp, stat->layer, false);
+	fprintf(fp, ",op=\"%s\"", stat->op);
+}
+
+/* The slowest paths are left out, too many label values */
+static void ovl_metrics_write_prom_latency(FILE *fp)
+{
+	struct ovl_latency_stat *stats;
+	int num;
+	int i;
+
+	num = ovl_latency_stats(&stats);
+	ovl_metrics_prom_head(fp, "op_latency_seconds", "summary",
+			      "Latency of operations on a layer.");
+	for (i = 0; i < num; i++) {
+		ovl_metrics_prom_op(fp, "op_latency_seconds", &stats[i]);
+		fprintf(fp, ",quantile=\"0.5\"} %.9f\n", stats[i].p50);
+		ovl_metrics_prom_op(fp, "op_latency_seconds", &stats[i]);
+		fprintf(fp, ",quantile=\"0.99\"} %.9f\n", stats[i].p99);
+		ovl_metrics_prom_op(fp, "op_latency_seconds", &stats[i]);
+		fprintf(fp, ",quantile=\"0.999\"} %.9f\n", stats[i].p999);
+		ovl_metrics_prom_op(fp, "op_latency_seconds_sum", &stats[i]);
+		fprintf(fp, "} %.9f\n", stats[i].sum);
+		ovl_metrics_prom_op(fp, "op_latency_seconds_count", &stats[i]);
+		fprintf(fp, "} %llu\n", stats[i].count);
+	}
+
+	ovl_metrics_prom_head(fp, "op_latency_max_seconds", "gauge",
+			      "Slowest operation on a layer.");
+	for (i = 0; i < num; i++) {
+		ovl_metrics_prom_op(fp, "op_latency_max_seconds", &stats[i]);
+		fprintf(fp, "} %.9f\n", stats[i].max);
+	}
+	free(stats);
+}
+
+static void ovl_metrics_write_prom(FILE *fp, int exit_value, double wall,
+				   const struct rusage *ru)
+{
+	static const char *kinds[] = {
+		"files", "directories", "whiteouts", "invalid_whiteouts",
+		"redirect_dirs", "invalid_redirect_dirs", "missing_impure",
+	};
+	long long counts[ARRAY_SIZE(kinds)];
+	struct ovl_metrics_layer *ml;
+	struct list_head *node;
+	int i;
+
+	ovl_metrics_prom_head(fp, "exit_value", "gauge",
+			      "Exit value of the check.");
+	fprintf(fp, "fsck_overlay_exit_value %d\n", exit_value);
+
+	ovl_metrics_prom_head(fp, "seconds", "gauge",
+			      "Wall and CPU time of the check.");
+	fprintf(fp, "fsck_overlay_seconds{mode=\"wall\"} %.6f\n", wall);
+	fprintf(fp, "fsck_overlay_seconds{mode=\"user\"} %ld.%06ld\n",
+		(long)ru->ru_utime.tv_sec, (long)ru->ru_utime.tv_usec);
+	fprintf(fp, "fsck_overlay_seconds{mode=\"system\"} %ld.%06ld\n",
+		(long)ru->ru_stime.tv_sec, (long)ru->ru_stime.tv_usec);
+
+	ovl_metrics_prom_head(fp, "max_rss_bytes", "gauge",
+			      "Peak resident set size of the check.");
+	fprintf(fp, "fsck_overlay_max_rss_bytes %lld\n",
+		(long long)ru->ru_maxrss * 1024);
+
+	ovl_metrics_prom_head(fp, "syscalls_total", "counter",
+			      "Syscalls made by type.");
+	for (i = 0; i < OVL_METRIC_SYSCALLS; i++)
+		fprintf(fp, "fsck_overlay_syscalls_total{type=\"%s\"} %llu\n",
+			ovl_metric_names[i], metrics[i]);
+
+	ovl_metrics_prom_head(fp, "dir_read_bytes_total", "counter",
+			      "Bytes of directories read.");
+	fprintf(fp, "fsck_overlay_dir_read_bytes_total %llu\n",
+		metrics[OVL_METRIC_DIR_BYTES]);
+
+	ovl_metrics_prom_head(fp, "cache_lookups_total", "counter",
+			      "Lookups in caches by result.");
+	for (i = 0; i < ARRAY_SIZE(ovl_metric_caches); i++) {
+		fprintf(fp, "fsck_overlay_cache_lookups_total{cache=\"%s\","
+			"result=\"hit\"} %llu\n", ovl_metric_caches[i].name,
+			metrics[ovl_metric_caches[i].hit]);
+		fprintf(fp, "fsck_overlay_cache_lookups_total{cache=\"%s\","
+			"result=\"miss\"} %llu\n", ovl_metric_caches[i].name,
+			metrics[ovl_metric_caches[i].miss]);
+	}
+
+	ovl_metrics_prom_head(fp, "layer_seconds", "gauge",
+			      "Wall and CPU time to scan a layer in a pass.");
+	list_for_each(node, &metrics_layers) {
+		ml = list_entry(node, struct ovl_metrics_layer, list);
+		ovl_metrics_prom_layer(fp, "layer_seconds", ml, "mode", "wall");
+		fprintf(fp, "%.6f\n", ml->wall);
+		ovl_metrics_prom_layer(fp, "layer_seconds", ml, "mode", "cpu");
+		fprintf(fp, "%.6f\n", ml->cpu);
+	}
+
+	ovl_metrics_prom_head(fp, "layer_entries", "gauge",
+			      "Entries found in a layer in a pass by kind.");
+	list_for_each(node, &metrics_layers) {
+		ml = list_entry(node, struct ovl_metrics_layer, list);
+		counts[0] = ml->result.files;
+		counts[1] = ml->result.directories;
+		counts[2] = ml->result.t_whiteouts;
+		counts[3] = ml->result.i_whiteouts;
+		counts[4] = ml->result.t_redirects;
+		counts[5] = ml->result.i_redirects;
+		counts[6] = ml->result.m_impure;
+		for (i = 0; i < ARRAY_SIZE(kinds); i++) {
+			ovl_metrics_prom_layer(fp, "layer_entries", ml,
+					       "kind", kinds[i]);
+			fprintf(fp, "%lld\n", counts[i]);
+		}
+	}
+
+	if (ovl_latency_enabled())
+		ovl_metrics_write_prom_latency(fp);
+}
+
+/*
+ * Save the metrics into the file with the final @exit_value.
+ *
+ * Return: 0 on success, -1 otherwise
+ */
+int ovl_metrics_close(int exit_value)
+{
+	struct ovl_metrics_layer *ml;
+	struct list_head *node, *tmp;
+	struct rusage ru = {};
+	char *tmpfile = NULL;
+	size_t len;
+	double wall;
+	FILE *fp;
+	int ret = -1;
+
+	if (!metrics_file)
+		return 0;
+
+	wall = ovl_metrics_clock(CLOCK_MONOTONIC) - metrics_start;
+	getrusage(RUSAGE_SELF, &ru);
+
+	len = strlen(metrics_file) + sizeof(".tmp");
+	tmpfile = smalloc(len);
+	snprintf(tmpfile, len, "%s.tmp", metrics_file);
+
+	fp = fopen(tmpfile, "w");
+	if (!fp) {
+		print_err(_("Failed to create metrics %s:%s\n"),
+			    tmpfile, strerror(errno));
+		goto out;
+	}
+
+	len = strlen(metrics_file);
+	if (len > strlen(OVL_METRICS_PROM_SUFFIX) &&
+	    !strcmp(metrics_file + len - strlen(OVL_METRICS_PROM_SUFFIX),
+		    OVL_METRICS_PROM_SUFFIX))
+		ovl_metrics_write_prom(fp, exit_value, wall, &ru);
+	else
+		ovl_metrics_write_json(fp, exit_value, wall, &ru);
+
+	if (fflush(fp) || ferror(fp)) {
+		print_err(_("Failed to write metrics %s:%s\n"),
+			    tmpfile, strerror(errno));
+		fclose(fp);
+		unlink(tmpfile);
+		goto out;
+	}
+	fclose(fp);
+
+	/* Never expose a partial file to the collector */
+	if (rename(tmpfile, metrics_file)) {
+		print_err(_("Failed to rename metrics %s:%s\n"),
+			    metrics_file, strerror(errno));
+		unlink(tmpfile);
+		goto out;
+	}
+	ret = 0;
+out:
+	list_for_each_safe(node, tmp, &metrics_layers) {
+		ml = list_entry(node, struct ovl_metrics_layer, list);
+		list_del(&ml->list);
+		free(ml->path);
+		free(ml);
+	}
+	free(tmpfile);
+	metrics_file = NULL;
+	return ret;
+}
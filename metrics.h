@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef OVL_METRICS_H
+#define OVL_METRICS_H
+
+/* Operations counted */
+enum {
+	OVL_METRIC_FSTATAT,
+	OVL_METRIC_OPENAT,
+	OVL_METRIC_GETXATTR,
+	OVL_METRIC_SETXATTR,
+	OVL_METRIC_REMOVEXATTR,
+	OVL_METRIC_UNLINKAT,
+	OVL_METRIC_MKNODAT,
+	OVL_METRIC_DIR_BYTES,		/* bytes of dirs read */
+	OVL_METRIC_CACHED_HIT,		/* lookup done in dcache only */
+	OVL_METRIC_CACHED_MISS,
+	OVL_METRIC_LAYER_HIT,		/* layer root dir already open */
+	OVL_METRIC_LAYER_MISS,
+	OVL_METRICS,
+};
+
+/* Start time of a layer scan */
+struct ovl_metrics_timer {
+	double wall;
+	double cpu;
+};
+
+int ovl_metrics_setup(char *file);
+void ovl_metric(int metric, long long n);
+void ovl_metrics_layer_begin(struct ovl_metrics_timer *timer);
+void ovl_metrics_layer_end(struct ovl_metrics_timer *timer,
+			   const struct ovl_layer *layer, int pass,
+			   const struct scan_result *result);
+int ovl_metrics_close(int exit_value);
+
+#endif /* OVL_METRICS_H */
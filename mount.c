@@ -26,7 +26,6 @@
 #include <getopt.h>
 #include <libgen.h>
 #include <stdbool.h>
-#include <mntent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <linux/limits.h>
@@ -37,26 +36,67 @@
 #include "check.h"
 #include "mount.h"
 #include "overlayfs.h"
+#include "list.h"
+#include "hash.h"
+#include "path.h"
+#include "trace.h"
+
+/* Hash table size of dirs used by mounted overlays */
+#define OVL_MNT_SEEN_BITS	12
+
+/* Identity of an underlying dir want to check */
+struct ovl_mnt_ident {
+	struct hlist_node node;
+	dev_t dev;
+	ino_t ino;
+	int index;		/* index in the checking paths */
+};
+
+/* Dir used by mounted overlays, already checked */
+struct ovl_mnt_seen {
+	struct hlist_node node;
+	char *path;
+};
+
+struct ovl_mnt_ctx {
+	struct hlist_head *idents;	/* identities of checking dirs */
+	unsigned int ident_bits;
+	struct hlist_head seen[1 << OVL_MNT_SEEN_BITS];
+	bool *mounted;
+};
+
+/* Threads used to resolve lower directories */
+#define OVL_RESOLVE_JOBS	16
 
-struct ovl_mnt_entry {
-	char **lowerdir;
-	int lowernum;
-	char *upperdir;
-	char *workdir;
+struct ovl_resolve_ctx {
+	char **paths;		/* lower directories specified */
+	char **dirs;		/* resolved lower directories */
+	int *errs;		/* errno of each resolving */
 };
 
-/* Mount buf allocate a time */
-#define ALLOC_NUM	16
+static void ovl_resolve_lowerdir(int i, void *arg)
+{
+	struct ovl_resolve_ctx *rctx = arg;
+	char temp[PATH_MAX];
+
+	if (realpath(rctx->paths[i], temp))
+		rctx->dirs[i] = sstrdup(temp);
+	else
+		rctx->errs[i] = errno;
+}
 
-/* Resolve each lower directories and check the validity */
+/*
+ * Resolve each lower directories and check the validity. Lower dirs are
+ * resolved in parallel, because there could be hundreds of them.
+ */
 static int ovl_resolve_lowerdirs(char *loweropt, char ***lowerdir,
 				 int *lowernum)
 {
-	char temp[PATH_MAX] = {0};
+	struct ovl_resolve_ctx rctx;
 	int num;
-	char **dirs;
 	char *p;
 	int i;
+	int ret = -1;
 
 	num = ovl_split_lowerdirs(loweropt);
 	if (num > OVL_MAX_STACK) {
@@ -65,31 +105,43 @@ static int ovl_resolve_lowerdirs(char *loweropt, char ***lowerdir,
 		return -1;
 	}
 
-	dirs = smalloc(sizeof(char *) * num);
+	rctx.paths = smalloc(sizeof(char *) * num);
+	rctx.dirs = smalloc(sizeof(char *) * num);
+	rctx.errs = smalloc(sizeof(int) * num);
 
 	p = loweropt;
 	for (i = 0; i < num; i++) {
-		if (!realpath(p, temp)) {
+		rctx.paths[i] = p;
+		p = strchr(p, '\0') + 1;
+	}
+
+	run_parallel(num, OVL_RESOLVE_JOBS, ovl_resolve_lowerdir, &rctx);
+
+	for (i = 0; i < num; i++) {
+		if (rctx.errs[i]) {
 			print_err(_("Failed to resolve lowerdir:%s:%s\n"),
-				    p, strerror(errno));
-			goto err;
+				    rctx.paths[i], strerror(rctx.errs[i]));
+			goto out;
 		}
-		dirs[i] = sstrdup(temp);
-		print_debug(_("Lowerdir %u:%s\n"), i, dirs[i]);
-		p = strchr(p, '\0') + 1;
+		ovl_trace(OVL_TRACE_MOUNT, OVL_TRACE_EVENT,
+			  _("Lowerdir %u:%s\n"), i, rctx.dirs[i]);
 	}
 
-	*lowerdir = dirs;
+	*lowerdir = rctx.dirs;
 	*lowernum = num;
-
-	return 0;
-err:
-	for (i--; i >= 0; i--)
-		free(dirs[i]);
-	free(dirs);
-	*lowerdir = NULL;
-	*lowernum = 0;
-	return -1;
+	rctx.dirs = NULL;
+	ret = 0;
+out:
+	if (rctx.dirs) {
+		for (i = 0; i < num; i++)
+			free(rctx.dirs[i]);
+		free(rctx.dirs);
+		*lowerdir = NULL;
+		*lowernum = 0;
+	}
+	free(rctx.paths);
+	free(rctx.errs);
+	return ret;
 }
 
 static inline char *ovl_match_dump(const char *opt, const char *type)
@@ -121,7 +173,8 @@ int ovl_get_dirs(struct ovl_config *config, char ***lowerdir,
 			goto err_out;
 		}
 		*upperdir = sstrdup(temp);
-		print_debug(_("Upperdir: %s\n"), *upperdir);
+		ovl_trace(OVL_TRACE_MOUNT, OVL_TRACE_EVENT,
+			  _("Upperdir: %s\n"), *upperdir);
 	}
 
 	/* Resolve workdir */
@@ -132,7 +185,8 @@ int ovl_get_dirs(struct ovl_config *config, char ***lowerdir,
 			goto err_work;
 		}
 		*workdir = sstrdup(temp);
-		print_debug(_("Workdir: %s\n"), *workdir);
+		ovl_trace(OVL_TRACE_MOUNT, OVL_TRACE_EVENT,
+			  _("Workdir: %s\n"), *workdir);
 	}
 
 	/* Resolve lowerdir */
@@ -189,77 +243,208 @@ void ovl_parse_opt(char *opt, struct ovl_config *config)
 	}
 }
 
+static inline unsigned int ovl_mnt_ident_hash(dev_t dev, ino_t ino,
+					      unsigned int bits)
+{
+	return hash_64(((uint64_t)dev << 32) ^ ino, bits);
+}
+
+/* Mark the checking dirs which have the same identity with @path */
+static void ovl_mnt_match(struct ovl_mnt_ctx *ctx, const char *path)
+{
+	struct ovl_mnt_ident *ident;
+	struct ovl_mnt_seen *seen;
+	struct hlist_head *head;
+	struct hlist_node *node;
+	struct stat st;
+
+	/* FIXME: relative path is relative to the mounter's cwd, skip */
+	if (path[0] != '/')
+		return;
+
+	/* Most of lower dirs are shared between overlays, stat only once */
+	head = &ctx->seen[hash_str(path, OVL_MNT_SEEN_BITS)];
+	hlist_for_each(node, head) {
+		seen = hlist_entry(node, struct ovl_mnt_seen, node);
+		if (!strcmp(seen->path, path))
+			return;
+	}
+	seen = smalloc(sizeof(*seen));
+	seen->path = sstrdup(path);
+	hlist_add_head(&seen->node, head);
+
+	if (stat(path, &st))
+		return;
+
+	head = &ctx->idents[ovl_mnt_ident_hash(st.st_dev, st.st_ino,
+					       ctx->ident_bits)];
+	hlist_for_each(node, head) {
+		ident = hlist_entry(node, struct ovl_mnt_ident, node);
+		if (ident->dev == st.st_dev && ident->ino == st.st_ino)
+			ctx->mounted[ident->index] = true;
+	}
+}
+
 /*
- * Scan current mounted overlayfs and get used underlying directories,
- * (do not scan overlayfs mounted with relative path)
+ * Terminate the first dir of a "lowerdir=" value in mountinfo, return the
+ * next one or NULL if it is the last. The value is shown as given at mount
+ * time with '\\' escaped as "\134", so "\134:" is an escaped ':' in a dir.
  */
-static int ovl_scan_mount_init(struct ovl_mnt_entry **ovl_mnt_entries,
-			       int *ovl_mnt_count)
+static char *ovl_mnt_next_lowerdir(char *dir)
 {
-	struct ovl_mnt_entry *entries = NULL;
-	struct mntent *mnt = NULL;
-	struct ovl_config config = {0};
-	FILE *fp;
-	char *opt;
-	int allocated, i = 0;
+	char *s;
+
+	for (s = dir; *s; s++) {
+		if (!strncmp(s, "\\134", 4) && s[4]) {
+			s += 4;
+		} else if (*s == ':') {
+			*s = '\0';
+			return s + 1;
+		}
+	}
+	return NULL;
+}
 
-	fp = setmntent(MOUNT_TAB, "r");
-	if (!fp) {
-		print_err(_("Fail to setmntent %s:%s\n"),
-			    MOUNT_TAB, strerror(errno));
-		return -1;
+/* Match each underlying dir in the super options of an overlay mount */
+static void ovl_mnt_match_opts(struct ovl_mnt_ctx *ctx, char *opts)
+{
+	/* One dir for each, ':' is not a separator of lowerdir+ either */
+	static const char * const others[] = {
+		OPT_LOWERDIR_APPEND, OPT_DATADIR_APPEND, OPT_UPPERDIR,
+		OPT_WORKDIR, NULL
+	};
+	const char * const *type;
+	char *p, *dir, *next;
+
+	while ((p = ovl_next_opt(&opts)) != NULL) {
+		/* Split on unescaped ':' first, then unescape each dir */
+		if (!strncmp(p, OPT_LOWERDIR, strlen(OPT_LOWERDIR))) {
+			for (dir = p + strlen(OPT_LOWERDIR); dir; dir = next) {
+				next = ovl_mnt_next_lowerdir(dir);
+				unescapename(dir);
+				/* Drop the '\\' of an escaped ':' */
+				ovl_split_lowerdirs(dir);
+				/* Skip the empty one of "::" data layers */
+				if (*dir)
+					ovl_mnt_match(ctx, dir);
+			}
+		}
+
+		for (type = others; *type; type++) {
+			if (!strncmp(p, *type, strlen(*type))) {
+				unescapename(p);
+				ovl_mnt_match(ctx, p + strlen(*type));
+			}
+		}
 	}
+}
 
-	allocated = sizeof(struct ovl_mnt_entry) * ALLOC_NUM;
-	entries = smalloc(allocated);
+/*
+ * Parse one line of mountinfo, see proc(5):
+ * "36 35 98:0 /mnt1 /mnt2 rw,noatime master:1 - ext3 /dev/root rw,errors=continue"
+ */
+static void ovl_mnt_parse_line(struct ovl_mnt_ctx *ctx, char *line)
+{
+	char *fstype, *source, *opts;
+
+	fstype = strstr(line, " - ");
+	if (!fstype)
+		return;
+	fstype += 3;
+
+	source = strchr(fstype, ' ');
+	if (!source)
+		return;
+	*source++ = '\0';
+	if (strcmp(fstype, OVERLAY_NAME))
+		return;
+
+	opts = strchr(source, ' ');
+	if (!opts)
+		return;
+	opts++;
+	opts[strcspn(opts, "\n")] = '\0';
+
+	ovl_mnt_match_opts(ctx, opts);
+}
 
-	while ((mnt = getmntent(fp))) {
-		if (strcmp(mnt->mnt_type, OVERLAY_NAME))
-			continue;
+static void ovl_mnt_free(struct ovl_mnt_ctx *ctx)
+{
+	struct hlist_node *node, *tmp;
+	unsigned int i;
 
-		opt = sstrdup(mnt->mnt_opts);
-		ovl_parse_opt(opt, &config);
-
-		if ((config.lowerdir && config.lowerdir[0] != '/') ||
-		    (config.upperdir && config.upperdir[0] != '/') ||
-		    (config.workdir && config.workdir[0] != '/'))
-			goto next;
-
-		if (!ovl_get_dirs(&config, &entries[i].lowerdir,
-				  &entries[i].lowernum,
-				  &entries[i].upperdir,
-				  &entries[i].workdir)) {
-			i++;
-			if (i % ALLOC_NUM == 0) {
-				allocated += sizeof(struct ovl_mnt_entry) * ALLOC_NUM;
-				entries = srealloc(entries, allocated);
-			}
+	for (i = 0; i < (1U << ctx->ident_bits); i++) {
+		hlist_for_each_safe(node, tmp, &ctx->idents[i]) {
+			hlist_del(node);
+			free(hlist_entry(node, struct ovl_mnt_ident, node));
 		}
-next:
-		ovl_free_opt(&config);
-		free(opt);
 	}
+	free(ctx->idents);
 
-	*ovl_mnt_entries = entries;
-	*ovl_mnt_count = i;
+	for (i = 0; i < (1U << OVL_MNT_SEEN_BITS); i++) {
+		hlist_for_each_safe(node, tmp, &ctx->seen[i]) {
+			struct ovl_mnt_seen *seen;
 
-	endmntent(fp);
-	return 0;
+			seen = hlist_entry(node, struct ovl_mnt_seen, node);
+			hlist_del(node);
+			free(seen->path);
+			free(seen);
+		}
+	}
 }
 
-static void ovl_scan_mount_exit(struct ovl_mnt_entry *ovl_mnt_entries,
-				int ovl_mnt_count)
+/*
+ * Scan every mounted filesystem once, check each of the specified
+ * directories is used by a mounted overlay or not, and set the
+ * corresponding flag in @mounted.
+ *
+ * Dirs are compared by (st_dev, st_ino) through a hash set, so the cost
+ * is linear with the number of mounts and layers, and dirs specified by
+ * symlinks or bind mounts are also matched.
+ *
+ * FIXME: We cannot distinguish mounted directories if overlayfs was
+ *        mounted use relative path, so there may have misjudgment.
+ */
+int ovl_check_mount_paths(char **paths, int num, bool *mounted)
 {
-	int i,j;
-
-	for (i = 0; i < ovl_mnt_count; i++) {
-		for (j = 0; j < ovl_mnt_entries[i].lowernum; j++)
-			free(ovl_mnt_entries[i].lowerdir[j]);
-		free(ovl_mnt_entries[i].lowerdir);
-		free(ovl_mnt_entries[i].upperdir);
-		free(ovl_mnt_entries[i].workdir);
+	struct ovl_mnt_ctx ctx = {};
+	struct ovl_mnt_ident *ident;
+	struct stat st;
+	char *line = NULL;
+	size_t size = 0;
+	FILE *fp;
+	unsigned int i;
+
+	fp = fopen(MOUNT_INFO, "r");
+	if (!fp) {
+		print_err(_("Fail to open %s:%s\n"),
+			    MOUNT_INFO, strerror(errno));
+		return -1;
+	}
+
+	ctx.mounted = mounted;
+	ctx.ident_bits = hash_bits(num * 2);
+	ctx.idents = smalloc(sizeof(struct hlist_head) << ctx.ident_bits);
+	for (i = 0; i < num; i++) {
+		if (!paths[i] || stat(paths[i], &st))
+			continue;
+
+		ident = smalloc(sizeof(*ident));
+		ident->dev = st.st_dev;
+		ident->ino = st.st_ino;
+		ident->index = i;
+		hlist_add_head(&ident->node,
+			       &ctx.idents[ovl_mnt_ident_hash(st.st_dev,
+					st.st_ino, ctx.ident_bits)]);
 	}
-	free(ovl_mnt_entries);
+
+	while (getline(&line, &size, fp) != -1)
+		ovl_mnt_parse_line(&ctx, line);
+
+	free(line);
+	fclose(fp);
+	ovl_mnt_free(&ctx);
+	return 0;
 }
 
 /*
@@ -269,56 +454,36 @@ static void ovl_scan_mount_exit(struct ovl_mnt_entry *ovl_mnt_entries,
  *
  * Note: fsck may modify lower layers, so even match only one directory
  *       is triggered as mounted.
- * FIXME: We cannot distinguish mounted directories if overlayfs was
- *        mounted use relative path, so there may have misjudgment.
  */
 int ovl_check_mount(struct ovl_fs *ofs, bool *mounted)
 {
-	struct ovl_mnt_entry *ovl_mnt_entries = NULL;
-	int ovl_mnt_entry_count = 0;
-	char *mounted_path = NULL;
-	int i,j,k;
+	int num = ofs->lower_num + 2;
+	char **paths;
+	bool *res;
+	int i;
 	int ret;
 
-	ret = ovl_scan_mount_init(&ovl_mnt_entries, &ovl_mnt_entry_count);
-	if (ret)
-		return ret;
-
-	/* Only check hard matching */
-	for (i = 0; i < ovl_mnt_entry_count; i++) {
-		/* Check lower */
-		for (j = 0; j < ovl_mnt_entries[i].lowernum; j++) {
-			for (k = 0; k < ofs->lower_num; k++) {
-				if (!strcmp(ofs->lower_layer[k].path,
-					    ovl_mnt_entries[i].lowerdir[j])) {
-					mounted_path = ofs->lower_layer[k].path;
-					*mounted = true;
-					goto out;
-				}
-			}
-		}
+	paths = smalloc(sizeof(char *) * num);
+	res = smalloc(sizeof(bool) * num);
 
-		/* Check upper */
-		if (ofs->upper_layer.path && ovl_mnt_entries[i].upperdir &&
-		    !(strcmp(ofs->upper_layer.path, ovl_mnt_entries[i].upperdir))) {
-			mounted_path = ofs->upper_layer.path;
-			*mounted = true;
-			goto out;
-		}
+	for (i = 0; i < ofs->lower_num; i++)
+		paths[i] = ofs->lower_layer[i].path;
+	paths[i++] = ofs->upper_layer.path;
+	paths[i++] = ofs->workdir.path;
+
+	ret = ovl_check_mount_paths(paths, num, res);
+	if (ret)
+		goto out;
 
-		/* Check worker */
-		if (ofs->workdir.path && ovl_mnt_entries[i].workdir &&
-		    !(strcmp(ofs->workdir.path, ovl_mnt_entries[i].workdir))) {
-			mounted_path = ofs->workdir.path;
+	for (i = 0; i < num; i++) {
+		if (res[i]) {
+			print_info(_("WARNING: Dir %s is mounted\n"), paths[i]);
 			*mounted = true;
-			goto out;
+			break;
 		}
 	}
 out:
-	ovl_scan_mount_exit(ovl_mnt_entries, ovl_mnt_entry_count);
-
-	if (*mounted)
-		print_info(_("WARNING: Dir %s is mounted\n"), mounted_path);
-
-	return 0;
+	free(paths);
+	free(res);
+	return ret;
 }
@@ -37,6 +37,8 @@
 #define OPT_LOWERDIR "lowerdir="
 #define OPT_UPPERDIR "upperdir="
 #define OPT_WORKDIR "workdir="
+#define OPT_LOWERDIR_APPEND "lowerdir+="
+#define OPT_DATADIR_APPEND "datadir+="
 
 /* Xattr */
 #define XATTR_TRUSTED_PREFIX	"trusted."
@@ -46,6 +48,10 @@
 #define OVL_ORIGIN_XATTR	OVL_XATTR_PREFIX "origin"
 #define OVL_IMPURE_XATTR	OVL_XATTR_PREFIX "impure"
 
+/* Whiteout */
+#define WHITEOUT_DEV	0
+#define WHITEOUT_MOD	0
+
 unsigned int ovl_split_lowerdirs(char *lower);
 char *ovl_next_opt(char **s);
 
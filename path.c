@@ -162,3 +162,57 @@ char *basename2(const char *path, const char *dir)
 mismatch:
 	return (path[0] == '\0') ? (char *)dot : (char *)path;
 }
+
+/*
+ * Escape a null-terminated pathname string into one word, the same way as
+ * the kernel does in /proc/self/mountinfo: white space, control characters
+ * and backslash are replaced by the octal form "\ooo".
+ *
+ * Note: This function will alloc memory, so should free the return value
+ *       after use.
+ */
+char *escapename(const char *path)
+{
+	const unsigned char *s;
+	char *str, *d;
+
+	str = malloc(strlen(path) * 4 + 1);
+	if (!str)
+		return NULL;
+
+	for (s = (const unsigned char *)path, d = str; *s; s++) {
+		if (*s <= ' ' || *s == '\\' || *s == 0x7f) {
+			*d++ = '\\';
+			*d++ = '0' + ((*s >> 6) & 7);
+			*d++ = '0' + ((*s >> 3) & 7);
+			*d++ = '0' + (*s & 7);
+		} else {
+			*d++ = *s;
+		}
+	}
+	*d = '\0';
+	return str;
+}
+
+/*
+ * Unescape the octal form "\ooo" in a string escaped by escapename() or
+ * the kernel, in place.
+ */
+void unescapename(char *str)
+{
+	char *s, *d;
+
+	for (s = d = str; *s; s++, d++) {
+		if (s[0] == '\\' &&
+		    s[1] >= '0' && s[1] <= '3' &&
+		    s[2] >= '0' && s[2] <= '7' &&
+		    s[3] >= '0' && s[3] <= '7') {
+			*d = ((s[1] - '0') << 6) | ((s[2] - '0') << 3) |
+			     (s[3] - '0');
+			s += 3;
+		} else {
+			*d = *s;
+		}
+	}
+	*d = '\0';
+}
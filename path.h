@@ -20,5 +20,7 @@
 
 char *joinname(const char *path, const char *name);
 char *basename2(const char *path, const char *dir);
+char *escapename(const char *path);
+void unescapename(char *str);
 
 #endif /* OVL_PATH_H */
@@ -0,0 +1,926 @@
+/*
+ * plan.c - Save repairs into a plan file and apply it later
+ *
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <fnmatch.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "common.h"
+#include "lib.h"
+#include "list.h"
+#include "path.h"
+#include "mount.h"
+#include "layer.h"
+#include "repair.h"
+#include "plan.h"
+#include "trace.h"
+
+/*
+ * Plan file format, one repair per line:
+ *
+ *   <action> <layer> <path> <ino> <ctime> <xattr> <old value> <new value>
+ *
+ * @action: unlink, whiteout, setxattr or rmxattr
+ * @layer, @path: layer root dir and target path in it, octal escaped
+ * @ino, @ctime: the target when planned, 0 and 0.0 if not exist
+ * @xattr: xattr name, "-" if not a xattr repair
+ * @old value, @new value: xattr value in hex, "-" if not exist
+ *
+ * The target should be the same as when planned (same inode, ctime and
+ * old xattr value), otherwise the repair is stale and is skipped.
+ */
+#define OVL_PLAN_HEADER	"# fsck.overlay repair plan v1\n"
+
+static const char * const ovl_plan_actions[] = {
+	[OVL_REPAIR_UNLINK] = "unlink",
+	[OVL_REPAIR_WHITEOUT] = "whiteout",
+	[OVL_REPAIR_SET_XATTR] = "setxattr",
+	[OVL_REPAIR_REMOVE_XATTR] = "rmxattr",
+};
+
+#define OVL_PLAN_ACTION_MAX	(OVL_REPAIR_REMOVE_XATTR + 1)
+
+/* How to apply a plan */
+#define OVL_PLAN_APPLY		0	/* plan file saved by --plan-out */
+#define OVL_PLAN_REPLAY		1	/* intent log left by durable check */
+#define OVL_PLAN_REVIEW		2	/* repairs found, ask before apply */
+
+/* Top dirs listed at most for a group of repairs in review */
+#define OVL_PLAN_REVIEW_SUBTREES	10
+
+extern int flags;
+extern int status;
+
+static int plan_fd = -1;	/* plan file to save, -1 if not planning */
+
+/* A repair loaded from the plan file */
+struct ovl_plan_entry {
+	struct list_head list;
+	int line;
+	int type;
+	struct ovl_layer *layer;
+	char *pathname;
+	ino_t ino;
+	struct timespec ctime;
+	char *xattr;
+	char *oldval;		/* NULL if not exist */
+	size_t oldsize;
+	char *newval;		/* NULL if not exist */
+	size_t newsize;
+	struct ovl_plan_group *group;	/* review only */
+};
+
+/* Repairs of one kind in one layer, accepted or rejected together */
+struct ovl_plan_group {
+	struct list_head list;
+	int type;
+	const char *xattr;
+	struct ovl_layer *layer;
+	int num;
+	struct list_head subtrees;
+};
+
+/* Repairs of a group in one top dir (or top entry) of the layer */
+struct ovl_plan_subtree {
+	struct list_head list;
+	char *name;
+	int num;
+};
+
+/* A layer dir to apply repairs */
+struct ovl_plan_layer {
+	struct list_head list;
+	struct ovl_layer layer;
+};
+
+struct ovl_plan {
+	struct list_head entries;
+	struct list_head layers;
+	int layer_num;
+};
+
+static int ovl_plan_create_tmp(void)
+{
+	FILE *fp;
+
+	fp = tmpfile();
+	if (!fp) {
+		print_err(_("Failed to create plan:%s\n"), strerror(errno));
+		return -1;
+	}
+	/* Shared by check processes in batch mode, always append */
+	plan_fd = fcntl(fileno(fp), F_DUPFD_CLOEXEC, 0);
+	fclose(fp);
+	if (plan_fd < 0 || fcntl(plan_fd, F_SETFL, O_APPEND) ||
+	    write(plan_fd, OVL_PLAN_HEADER, strlen(OVL_PLAN_HEADER)) < 0) {
+		print_err(_("Failed to create plan:%s\n"), strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Create the plan file, repairs are saved into it instead of doing. An
+ * anonymous temporary plan is created if @file is NULL, for review.
+ */
+int ovl_plan_create(const char *file)
+{
+	if (!file)
+		return ovl_plan_create_tmp();
+
+	plan_fd = open(file, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND|O_CLOEXEC, 0644);
+	if (plan_fd < 0) {
+		print_err(_("Failed to create plan %s:%s\n"),
+			    file, strerror(errno));
+		return -1;
+	}
+	if (write(plan_fd, OVL_PLAN_HEADER, strlen(OVL_PLAN_HEADER)) < 0) {
+		print_err(_("Failed to write plan %s:%s\n"),
+			    file, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* Close the plan file, make sure it is written */
+int ovl_plan_close(void)
+{
+	int ret = 0;
+
+	if (plan_fd < 0)
+		return 0;
+
+	if (fsync(plan_fd) || close(plan_fd)) {
+		print_err(_("Failed to close plan:%s\n"), strerror(errno));
+		ret = -1;
+	}
+	plan_fd = -1;
+	return ret;
+}
+
+static char *ovl_plan_hex(const char *value, size_t size)
+{
+	char *str;
+	size_t i;
+
+	if (!value)
+		return sstrdup("-");
+
+	str = smalloc(size * 2 + 2);
+	for (i = 0; i < size; i++)
+		sprintf(str + i * 2, "%02x", (unsigned char)value[i]);
+	/* An empty value is "0x" */
+	if (!size)
+		strcpy(str, "0x");
+	return str;
+}
+
+static int ovl_plan_unhex(const char *str, char **value, size_t *size)
+{
+	size_t len = strlen(str);
+	size_t i;
+	unsigned int c;
+
+	*value = NULL;
+	*size = 0;
+	if (!strcmp(str, "-"))
+		return 0;
+	if (!strcmp(str, "0x")) {
+		*value = smalloc(1);
+		return 0;
+	}
+	if (len % 2)
+		return -1;
+
+	*value = smalloc(len / 2 + 1);
+	for (i = 0; i < len / 2; i++) {
+		if (sscanf(str + i * 2, "%2x", &c) != 1) {
+			free(*value);
+			*value = NULL;
+			return -1;
+		}
+		(*value)[i] = c;
+	}
+	*size = len / 2;
+	return 0;
+}
+
+/*
+ * Write a repair line into @fd together with the current state of the
+ * target as the precondition. Each line is written at once, so check
+ * processes in batch mode could share one file.
+ */
+int ovl_plan_write(int fd, int type, const struct ovl_layer *layer,
+		   const char *pathname, const char *xattr,
+		   const void *value, size_t size)
+{
+	char *lpath, *tpath, *oldhex, *newhex;
+	char *oldval = NULL;
+	char *line = NULL;
+	struct stat st = {0};
+	ssize_t len;
+	int ret = -1;
+
+	if (fstatat_beneath(layer->fd, pathname, &st)) {
+		if (errno != ENOENT && errno != ENOTDIR) {
+			print_err(_("Cannot stat %s: %s\n"), pathname,
+				    strerror(errno));
+			return -1;
+		}
+		memset(&st, 0, sizeof(st));
+	}
+
+	if (xattr && st.st_ino) {
+		bool exist = false;
+
+		len = get_xattr(layer->fd, pathname, xattr, &oldval, &exist);
+		if (len < 0)
+			return -1;
+		if (exist && !oldval)
+			oldval = smalloc(1);
+		oldhex = ovl_plan_hex(oldval, len);
+	} else {
+		oldhex = ovl_plan_hex(NULL, 0);
+	}
+	newhex = ovl_plan_hex(value, size);
+
+	lpath = escapename(layer->path);
+	tpath = escapename(pathname);
+
+	len = asprintf(&line, "%s %s %s %llu %lld.%09ld %s %s %s\n",
+		       ovl_plan_actions[type], lpath, tpath,
+		       (unsigned long long)st.st_ino,
+		       (long long)st.st_ctim.tv_sec, st.st_ctim.tv_nsec,
+		       xattr ? : "-", oldhex, newhex);
+	if (len < 0) {
+		print_err(_("asprintf failed:%s\n"), strerror(errno));
+		goto out;
+	}
+
+	if (write(fd, line, len) != len) {
+		print_err(_("Failed to write repair:%s\n"), strerror(errno));
+		goto out;
+	}
+	ret = 0;
+out:
+	free(line);
+	free(lpath);
+	free(tpath);
+	free(oldhex);
+	free(newhex);
+	free(oldval);
+	return ret;
+}
+
+/* Save a repair into the plan file instead of doing */
+int ovl_plan_add(int type, const struct ovl_layer *layer,
+		 const char *pathname, const char *xattr,
+		 const void *value, size_t size)
+{
+	return ovl_plan_write(plan_fd, type, layer, pathname, xattr,
+			      value, size);
+}
+
+static struct ovl_layer *ovl_plan_get_layer(struct ovl_plan *plan,
+					    const char *path)
+{
+	struct ovl_plan_layer *player;
+	struct list_head *node;
+
+	list_for_each(node, &plan->layers) {
+		player = list_entry(node, struct ovl_plan_layer, list);
+		if (!strcmp(player->layer.path, path))
+			return &player->layer;
+	}
+
+	player = smalloc(sizeof(*player));
+	player->layer.path = sstrdup(path);
+	player->layer.fd = -1;
+	list_add_tail(&player->list, &plan->layers);
+	plan->layer_num++;
+	return &player->layer;
+}
+
+static void ovl_plan_free_entry(struct ovl_plan_entry *entry)
+{
+	free(entry->pathname);
+	free(entry->xattr);
+	free(entry->oldval);
+	free(entry->newval);
+	free(entry);
+}
+
+/* Parse one line of plan file */
+static int ovl_plan_parse(struct ovl_plan *plan, char *buf, int line)
+{
+	char *action = NULL, *lpath = NULL, *tpath = NULL;
+	char *xattr = NULL, *oldhex = NULL, *newhex = NULL;
+	struct ovl_plan_entry *entry = NULL;
+	unsigned long long ino;
+	long long sec;
+	long nsec;
+	int type;
+	int ret = -1;
+
+	if (sscanf(buf, "%ms %ms %ms %llu %lld.%ld %ms %ms %ms",
+		   &action, &lpath, &tpath, &ino, &sec, &nsec,
+		   &xattr, &oldhex, &newhex) != 9)
+		goto out;
+
+	for (type = 1; type < OVL_PLAN_ACTION_MAX; type++)
+		if (!strcmp(action, ovl_plan_actions[type]))
+			break;
+	if (type == OVL_PLAN_ACTION_MAX)
+		goto out;
+
+	entry = smalloc(sizeof(*entry));
+	if (ovl_plan_unhex(oldhex, &entry->oldval, &entry->oldsize) ||
+	    ovl_plan_unhex(newhex, &entry->newval, &entry->newsize))
+		goto out;
+
+	unescapename(lpath);
+	unescapename(tpath);
+	entry->line = line;
+	entry->type = type;
+	entry->layer = ovl_plan_get_layer(plan, lpath);
+	entry->pathname = tpath;
+	tpath = NULL;
+	entry->ino = ino;
+	entry->ctime.tv_sec = sec;
+	entry->ctime.tv_nsec = nsec;
+	if (strcmp(xattr, "-")) {
+		entry->xattr = xattr;
+		xattr = NULL;
+	}
+	list_add_tail(&entry->list, &plan->entries);
+	entry = NULL;
+	ret = 0;
+out:
+	if (ret)
+		print_err(_("Plan line %d: invalid repair\n"), line);
+	if (entry)
+		ovl_plan_free_entry(entry);
+	free(action);
+	free(lpath);
+	free(tpath);
+	free(xattr);
+	free(oldhex);
+	free(newhex);
+	return ret;
+}
+
+/* Load a plan file, or the anonymous plan to review if @file is NULL */
+static int ovl_plan_load(struct ovl_plan *plan, const char *file)
+{
+	FILE *fp;
+	char *buf = NULL;
+	size_t size = 0;
+	int line = 0;
+	int ret = 0;
+
+	if (file) {
+		fp = fopen(file, "r");
+	} else {
+		int fd = fcntl(plan_fd, F_DUPFD_CLOEXEC, 0);
+
+		fp = fd < 0 ? NULL : fdopen(fd, "r");
+		if (!fp && fd >= 0)
+			close(fd);
+		if (fp)
+			rewind(fp);
+		file = "to review";
+	}
+	if (!fp) {
+		print_err(_("Failed to open plan %s:%s\n"),
+			    file, strerror(errno));
+		return -1;
+	}
+
+	while (getline(&buf, &size, fp) > 0) {
+		line++;
+		if (buf[0] == '#' || buf[0] == '\n')
+			continue;
+		ret = ovl_plan_parse(plan, buf, line);
+		if (ret)
+			break;
+	}
+
+	free(buf);
+	fclose(fp);
+	return ret;
+}
+
+/*
+ * Layers should not be mounted before any change. Checked in every mode,
+ * the overlay could be mounted while the operator is reviewing.
+ */
+static int ovl_plan_check_mounted(struct ovl_plan *plan)
+{
+	struct ovl_plan_layer *player;
+	struct list_head *node;
+	char **paths;
+	bool *mounted;
+	int i = 0;
+	int ret;
+
+	paths = smalloc(sizeof(char *) * (plan->layer_num ? : 1));
+	mounted = smalloc(sizeof(bool) * (plan->layer_num ? : 1));
+
+	list_for_each(node, &plan->layers) {
+		player = list_entry(node, struct ovl_plan_layer, list);
+		paths[i++] = player->layer.path;
+	}
+
+	ret = ovl_check_mount_paths(paths, plan->layer_num, mounted);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < plan->layer_num; i++) {
+		if (mounted[i]) {
+			print_info(_("WARNING: Dir %s is mounted\n"), paths[i]);
+			ret = -1;
+		}
+	}
+out:
+	free(paths);
+	free(mounted);
+	return ret;
+}
+
+/* Layers should not be mounted and could be opened */
+static int ovl_plan_open_layers(struct ovl_plan *plan)
+{
+	struct ovl_plan_layer *player;
+	struct list_head *node;
+	int ret;
+
+	ret = ovl_plan_check_mounted(plan);
+	if (ret)
+		return ret;
+
+	list_for_each(node, &plan->layers) {
+		player = list_entry(node, struct ovl_plan_layer, list);
+		ret = ovl_open_layer(&player->layer);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * Check the target is the same as when planned. The ctime is not checked
+ * if @strict is false, repairs logged together in one dir change the
+ * ctime of each other.
+ */
+static bool ovl_plan_valid(struct ovl_plan_entry *entry, bool strict)
+{
+	struct stat st = {0};
+	char *val = NULL;
+	bool exist = false;
+	bool valid;
+	ssize_t len;
+
+	if (fstatat_beneath(entry->layer->fd, entry->pathname, &st))
+		memset(&st, 0, sizeof(st));
+
+	if (st.st_ino != entry->ino)
+		return false;
+	if (!entry->ino)
+		return true;
+	if (strict && (st.st_ctim.tv_sec != entry->ctime.tv_sec ||
+		       st.st_ctim.tv_nsec != entry->ctime.tv_nsec))
+		return false;
+	if (!entry->xattr)
+		return true;
+
+	len = get_xattr(entry->layer->fd, entry->pathname, entry->xattr,
+			&val, &exist);
+	if (len < 0)
+		return false;
+	if (!exist || !entry->oldval)
+		valid = !exist && !entry->oldval;
+	else
+		valid = (size_t)len == entry->oldsize &&
+			!memcmp(val ? : "", entry->oldval, len);
+	free(val);
+	return valid;
+}
+
+/* Check the repair is already done, used when replaying intent log */
+static bool ovl_plan_done(struct ovl_plan_entry *entry)
+{
+	struct stat st = {0};
+	char *val = NULL;
+	bool exist = false;
+	bool done = false;
+	ssize_t len;
+
+	if (fstatat_beneath(entry->layer->fd, entry->pathname, &st))
+		return entry->type == OVL_REPAIR_UNLINK;
+
+	switch (entry->type) {
+	case OVL_REPAIR_UNLINK:
+		return st.st_ino != entry->ino;
+	case OVL_REPAIR_WHITEOUT:
+		return S_ISCHR(st.st_mode) && st.st_rdev == makedev(0, 0);
+	}
+
+	len = get_xattr(entry->layer->fd, entry->pathname, entry->xattr,
+			&val, &exist);
+	if (len < 0)
+		return false;
+	if (entry->type == OVL_REPAIR_REMOVE_XATTR)
+		done = !exist;
+	else if (exist)
+		done = (size_t)len == entry->newsize &&
+		       !memcmp(val ? : "", entry->newval, len);
+	free(val);
+	return done;
+}
+
+static int ovl_plan_queue(struct ovl_plan_entry *entry)
+{
+	switch (entry->type) {
+	case OVL_REPAIR_UNLINK:
+		return ovl_repair_unlink(entry->layer, entry->pathname);
+	case OVL_REPAIR_WHITEOUT:
+		return ovl_repair_whiteout(entry->layer, entry->pathname);
+	case OVL_REPAIR_SET_XATTR:
+		return ovl_repair_set_xattr(entry->layer, entry->pathname,
+					    entry->xattr, entry->newval,
+					    entry->newsize);
+	case OVL_REPAIR_REMOVE_XATTR:
+		return ovl_repair_remove_xattr(entry->layer, entry->pathname,
+					       entry->xattr);
+	}
+	return -1;
+}
+
+static int ovl_plan_sync_layers(struct ovl_plan *plan)
+{
+	struct ovl_plan_layer *player;
+	struct list_head *node;
+
+	list_for_each(node, &plan->layers) {
+		player = list_entry(node, struct ovl_plan_layer, list);
+		if (syncfs(player->layer.fd)) {
+			print_err(_("Failed to syncfs %s:%s\n"),
+				    player->layer.path, strerror(errno));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void ovl_plan_free(struct ovl_plan *plan)
+{
+	struct list_head *node, *tmp;
+
+	list_for_each_safe(node, tmp, &plan->entries) {
+		list_del(node);
+		ovl_plan_free_entry(list_entry(node, struct ovl_plan_entry,
+					       list));
+	}
+
+	list_for_each_safe(node, tmp, &plan->layers) {
+		struct ovl_plan_layer *player;
+
+		player = list_entry(node, struct ovl_plan_layer, list);
+		list_del(node);
+		if (player->layer.fd >= 0)
+			close(player->layer.fd);
+		free(player->layer.path);
+		free(player);
+	}
+}
+
+static struct ovl_plan_group *ovl_plan_get_group(struct list_head *groups,
+						struct ovl_plan_entry *entry)
+{
+	struct ovl_plan_group *group;
+	struct list_head *node;
+
+	list_for_each(node, groups) {
+		group = list_entry(node, struct ovl_plan_group, list);
+		if (group->type == entry->type &&
+		    group->layer == entry->layer &&
+		    !strcmp(group->xattr ? : "", entry->xattr ? : ""))
+			return group;
+	}
+
+	group = smalloc(sizeof(*group));
+	group->type = entry->type;
+	group->xattr = entry->xattr;
+	group->layer = entry->layer;
+	INIT_LIST_HEAD(&group->subtrees);
+	list_add_tail(&group->list, groups);
+	return group;
+}
+
+static void ovl_plan_add_subtree(struct ovl_plan_group *group,
+				 const char *pathname)
+{
+	struct ovl_plan_subtree *subtree;
+	struct list_head *node;
+	size_t len = strcspn(pathname, "/");
+
+	group->num++;
+	list_for_each(node, &group->subtrees) {
+		subtree = list_entry(node, struct ovl_plan_subtree, list);
+		if (strlen(subtree->name) == len &&
+		    !strncmp(subtree->name, pathname, len)) {
+			subtree->num++;
+			return;
+		}
+	}
+
+	subtree = smalloc(sizeof(*subtree));
+	subtree->name = sstrndup(pathname, len);
+	subtree->num = 1;
+	list_add_tail(&subtree->list, &group->subtrees);
+}
+
+static void ovl_plan_free_groups(struct list_head *groups)
+{
+	struct list_head *node, *tmp, *snode, *stmp;
+
+	list_for_each_safe(node, tmp, groups) {
+		struct ovl_plan_group *group;
+
+		group = list_entry(node, struct ovl_plan_group, list);
+		list_for_each_safe(snode, stmp, &group->subtrees) {
+			struct ovl_plan_subtree *subtree;
+
+			subtree = list_entry(snode, struct ovl_plan_subtree,
+					     list);
+			free(subtree->name);
+			free(subtree);
+		}
+		free(group);
+	}
+}
+
+/* Show a group of repairs with the number of repairs in each top dir */
+static void ovl_plan_show_group(struct ovl_plan_group *group, int index,
+				int num)
+{
+	struct ovl_plan_subtree *subtree;
+	struct list_head *node;
+	int shown = 0;
+
+	print_info(_("Review [%d/%d]: %s%s%s in %s, %d repairs\n"),
+		     index, num, ovl_plan_actions[group->type],
+		     group->xattr ? " " : "", group->xattr ? : "",
+		     group->layer->path, group->num);
+
+	list_for_each(node, &group->subtrees) {
+		subtree = list_entry(node, struct ovl_plan_subtree, list);
+		if (shown++ == OVL_PLAN_REVIEW_SUBTREES) {
+			print_info(_("    ...\n"));
+			break;
+		}
+		print_info(_("    %-40s %d\n"), subtree->name, subtree->num);
+	}
+}
+
+/*
+ * Check a repair is accepted by the answer. The answer is "y", "n" or
+ * a list of patterns of paths in the layer, a pattern also matches the
+ * entries below the matched dir. A pattern starts with '!' rejects the
+ * matched repairs, the last matched pattern takes effect, and repairs
+ * not matched are rejected.
+ */
+static bool ovl_plan_accept(const char *answer, const char *pathname)
+{
+	char *str = sstrdup(answer);
+	char *token, *saveptr = NULL;
+	bool accept = false;
+
+	if (!strcasecmp(answer, "y") || !strcasecmp(answer, "yes"))
+		accept = true;
+	else if (strcasecmp(answer, "n") && strcasecmp(answer, "no"))
+		for (token = strtok_r(str, " \t", &saveptr); token;
+		     token = strtok_r(NULL, " \t", &saveptr)) {
+			bool neg = (token[0] == '!');
+
+			if (!fnmatch(token + neg, pathname, FNM_LEADING_DIR))
+				accept = !neg;
+		}
+
+	free(str);
+	return accept;
+}
+
+/*
+ * Group the repairs by kind and layer, ask once for each group, and drop
+ * the rejected repairs from the plan.
+ *
+ * Return: the number of rejected repairs
+ */
+static int ovl_plan_ask(struct ovl_plan *plan)
+{
+	struct ovl_plan_entry *entry;
+	struct ovl_plan_group *group;
+	struct list_head groups;
+	struct list_head *node, *enode, *tmp;
+	char *answer = NULL;
+	size_t size = 0;
+	int num = 0, index = 0;
+	int rejected = 0;
+
+	INIT_LIST_HEAD(&groups);
+	list_for_each(node, &plan->entries) {
+		entry = list_entry(node, struct ovl_plan_entry, list);
+		entry->group = ovl_plan_get_group(&groups, entry);
+		ovl_plan_add_subtree(entry->group, entry->pathname);
+	}
+	list_for_each(node, &groups)
+		num++;
+
+	list_for_each(node, &groups) {
+		ssize_t len;
+
+		group = list_entry(node, struct ovl_plan_group, list);
+		ovl_plan_show_group(group, ++index, num);
+		print_info(_("Apply? [y/n/PATTERN...]: \n"));
+		fflush(stdout);
+
+		/* Reject all if no more answers */
+		len = getline(&answer, &size, stdin);
+		if (len < 0) {
+			answer = srealloc(answer, 2);
+			strcpy(answer, "n");
+		} else {
+			answer[strcspn(answer, "\n")] = '\0';
+			if (!answer[0])
+				strcpy(answer, "y");
+		}
+
+		list_for_each_safe(enode, tmp, &plan->entries) {
+			entry = list_entry(enode, struct ovl_plan_entry, list);
+			if (entry->group != group ||
+			    ovl_plan_accept(answer, entry->pathname))
+				continue;
+			list_del(enode);
+			ovl_plan_free_entry(entry);
+			rejected++;
+		}
+	}
+	free(answer);
+	ovl_plan_free_groups(&groups);
+	return rejected;
+}
+
+/*
+ * Apply the repairs saved in a plan file, an intent log or the plan to
+ * review. All the preconditions are validated before any change, so
+ * several repairs of one target are not taken as stale by each other.
+ * Stale and rejected repairs are skipped and left as inconsistency.
+ */
+static int ovl_plan_run(const char *file, int mode)
+{
+	bool replay = (mode == OVL_PLAN_REPLAY);
+	const char *what = replay ? "intent log" : "plan";
+	struct ovl_plan plan;
+	struct ovl_plan_entry *entry;
+	struct list_head *node, *tmp;
+	int applied = 0, stale = 0, done = 0, rejected = 0;
+	int ret;
+
+	INIT_LIST_HEAD(&plan.entries);
+	INIT_LIST_HEAD(&plan.layers);
+	plan.layer_num = 0;
+
+	ret = ovl_plan_load(&plan, file);
+	if (ret)
+		goto out;
+
+	/* Checked again after asking, just before applying */
+	if (mode == OVL_PLAN_REVIEW) {
+		ret = ovl_plan_check_mounted(&plan);
+		if (ret)
+			goto out;
+		rejected = ovl_plan_ask(&plan);
+		if (list_empty(&plan.entries))
+			goto report;
+	}
+
+	ret = ovl_plan_open_layers(&plan);
+	if (ret)
+		goto out;
+
+	list_for_each_safe(node, tmp, &plan.entries) {
+		entry = list_entry(node, struct ovl_plan_entry, list);
+		if (replay && ovl_plan_done(entry)) {
+			list_del(node);
+			ovl_plan_free_entry(entry);
+			done++;
+			continue;
+		}
+		if (ovl_plan_valid(entry, !replay))
+			continue;
+
+		print_info(_("Stale repair at %s line %d: %s \"%s\" in %s, "
+			     "skip\n"), what, entry->line,
+			     ovl_plan_actions[entry->type], entry->pathname,
+			     entry->layer->path);
+		list_del(node);
+		ovl_plan_free_entry(entry);
+		stale++;
+	}
+
+	list_for_each(node, &plan.entries) {
+		entry = list_entry(node, struct ovl_plan_entry, list);
+		ovl_trace(OVL_TRACE_REPAIR, OVL_TRACE_EVENT,
+			  _("Apply %s line %d: %s \"%s\" in %s\n"),
+			  what, entry->line, ovl_plan_actions[entry->type],
+			  entry->pathname, entry->layer->path);
+		ret = ovl_plan_queue(entry);
+		if (ret)
+			goto out;
+		applied++;
+	}
+
+	ret = ovl_repair_flush();
+	if (ret)
+		goto out;
+
+	/* Replayed repairs should be durable before dropping the log */
+	if ((replay || (flags & FL_DURABLE)) && applied) {
+		ret = ovl_plan_sync_layers(&plan);
+		if (ret)
+			goto out;
+	}
+report:
+	if (flags & FL_VERBOSE) {
+		if (mode == OVL_PLAN_REVIEW)
+			print_info(_("Review: %d repairs applied, %d rejected, "
+				     "%d stale\n"), applied, rejected, stale);
+		else
+			print_info(_("%s: %d repairs applied, %d done, "
+				     "%d stale\n"), replay ? "Intent log" : "Plan",
+				     applied, done, stale);
+	}
+	if (applied)
+		set_changed(&status);
+	if (stale || rejected)
+		set_inconsistency(&status);
+out:
+	ovl_plan_free(&plan);
+	return ret;
+}
+
+/* Apply the repairs saved in a plan file without scanning */
+int ovl_plan_apply(const char *file)
+{
+	return ovl_plan_run(file, OVL_PLAN_APPLY);
+}
+
+/* Finish the repairs logged by an interrupted durable check */
+int ovl_plan_replay(const char *file)
+{
+	return ovl_plan_run(file, OVL_PLAN_REPLAY);
+}
+
+/*
+ * Ask the operator to accept or reject the repairs found by checking in
+ * review mode, and apply the accepted ones at once.
+ */
+int ovl_plan_review(void)
+{
+	int ret;
+
+	ret = ovl_plan_run(NULL, OVL_PLAN_REVIEW);
+	close(plan_fd);
+	plan_fd = -1;
+	return ret;
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef OVL_PLAN_H
+#define OVL_PLAN_H
+
+int ovl_plan_create(const char *file);
+int ovl_plan_close(void);
+int ovl_plan_write(int fd, int type, const struct ovl_layer *layer,
+		   const char *pathname, const char *xattr,
+		   const void *value, size_t size);
+int ovl_plan_add(int type, const struct ovl_layer *layer,
+		 const char *pathname, const char *xattr,
+		 const void *value, size_t size);
+int ovl_plan_apply(const char *file);
+int ovl_plan_replay(const char *file);
+int ovl_plan_review(void);
+
+#endif /* OVL_PLAN_H */
@@ -0,0 +1,39 @@
+/*
+ * probes.c - Semaphores of the static tracepoints
+ *
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "probes.h"
+
+#ifdef OVL_SDT
+/* Raised by the tracer while a probe is attached, see probes.h */
+#define OVL_PROBE_DEFINE(name) \
+	unsigned short OVL_PROBE_SEMAPHORE(name) \
+		__attribute__ ((section (".probes")))
+
+OVL_PROBE_DEFINE(pass__begin);
+OVL_PROBE_DEFINE(pass__end);
+OVL_PROBE_DEFINE(layer__begin);
+OVL_PROBE_DEFINE(layer__end);
+OVL_PROBE_DEFINE(scan__entry);
+OVL_PROBE_DEFINE(lookup__begin);
+OVL_PROBE_DEFINE(lookup__end);
+OVL_PROBE_DEFINE(repair);
+OVL_PROBE_DEFINE(cache__hit);
+OVL_PROBE_DEFINE(cache__miss);
+#endif
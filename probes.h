@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef OVL_PROBES_H
+#define OVL_PROBES_H
+
+/*
+ * Static tracepoints (USDT) of provider "fsck_overlay" for bpftrace, perf
+ * and systemtap, e.g.:
+ *
+ *   bpftrace -e 'usdt:./fsck.overlay:fsck_overlay:lookup__end
+ *                { @ns[str(arg0)] = hist(arg4); }'
+ *
+ * They are built in if <sys/sdt.h> is found, each probe is a nop and an
+ * ELF note with a semaphore, which the tracer raises while attached. The
+ * arguments are evaluated, and the time taken, only if it is raised, so
+ * nothing is paid at run time without a tracer. Build with -DOVL_NO_SDT
+ * to leave them out.
+ *
+ * Probes and arguments (strings are char *, ns is elapsed time):
+ *   pass__begin	pass
+ *   pass__end		pass, ret
+ *   layer__begin	layer path, stack (-1 for upper), pass
+ *   layer__end		layer path, stack, pass, files + dirs, ns
+ *   scan__entry	layer path, path, fts_info, fts_level
+ *   lookup__begin	path, start stack
+ *   lookup__end	path, start stack, found stack (-1 if not), ret, ns
+ *   repair		type (OVL_REPAIR_*), path, ret, ns
+ *   cache__hit		cache ("resolve_cached" or "layer_fd"), path
+ *   cache__miss	cache, path
+ *
+ * A probe with a ns argument gets its begin time by OVL_PROBE_CLOCK(),
+ * and the ns by ovl_probe_elapsed(), 0 if not attached at the begin.
+ */
+#if !defined(OVL_NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define OVL_SDT
+#endif
+#endif
+
+#ifdef OVL_SDT
+#include <time.h>
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+/* Semaphores of the probes, defined in probes.c */
+#define OVL_PROBE_SEMAPHORE(name)	fsck_overlay_##name##_semaphore
+#define OVL_PROBE_DECLARE(name) \
+	extern unsigned short OVL_PROBE_SEMAPHORE(name) \
+		__attribute__ ((section (".probes")))
+
+OVL_PROBE_DECLARE(pass__begin);
+OVL_PROBE_DECLARE(pass__end);
+OVL_PROBE_DECLARE(layer__begin);
+OVL_PROBE_DECLARE(layer__end);
+OVL_PROBE_DECLARE(scan__entry);
+OVL_PROBE_DECLARE(lookup__begin);
+OVL_PROBE_DECLARE(lookup__end);
+OVL_PROBE_DECLARE(repair);
+OVL_PROBE_DECLARE(cache__hit);
+OVL_PROBE_DECLARE(cache__miss);
+
+/* A tracer is attached to the probe */
+#define OVL_PROBE_ENABLED(name) \
+	__builtin_expect(OVL_PROBE_SEMAPHORE(name), 0)
+
+#define OVL_PROBE1(name, a1) \
+	do { if (OVL_PROBE_ENABLED(name)) \
+		DTRACE_PROBE1(fsck_overlay, name, a1); } while (0)
+#define OVL_PROBE2(name, a1, a2) \
+	do { if (OVL_PROBE_ENABLED(name)) \
+		DTRACE_PROBE2(fsck_overlay, name, a1, a2); } while (0)
+#define OVL_PROBE3(name, a1, a2, a3) \
+	do { if (OVL_PROBE_ENABLED(name)) \
+		DTRACE_PROBE3(fsck_overlay, name, a1, a2, a3); } while (0)
+#define OVL_PROBE4(name, a1, a2, a3, a4) \
+	do { if (OVL_PROBE_ENABLED(name)) \
+		DTRACE_PROBE4(fsck_overlay, name, a1, a2, a3, a4); } while (0)
+#define OVL_PROBE5(name, a1, a2, a3, a4, a5) \
+	do { if (OVL_PROBE_ENABLED(name)) \
+		DTRACE_PROBE5(fsck_overlay, name, a1, a2, a3, a4, a5); \
+	} while (0)
+
+/* Monotonic ns for the elapsed time given to probes */
+static inline unsigned long long ovl_probe_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#define OVL_PROBE_CLOCK(name) \
+	(OVL_PROBE_ENABLED(name) ? ovl_probe_clock() : 0ULL)
+
+static inline unsigned long long ovl_probe_elapsed(unsigned long long begin)
+{
+	return begin ? ovl_probe_clock() - begin : 0;
+}
+#else
+#define OVL_PROBE_ENABLED(name)	0
+
+#define OVL_PROBE1(name, a1) \
+	do { (void)(a1); } while (0)
+#define OVL_PROBE2(name, a1, a2) \
+	do { (void)(a1); (void)(a2); } while (0)
+#define OVL_PROBE3(name, a1, a2, a3) \
+	do { (void)(a1); (void)(a2); (void)(a3); } while (0)
+#define OVL_PROBE4(name, a1, a2, a3, a4) \
+	do { (void)(a1); (void)(a2); (void)(a3); (void)(a4); } while (0)
+#define OVL_PROBE5(name, a1, a2, a3, a4, a5) \
+	do { (void)(a1); (void)(a2); (void)(a3); (void)(a4); \
+	     (void)(a5); } while (0)
+
+#define OVL_PROBE_CLOCK(name)		0ULL
+#define ovl_probe_elapsed(begin)	((void)(begin), 0ULL)
+#endif
+
+#endif /* OVL_PROBES_H */
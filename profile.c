@@ -0,0 +1,468 @@
+/*
+ * profile.c - Profile the shape of each layer while scanning
+ *
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <fts.h>
+
+#include "common.h"
+#include "lib.h"
+#include "list.h"
+#include "path.h"
+#include "overlayfs.h"
+#include "profile.h"
+
+/*
+ * With --profile, the shape of each layer is collected in the scan of
+ * pass two, which scans every layer once: histograms of the entries of
+ * each dir (fan-out), the depth and the name length of each entry, the
+ * bytes of xattrs (names and values) of each entry and the whiteouts of
+ * each dir, and the largest dirs.
+ *
+ * The time from an entry read to the next is the cost of checking the
+ * entry, summed by kind (dir, file or whiteout) for all passes, with
+ * the time of profiling itself left out. The check time of this shape
+ * without --profile is predicted by the cost of each kind.
+ */
+#define OVL_PROFILE_EXACT	16	/* values counted one by one */
+#define OVL_PROFILE_BUCKETS	48	/* then by powers of two */
+#define OVL_PROFILE_TOP		8	/* largest dirs kept */
+
+enum {
+	OVL_PROFILE_FANOUT,
+	OVL_PROFILE_DEPTH,
+	OVL_PROFILE_NAMELEN,
+	OVL_PROFILE_XATTR,
+	OVL_PROFILE_WHITEOUTS,
+	OVL_PROFILE_HISTS,
+};
+
+enum {
+	OVL_PROFILE_DIR,
+	OVL_PROFILE_FILE,
+	OVL_PROFILE_WHITEOUT,
+	OVL_PROFILE_KINDS,
+};
+
+/*
+ * Values below OVL_PROFILE_EXACT are counted in their own buckets, as
+ * most depths and names are short, and larger ones by powers of two.
+ */
+struct ovl_profile_hist {
+	long long count;
+	long long sum;
+	long long max;
+	long long buckets[OVL_PROFILE_BUCKETS];
+};
+
+struct ovl_profile_dir {
+	long long entries;
+	char *pathname;
+};
+
+/* Profile of one layer */
+struct ovl_profile_layer {
+	struct list_head list;
+	struct ovl_layer *layer;	/* could be freed before the report */
+	char *path;
+	int type;
+	int stack;
+	long long kinds[OVL_PROFILE_KINDS];	/* entries of each kind */
+	long long redirects;
+	struct ovl_profile_hist hists[OVL_PROFILE_HISTS];
+	struct ovl_profile_dir top[OVL_PROFILE_TOP];
+	unsigned long long cost[OVL_PROFILE_KINDS];	/* ns of all passes */
+};
+
+/* A layer being scanned by a thread */
+struct ovl_profile_scan {
+	struct ovl_profile_layer *pl;
+	bool shape;			/* collect the shape in this pass */
+	unsigned long long last;	/* ns the last entry was read */
+	int kind;			/* kind of the last entry */
+	int levels;
+	long long *entries;		/* entries of the dir at each level */
+	long long *whiteouts;		/* whiteouts of the dir at each level */
+	unsigned long long cost[OVL_PROFILE_KINDS];
+};
+
+static const char *ovl_profile_names[OVL_PROFILE_HISTS] = {
+	[OVL_PROFILE_FANOUT] = "fan-out",
+	[OVL_PROFILE_DEPTH] = "depth",
+	[OVL_PROFILE_NAMELEN] = "name length",
+	[OVL_PROFILE_XATTR] = "xattr bytes",
+	[OVL_PROFILE_WHITEOUTS] = "whiteouts/dir",
+};
+
+static bool profile_enabled;
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(profile_layers);
+static __thread struct ovl_profile_scan *profile_scan;
+
+static unsigned long long ovl_profile_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int ovl_profile_bucket(long long val)
+{
+	int i = OVL_PROFILE_EXACT;
+
+	if (val < OVL_PROFILE_EXACT)
+		return val;
+
+	while (i < OVL_PROFILE_BUCKETS - 1 && val >= (OVL_PROFILE_EXACT << 1 <<
+						      (i - OVL_PROFILE_EXACT)))
+		i++;
+	return i;
+}
+
+/* The least value counted in bucket @i */
+static long long ovl_profile_bucket_min(int i)
+{
+	if (i < OVL_PROFILE_EXACT)
+		return i;
+	return (long long)OVL_PROFILE_EXACT << (i - OVL_PROFILE_EXACT);
+}
+
+static void ovl_profile_add(struct ovl_profile_hist *hist, long long val)
+{
+	hist->buckets[ovl_profile_bucket(val)]++;
+	hist->count++;
+	hist->sum += val;
+	hist->max = max(hist->max, val);
+}
+
+/* Upper bound of the @pct percentile, no more than the max */
+static long long ovl_profile_pct(const struct ovl_profile_hist *hist,
+				 double pct)
+{
+	long long sum = 0;
+	int i;
+
+	for (i = 0; i < OVL_PROFILE_BUCKETS; i++) {
+		sum += hist->buckets[i];
+		if (sum >= hist->count * pct)
+			break;
+	}
+	if (i >= OVL_PROFILE_BUCKETS - 1)
+		return hist->max;
+	return min(ovl_profile_bucket_min(i + 1) - 1, hist->max);
+}
+
+/* Keep @entries of dir @pathname if it is one of the largest */
+static void ovl_profile_top(struct ovl_profile_layer *pl, long long entries,
+			    const char *pathname)
+{
+	struct ovl_profile_dir *dir = &pl->top[0];
+	int i;
+
+	for (i = 1; i < OVL_PROFILE_TOP; i++) {
+		if (pl->top[i].entries < dir->entries)
+			dir = &pl->top[i];
+	}
+	if (entries <= dir->entries)
+		return;
+
+	free(dir->pathname);
+	dir->entries = entries;
+	dir->pathname = sstrdup(pathname);
+}
+
+/* Bytes of the xattr names and values of an entry, redirect is found */
+static long long ovl_profile_xattr(const char *path, bool *redirect)
+{
+	ssize_t len, size;
+	long long bytes;
+	char *list, *name;
+
+	len = llistxattr(path, NULL, 0);
+	if (len <= 0)
+		return 0;
+
+	list = smalloc(len);
+	len = max(llistxattr(path, list, len), (ssize_t)0);
+	bytes = len;
+	for (name = list; name < list + len; name += strlen(name) + 1) {
+		size = lgetxattr(path, name, NULL, 0);
+		if (size > 0)
+			bytes += size;
+		if (!strcmp(name, OVL_REDIRECT_XATTR))
+			*redirect = true;
+	}
+	free(list);
+	return bytes;
+}
+
+/* Count the shape of an entry, into the profile of the layer */
+static void ovl_profile_shape(struct ovl_profile_scan *scan, FTSENT *ftsent,
+			      int kind)
+{
+	struct ovl_profile_layer *pl = scan->pl;
+	struct ovl_profile_hist *hists = pl->hists;
+	int level = ftsent->fts_level;
+	bool redirect = false;
+
+	if (ftsent->fts_info == FTS_DP) {
+		if (level >= scan->levels)
+			return;
+
+		ovl_profile_add(&hists[OVL_PROFILE_FANOUT],
+				scan->entries[level]);
+		ovl_profile_add(&hists[OVL_PROFILE_WHITEOUTS],
+				scan->whiteouts[level]);
+		ovl_profile_top(pl, scan->entries[level],
+				basename2(ftsent->fts_path, pl->path));
+		return;
+	}
+
+	pl->kinds[kind]++;
+	ovl_profile_add(&hists[OVL_PROFILE_DEPTH], level);
+	ovl_profile_add(&hists[OVL_PROFILE_XATTR],
+			ovl_profile_xattr(ftsent->fts_accpath, &redirect));
+	if (redirect)
+		pl->redirects++;
+
+	if (level > 0) {
+		ovl_profile_add(&hists[OVL_PROFILE_NAMELEN],
+				ftsent->fts_namelen);
+		if (level - 1 < scan->levels) {
+			scan->entries[level - 1]++;
+			if (kind == OVL_PROFILE_WHITEOUT)
+				scan->whiteouts[level - 1]++;
+		}
+	}
+
+	if (ftsent->fts_info == FTS_D) {
+		if (level >= scan->levels) {
+			scan->levels = level + 16;
+			scan->entries = srealloc(scan->entries,
+					sizeof(*scan->entries) * scan->levels);
+			scan->whiteouts = srealloc(scan->whiteouts,
+					sizeof(*scan->whiteouts) * scan->levels);
+		}
+		scan->entries[level] = 0;
+		scan->whiteouts[level] = 0;
+	}
+}
+
+/* Collect the shape of the layer if not yet */
+static struct ovl_profile_layer *ovl_profile_layer(struct ovl_layer *layer)
+{
+	struct ovl_profile_layer *pl;
+	struct list_head *node;
+
+	list_for_each(node, &profile_layers) {
+		pl = list_entry(node, struct ovl_profile_layer, list);
+		if (pl->layer == layer)
+			return pl;
+	}
+
+	pl = smalloc(sizeof(*pl));
+	pl->layer = layer;
+	pl->path = sstrdup(layer->path);
+	pl->type = layer->type;
+	pl->stack = layer->stack;
+	list_add_tail(&pl->list, &profile_layers);
+	return pl;
+}
+
+void ovl_profile_setup(bool enable)
+{
+	profile_enabled = enable;
+}
+
+/* Profile the scan of @layer in @pass in this thread */
+void ovl_profile_scan_begin(struct ovl_layer *layer, int pass)
+{
+	if (!profile_enabled)
+		return;
+
+	profile_scan = smalloc(sizeof(*profile_scan));
+	profile_scan->shape = (pass == OVL_SCAN_PASS_TWO);
+	profile_scan->kind = -1;
+
+	pthread_mutex_lock(&profile_lock);
+	profile_scan->pl = ovl_profile_layer(layer);
+	pthread_mutex_unlock(&profile_lock);
+}
+
+/* An entry is read by the scan, called for each one */
+void ovl_profile_entry(FTSENT *ftsent)
+{
+	struct ovl_profile_scan *scan = profile_scan;
+	unsigned long long now;
+	struct stat *st = ftsent->fts_statp;
+	int kind;
+
+	if (!scan)
+		return;
+
+	now = ovl_profile_now();
+	if (scan->kind >= 0)
+		scan->cost[scan->kind] += now - scan->last;
+
+	if (ftsent->fts_info == FTS_D || ftsent->fts_info == FTS_DP)
+		kind = OVL_PROFILE_DIR;
+	else if (ftsent->fts_info == FTS_DEFAULT && S_ISCHR(st->st_mode) &&
+		 st->st_rdev == WHITEOUT_DEV)
+		kind = OVL_PROFILE_WHITEOUT;
+	else
+		kind = OVL_PROFILE_FILE;
+
+	if (scan->shape)
+		ovl_profile_shape(scan, ftsent, kind);
+
+	/* The time of profiling is not a cost of the check */
+	scan->kind = kind;
+	scan->last = ovl_profile_now();
+}
+
+/* The scan in this thread ends, add its cost to the layer */
+void ovl_profile_scan_end(void)
+{
+	struct ovl_profile_scan *scan = profile_scan;
+	int k;
+
+	if (!scan)
+		return;
+
+	if (scan->kind >= 0)
+		scan->cost[scan->kind] += ovl_profile_now() - scan->last;
+
+	pthread_mutex_lock(&profile_lock);
+	for (k = 0; k < OVL_PROFILE_KINDS; k++)
+		scan->pl->cost[k] += scan->cost[k];
+	pthread_mutex_unlock(&profile_lock);
+
+	free(scan->entries);
+	free(scan->whiteouts);
+	free(scan);
+	profile_scan = NULL;
+}
+
+static void ovl_profile_report_hist(const char *name,
+				    const struct ovl_profile_hist *hist)
+{
+	char line[OVL_PROFILE_BUCKETS * 32];
+	int len = 0;
+	int i;
+
+	print_info(_("  %-14s p50 %-6lld p90 %-6lld p99 %-6lld max %-6lld "
+		     "mean %.1f\n"), name, ovl_profile_pct(hist, 0.5),
+		     ovl_profile_pct(hist, 0.9), ovl_profile_pct(hist, 0.99),
+		     hist->max, hist->count ?
+		     (double)hist->sum / hist->count : 0.0);
+
+	/* Count of each bucket by its least value */
+	for (i = 0; i < OVL_PROFILE_BUCKETS; i++) {
+		if (!hist->buckets[i])
+			continue;
+		len += snprintf(line + len, sizeof(line) - len, " %lld:%lld",
+				ovl_profile_bucket_min(i), hist->buckets[i]);
+	}
+	print_info(_("  %-14s%s\n"), "", line);
+}
+
+static double ovl_profile_us(unsigned long long ns, long long count)
+{
+	return count ? ns / 1000.0 / count : 0.0;
+}
+
+/* Print the profile of each layer, and predict the check time */
+void ovl_profile_report(void)
+{
+	struct ovl_profile_layer *pl;
+	struct ovl_profile_dir *dir;
+	struct list_head *node, *tmp;
+	unsigned long long total = 0, ns;
+	int i, j;
+
+	list_for_each_safe(node, tmp, &profile_layers) {
+		pl = list_entry(node, struct ovl_profile_layer, list);
+		if (pl->type == OVL_LOWER)
+			print_info(_("Profile of lowerdir-%d \"%s\":\n"),
+				     pl->stack, pl->path);
+		else
+			print_info(_("Profile of upperdir \"%s\":\n"),
+				     pl->path);
+
+		print_info(_("  %lld dirs, %lld files, %lld whiteouts, "
+			     "%lld redirect dirs\n"),
+			     pl->kinds[OVL_PROFILE_DIR],
+			     pl->kinds[OVL_PROFILE_FILE],
+			     pl->kinds[OVL_PROFILE_WHITEOUT], pl->redirects);
+		for (i = 0; i < OVL_PROFILE_HISTS; i++)
+			ovl_profile_report_hist(ovl_profile_names[i],
+						&pl->hists[i]);
+
+		/* Largest first */
+		print_info(_("  Largest dirs:\n"));
+		for (i = 0; i < OVL_PROFILE_TOP; i++) {
+			dir = NULL;
+			for (j = 0; j < OVL_PROFILE_TOP; j++) {
+				if (pl->top[j].pathname &&
+				    (!dir || pl->top[j].entries > dir->entries))
+					dir = &pl->top[j];
+			}
+			if (!dir)
+				break;
+			print_info(_("    %-10lld \"%s\"\n"), dir->entries,
+				     dir->pathname);
+			free(dir->pathname);
+			dir->pathname = NULL;
+		}
+
+		ns = pl->cost[OVL_PROFILE_DIR] + pl->cost[OVL_PROFILE_FILE] +
+		     pl->cost[OVL_PROFILE_WHITEOUT];
+		print_info(_("  Check cost: %.3fs, %.1fus per dir, %.1fus per "
+			     "file, %.1fus per whiteout\n"), ns / 1e9,
+			     ovl_profile_us(pl->cost[OVL_PROFILE_DIR],
+					    pl->kinds[OVL_PROFILE_DIR]),
+			     ovl_profile_us(pl->cost[OVL_PROFILE_FILE],
+					    pl->kinds[OVL_PROFILE_FILE]),
+			     ovl_profile_us(pl->cost[OVL_PROFILE_WHITEOUT],
+					    pl->kinds[OVL_PROFILE_WHITEOUT]));
+		total += ns;
+
+		list_del(node);
+		free(pl->path);
+		free(pl);
+	}
+
+	if (total)
+		print_info(_("Predicted check time without --profile: %.3fs\n"),
+			     total / 1e9);
+}
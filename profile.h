@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef OVL_PROFILE_H
+#define OVL_PROFILE_H
+
+struct _ftsent;
+
+void ovl_profile_setup(bool enable);
+void ovl_profile_scan_begin(struct ovl_layer *layer, int pass);
+void ovl_profile_entry(struct _ftsent *ftsent);
+void ovl_profile_scan_end(void);
+void ovl_profile_report(void);
+
+#endif /* OVL_PROFILE_H */
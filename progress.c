@@ -0,0 +1,294 @@
+/*
+ * progress.c - Report progress of scanning layers periodically
+ *
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/statvfs.h>
+#include <linux/limits.h>
+
+#include "common.h"
+#include "lib.h"
+#include "list.h"
+#include "progress.h"
+
+/*
+ * With -C fd, a line is written to fd every second for each layer being
+ * scanned: the pass, the layer, entries and dirs done, the rate and the
+ * ETA, and one more line when the scan of the layer ends. The scanning
+ * thread only bumps its counters, a sampler thread reads them and writes
+ * the lines, so the hot loop is not slowed by formatting and writing.
+ *
+ * The total entries of a layer are estimated by the inodes in use of its
+ * filesystem (f_files - f_ffree), which could be more than the layer if
+ * the filesystem is shared. Pass two of a layer takes the entries found
+ * by pass one instead.
+ */
+#define OVL_PROGRESS_INTERVAL	1	/* seconds */
+#define OVL_PROGRESS_LINE	(PATH_MAX + 256)
+
+/* A layer being scanned by a thread */
+struct ovl_progress_scan {
+	struct list_head list;
+	struct ovl_layer *layer;
+	int pass;
+	double start;
+	long long total;		/* estimated entries, 0 if unknown */
+	long long entries;		/* bumped by the scanning thread only */
+	long long dirs;			/* dirs done */
+};
+
+static int progress_fd = -1;		/* -1 if not reporting */
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(progress_scans);
+static bool progress_sampler;		/* sampler thread is running */
+static __thread struct ovl_progress_scan *progress_scan;
+
+static double ovl_progress_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Entries of the layer expected to be scanned in this pass */
+static long long ovl_progress_estimate(const struct ovl_layer *layer,
+				       int pass)
+{
+	struct statvfs fs;
+
+	if (pass != OVL_SCAN_PASS_ONE && layer->entries)
+		return layer->entries;
+
+	if (fstatvfs(layer->fd, &fs) || fs.f_files < fs.f_ffree)
+		return 0;
+	return fs.f_files - fs.f_ffree;
+}
+
+/* Format the progress of @scan into @buf, @done if the scan ended */
+static int ovl_progress_format(char *buf, size_t size,
+			       const struct ovl_progress_scan *scan,
+			       double now, bool done)
+{
+	const struct ovl_layer *layer = scan->layer;
+	long long entries = __atomic_load_n(&scan->entries, __ATOMIC_RELAXED);
+	long long dirs = __atomic_load_n(&scan->dirs, __ATOMIC_RELAXED);
+	double elapsed = now - scan->start;
+	double rate = elapsed > 0 ? entries / elapsed : 0;
+	long long total = done ? entries : max(scan->total, entries);
+	char name[32];
+	char eta[32];
+	long eta_secs;
+
+	if (layer->type == OVL_UPPER)
+		snprintf(name, sizeof(name), "upper layer");
+	else
+		snprintf(name, sizeof(name), "lower layer %d", layer->stack);
+
+	if (done) {
+		snprintf(eta, sizeof(eta), "done in %.1fs", elapsed);
+	} else if (scan->total > entries && rate > 0) {
+		eta_secs = (scan->total - entries) / rate;
+		snprintf(eta, sizeof(eta), "ETA %ld:%02ld:%02ld",
+			 eta_secs / 3600, eta_secs / 60 % 60, eta_secs % 60);
+	} else {
+		snprintf(eta, sizeof(eta), "ETA unknown");
+	}
+
+	return snprintf(buf, size, "Pass %d, %s %s: %lld/%lld entries, "
+			"%lld dirs, %.0f entries/s, %s\n", scan->pass, name,
+			layer->path, entries, total, dirs, rate, eta);
+}
+
+/* Write all of @buf, lines of several writers are not mixed */
+static void ovl_progress_write(const char *buf, int len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(progress_fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		buf += ret;
+		len -= ret;
+	}
+}
+
+/* Sample the counters of the scans and report them periodically */
+static void *ovl_progress_sampler(void *arg)
+{
+	struct ovl_progress_scan *scan;
+	struct list_head *node;
+	struct timespec ts;
+	char *buf = NULL;
+	size_t size = 0;
+	int len;
+
+	for (;;) {
+		ts.tv_sec = OVL_PROGRESS_INTERVAL;
+		ts.tv_nsec = 0;
+		while (nanosleep(&ts, &ts) && errno == EINTR)
+			;
+
+		/* Format under the lock, write without holding it */
+		len = 0;
+		pthread_mutex_lock(&progress_lock);
+		list_for_each(node, &progress_scans) {
+			scan = list_entry(node, struct ovl_progress_scan, list);
+			if (size - len < OVL_PROGRESS_LINE) {
+				size += OVL_PROGRESS_LINE;
+				buf = srealloc(buf, size);
+			}
+			len += ovl_progress_format(buf + len, size - len, scan,
+						   ovl_progress_now(), false);
+			len = min(len, (int)size - 1);
+		}
+		pthread_mutex_unlock(&progress_lock);
+
+		if (len)
+			ovl_progress_write(buf, len);
+	}
+	return NULL;
+}
+
+static void ovl_progress_fork_prepare(void)
+{
+	pthread_mutex_lock(&progress_lock);
+}
+
+static void ovl_progress_fork_parent(void)
+{
+	pthread_mutex_unlock(&progress_lock);
+}
+
+/* The sampler is not inherited by the check process of batch mode */
+static void ovl_progress_fork_child(void)
+{
+	INIT_LIST_HEAD(&progress_scans);
+	progress_sampler = false;
+	pthread_mutex_unlock(&progress_lock);
+}
+
+/* Report progress into @fd, 0 for stdout as e2fsck, -1 to not report */
+int ovl_progress_setup(int fd)
+{
+	if (fd < 0)
+		return 0;
+
+	if (fd == 0)
+		fd = STDOUT_FILENO;
+	if (fcntl(fd, F_GETFD) < 0) {
+		print_err(_("Invalid progress fd %d:%s\n"), fd,
+			    strerror(errno));
+		return -1;
+	}
+
+	progress_fd = fd;
+	if (pthread_atfork(ovl_progress_fork_prepare, ovl_progress_fork_parent,
+			   ovl_progress_fork_child)) {
+		print_err(_("Failed to register fork handlers\n"));
+		return -1;
+	}
+	return 0;
+}
+
+/* Report the progress of scanning @layer in @pass in this thread */
+void ovl_progress_scan_begin(struct ovl_layer *layer, int pass)
+{
+	pthread_t thread;
+
+	if (progress_fd < 0)
+		return;
+
+	progress_scan = smalloc(sizeof(*progress_scan));
+	progress_scan->layer = layer;
+	progress_scan->pass = pass;
+	progress_scan->total = ovl_progress_estimate(layer, pass);
+	progress_scan->start = ovl_progress_now();
+
+	pthread_mutex_lock(&progress_lock);
+	list_add_tail(&progress_scan->list, &progress_scans);
+	if (!progress_sampler &&
+	    !pthread_create(&thread, NULL, ovl_progress_sampler, NULL)) {
+		pthread_detach(thread);
+		progress_sampler = true;
+	}
+	pthread_mutex_unlock(&progress_lock);
+}
+
+/*
+ * An entry is scanned, called for each entry, only the scanning thread
+ * writes the counters so no atomic add is needed.
+ */
+void ovl_progress_entry(void)
+{
+	if (!progress_scan)
+		return;
+
+	__atomic_store_n(&progress_scan->entries, progress_scan->entries + 1,
+			 __ATOMIC_RELAXED);
+}
+
+/* All entries of a dir are scanned */
+void ovl_progress_dir(void)
+{
+	if (!progress_scan)
+		return;
+
+	__atomic_store_n(&progress_scan->dirs, progress_scan->dirs + 1,
+			 __ATOMIC_RELAXED);
+}
+
+/* The scan in this thread ends, report it and keep its entries */
+void ovl_progress_scan_end(void)
+{
+	char buf[OVL_PROGRESS_LINE];
+	int len;
+
+	if (!progress_scan)
+		return;
+
+	pthread_mutex_lock(&progress_lock);
+	list_del(&progress_scan->list);
+	pthread_mutex_unlock(&progress_lock);
+
+	len = ovl_progress_format(buf, sizeof(buf), progress_scan,
+				  ovl_progress_now(), true);
+	ovl_progress_write(buf, min(len, (int)sizeof(buf) - 1));
+
+	if (progress_scan->pass == OVL_SCAN_PASS_ONE)
+		progress_scan->layer->entries = progress_scan->entries;
+	free(progress_scan);
+	progress_scan = NULL;
+}
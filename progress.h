@@ -0,0 +1,28 @@
+/*
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef OVL_PROGRESS_H
+#define OVL_PROGRESS_H
+
+int ovl_progress_setup(int fd);
+void ovl_progress_scan_begin(struct ovl_layer *layer, int pass);
+void ovl_progress_entry(void);
+void ovl_progress_dir(void);
+void ovl_progress_scan_end(void);
+
+#endif /* OVL_PROGRESS_H */
@@ -0,0 +1,408 @@
+/*
+ * repair.c - Queue and apply repairs of underlying layers
+ *
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+
+#include "common.h"
+#include "lib.h"
+#include "path.h"
+#include "overlayfs.h"
+#include "repair.h"
+#include "plan.h"
+#include "journal.h"
+#include "metrics.h"
+#include "latency.h"
+#include "probes.h"
+#include "trace.h"
+#include "findings.h"
+
+extern int flags;
+
+/* Repairs queued at most, apply them if the queue is full */
+#define OVL_REPAIR_BATCH	4096
+
+/* A repair checked and confirmed but not applied yet */
+struct ovl_repair {
+	int type;		/* OVL_REPAIR_* */
+	int dirfd;		/* layer root dir fd */
+	char *dir;		/* parent dir, relative to layer root */
+	char *name;		/* target name in parent dir */
+	const char *xattr;	/* xattr name, xattr repair only */
+	char *value;		/* xattr value, could be NULL */
+	size_t size;		/* size of xattr value */
+	unsigned int seq;	/* queued order */
+	struct ovl_finding *finding;	/* written when applied */
+};
+
+static const char *ovl_repair_names[] = {
+	[OVL_REPAIR_UNLINK]		= "unlink",
+	[OVL_REPAIR_WHITEOUT]		= "whiteout",
+	[OVL_REPAIR_SET_XATTR]		= "setxattr",
+	[OVL_REPAIR_REMOVE_XATTR]	= "removexattr",
+};
+
+static struct ovl_repair *repair_queue;
+static int repair_num;
+static unsigned int repair_seq;
+/*
+ * Repairs queued in the upper layer ([0]) or the lower layer i ([i + 1])
+ * and the layers below it, which are walked by lookups from there.
+ */
+static unsigned int repair_walk_seq[OVL_MAX_STACK + 1];
+static pthread_mutex_t repair_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int ovl_repair_do_flush(void);
+
+/* Index of @layer in repair_walk_seq, -1 if not looked up */
+static int ovl_repair_walk_index(const struct ovl_layer *layer)
+{
+	if (layer->type == OVL_UPPER)
+		return 0;
+	if (layer->type == OVL_LOWER && layer->stack < OVL_MAX_STACK)
+		return layer->stack + 1;
+	return -1;
+}
+
+static int ovl_repair_add(int type, const struct ovl_layer *layer,
+			  const char *pathname, const char *xattr,
+			  const void *value, size_t size)
+{
+	struct ovl_repair *repair;
+	const char *p;
+	int ret = 0;
+	int i;
+
+	/* Passes could be pipelined, queue and flush one at a time */
+	pthread_mutex_lock(&repair_lock);
+
+	/* Only save into the plan file if planning */
+	if (flags & FL_PLAN) {
+		ret = ovl_plan_add(type, layer, pathname, xattr, value, size);
+		ovl_finding_done(ovl_finding_take(), ret ? "none" : "planned",
+				 ret ? errno : 0);
+		goto out;
+	}
+
+	/* Make room first, the repair is neither logged nor queued if failed */
+	if (!repair_queue) {
+		repair_queue = smalloc(sizeof(*repair) * OVL_REPAIR_BATCH);
+	} else if (repair_num == OVL_REPAIR_BATCH && ovl_repair_do_flush()) {
+		ovl_finding_done(ovl_finding_take(), "none", errno);
+		ret = -1;
+		goto out;
+	}
+
+	/* Log it before doing if durable */
+	if (ovl_journal_log(type, layer, pathname, xattr, value, size)) {
+		ovl_finding_done(ovl_finding_take(), "none", errno);
+		ret = -1;
+		goto out;
+	}
+
+	repair = &repair_queue[repair_num++];
+	repair->type = type;
+	repair->dirfd = layer->fd;
+
+	p = strrchr(pathname, '/');
+	if (p) {
+		repair->dir = sstrndup(pathname, p - pathname);
+		repair->name = sstrdup(p + 1);
+	} else {
+		repair->dir = sstrdup(".");
+		repair->name = sstrdup(pathname);
+	}
+
+	repair->xattr = xattr;
+	repair->value = NULL;
+	repair->size = size;
+	if (value) {
+		repair->value = smalloc(size);
+		memcpy(repair->value, value, size);
+	}
+	repair->seq = repair_seq++;
+	repair->finding = ovl_finding_take();
+
+	/* Lookups from this layer and the layers above could change */
+	for (i = ovl_repair_walk_index(layer); i >= 0; i--)
+		__atomic_add_fetch(&repair_walk_seq[i], 1, __ATOMIC_RELAXED);
+out:
+	pthread_mutex_unlock(&repair_lock);
+	return ret;
+}
+
+/*
+ * Number of repairs queued so far in @layer and the lower layers below
+ * it, a change means the targets of lookups from @layer may change.
+ */
+unsigned int ovl_repair_seq(const struct ovl_layer *layer)
+{
+	int i = ovl_repair_walk_index(layer);
+
+	return i < 0 ? 0 : __atomic_load_n(&repair_walk_seq[i],
+					   __ATOMIC_RELAXED);
+}
+
+/* Remove a target, e.g. an orphan whiteout */
+int ovl_repair_unlink(const struct ovl_layer *layer, const char *pathname)
+{
+	return ovl_repair_add(OVL_REPAIR_UNLINK, layer, pathname,
+			      NULL, NULL, 0);
+}
+
+/* Create a whiteout */
+int ovl_repair_whiteout(const struct ovl_layer *layer, const char *pathname)
+{
+	return ovl_repair_add(OVL_REPAIR_WHITEOUT, layer, pathname,
+			      NULL, NULL, 0);
+}
+
+/* Set or replace an xattr */
+int ovl_repair_set_xattr(const struct ovl_layer *layer, const char *pathname,
+			 const char *xattr, const void *value, size_t size)
+{
+	return ovl_repair_add(OVL_REPAIR_SET_XATTR, layer, pathname,
+			      xattr, value, size);
+}
+
+/* Remove an xattr */
+int ovl_repair_remove_xattr(const struct ovl_layer *layer,
+			    const char *pathname, const char *xattr)
+{
+	return ovl_repair_add(OVL_REPAIR_REMOVE_XATTR, layer, pathname,
+			      xattr, NULL, 0);
+}
+
+/*
+ * Sort repairs by layer and parent dir, so each dir is opened only once
+ * and entries of one dir are modified together. Repairs of one dir keep
+ * the queued order, a later repair may depend on an earlier one.
+ */
+static int ovl_repair_cmp(const void *a, const void *b)
+{
+	const struct ovl_repair *ra = a, *rb = b;
+	int ret;
+
+	if (ra->dirfd != rb->dirfd)
+		return ra->dirfd < rb->dirfd ? -1 : 1;
+	ret = strcmp(ra->dir, rb->dir);
+	if (ret)
+		return ret;
+	return ra->seq < rb->seq ? -1 : 1;
+}
+
+static int ovl_repair_xattr(int pfd, struct ovl_repair *repair,
+			    const char *pathname)
+{
+	unsigned long long start;
+	int fd;
+	int ret;
+
+	ovl_metric(OVL_METRIC_OPENAT, 1);
+	start = ovl_latency_start();
+	fd = openat(pfd, repair->name, O_CLOEXEC|O_NONBLOCK|O_NOFOLLOW|O_RDONLY);
+	ovl_latency(repair->dirfd, OVL_LATENCY_OPENAT, start, pathname);
+	if (fd < 0) {
+		print_err(_("Failed to openat %s: %s\n"),
+			    pathname, strerror(errno));
+		return -1;
+	}
+
+	if (repair->type == OVL_REPAIR_REMOVE_XATTR) {
+		ovl_metric(OVL_METRIC_REMOVEXATTR, 1);
+		start = ovl_latency_start();
+		ret = fremovexattr(fd, repair->xattr);
+		ovl_latency(repair->dirfd, OVL_LATENCY_REMOVEXATTR, start,
+			    pathname);
+		if (ret)
+			print_err(_("Cannot fremovexattr %s %s: %s\n"),
+				    pathname, repair->xattr, strerror(errno));
+		goto out;
+	}
+
+	ovl_metric(OVL_METRIC_SETXATTR, 1);
+	start = ovl_latency_start();
+	ret = fsetxattr(fd, repair->xattr, repair->value, repair->size,
+			XATTR_CREATE);
+	if (ret && errno == EEXIST) {
+		ovl_metric(OVL_METRIC_SETXATTR, 1);
+		ret = fsetxattr(fd, repair->xattr, repair->value,
+				repair->size, XATTR_REPLACE);
+	}
+	ovl_latency(repair->dirfd, OVL_LATENCY_SETXATTR, start, pathname);
+	if (ret)
+		print_err(_("Cannot fsetxattr %s %s: %s\n"), pathname,
+			    repair->xattr, strerror(errno));
+out:
+	close(fd);
+	return ret;
+}
+
+/* Apply one repair in the opened parent dir */
+static int ovl_repair_apply(int pfd, struct ovl_repair *repair)
+{
+	char *pathname = joinname(repair->dir, repair->name);
+	unsigned long long begin = OVL_PROBE_CLOCK(repair);
+	unsigned long long start;
+	int ret = 0;
+
+	ovl_trace(OVL_TRACE_REPAIR, OVL_TRACE_EVENT, _("Repair %d: %s\n"),
+		  repair->type, pathname);
+
+	switch (repair->type) {
+	case OVL_REPAIR_UNLINK:
+		ovl_metric(OVL_METRIC_UNLINKAT, 1);
+		start = ovl_latency_start();
+		ret = unlinkat(pfd, repair->name, 0);
+		ovl_latency(repair->dirfd, OVL_LATENCY_UNLINKAT, start,
+			    pathname);
+		if (ret)
+			print_err(_("Cannot unlink %s: %s\n"), pathname,
+				    strerror(errno));
+		break;
+	case OVL_REPAIR_WHITEOUT:
+		ovl_metric(OVL_METRIC_MKNODAT, 1);
+		start = ovl_latency_start();
+		ret = mknodat(pfd, repair->name, S_IFCHR | WHITEOUT_MOD,
+			      makedev(0, 0));
+		ovl_latency(repair->dirfd, OVL_LATENCY_MKNODAT, start,
+			    pathname);
+		if (ret)
+			print_err(_("Cannot mknod %s:%s\n"), pathname,
+				    strerror(errno));
+		break;
+	case OVL_REPAIR_SET_XATTR:
+	case OVL_REPAIR_REMOVE_XATTR:
+		ret = ovl_repair_xattr(pfd, repair, pathname);
+		break;
+	}
+
+	ovl_finding_done(repair->finding, ovl_repair_names[repair->type],
+			 ret ? errno : 0);
+	repair->finding = NULL;
+	OVL_PROBE4(repair, repair->type, pathname, ret,
+		   ovl_probe_elapsed(begin));
+	free(pathname);
+	return ret;
+}
+
+static void ovl_repair_free(struct ovl_repair *repair)
+{
+	/* Dropped after a failure, not applied */
+	ovl_finding_done(repair->finding, "none", 0);
+	free(repair->dir);
+	free(repair->name);
+	free(repair->value);
+}
+
+/* Open the parent dir of a repair, the layer root dir is already open */
+static int ovl_repair_open_dir(struct ovl_repair *repair)
+{
+	unsigned long long start;
+	int fd;
+
+	if (!strcmp(repair->dir, "."))
+		return repair->dirfd;
+
+	ovl_metric(OVL_METRIC_OPENAT, 1);
+	start = ovl_latency_start();
+	fd = openat(repair->dirfd, repair->dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	ovl_latency(repair->dirfd, OVL_LATENCY_OPENAT, start, repair->dir);
+	if (fd < 0)
+		print_err(_("Failed to openat %s: %s\n"),
+			    repair->dir, strerror(errno));
+	return fd;
+}
+
+/*
+ * Apply all the queued repairs grouped by parent dir. Stop at the first
+ * failure, the rest are dropped.
+ *
+ * Return: 0 on success, -1 otherwise
+ */
+static int ovl_repair_do_flush(void)
+{
+	struct ovl_repair *group = NULL;
+	int pfd = -1;
+	int ret = 0;
+	int i;
+
+	if (!repair_num)
+		return 0;
+
+	/* The logged repairs should be durable before any of them is done */
+	ret = ovl_journal_sync();
+
+	qsort(repair_queue, repair_num, sizeof(struct ovl_repair),
+	      ovl_repair_cmp);
+
+	for (i = 0; i < repair_num && !ret; i++) {
+		struct ovl_repair *repair = &repair_queue[i];
+
+		/* Open the parent dir once for all its entries */
+		if (!group || group->dirfd != repair->dirfd ||
+		    strcmp(group->dir, repair->dir)) {
+			if (group && pfd != group->dirfd)
+				close(pfd);
+			group = NULL;
+			pfd = ovl_repair_open_dir(repair);
+			if (pfd < 0) {
+				ret = -1;
+				break;
+			}
+			group = repair;
+		}
+
+		ret = ovl_repair_apply(pfd, repair);
+	}
+
+	if (group && pfd != group->dirfd)
+		close(pfd);
+
+	for (i = 0; i < repair_num; i++)
+		ovl_repair_free(&repair_queue[i]);
+	repair_num = 0;
+	return ret;
+}
+
+/* Apply all the queued repairs, could be called by any pass */
+int ovl_repair_flush(void)
+{
+	int ret;
+
+	pthread_mutex_lock(&repair_lock);
+	ret = ovl_repair_do_flush();
+	pthread_mutex_unlock(&repair_lock);
+	return ret;
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef OVL_REPAIR_H
+#define OVL_REPAIR_H
+
+/* Repair types */
+#define OVL_REPAIR_UNLINK		1
+#define OVL_REPAIR_WHITEOUT		2
+#define OVL_REPAIR_SET_XATTR		3
+#define OVL_REPAIR_REMOVE_XATTR		4
+
+/*
+ * Queue repairs found by checks, they are applied later by
+ * ovl_repair_flush() grouped by parent dir, or saved into the plan file
+ * if planning.
+ */
+int ovl_repair_unlink(const struct ovl_layer *layer, const char *pathname);
+int ovl_repair_whiteout(const struct ovl_layer *layer, const char *pathname);
+int ovl_repair_set_xattr(const struct ovl_layer *layer, const char *pathname,
+			 const char *xattr, const void *value, size_t size);
+int ovl_repair_remove_xattr(const struct ovl_layer *layer,
+			    const char *pathname, const char *xattr);
+int ovl_repair_flush(void);
+unsigned int ovl_repair_seq(const struct ovl_layer *layer);
+
+#endif /* OVL_REPAIR_H */
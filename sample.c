@@ -0,0 +1,280 @@
+/*
+ * sample.c - Estimate inconsistency of a layer by random sampling
+ *
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <math.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "lib.h"
+#include "path.h"
+#include "throttle.h"
+#include "watch.h"
+#include "metrics.h"
+#include "latency.h"
+#include "sample.h"
+
+/*
+ * Each probe walks down from the layer root to a leaf dir, at each dir
+ * it goes into one subdir chosen at random, weighted by the number of
+ * subdirs of the subdir (st_nlink - 1) as a hint of its subtree size.
+ * All entries of each dir on the path are checked. Weighted by the
+ * inverse probability to reach the dir (Horvitz-Thompson), the counts
+ * found in the dirs on the path give an unbiased estimate of the totals
+ * of the layer. The estimates of all probes are averaged, and the 95%
+ * confidence interval is given by their variance.
+ *
+ * Dirs near the root are on most paths, so the dirs read are kept in a
+ * tree and each dir is read and checked only once.
+ */
+#define SAMPLE_Z95	1.96
+
+/* A dir read by probes */
+struct sample_node {
+	char *pathname;			/* relative to layer root */
+	bool read;			/* entries are read and checked */
+	int nsub;
+	struct sample_node **subs;	/* subdirs */
+	double *weights;		/* weight of each subdir */
+	double wsum;
+	double count[SAMPLE_KINDS];	/* found in this dir (no iterate) */
+};
+
+static struct sample_node *sample_new_node(char *pathname)
+{
+	struct sample_node *node = smalloc(sizeof(*node));
+
+	node->pathname = pathname;
+	return node;
+}
+
+static void sample_free_node(struct sample_node *node)
+{
+	int i;
+
+	for (i = 0; i < node->nsub; i++)
+		sample_free_node(node->subs[i]);
+	free(node->subs);
+	free(node->weights);
+	free(node->pathname);
+	free(node);
+}
+
+static void sample_count(double *count, const struct scan_result *result,
+			 int sign)
+{
+	count[SAMPLE_FILES] += sign * result->files;
+	count[SAMPLE_DIRECTORIES] += sign * result->directories;
+	count[SAMPLE_T_WHITEOUTS] += sign * result->t_whiteouts;
+	count[SAMPLE_I_WHITEOUTS] += sign * result->i_whiteouts;
+	count[SAMPLE_T_REDIRECTS] += sign * result->t_redirects;
+	count[SAMPLE_I_REDIRECTS] += sign * result->i_redirects;
+}
+
+/* Check one entry of a dir the same way as scan_dir() */
+static int sample_check_entry(struct scan_ctx *sctx,
+			      struct scan_operations *sop,
+			      struct sample_node *node, const char *name,
+			      struct stat *st)
+{
+	char *pathname = joinname(node->pathname, name);
+	int ret = 0;
+
+	sctx->pathname = pathname;
+	sctx->filename = name;
+	sctx->st = st;
+
+	if (S_ISDIR(st->st_mode)) {
+		sctx->result.directories++;
+		if (sop->redirect)
+			ret = sop->redirect(sctx);
+		if (ret)
+			goto out;
+
+		node->subs = srealloc(node->subs, sizeof(*node->subs) *
+				      (node->nsub + 1));
+		node->weights = srealloc(node->weights,
+					 sizeof(*node->weights) *
+					 (node->nsub + 1));
+		node->subs[node->nsub] = sample_new_node(pathname);
+		node->weights[node->nsub] = max((double)st->st_nlink - 1, 1.0);
+		node->wsum += node->weights[node->nsub++];
+		return 0;
+	} else if (S_ISREG(st->st_mode)) {
+		sctx->result.files++;
+	} else if (!S_ISLNK(st->st_mode) && sop->whiteout) {
+		ret = sop->whiteout(sctx);
+	}
+out:
+	free(pathname);
+	return ret;
+}
+
+/* Read and check all entries of a dir */
+static int sample_read_node(struct scan_ctx *sctx, struct scan_operations *sop,
+			    struct sample_node *node)
+{
+	unsigned long long start;
+	struct dirent *de;
+	struct stat st;
+	DIR *dir;
+	int ret = 0;
+	int fd;
+
+	ovl_metric(OVL_METRIC_OPENAT, 1);
+	start = ovl_latency_start();
+	fd = openat(sctx->layer->fd, node->pathname,
+		    O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+	ovl_latency(sctx->layer->fd, OVL_LATENCY_OPENAT, start,
+		    node->pathname);
+	if (fd < 0 || !(dir = fdopendir(fd))) {
+		print_err(_("Failed to open %s in %s:%s\n"), node->pathname,
+			    sctx->layer->path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	sample_count(node->count, &sctx->result, -1);
+	while ((de = readdir(dir))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+
+		ovl_throttle(1);
+		if (!ovl_watch_progress(node->pathname))
+			break;
+		ovl_metric(OVL_METRIC_FSTATAT, 1);
+		start = ovl_latency_start();
+		ret = fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW);
+		ovl_latency(sctx->layer->fd, OVL_LATENCY_FSTATAT, start,
+			    node->pathname);
+		if (ret) {
+			if (errno == ENOENT) {
+				ret = 0;
+				continue;
+			}
+			print_err(_("Failed to stat %s/%s:%s\n"),
+				    node->pathname, de->d_name, strerror(errno));
+			ret = -1;
+			break;
+		}
+
+		ret = sample_check_entry(sctx, sop, node, de->d_name, &st);
+		if (ret)
+			break;
+	}
+	sample_count(node->count, &sctx->result, 1);
+	closedir(dir);
+
+	node->read = true;
+	return ret;
+}
+
+/* Walk down from the root, return the estimate of this probe in @est */
+static int sample_probe(struct scan_ctx *sctx, struct scan_operations *sop,
+			struct sample_node *root, double *est, int *reads)
+{
+	struct sample_node *node = root;
+	double weight = 1.0;
+	double r;
+	int i, k;
+
+	/* The root dir itself */
+	est[SAMPLE_DIRECTORIES] += 1;
+
+	for (;;) {
+		if (!node->read) {
+			if (sample_read_node(sctx, sop, node))
+				return -1;
+			(*reads)++;
+		}
+
+		for (k = 0; k < SAMPLE_KINDS; k++)
+			est[k] += weight * node->count[k];
+
+		if (!node->nsub)
+			return 0;
+
+		/* Go into a subdir, weighted by its size */
+		r = drand48() * node->wsum;
+		for (i = 0; i < node->nsub - 1; i++) {
+			r -= node->weights[i];
+			if (r < 0)
+				break;
+		}
+		weight *= node->wsum / node->weights[i];
+		node = node->subs[i];
+	}
+}
+
+/*
+ * Estimate the counts of a layer by @probes random walks, the callbacks
+ * of @sop are invoked for entries of the dirs walked through as by
+ * scan_dir(), and exact counts of them are in sctx->result.
+ */
+int sample_dir(struct scan_ctx *sctx, struct scan_operations *sop,
+	       int probes, struct sample_result *result)
+{
+	struct sample_node *root = sample_new_node(sstrdup("."));
+	double sum[SAMPLE_KINDS] = {0}, sumsq[SAMPLE_KINDS] = {0};
+	int ret = 0;
+	int i, k;
+
+	memset(result, 0, sizeof(*result));
+	sctx->result.directories++;
+	for (i = 0; i < probes; i++) {
+		double est[SAMPLE_KINDS] = {0};
+
+		ret = sample_probe(sctx, sop, root, est, &result->dirs);
+		if (ret)
+			goto out;
+
+		for (k = 0; k < SAMPLE_KINDS; k++) {
+			sum[k] += est[k];
+			sumsq[k] += est[k] * est[k];
+		}
+	}
+
+	result->probes = probes;
+	for (k = 0; k < SAMPLE_KINDS; k++) {
+		double var = 0;
+
+		result->mean[k] = sum[k] / probes;
+		if (probes > 1)
+			var = (sumsq[k] - probes * result->mean[k] *
+			       result->mean[k]) / (probes - 1);
+		result->ci[k] = SAMPLE_Z95 * sqrt(max(var, 0.0) / probes);
+	}
+out:
+	sample_free_node(root);
+	return ret;
+}
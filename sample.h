@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef OVL_SAMPLE_H
+#define OVL_SAMPLE_H
+
+/* Kinds of counts estimated by sampling */
+enum {
+	SAMPLE_FILES,
+	SAMPLE_DIRECTORIES,
+	SAMPLE_T_WHITEOUTS,
+	SAMPLE_I_WHITEOUTS,
+	SAMPLE_T_REDIRECTS,
+	SAMPLE_I_REDIRECTS,
+	SAMPLE_KINDS,
+};
+
+/* Estimated counts of a layer */
+struct sample_result {
+	int probes;
+	int dirs;			/* dirs read */
+	double mean[SAMPLE_KINDS];	/* estimated total */
+	double ci[SAMPLE_KINDS];	/* half width of 95% interval */
+};
+
+int sample_dir(struct scan_ctx *sctx, struct scan_operations *sop,
+	       int probes, struct sample_result *result);
+
+#endif /* OVL_SAMPLE_H */
@@ -0,0 +1,448 @@
+/*
+ * shard.c - Split checking of one overlay into independent shards
+ *
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+
+#include "common.h"
+#include "lib.h"
+#include "path.h"
+#include "list.h"
+#include "hash.h"
+#include "shard.h"
+
+/*
+ * Entries down to the shard depth are owned by the shard selected by the
+ * hash of their path, the same in each layer, and entries below them go
+ * with them. Dirs above the depth are entered by all shards, but only
+ * checked by their owners, and the owner of a dir also counts the
+ * impurities of all its entries to check its impure xattr. The root dir
+ * is owned by the first shard.
+ *
+ * Redirect dirs in one shard may point to origins in another, so the
+ * valid redirect dirs found are saved in the result file of each shard,
+ * and the duplicate ones among shards are found when merging.
+ */
+#define OVL_SHARD_HEADER	"# fsck.overlay shard result v1\n"
+
+extern int flags;
+extern int status;
+
+/* A valid redirect dir found by a shard */
+struct ovl_shard_redirect {
+	struct list_head list;
+	char *pathname;
+	int dirtype;
+	int stack;
+	char *origin;
+	int ostack;
+	int shard;
+};
+
+static int shard_index = -1;	/* 0 based, -1 if not sharded */
+static int shard_num;
+static int shard_depth = 1;
+static const char *shard_file;	/* result file to save, NULL if not */
+static char *shard_layers;	/* escaped layer paths of the overlay */
+static struct scan_result shard_scan;
+static LIST_HEAD(shard_redirects);
+
+/* Parse "I/N[:DEPTH]", I is 1 based */
+int ovl_shard_setup(const char *spec, const char *file)
+{
+	int index, num, depth = 1;
+	char end;
+
+	if (!spec)
+		return 0;
+
+	if ((sscanf(spec, "%d/%d%c", &index, &num, &end) != 2 &&
+	     (sscanf(spec, "%d/%d:%d%c", &index, &num, &depth, &end) != 3)) ||
+	    num < 1 || index < 1 || index > num || depth < 1) {
+		print_info(_("Invalid shard %s\n"), spec);
+		return -1;
+	}
+
+	shard_index = index - 1;
+	shard_num = num;
+	shard_depth = depth;
+	shard_file = file;
+	return 0;
+}
+
+bool ovl_shard_enabled(void)
+{
+	return shard_index >= 0;
+}
+
+/* Is the entry of @pathname at @level checked by this shard */
+bool ovl_shard_mine(int level, const char *pathname)
+{
+	if (shard_index < 0 || level > shard_depth)
+		return true;
+	if (level == 0)
+		return shard_index == 0;
+	return hash_str(pathname, 32) % shard_num == shard_index;
+}
+
+/* Is a dir at @level entered by all shards */
+bool ovl_shard_shared(int level)
+{
+	return level < shard_depth;
+}
+
+/* Keep the result of this shard and the layers checked */
+void ovl_shard_result(const struct ovl_fs *ofs,
+		      const struct scan_result *result)
+{
+	size_t len;
+	char *path;
+	int i;
+
+	if (!shard_file)
+		return;
+
+	shard_scan = *result;
+
+	path = escapename(ofs->upper_layer.path ? : "-");
+	shard_layers = sstrdup(path);
+	free(path);
+	for (i = 0; i < ofs->lower_num; i++) {
+		path = escapename(ofs->lower_layer[i].path);
+		len = strlen(shard_layers);
+		shard_layers = srealloc(shard_layers, len + strlen(path) + 2);
+		sprintf(shard_layers + len, " %s", path);
+		free(path);
+	}
+}
+
+static void ovl_shard_add(struct list_head *head, const char *pathname,
+			  int dirtype, int stack, const char *origin,
+			  int ostack, int shard)
+{
+	struct ovl_shard_redirect *new = smalloc(sizeof(*new));
+
+	new->pathname = sstrdup(pathname);
+	new->dirtype = dirtype;
+	new->stack = stack;
+	new->origin = sstrdup(origin);
+	new->ostack = ostack;
+	new->shard = shard;
+	list_add_tail(&new->list, head);
+}
+
+/* Keep a valid redirect dir found by this shard */
+void ovl_shard_redirect(const char *pathname, int dirtype, int stack,
+			const char *origin, int ostack)
+{
+	if (!shard_file)
+		return;
+
+	ovl_shard_add(&shard_redirects, pathname, dirtype, stack,
+		      origin, ostack, shard_index);
+}
+
+static void ovl_shard_free(struct list_head *head)
+{
+	struct ovl_shard_redirect *entry;
+	struct list_head *node, *tmp;
+
+	list_for_each_safe(node, tmp, head) {
+		entry = list_entry(node, struct ovl_shard_redirect, list);
+		list_del_init(node);
+		free(entry->pathname);
+		free(entry->origin);
+		free(entry);
+	}
+}
+
+/* Save the result of this shard with the final status @st */
+int ovl_shard_close(int st)
+{
+	const struct scan_result *r = &shard_scan;
+	struct ovl_shard_redirect *entry;
+	struct list_head *node;
+	char *path, *origin;
+	FILE *fp;
+	int ret = 0;
+
+	if (!shard_file || !shard_layers)
+		goto out;
+
+	fp = fopen(shard_file, "w");
+	if (!fp) {
+		print_err(_("Failed to create shard result %s:%s\n"),
+			    shard_file, strerror(errno));
+		ret = -1;
+		goto out;
+	}
+
+	fprintf(fp, OVL_SHARD_HEADER);
+	fprintf(fp, "shard %d %d %d\n", shard_index + 1, shard_num,
+		shard_depth);
+	fprintf(fp, "layers %s\n", shard_layers);
+	fprintf(fp, "status %d\n", st);
+	fprintf(fp, "result %lld %lld %lld %lld %lld %lld %lld\n",
+		r->files, r->directories, r->t_whiteouts, r->i_whiteouts,
+		r->t_redirects, r->i_redirects, r->m_impure);
+
+	list_for_each(node, &shard_redirects) {
+		entry = list_entry(node, struct ovl_shard_redirect, list);
+		path = escapename(entry->pathname);
+		origin = escapename(entry->origin);
+		fprintf(fp, "redirect %d %d %d %s %s\n", entry->dirtype,
+			entry->stack, entry->ostack, path, origin);
+		free(path);
+		free(origin);
+	}
+
+	if (fflush(fp) || ferror(fp)) {
+		print_err(_("Failed to write shard result %s:%s\n"),
+			    shard_file, strerror(errno));
+		ret = -1;
+	}
+	fclose(fp);
+out:
+	ovl_shard_free(&shard_redirects);
+	free(shard_layers);
+	shard_layers = NULL;
+	return ret;
+}
+
+/* Merging state */
+struct ovl_shard_merge {
+	int num;			/* shards, 0 if not known yet */
+	int depth;
+	char *layers;
+	bool *seen;
+	struct scan_result result;
+	struct list_head redirects;
+	int redirect_num;
+};
+
+static int ovl_shard_parse(struct ovl_shard_merge *merge, const char *file,
+			   char *buf, int *shard)
+{
+	struct scan_result *r = &merge->result;
+	struct scan_result one = {0};
+	char *path = NULL, *origin = NULL;
+	int index, num, depth;
+	int dirtype, stack, ostack;
+	int ret = 0;
+	int st;
+
+	buf[strcspn(buf, "\n")] = '\0';
+
+	if (sscanf(buf, "shard %d %d %d", &index, &num, &depth) == 3) {
+		if (*shard >= 0 || num < 1 || index < 1 || index > num)
+			return -1;
+		if (!merge->num) {
+			merge->num = num;
+			merge->depth = depth;
+			merge->seen = smalloc(sizeof(bool) * num);
+		} else if (num != merge->num || depth != merge->depth) {
+			print_info(_("Shard %s is not split as others\n"),
+				     file);
+			return -1;
+		}
+		if (merge->seen[index - 1]) {
+			print_info(_("Shard %d/%d is given twice\n"),
+				     index, num);
+			return -1;
+		}
+		merge->seen[index - 1] = true;
+		*shard = index - 1;
+	} else if (!strncmp(buf, "layers ", 7)) {
+		if (!merge->layers) {
+			merge->layers = sstrdup(buf + 7);
+		} else if (strcmp(merge->layers, buf + 7)) {
+			print_info(_("Shard %s is not of the same overlay\n"),
+				     file);
+			return -1;
+		}
+	} else if (sscanf(buf, "status %d", &st) == 1) {
+		status |= st;
+	} else if (sscanf(buf, "result %lld %lld %lld %lld %lld %lld %lld",
+			  &one.files, &one.directories, &one.t_whiteouts,
+			  &one.i_whiteouts, &one.t_redirects,
+			  &one.i_redirects, &one.m_impure) == 7) {
+		r->files += one.files;
+		r->directories += one.directories;
+		r->t_whiteouts += one.t_whiteouts;
+		r->i_whiteouts += one.i_whiteouts;
+		r->t_redirects += one.t_redirects;
+		r->i_redirects += one.i_redirects;
+		r->m_impure += one.m_impure;
+	} else if (*shard >= 0 &&
+		   sscanf(buf, "redirect %d %d %d %ms %ms", &dirtype,
+			  &stack, &ostack, &path, &origin) == 5) {
+		unescapename(path);
+		unescapename(origin);
+		ovl_shard_add(&merge->redirects, path, dirtype, stack,
+			      origin, ostack, *shard);
+		merge->redirect_num++;
+	} else {
+		ret = -1;
+	}
+
+	free(path);
+	free(origin);
+	return ret;
+}
+
+static int ovl_shard_load(struct ovl_shard_merge *merge, const char *file)
+{
+	char *buf = NULL;
+	size_t size = 0;
+	int shard = -1;
+	int line = 0;
+	int ret = 0;
+	FILE *fp;
+
+	fp = fopen(file, "r");
+	if (!fp) {
+		print_err(_("Failed to open shard result %s:%s\n"),
+			    file, strerror(errno));
+		return -1;
+	}
+
+	while (getline(&buf, &size, fp) > 0) {
+		line++;
+		if (line == 1 && strcmp(buf, OVL_SHARD_HEADER)) {
+			print_info(_("%s is not a shard result\n"), file);
+			ret = -1;
+			break;
+		}
+		if (buf[0] == '#' || buf[0] == '\n')
+			continue;
+		ret = ovl_shard_parse(merge, file, buf, &shard);
+		if (ret) {
+			print_info(_("Invalid line %d in shard result %s\n"),
+				     line, file);
+			break;
+		}
+	}
+	if (!ret && shard < 0) {
+		print_info(_("%s is not a shard result\n"), file);
+		ret = -1;
+	}
+
+	free(buf);
+	fclose(fp);
+	return ret;
+}
+
+static int ovl_shard_cmp(const void *a, const void *b)
+{
+	const struct ovl_shard_redirect *ra = *(struct ovl_shard_redirect **)a;
+	const struct ovl_shard_redirect *rb = *(struct ovl_shard_redirect **)b;
+
+	if (ra->ostack != rb->ostack)
+		return ra->ostack - rb->ostack;
+	return strcmp(ra->origin, rb->origin);
+}
+
+static void ovl_shard_print_dir(const struct ovl_shard_redirect *entry)
+{
+	if (entry->dirtype == OVL_UPPER)
+		print_info(_("\"%s\" in upperdir (shard %d)"),
+			     entry->pathname, entry->shard + 1);
+	else
+		print_info(_("\"%s\" in lowerdir-%d (shard %d)"),
+			     entry->pathname, entry->stack, entry->shard + 1);
+}
+
+/*
+ * Find redirect dirs in different shards point to the same origin, they
+ * are not found by any shard alone.
+ */
+static void ovl_shard_check_redirects(struct ovl_shard_merge *merge)
+{
+	struct ovl_shard_redirect **sorted;
+	struct list_head *node;
+	int i = 0;
+
+	if (!merge->redirect_num)
+		return;
+
+	sorted = smalloc(sizeof(*sorted) * merge->redirect_num);
+	list_for_each(node, &merge->redirects)
+		sorted[i++] = list_entry(node, struct ovl_shard_redirect, list);
+	qsort(sorted, merge->redirect_num, sizeof(*sorted), ovl_shard_cmp);
+
+	for (i = 1; i < merge->redirect_num; i++) {
+		if (ovl_shard_cmp(&sorted[i - 1], &sorted[i]))
+			continue;
+
+		print_info(_("Duplicate redirect directory: "));
+		ovl_shard_print_dir(sorted[i]);
+		print_info(_(" and "));
+		ovl_shard_print_dir(sorted[i - 1]);
+		print_info(_("\n"));
+
+		merge->result.i_redirects++;
+		set_inconsistency(&status);
+	}
+	free(sorted);
+}
+
+/* Merge the result files of all shards of one overlay */
+int ovl_shard_merge(char *files[], int num)
+{
+	struct ovl_shard_merge merge = {0};
+	struct scan_result *r = &merge.result;
+	int ret = 0;
+	int i;
+
+	INIT_LIST_HEAD(&merge.redirects);
+
+	for (i = 0; i < num; i++) {
+		ret = ovl_shard_load(&merge, files[i]);
+		if (ret)
+			goto out;
+	}
+
+	for (i = 0; i < merge.num; i++) {
+		if (!merge.seen[i]) {
+			print_info(_("Result of shard %d/%d is missing\n"),
+				     i + 1, merge.num);
+			ret = -1;
+			goto out;
+		}
+	}
+
+	ovl_shard_check_redirects(&merge);
+
+	print_info(_("Merge %d shards: %lld directories, %lld files, "
+		     "%lld/%lld whiteouts, %lld/%lld redirect dirs "
+		     "%lld missing impure\n"), merge.num,
+		     r->directories, r->files,
+		     r->i_whiteouts, r->t_whiteouts,
+		     r->i_redirects, r->t_redirects,
+		     r->m_impure);
+out:
+	ovl_shard_free(&merge.redirects);
+	free(merge.seen);
+	free(merge.layers);
+	return ret;
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef OVL_SHARD_H
+#define OVL_SHARD_H
+
+#include <stdbool.h>
+
+int ovl_shard_setup(const char *spec, const char *file);
+bool ovl_shard_enabled(void);
+bool ovl_shard_mine(int level, const char *pathname);
+bool ovl_shard_shared(int level);
+void ovl_shard_result(const struct ovl_fs *ofs,
+		      const struct scan_result *result);
+void ovl_shard_redirect(const char *pathname, int dirtype, int stack,
+			const char *origin, int ostack);
+int ovl_shard_close(int st);
+int ovl_shard_merge(char *files[], int num);
+
+#endif /* OVL_SHARD_H */
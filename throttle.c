@@ -0,0 +1,241 @@
+/*
+ * throttle.c - Limit the rate of scanning and back off on I/O pressure
+ *
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "lib.h"
+#include "throttle.h"
+
+/*
+ * Each metadata operation (an entry scanned or a target looked up) takes
+ * a token from a token bucket, which is refilled at the current limit.
+ * Once per window, the "some avg10" stall of /proc/pressure/io is read:
+ * the limit is halved if it is above the threshold, and grows back if it
+ * is below half of the threshold. Without a rate, the limit is a factor
+ * of the peak rate reached when not throttled.
+ */
+#define OVL_PSI_IO		"/proc/pressure/io"
+#define OVL_THROTTLE_WINDOW	1.0	/* seconds to adjust limit */
+#define OVL_THROTTLE_BURST	0.1	/* seconds of tokens could burst */
+#define OVL_THROTTLE_MIN_FACTOR	(1.0 / 64)
+#define OVL_THROTTLE_MIN_RATE	10.0
+
+extern int flags;
+
+struct ovl_throttle {
+	bool enabled;
+	double rate;		/* max ops/sec set by user, 0 if unlimited */
+	double pressure;	/* io stall % to back off, 0 if not adaptive */
+	double factor;		/* (0, 1], shrunk on pressure */
+	double limit;		/* current ops/sec, 0 if unlimited */
+	double peak;		/* max ops/sec reached when not throttled */
+	double tokens;		/* negative if in debt */
+	double last;		/* last refill time */
+	double start;		/* first operation time */
+	double win_start;	/* start of this window */
+	unsigned long long win_ops;
+	unsigned long long ops;	/* total operations */
+	double stall;		/* last io stall % read */
+	pthread_mutex_t lock;
+};
+
+static struct ovl_throttle throttle = {
+	.factor = 1.0,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static double ovl_throttle_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Read "some avg10" of io pressure in percent, -1 if not available */
+static double ovl_throttle_read_psi(void)
+{
+	FILE *fp;
+	double avg10 = -1;
+
+	fp = fopen(OVL_PSI_IO, "r");
+	if (!fp)
+		return -1;
+	if (fscanf(fp, "some avg10=%lf", &avg10) != 1)
+		avg10 = -1;
+	fclose(fp);
+	return avg10;
+}
+
+/*
+ * Setup the throttle, @rate is the max ops/sec and @pressure is the io
+ * stall percent to back off, 0 means no limit for each.
+ */
+int ovl_throttle_setup(double rate, double pressure)
+{
+	if (!rate && !pressure)
+		return 0;
+
+	if (pressure && ovl_throttle_read_psi() < 0) {
+		print_info(_("IO pressure is not available in %s, "
+			     "not adaptive\n"), OVL_PSI_IO);
+		pressure = 0;
+	}
+
+	throttle.enabled = rate || pressure;
+	throttle.rate = rate;
+	throttle.pressure = pressure;
+	throttle.limit = rate;
+	return 0;
+}
+
+/*
+ * Share the rate among @jobs check processes running at the same time in
+ * batch mode.
+ */
+void ovl_throttle_share(int jobs)
+{
+	if (!throttle.enabled || jobs <= 1)
+		return;
+
+	throttle.rate /= jobs;
+	throttle.limit = throttle.rate * throttle.factor;
+}
+
+/* Adjust the limit by io pressure at the end of each window */
+static void ovl_throttle_adjust(double now)
+{
+	double elapsed = now - throttle.win_start;
+	double measured = throttle.win_ops / elapsed;
+	double factor = throttle.factor;
+
+	if (throttle.factor == 1.0 && measured > throttle.peak)
+		throttle.peak = measured;
+
+	if (throttle.pressure) {
+		throttle.stall = ovl_throttle_read_psi();
+		if (throttle.stall > throttle.pressure)
+			factor = max(factor / 2, OVL_THROTTLE_MIN_FACTOR);
+		else if (throttle.stall >= 0 &&
+			 throttle.stall < throttle.pressure / 2)
+			factor = min(factor * 2, 1.0);
+	}
+
+	if (factor != throttle.factor) {
+		throttle.factor = factor;
+		if (throttle.rate)
+			throttle.limit = throttle.rate * factor;
+		else if (factor < 1.0)
+			throttle.limit = max(throttle.peak * factor,
+					     OVL_THROTTLE_MIN_RATE);
+		else
+			throttle.limit = 0;
+
+		if (flags & FL_VERBOSE)
+			print_info(_("Throttle: io pressure %.1f%%, "
+				     "%.0f ops/s, limit %.0f ops/s\n"),
+				     throttle.stall, measured, throttle.limit);
+	}
+
+	throttle.win_start = now;
+	throttle.win_ops = 0;
+}
+
+/* Account @ops operations, and wait if run out of the rate */
+void ovl_throttle(int ops)
+{
+	double now, wait = 0;
+	struct timespec ts;
+
+	if (!throttle.enabled)
+		return;
+
+	pthread_mutex_lock(&throttle.lock);
+	now = ovl_throttle_now();
+	if (!throttle.start) {
+		throttle.start = throttle.last = throttle.win_start = now;
+		throttle.tokens = throttle.limit * OVL_THROTTLE_BURST;
+	}
+
+	throttle.ops += ops;
+	throttle.win_ops += ops;
+	if (now - throttle.win_start >= OVL_THROTTLE_WINDOW)
+		ovl_throttle_adjust(now);
+
+	if (throttle.limit) {
+		throttle.tokens += (now - throttle.last) * throttle.limit;
+		throttle.tokens = min(throttle.tokens,
+				      max(throttle.limit * OVL_THROTTLE_BURST,
+					  1.0));
+		throttle.tokens -= ops;
+		if (throttle.tokens < 0)
+			wait = -throttle.tokens / throttle.limit;
+	}
+	throttle.last = now;
+	pthread_mutex_unlock(&throttle.lock);
+
+	if (wait > 0) {
+		ts.tv_sec = (time_t)wait;
+		ts.tv_nsec = (wait - ts.tv_sec) * 1e9;
+		while (nanosleep(&ts, &ts) && errno == EINTR)
+			;
+	}
+}
+
+/* Scale the number of workers by io pressure */
+int ovl_throttle_jobs(int jobs)
+{
+	double now;
+
+	if (!throttle.enabled || !throttle.pressure)
+		return jobs;
+
+	pthread_mutex_lock(&throttle.lock);
+	now = ovl_throttle_now();
+	if (!throttle.start)
+		throttle.start = throttle.last = throttle.win_start = now;
+	else if (now - throttle.win_start >= OVL_THROTTLE_WINDOW)
+		ovl_throttle_adjust(now);
+	jobs = max((int)(jobs * throttle.factor), 1);
+	pthread_mutex_unlock(&throttle.lock);
+	return jobs;
+}
+
+/* Show the rate achieved */
+void ovl_throttle_report(void)
+{
+	double elapsed;
+
+	if (!throttle.enabled || !(flags & FL_VERBOSE) || !throttle.start)
+		return;
+
+	elapsed = ovl_throttle_now() - throttle.start;
+	print_info(_("Throttle: %llu ops in %.1fs, %.0f ops/s achieved, "
+		     "limit %.0f ops/s\n"), throttle.ops, elapsed,
+		     elapsed > 0 ? throttle.ops / elapsed : 0.0,
+		     throttle.limit);
+}
@@ -0,0 +1,28 @@
+/*
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef OVL_THROTTLE_H
+#define OVL_THROTTLE_H
+
+int ovl_throttle_setup(double rate, double pressure);
+void ovl_throttle_share(int jobs);
+void ovl_throttle(int ops);
+int ovl_throttle_jobs(int jobs);
+void ovl_throttle_report(void);
+
+#endif /* OVL_THROTTLE_H */
@@ -0,0 +1,354 @@
+/*
+ * trace.c - Trace records of each thread in a ring buffer
+ *
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <time.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "trace.h"
+
+/*
+ * With --trace, the messages of the traced categories are recorded into
+ * a ring buffer of the thread, the oldest are overwritten. A thread only
+ * writes its own ring without lock, and each record has a sequence
+ * number, so a reader skips the records being written. Rings are never
+ * freed, the ring of an exited thread is taken by the next new thread.
+ *
+ * The rings are dumped to stderr on SIGUSR1, on a fatal signal and at
+ * exit, with write(2) only so it could be done in a signal handler. If a
+ * category is not traced, the only cost is a branch, the arguments of
+ * ovl_trace() are not evaluated.
+ */
+#define OVL_TRACE_RING		1024	/* records kept of each thread */
+#define OVL_TRACE_MSG		176	/* longer messages are truncated */
+#define OVL_TRACE_LEVEL_MAX	OVL_TRACE_DETAIL
+
+struct ovl_trace_rec {
+	unsigned long seq;		/* index + 1, 0 if being written */
+	unsigned long long ns;
+	unsigned char cat;
+	unsigned char level;
+	char msg[OVL_TRACE_MSG];
+};
+
+struct ovl_trace_ring {
+	struct ovl_trace_ring *next;	/* all rings */
+	int id;
+	int busy;			/* taken by a live thread */
+	unsigned long head;		/* records written */
+	struct ovl_trace_rec recs[OVL_TRACE_RING];
+};
+
+unsigned char ovl_trace_levels[OVL_TRACE_CATEGORIES];
+
+static const char *ovl_trace_names[OVL_TRACE_CATEGORIES] = {
+	[OVL_TRACE_SCAN] = "scan",
+	[OVL_TRACE_LOOKUP] = "lookup",
+	[OVL_TRACE_REDIRECT] = "redirect",
+	[OVL_TRACE_REPAIR] = "repair",
+	[OVL_TRACE_MOUNT] = "mount",
+};
+
+static bool trace_enabled;
+static struct ovl_trace_ring *trace_rings;
+static int trace_ring_num;
+static int trace_dumping;
+static pthread_key_t trace_key;
+static __thread struct ovl_trace_ring *trace_ring;
+
+/* The thread exits, leave its ring to the next thread */
+static void ovl_trace_release(void *arg)
+{
+	struct ovl_trace_ring *ring = arg;
+
+	__atomic_store_n(&ring->busy, 0, __ATOMIC_RELEASE);
+}
+
+/* Take a free ring or add a new one for this thread */
+static struct ovl_trace_ring *ovl_trace_get_ring(void)
+{
+	struct ovl_trace_ring *ring;
+	int busy;
+
+	ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE);
+	for (; ring; ring = ring->next) {
+		busy = 0;
+		if (__atomic_compare_exchange_n(&ring->busy, &busy, 1, false,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_RELAXED))
+			goto found;
+	}
+
+	ring = smalloc(sizeof(*ring));
+	ring->busy = 1;
+	ring->id = __atomic_add_fetch(&trace_ring_num, 1, __ATOMIC_RELAXED);
+	ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring,
+					    false, __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED))
+		;
+found:
+	pthread_setspecific(trace_key, ring);
+	trace_ring = ring;
+	return ring;
+}
+
+/* Record a message into the ring of this thread, errno is kept */
+void ovl_trace_record(int cat, int level, const char *fmt, ...)
+{
+	struct ovl_trace_ring *ring = trace_ring;
+	struct ovl_trace_rec *rec;
+	struct timespec ts;
+	unsigned long head;
+	va_list args;
+	int err = errno;
+
+	if (!ring)
+		ring = ovl_trace_get_ring();
+
+	head = ring->head;
+	rec = &ring->recs[head % OVL_TRACE_RING];
+	__atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	rec->ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	rec->cat = cat;
+	rec->level = level;
+	va_start(args, fmt);
+	vsnprintf(rec->msg, sizeof(rec->msg), fmt, args);
+	va_end(args);
+
+	__atomic_store_n(&rec->seq, head + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	errno = err;
+}
+
+/* Append @val in decimal of at least @width digits, signal safe */
+static char *ovl_trace_utoa(char *p, unsigned long long val, int width)
+{
+	char digits[24];
+	int n = 0;
+
+	do {
+		digits[n++] = '0' + val % 10;
+		val /= 10;
+	} while (val || n < width);
+
+	while (n)
+		*p++ = digits[--n];
+	return p;
+}
+
+static char *ovl_trace_puts(char *p, const char *s)
+{
+	size_t len = strlen(s);
+
+	memcpy(p, s, len);
+	return p + len;
+}
+
+static void ovl_trace_write(const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(STDERR_FILENO, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		buf += ret;
+		len -= ret;
+	}
+}
+
+/* Write one record as "[sec.usec] T<ring> <cat>:<level> <msg>" */
+static void ovl_trace_dump_rec(const struct ovl_trace_ring *ring,
+			       const struct ovl_trace_rec *rec)
+{
+	char line[OVL_TRACE_MSG + 64];
+	char *p = line;
+	size_t len;
+
+	*p++ = '[';
+	p = ovl_trace_utoa(p, rec->ns / 1000000000ULL, 5);
+	*p++ = '.';
+	p = ovl_trace_utoa(p, rec->ns % 1000000000ULL / 1000, 6);
+	p = ovl_trace_puts(p, "] T");
+	p = ovl_trace_utoa(p, ring->id, 1);
+	*p++ = ' ';
+	p = ovl_trace_puts(p, ovl_trace_names[rec->cat]);
+	*p++ = ':';
+	p = ovl_trace_utoa(p, rec->level, 1);
+	*p++ = ' ';
+
+	len = strnlen(rec->msg, sizeof(rec->msg) - 1);
+	memcpy(p, rec->msg, len);
+	p += len;
+	if (!len || p[-1] != '\n')
+		*p++ = '\n';
+	ovl_trace_write(line, p - line);
+}
+
+/*
+ * Dump the records of all threads, oldest first in each thread. Could
+ * be called in a signal handler, records being written are skipped.
+ */
+void ovl_trace_dump(void)
+{
+	struct ovl_trace_ring *ring;
+	struct ovl_trace_rec rec;
+	unsigned long head, i;
+	int err = errno;
+
+	if (!trace_enabled ||
+	    __atomic_exchange_n(&trace_dumping, 1, __ATOMIC_ACQUIRE))
+		return;
+
+	ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE);
+	for (; ring; ring = ring->next) {
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		i = head > OVL_TRACE_RING ? head - OVL_TRACE_RING : 0;
+		for (; i < head; i++) {
+			const struct ovl_trace_rec *src;
+
+			src = &ring->recs[i % OVL_TRACE_RING];
+			if (__atomic_load_n(&src->seq, __ATOMIC_ACQUIRE) != i + 1)
+				continue;
+			memcpy(&rec, src, sizeof(rec));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&src->seq, __ATOMIC_RELAXED) != i + 1)
+				continue;
+			ovl_trace_dump_rec(ring, &rec);
+		}
+	}
+
+	__atomic_store_n(&trace_dumping, 0, __ATOMIC_RELEASE);
+	errno = err;
+}
+
+static void ovl_trace_signal(int sig)
+{
+	ovl_trace_dump();
+}
+
+/* Dump before dying, the default action is restored by SA_RESETHAND */
+static void ovl_trace_fatal(int sig)
+{
+	ovl_trace_dump();
+	raise(sig);
+}
+
+/* Records of the parent are dumped by the parent */
+static void ovl_trace_fork_child(void)
+{
+	struct ovl_trace_ring *ring;
+
+	for (ring = trace_rings; ring; ring = ring->next) {
+		ring->head = 0;
+		ring->busy = (ring == trace_ring);
+	}
+}
+
+static void ovl_trace_exit(void)
+{
+	ovl_trace_dump();
+}
+
+/* Parse "cat[:level],..." or "all[:level]" into the trace levels */
+static int ovl_trace_parse(char *spec)
+{
+	char *cat, *level, *save = NULL;
+	bool found;
+	int lv, i;
+
+	for (cat = strtok_r(spec, ",", &save); cat;
+	     cat = strtok_r(NULL, ",", &save)) {
+		lv = OVL_TRACE_EVENT;
+		level = strchr(cat, ':');
+		if (level) {
+			*level++ = '\0';
+			lv = atoi(level);
+			if (lv < 1 || lv > OVL_TRACE_LEVEL_MAX) {
+				print_info(_("Invalid trace level %s\n\n"),
+					     level);
+				return -1;
+			}
+		}
+
+		found = false;
+		for (i = 0; i < OVL_TRACE_CATEGORIES; i++) {
+			if (strcmp(cat, "all") &&
+			    strcmp(cat, ovl_trace_names[i]))
+				continue;
+			ovl_trace_levels[i] = lv;
+			found = true;
+		}
+		if (!found) {
+			print_info(_("Invalid trace category %s\n\n"), cat);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Trace the categories in @spec, NULL if not tracing */
+int ovl_trace_setup(char *spec)
+{
+	static const int fatal[] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT};
+	struct sigaction sa = {};
+	int i;
+
+	if (!spec)
+		return 0;
+
+	if (ovl_trace_parse(spec))
+		return -1;
+
+	if (pthread_key_create(&trace_key, ovl_trace_release) ||
+	    pthread_atfork(NULL, NULL, ovl_trace_fork_child) ||
+	    atexit(ovl_trace_exit)) {
+		print_err(_("Failed to set up tracing\n"));
+		return -1;
+	}
+
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = ovl_trace_signal;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &sa, NULL);
+
+	sa.sa_handler = ovl_trace_fatal;
+	sa.sa_flags = SA_RESETHAND | SA_NODEFER;
+	for (i = 0; i < sizeof(fatal) / sizeof(fatal[0]); i++)
+		sigaction(fatal[i], &sa, NULL);
+
+	trace_enabled = true;
+	return 0;
+}
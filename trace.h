@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef OVL_TRACE_H
+#define OVL_TRACE_H
+
+/* Trace categories */
+enum {
+	OVL_TRACE_SCAN,
+	OVL_TRACE_LOOKUP,
+	OVL_TRACE_REDIRECT,
+	OVL_TRACE_REPAIR,
+	OVL_TRACE_MOUNT,
+	OVL_TRACE_CATEGORIES,
+};
+
+/* Trace levels */
+#define OVL_TRACE_EVENT		1	/* each layer, pass, repair, ... */
+#define OVL_TRACE_DETAIL	2	/* each entry */
+
+extern unsigned char ovl_trace_levels[OVL_TRACE_CATEGORIES];
+
+/*
+ * Record a trace of @cat at @level, the arguments are not evaluated if
+ * the category is not traced at this level.
+ */
+#define ovl_trace(cat, level, fmt, ...)					\
+do {									\
+	if (__builtin_expect(ovl_trace_levels[cat] >= (level), 0))	\
+		ovl_trace_record(cat, level, fmt, ##__VA_ARGS__);	\
+} while (0)
+
+void ovl_trace_record(int cat, int level, const char *fmt, ...)
+	__attribute__ ((__format__ (__printf__, 3, 4)));
+int ovl_trace_setup(char *spec);
+void ovl_trace_dump(void);
+
+#endif /* OVL_TRACE_H */
@@ -0,0 +1,508 @@
+/*
+ * watch.c - Watch I/O of lower layers and quarantine the hung ones
+ *
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <linux/limits.h>
+
+#include "common.h"
+#include "lib.h"
+#include "list.h"
+#include "layer.h"
+#include "watch.h"
+
+/*
+ * With an operation timeout, lookups in lower layers are run on worker
+ * threads, and the caller waits for at most the timeout. If a lookup does
+ * not finish in time, e.g. the network filesystem of the layer does not
+ * respond, the layer is reported with the path in flight and quarantined.
+ * The worker is left behind, and later lookups in the layer are skipped,
+ * so are the checks need them. A worker is added whenever queued
+ * operations outnumber idle workers, so the other layers are still
+ * checked, and the timeout counts from when a worker starts the lookup.
+ *
+ * Scanning a lower layer runs in the checking thread, which could not be
+ * taken back from a hung syscall. A monitor thread reports the layer with
+ * the path scanned lately if the scan makes no progress in time and
+ * quarantines it, the scan of the layer stops once the syscall returns.
+ * The scanning thread only stores a coarse time stamp for each entry,
+ * and the path every OVL_WATCH_PATH_EVERY entries, without the lock.
+ */
+#define OVL_WATCH_MAX_WORKERS	256
+#define OVL_WATCH_PATH_EVERY	64
+
+extern int flags;
+extern int status;
+
+/* An operation on a lower layer */
+struct ovl_watch_op {
+	struct list_head list;
+	struct ovl_layer *layer;
+	char *pathname;			/* target in flight */
+	int (*fn)(int dirfd, void *arg);
+	void *arg;
+	void (*release)(void *arg);
+	int ret;
+	struct timespec deadline;	/* set when started */
+	bool started;
+	bool done;
+	bool abandoned;			/* caller gave up, free it when done */
+	pthread_cond_t cond;
+};
+
+/* A lower layer being scanned by a thread */
+struct ovl_watch_scan {
+	struct list_head list;
+	const struct ovl_layer *layer;
+	unsigned int seq;		/* odd while pathname is updated */
+	char pathname[PATH_MAX];	/* an entry scanned lately */
+	unsigned long entries;
+	long long last;			/* last progress ms, atomic */
+	bool stop;			/* layer is quarantined, atomic */
+	int paused;			/* waiting for others, not the layer */
+};
+
+static double watch_timeout;		/* seconds, 0 if not watching */
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t watch_work = PTHREAD_COND_INITIALIZER;
+static LIST_HEAD(watch_queue);
+static int watch_workers;
+static int watch_idle;
+static int watch_queued;
+static bool watch_monitor;		/* monitor thread is running */
+static char **watch_quarantined;	/* root paths of quarantined layers */
+static int watch_quarantined_num;
+static int watch_reported;
+static int watch_skipped;
+static LIST_HEAD(watch_scans);
+static __thread struct ovl_watch_scan *watch_scan;
+
+/* Coarse ms for the progress of scans, cheap enough for each entry */
+static long long ovl_watch_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* Update the path of @scan by its thread, read by the monitor */
+static void ovl_watch_set_path(struct ovl_watch_scan *scan,
+			       const char *pathname)
+{
+	__atomic_add_fetch(&scan->seq, 1, __ATOMIC_ACQ_REL);
+	strncpy(scan->pathname, pathname, PATH_MAX - 1);
+	__atomic_add_fetch(&scan->seq, 1, __ATOMIC_RELEASE);
+}
+
+/* Copy the path of @scan, by the monitor */
+static void ovl_watch_get_path(struct ovl_watch_scan *scan, char *buf)
+{
+	unsigned int seq;
+
+	do {
+		seq = __atomic_load_n(&scan->seq, __ATOMIC_ACQUIRE);
+		memcpy(buf, scan->pathname, PATH_MAX);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) ||
+		 seq != __atomic_load_n(&scan->seq, __ATOMIC_RELAXED));
+	buf[PATH_MAX - 1] = '\0';
+}
+
+/* Caller holds watch_lock */
+static bool ovl_watch_is_quarantined(const struct ovl_layer *layer)
+{
+	int i;
+
+	for (i = 0; i < watch_quarantined_num; i++) {
+		if (!strcmp(watch_quarantined[i], layer->path))
+			return true;
+	}
+	return false;
+}
+
+/* Caller holds watch_lock */
+static void ovl_watch_quarantine(const struct ovl_layer *layer,
+				 const char *what, const char *pathname)
+{
+	struct ovl_watch_scan *scan;
+	struct list_head *node;
+
+	if (ovl_watch_is_quarantined(layer))
+		return;
+
+	/* Stop the scans of the layer */
+	list_for_each(node, &watch_scans) {
+		scan = list_entry(node, struct ovl_watch_scan, list);
+		if (!strcmp(scan->layer->path, layer->path))
+			__atomic_store_n(&scan->stop, true, __ATOMIC_RELAXED);
+	}
+
+	watch_quarantined = srealloc(watch_quarantined,
+				     sizeof(char *) * (watch_quarantined_num + 1));
+	watch_quarantined[watch_quarantined_num++] = sstrdup(layer->path);
+
+	print_info(_("Lower layer %d %s does not respond in %.0fs when %s "
+		     "\"%s\", quarantined\n"), layer->stack, layer->path,
+		     watch_timeout, what, pathname);
+}
+
+static void ovl_watch_free_op(struct ovl_watch_op *op)
+{
+	if (op->release)
+		op->release(op->arg);
+	pthread_cond_destroy(&op->cond);
+	free(op->pathname);
+	free(op);
+}
+
+/* Timeout from now, against CLOCK_REALTIME of pthread_cond_timedwait() */
+static void ovl_watch_deadline(struct timespec *deadline)
+{
+	clock_gettime(CLOCK_REALTIME, deadline);
+	deadline->tv_sec += (time_t)watch_timeout;
+	deadline->tv_nsec += (watch_timeout - (time_t)watch_timeout) * 1e9;
+	if (deadline->tv_nsec >= 1000000000) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+}
+
+static void *ovl_watch_worker(void *arg)
+{
+	struct ovl_watch_op *op;
+	int fd;
+
+	pthread_mutex_lock(&watch_lock);
+	for (;;) {
+		while (list_empty(&watch_queue))
+			pthread_cond_wait(&watch_work, &watch_lock);
+
+		op = list_entry(watch_queue.next, struct ovl_watch_op, list);
+		list_del_init(&op->list);
+		watch_queued--;
+		watch_idle--;
+		ovl_watch_deadline(&op->deadline);
+		op->started = true;
+		pthread_cond_signal(&op->cond);
+		pthread_mutex_unlock(&watch_lock);
+
+		fd = ovl_layer_get(op->layer);
+		op->ret = (fd < 0) ? -1 : op->fn(fd, op->arg);
+		if (fd >= 0)
+			ovl_layer_put(op->layer);
+
+		pthread_mutex_lock(&watch_lock);
+		watch_idle++;
+		op->done = true;
+		if (op->abandoned)
+			ovl_watch_free_op(op);
+		else
+			pthread_cond_signal(&op->cond);
+	}
+	return NULL;
+}
+
+/* Scan in a lower layer makes no progress in time */
+static void *ovl_watch_monitor(void *arg)
+{
+	struct ovl_watch_scan *scan;
+	struct list_head *node;
+	char pathname[PATH_MAX];
+	struct timespec ts = {
+		.tv_sec = (time_t)(watch_timeout / 4),
+		.tv_nsec = (watch_timeout / 4 - (time_t)(watch_timeout / 4)) * 1e9,
+	};
+	long long now;
+
+	for (;;) {
+		while (nanosleep(&ts, &ts) && errno == EINTR)
+			;
+		ts.tv_sec = (time_t)(watch_timeout / 4);
+		ts.tv_nsec = (watch_timeout / 4 - ts.tv_sec) * 1e9;
+
+		pthread_mutex_lock(&watch_lock);
+		now = ovl_watch_now_ms();
+		list_for_each(node, &watch_scans) {
+			scan = list_entry(node, struct ovl_watch_scan, list);
+			if (scan->paused || now - __atomic_load_n(&scan->last,
+					__ATOMIC_RELAXED) <= watch_timeout * 1000)
+				continue;
+			ovl_watch_get_path(scan, pathname);
+			ovl_watch_quarantine(scan->layer, "scanning near",
+					     pathname);
+		}
+		pthread_mutex_unlock(&watch_lock);
+	}
+	return NULL;
+}
+
+static void ovl_watch_fork_prepare(void)
+{
+	pthread_mutex_lock(&watch_lock);
+}
+
+static void ovl_watch_fork_parent(void)
+{
+	pthread_mutex_unlock(&watch_lock);
+}
+
+/* Threads are not inherited by the check process of batch mode */
+static void ovl_watch_fork_child(void)
+{
+	INIT_LIST_HEAD(&watch_queue);
+	INIT_LIST_HEAD(&watch_scans);
+	watch_workers = 0;
+	watch_idle = 0;
+	watch_queued = 0;
+	watch_monitor = false;
+	pthread_mutex_unlock(&watch_lock);
+}
+
+/* Watch each operation on lower layers with a timeout of @seconds */
+int ovl_watch_setup(double seconds)
+{
+	if (!seconds)
+		return 0;
+
+	watch_timeout = seconds;
+	if (pthread_atfork(ovl_watch_fork_prepare, ovl_watch_fork_parent,
+			   ovl_watch_fork_child)) {
+		print_err(_("Failed to register fork handlers\n"));
+		return -1;
+	}
+	return 0;
+}
+
+bool ovl_watch_enabled(void)
+{
+	return watch_timeout > 0;
+}
+
+/*
+ * The scan in this thread is waiting for other layers, other threads or
+ * the user, not stalled by the layer it scans.
+ */
+void ovl_watch_pause(void)
+{
+	if (!watch_scan)
+		return;
+
+	pthread_mutex_lock(&watch_lock);
+	watch_scan->paused++;
+	pthread_mutex_unlock(&watch_lock);
+}
+
+void ovl_watch_resume(void)
+{
+	if (!watch_scan)
+		return;
+
+	pthread_mutex_lock(&watch_lock);
+	watch_scan->paused--;
+	__atomic_store_n(&watch_scan->last, ovl_watch_now_ms(),
+			 __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&watch_lock);
+}
+
+/*
+ * Run @fn with the root dir fd of the lower @layer on a worker thread,
+ * and wait for at most the timeout. @arg is owned by the operation, it
+ * is freed by @release if the layer is quarantined.
+ *
+ * Return: the return value of @fn, or OVL_WATCH_STUCK if the layer is
+ * quarantined, @arg could not be used then.
+ */
+int ovl_watch_call(struct ovl_layer *layer, const char *pathname,
+		   int (*fn)(int dirfd, void *arg), void *arg,
+		   void (*release)(void *arg))
+{
+	struct ovl_watch_op *op;
+	pthread_t thread;
+	int ret = OVL_WATCH_STUCK;
+
+	ovl_watch_pause();
+	pthread_mutex_lock(&watch_lock);
+	if (ovl_watch_is_quarantined(layer)) {
+		watch_skipped++;
+		pthread_mutex_unlock(&watch_lock);
+		ovl_watch_resume();
+		if (release)
+			release(arg);
+		return OVL_WATCH_STUCK;
+	}
+
+	op = smalloc(sizeof(*op));
+	INIT_LIST_HEAD(&op->list);
+	op->layer = layer;
+	op->pathname = sstrdup(pathname);
+	op->fn = fn;
+	op->arg = arg;
+	op->release = release;
+	pthread_cond_init(&op->cond, NULL);
+	list_add_tail(&op->list, &watch_queue);
+	watch_queued++;
+
+	/*
+	 * The workers could be hung, add one unless an idle worker is left
+	 * for each queued operation, which is not taken by other callers.
+	 */
+	if (watch_queued > watch_idle &&
+	    watch_workers < OVL_WATCH_MAX_WORKERS &&
+	    !pthread_create(&thread, NULL, ovl_watch_worker, NULL)) {
+		pthread_detach(thread);
+		watch_workers++;
+		watch_idle++;
+	}
+	pthread_cond_signal(&watch_work);
+
+	while (!op->done) {
+		/* Not the fault of the layer if not started yet */
+		if (!op->started) {
+			pthread_cond_wait(&op->cond, &watch_lock);
+			continue;
+		}
+		if (pthread_cond_timedwait(&op->cond, &watch_lock,
+					   &op->deadline) != ETIMEDOUT)
+			continue;
+		if (op->done)
+			break;
+		ovl_watch_quarantine(layer, "looking up", op->pathname);
+		watch_skipped++;
+		op->abandoned = true;
+		pthread_mutex_unlock(&watch_lock);
+		ovl_watch_resume();
+		return OVL_WATCH_STUCK;
+	}
+
+	ret = op->ret;
+	op->release = NULL;
+	ovl_watch_free_op(op);
+	pthread_mutex_unlock(&watch_lock);
+	ovl_watch_resume();
+	return ret;
+}
+
+static int ovl_watch_probe_fn(int dirfd, void *arg)
+{
+	return 0;
+}
+
+/*
+ * Open the lower @layer with timeout before scanning it.
+ *
+ * Return: 0 if it responds, OVL_WATCH_STUCK if it is quarantined
+ */
+int ovl_watch_probe(struct ovl_layer *layer)
+{
+	if (!watch_timeout)
+		return 0;
+
+	if (ovl_watch_call(layer, ".", ovl_watch_probe_fn, NULL, NULL) ==
+	    OVL_WATCH_STUCK) {
+		print_info(_("Lower layer %d is quarantined, not checked\n"),
+			     layer->stack);
+		return OVL_WATCH_STUCK;
+	}
+	return 0;
+}
+
+/* Watch the progress of scanning the lower @layer in this thread */
+void ovl_watch_scan_begin(const struct ovl_layer *layer)
+{
+	pthread_t thread;
+
+	if (!watch_timeout)
+		return;
+
+	watch_scan = smalloc(sizeof(*watch_scan));
+	watch_scan->layer = layer;
+	strncpy(watch_scan->pathname, layer->path, PATH_MAX - 1);
+	watch_scan->last = ovl_watch_now_ms();
+
+	pthread_mutex_lock(&watch_lock);
+	list_add_tail(&watch_scan->list, &watch_scans);
+	watch_scan->stop = ovl_watch_is_quarantined(layer);
+	if (!watch_monitor &&
+	    !pthread_create(&thread, NULL, ovl_watch_monitor, NULL)) {
+		pthread_detach(thread);
+		watch_monitor = true;
+	}
+	pthread_mutex_unlock(&watch_lock);
+}
+
+/*
+ * Going to scan @pathname.
+ *
+ * Return: false if the layer is quarantined, stop scanning it
+ */
+bool ovl_watch_progress(const char *pathname)
+{
+	if (!watch_scan)
+		return true;
+
+	__atomic_store_n(&watch_scan->last, ovl_watch_now_ms(),
+			 __ATOMIC_RELAXED);
+	if (!(watch_scan->entries++ % OVL_WATCH_PATH_EVERY))
+		ovl_watch_set_path(watch_scan, pathname);
+	return !__atomic_load_n(&watch_scan->stop, __ATOMIC_RELAXED);
+}
+
+void ovl_watch_scan_end(void)
+{
+	if (!watch_scan)
+		return;
+
+	pthread_mutex_lock(&watch_lock);
+	list_del(&watch_scan->list);
+	pthread_mutex_unlock(&watch_lock);
+	free(watch_scan);
+	watch_scan = NULL;
+}
+
+/*
+ * Report the quarantined layers at the end of a check, the result is
+ * partial if a layer is quarantined or a lookup is skipped in this check.
+ *
+ * Return: true if the check is incomplete
+ */
+bool ovl_watch_report(void)
+{
+	bool incomplete;
+
+	pthread_mutex_lock(&watch_lock);
+	incomplete = watch_skipped || watch_quarantined_num > watch_reported;
+	if (incomplete)
+		print_info(_("Check is incomplete, %d lower layers quarantined, "
+			     "%d lookups skipped\n"), watch_quarantined_num,
+			     watch_skipped);
+	watch_reported = watch_quarantined_num;
+	watch_skipped = 0;
+	pthread_mutex_unlock(&watch_lock);
+
+	if (incomplete)
+		set_inconsistency(&status);
+	return incomplete;
+}
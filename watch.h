@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2017 Huawei.  All Rights Reserved.
+ * Author: zhangyi (F) <yi.zhang@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef OVL_WATCH_H
+#define OVL_WATCH_H
+
+#define OVL_WATCH_STUCK		1	/* layer is quarantined */
+
+int ovl_watch_setup(double seconds);
+bool ovl_watch_enabled(void);
+void ovl_watch_pause(void);
+void ovl_watch_resume(void);
+int ovl_watch_call(struct ovl_layer *layer, const char *pathname,
+		   int (*fn)(int dirfd, void *arg), void *arg,
+		   void (*release)(void *arg));
+int ovl_watch_probe(struct ovl_layer *layer);
+void ovl_watch_scan_begin(const struct ovl_layer *layer);
+bool ovl_watch_progress(const char *pathname);
+void ovl_watch_scan_end(void);
+bool ovl_watch_report(void);
+
+#endif /* OVL_WATCH_H */